@@ -0,0 +1,237 @@
+
+#include "alarm-manager.h"
+#include "aldb-reader.h"
+#include "logger.h"
+#include "plm-command.h"
+
+
+namespace plm {
+
+// How long to wait for the next streamed record before requesting the
+// missing ones.
+static const int IDLE_TIMEOUT = 1500;  // msecs
+
+// Requests for a single record before giving up on the device.
+static const int MAX_ATTEMPTS = 3;
+
+
+bool aldb_record::from_user_data(const char *data, aldb_record *record)
+{
+    // 0x00, 0x01 (a record), address[2], 0x00, the record[8], checksum
+    if(data[1] != 0x01) {
+        return false;
+    }
+
+    record->address = ((unsigned char)data[2] << 8) | (unsigned char)data[3];
+    record->flags = data[5];
+    record->group = data[6];
+    record->device = insteon_address::from_bytes(data + 7);
+
+    for(int i = 0; i < 3; ++i) {
+        record->data[i] = data[10 + i];
+    }
+
+    return true;
+}
+
+
+aldb_reader::aldb_reader(plm_endpoint *plm,
+                         net::alarm_manager *alarm_manager,
+                         insteon_address device)
+    : plm_(plm),
+      alarm_manager_(alarm_manager),
+      device_(device),
+      window_(16),
+      reading_(false),
+      end_(0),
+      request_address_(0),
+      request_count_(0),
+      request_id_(0),
+      next_window_(0),
+      idle_alarm_(0),
+      requests_(0)
+{
+    plm_->add_listener(this);
+}
+
+
+aldb_reader::~aldb_reader()
+{
+    stop_idle_alarm();
+    plm_->remove_listener(this);
+}
+
+
+void aldb_reader::set_window(int records)
+{
+    window_ = records;
+}
+
+
+void aldb_reader::read(const std::function<void(bool)> &done)
+{
+    done_ = done;
+    reading_ = true;
+    records_.clear();
+    attempts_.clear();
+    end_ = 0;
+    next_window_ = aldb_record::FIRST_ADDRESS;
+    requests_ = 0;
+
+    request_next();
+}
+
+
+void aldb_reader::on_command(const plm_frame &frame)
+{
+    aldb_record record;
+
+    if(!reading_ || !frame.is_extended() || frame.from() != device_ ||
+       frame.cmd1() != 0x2f ||
+       !aldb_record::from_user_data(frame.user_data(), &record))
+    {
+        return;
+    }
+
+    records_[record.address] = record;
+
+    if(record.is_last() && record.address > end_) {
+        end_ = record.address;
+    }
+
+    if(is_request_complete()) {
+        stop_idle_alarm();
+        request_next();
+    } else {
+        restart_idle_alarm();
+    }
+}
+
+
+void aldb_reader::request(int address, int count)
+{
+    request_address_ = address;
+    request_count_ = count;
+    ++request_id_;
+    ++requests_;
+
+    int id = request_id_;
+    plm_->send_command(
+        plm_command::read_aldb(device_, address, count),
+        [this, id](plm_endpoint::response_t r) { on_request_done(id, r); },
+        plm_endpoint::BACKGROUND);
+}
+
+
+void aldb_reader::on_request_done(int id, plm_endpoint::response_t r)
+{
+    // The records of an earlier request may have all arrived before its
+    // ACK.
+    if(!reading_ || id != request_id_) {
+        return;
+    }
+
+    if(!r.is_ok()) {
+        log_error("Cannot read the ALDB of %s", device_.to_hex());
+        finish(false);
+        return;
+    }
+
+    // The device starts streaming the records now.
+    restart_idle_alarm();
+}
+
+
+void aldb_reader::restart_idle_alarm()
+{
+    stop_idle_alarm();
+    idle_alarm_ = alarm_manager_->schedule_alarm(
+        [this]() {
+            idle_alarm_ = 0;
+            request_next();
+        },
+        IDLE_TIMEOUT);
+}
+
+
+void aldb_reader::stop_idle_alarm()
+{
+    if(idle_alarm_) {
+        idle_alarm_->stop();
+        idle_alarm_ = 0;
+    }
+}
+
+
+bool aldb_reader::is_request_complete() const
+{
+    for(int i = 0; i < request_count_; ++i) {
+        if(is_missing(request_address_ - i * aldb_record::SIZE)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+void aldb_reader::request_next()
+{
+    // Fill the gaps first, from the top.
+    for(int address = aldb_record::FIRST_ADDRESS; address > next_window_;
+        address -= aldb_record::SIZE)
+    {
+        if(!is_missing(address)) {
+            continue;
+        }
+
+        if(++attempts_[address] > MAX_ATTEMPTS) {
+            log_error("ALDB record 0x%x of %s is missing", address,
+                      device_.to_hex());
+            finish(false);
+            return;
+        }
+
+        request(address, 1);
+        return;
+    }
+
+    // Done at the high water mark, or when the database is full.
+    if(end_ != 0 || next_window_ < 0) {
+        finish(true);
+        return;
+    }
+
+    request(next_window_, window_);
+    next_window_ -= window_ * aldb_record::SIZE;
+}
+
+
+bool aldb_reader::is_missing(int address) const
+{
+    return address > next_window_ && address >= 0 && address >= end_ &&
+           records_.find(address) == records_.end();
+}
+
+
+void aldb_reader::finish(bool ok)
+{
+    reading_ = false;
+    stop_idle_alarm();
+
+    // The high water mark and whatever is past it are not part of the
+    // database.
+    if(end_ != 0) {
+        records_.erase(records_.begin(), records_.upper_bound(end_));
+    }
+
+    log_info("Read %zu ALDB records of %s with %d requests",
+             records_.size(), device_.to_hex(), requests_);
+
+    std::function<void(bool)> done;
+    done.swap(done_);
+    done(ok);
+}
+
+
+}
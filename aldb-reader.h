@@ -0,0 +1,143 @@
+
+#ifndef ALDB_READER_H_
+#define ALDB_READER_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+
+#include "insteon-address.h"
+#include "plm-connection.h"
+#include "plm-endpoint.h"
+
+
+namespace net {
+class alarm;
+class alarm_manager;
+}
+
+
+namespace plm {
+
+
+// A record of a device's ALL-link database. The records are 8 bytes each
+// and are stored downwards from 0x0fff.
+struct aldb_record {
+    enum {
+        IN_USE = 0x80,
+        CONTROLLER = 0x40,
+
+        // Clear in the first record that has never been used, which marks
+        // the end of the database.
+        HIGH_WATER = 0x02,
+
+        FIRST_ADDRESS = 0x0fff,
+        SIZE = 8
+    };
+
+    aldb_record() : address(0), flags(0), group(0), data() {}
+
+    bool is_in_use() const { return flags & IN_USE; }
+    bool is_controller() const { return flags & CONTROLLER; }
+    bool is_last() const { return !(flags & HIGH_WATER); }
+
+    // Decodes the user data of a read ALDB response (extended 0x2f with 0x01
+    // in the second byte). Returns false if it is something else.
+    static bool from_user_data(const char *data, aldb_record *record);
+
+    uint16_t address;
+    uint8_t flags;
+    uint8_t group;
+    insteon_address device;
+    uint8_t data[3];
+};
+
+
+// Reads the ALL-link database of a device with extended read ALDB requests.
+// The database is requested in windows of consecutive records that the
+// device streams back as extended messages. Streamed records are easily lost
+// on the powerline, so once a window goes quiet the records missing from it
+// are requested one by one before moving on to the next window. Reading ends
+// at the high water mark.
+class aldb_reader : public plm_command_listener {
+public:
+    // The endpoint should be started. The reader listens on it until it is
+    // destroyed.
+    aldb_reader(plm_endpoint *plm,
+                net::alarm_manager *alarm_manager,
+                insteon_address device);
+    ~aldb_reader();
+
+    // Records per window request, 16 by default.
+    void set_window(int records);
+
+    // Reads the database, the records read before are dropped. The callback
+    // is called with true once all the records up to the high water mark
+    // are in, or with false if the device stops responding.
+    void read(const std::function<void(bool)> &done);
+
+    // The records read, by their address.
+    const std::map<uint16_t, aldb_record> &records() const {
+        return records_;
+    }
+
+    // Number of read requests sent, including the re-requests.
+    int requests() const { return requests_; }
+
+    virtual void on_command(const plm_frame &frame) override;
+
+private:
+    aldb_reader(const aldb_reader &);
+    aldb_reader &operator= (const aldb_reader &);
+
+    // Sends a request for 'count' records starting at 'address'.
+    void request(int address, int count);
+    void on_request_done(int id, plm_endpoint::response_t r);
+
+    void restart_idle_alarm();
+    void stop_idle_alarm();
+
+    // True once all the records of the current request are in.
+    bool is_request_complete() const;
+
+    // Requests the next missing record or the next window, or finishes.
+    void request_next();
+
+    // True if the record at the address has been requested, is not past the
+    // end and has not arrived.
+    bool is_missing(int address) const;
+
+    void finish(bool ok);
+
+private:
+    plm_endpoint *plm_;  // not owned
+    net::alarm_manager *alarm_manager_;  // not owned
+    insteon_address device_;
+    int window_;
+
+    std::function<void(bool)> done_;
+    bool reading_;
+    std::map<uint16_t, aldb_record> records_;
+
+    // The address of the last record, 0 until the high water mark is seen.
+    uint16_t end_;
+
+    // The current request, and the first record of the next window. Records
+    // above next_window_ have been requested.
+    int request_address_;
+    int request_count_;
+    int request_id_;
+    int next_window_;
+
+    // Attempts per record that had to be requested again.
+    std::map<uint16_t, int> attempts_;
+
+    net::alarm *idle_alarm_;
+    int requests_;
+};
+
+
+}
+
+#endif
@@ -0,0 +1,252 @@
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+
+#include "aldb-reader.h"
+#include "logger.h"
+#include "mock-alarm-manager.h"
+#include "mock-event-manager.h"
+#include "mock-executor.h"
+#include "mock-plm-fd.h"
+#include "plm-command.h"
+#include "plm-simulator.h"
+#include "select-server.h"
+
+#include <gtest/gtest.h>
+
+
+namespace plm {
+
+
+static const insteon_address DEVICE(0x0a0b0c);
+
+
+class AldbReaderTest : public testing::Test {
+public:
+    virtual void SetUp() {
+        disable_logging();
+
+        executor_.reset(new mock_executor);
+        event_manager_.reset(new mock_event_manager);
+        fd_.reset(new mock_plm_fd);
+        endpoint_alarms_.reset(new mock_alarm_manager);
+        reader_alarms_.reset(new mock_alarm_manager);
+        endpoint_.reset(new plm_endpoint(
+            fd_.get(),
+            endpoint_alarms_.get(),
+            event_manager_.get(),
+            executor_.get()));
+        reader_.reset(new aldb_reader(endpoint_.get(), reader_alarms_.get(),
+                                      DEVICE));
+
+        endpoint_->start();
+        finished_ = false;
+        ok_ = false;
+    }
+
+    virtual void TearDown() {
+        reader_.reset();
+        endpoint_->stop();
+    }
+
+    void loop_once() {
+        event_manager_->send_signal();
+        executor_->run_until_empty();
+    }
+
+    void read() {
+        reader_->read([this](bool ok) {
+            finished_ = true;
+            ok_ = ok;
+        });
+        loop_once();
+    }
+
+    // Checks that the given request was the last one sent, then lets the
+    // modem and the device acknowledge it.
+    void expect_request(int address, int count) {
+        std::string cmd = plm_command::read_aldb(DEVICE, address, count)
+            .bytes();
+        std::string written = fd_->get_write_buf();
+
+        ASSERT_LE(cmd.size(), written.size());
+        EXPECT_EQ(cmd, written.substr(written.size() - cmd.size()));
+
+        fd_->set_read_buf(
+            '\x02' + cmd + '\x06' +
+            std::string("\x02\x50\x0a\x0b\x0c\x11\x22\x33\x2b\x2f\x00", 11));
+        loop_once();
+    }
+
+    // Sends the record at the address, the last one is the high water mark.
+    void send_record(int address, bool last = false) {
+        char msg[25] = { 0x02, 0x51, 0x0a, 0x0b, 0x0c, 0x11, 0x22, 0x33,
+                         0x1b, 0x2f, 0x00, 0x00, 0x01, char(address >> 8),
+                         char(address), 0x00 };
+
+        if(!last) {
+            msg[16] = char(0xe2);
+            msg[17] = 0x01;
+            msg[18] = 0x20;
+            msg[20] = char(address);
+        }
+
+        unsigned sum = 0;
+
+        for(int i = 9; i < 24; ++i) {
+            sum += (unsigned char)msg[i];
+        }
+
+        msg[24] = char(0x100 - (sum & 0xff));
+        fd_->set_read_buf(std::string(msg, sizeof(msg)));
+        loop_once();
+    }
+
+protected:
+    std::unique_ptr<mock_executor> executor_;
+    std::unique_ptr<mock_event_manager> event_manager_;
+    std::unique_ptr<mock_plm_fd> fd_;
+    std::unique_ptr<mock_alarm_manager> endpoint_alarms_;
+    std::unique_ptr<mock_alarm_manager> reader_alarms_;
+    std::unique_ptr<plm_endpoint> endpoint_;
+    std::unique_ptr<aldb_reader> reader_;
+
+    bool finished_;
+    bool ok_;
+};
+
+
+TEST_F(AldbReaderTest, ReadsWindowsAndFillsGaps)
+{
+    reader_->set_window(4);
+    read();
+
+    // 0x0ff7 gets lost.
+    expect_request(0x0fff, 4);
+    send_record(0x0fff);
+    send_record(0x0fef);
+    send_record(0x0fe7);
+
+    // It is requested on its own once the stream goes quiet.
+    reader_alarms_->fire_all_alarms();
+    loop_once();
+    expect_request(0x0ff7, 1);
+    send_record(0x0ff7);
+
+    // The window is complete, on to the next one.
+    expect_request(0x0fdf, 4);
+    send_record(0x0fdf);
+    EXPECT_FALSE(finished_);
+    send_record(0x0fd7, true);
+
+    EXPECT_TRUE(finished_);
+    EXPECT_TRUE(ok_);
+    EXPECT_EQ(3, reader_->requests());
+
+    const std::map<uint16_t, aldb_record> &records = reader_->records();
+    ASSERT_EQ(5u, records.size());
+    EXPECT_EQ(0x0fdf, records.begin()->first);
+    EXPECT_EQ(0x0fff, records.rbegin()->first);
+
+    const aldb_record &r = records.find(0x0fef)->second;
+    EXPECT_TRUE(r.is_in_use());
+    EXPECT_TRUE(r.is_controller());
+    EXPECT_FALSE(r.is_last());
+    EXPECT_EQ(1, r.group);
+    EXPECT_EQ(insteon_address(0x2000ef), r.device);
+}
+
+
+TEST_F(AldbReaderTest, IgnoresOtherMessages)
+{
+    reader_->set_window(2);
+    read();
+    expect_request(0x0fff, 2);
+
+    // A standard message and a record from another device.
+    fd_->set_read_buf(
+        std::string("\x02\x50\x0a\x0b\x0c\x11\x22\x33\x2b\x2f\x00", 11) +
+        std::string("\x02\x51\x01\x02\x03\x11\x22\x33\x1b\x2f\x00"
+                    "\x00\x01\x0f\xff\x00\xe2\x01\x20\x00\x00"
+                    "\x03\x1c\x01\x9f", 25));
+    loop_once();
+    EXPECT_TRUE(reader_->records().empty());
+
+    send_record(0x0fff, true);
+    EXPECT_TRUE(finished_);
+    EXPECT_TRUE(ok_);
+    EXPECT_TRUE(reader_->records().empty());
+}
+
+
+TEST_F(AldbReaderTest, GivesUpOnMissingRecord)
+{
+    reader_->set_window(2);
+    read();
+    expect_request(0x0fff, 2);
+    send_record(0x0ff7);
+
+    for(int i = 0; i < 3; ++i) {
+        reader_alarms_->fire_all_alarms();
+        loop_once();
+        expect_request(0x0fff, 1);
+    }
+
+    reader_alarms_->fire_all_alarms();
+    EXPECT_TRUE(finished_);
+    EXPECT_FALSE(ok_);
+}
+
+
+TEST(AldbReaderSimulatorTest, ReadsLargeDatabase)
+{
+    disable_logging();
+
+    std::string slave_path;
+    int slave;
+    int master = plm_simulator::open_pty(&slave_path, &slave);
+    net::select_server ss;
+    plm_simulator sim(master, &ss, &ss);
+
+    plm_simulator::device_profile fast;
+    fast.latency_msecs = 5;
+    sim.set_default_profile(fast);
+    sim.set_baud_rate(0);
+    sim.set_busy_msecs(0);
+    sim.set_aldb_size(200);
+    sim.set_record_msecs(1);
+    sim.start();
+
+    plm_fd fd(slave_path);
+    plm_endpoint endpoint(&fd, &ss, &ss, &ss);
+    aldb_reader reader(&endpoint, &ss, insteon_address(5));
+    bool ok = false;
+
+    endpoint.start();
+    reader.read([&](bool r) {
+        ok = r;
+        ss.stop();
+    });
+
+    net::alarm *timeout = ss.schedule_alarm([&]() { ss.stop(); }, 10000);
+    ss.loop();
+
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(200u, reader.records().size());
+    EXPECT_EQ(13, reader.requests());
+
+    if(ok) {
+        timeout->stop();
+    }
+
+    endpoint.stop();
+    sim.stop();
+    close(slave);
+    close(master);
+}
+
+
+}
@@ -0,0 +1,53 @@
+
+#include <stdlib.h>
+
+#include <new>
+
+#include "alloc-counter.h"
+
+
+namespace {
+
+// Per thread, so that tests can assert on the code they run regardless of
+// what other threads do.
+thread_local uint64_t thread_allocations = 0;
+
+}
+
+
+void *operator new(size_t size)
+{
+    ++thread_allocations;
+
+    void *p = malloc(size ? size : 1);
+
+    if(!p) {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+
+uint64_t allocation_count()
+{
+    return thread_allocations;
+}
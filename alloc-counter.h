@@ -0,0 +1,15 @@
+
+#ifndef ALLOC_COUNTER_H_
+#define ALLOC_COUNTER_H_
+
+#include <stdint.h>
+
+
+// alloc-counter.cc replaces the global operator new to count heap
+// allocations. It is linked into the tests and benchmarks only, never into
+// libcore.a.
+
+// Number of heap allocations made by the calling thread so far.
+uint64_t allocation_count();
+
+#endif
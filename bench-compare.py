@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+
+# Compares Google Benchmark JSON results against a stored baseline.
+#
+# Usage: bench-compare.py [--threshold percent] baseline-dir results-dir
+#
+# Prints the time and allocations per operation of every benchmark next to
+# the baseline. Times slower by more than the threshold (10% by default) are
+# flagged, but do not fail since they depend on the machine. An increase in
+# allocations is deterministic and makes the script exit with 1.
+
+import argparse
+import glob
+import json
+import os
+import sys
+
+
+def load(directory):
+    results = {}
+
+    for path in sorted(glob.glob(os.path.join(directory, '*.json'))):
+        with open(path) as f:
+            data = json.load(f)
+
+        for b in data.get('benchmarks', []):
+            if b.get('run_type', 'iteration') != 'iteration':
+                continue
+            results[b['name']] = b
+
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--threshold', type=float, default=10)
+    parser.add_argument('baseline')
+    parser.add_argument('results')
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    results = load(args.results)
+
+    if not baseline:
+        print('No baseline in %s, run make bench-update-baseline'
+              % args.baseline)
+        return 0
+
+    failed = False
+
+    print('%-40s %12s %12s %8s %10s %10s' %
+          ('Benchmark', 'base ns', 'ns', 'change', 'base alloc', 'alloc'))
+
+    for name, r in results.items():
+        b = baseline.get(name)
+
+        if b is None:
+            print('%-40s %12s %12.1f' % (name, '-', r['cpu_time']))
+            continue
+
+        change = (r['cpu_time'] / b['cpu_time'] - 1) * 100
+        allocs = r.get('allocs/op', 0)
+        base_allocs = b.get('allocs/op', 0)
+        flags = []
+
+        if change > args.threshold:
+            flags.append('SLOWER')
+
+        # Allow for the allocations of the first iteration being spread
+        # over a different number of iterations.
+        if allocs > base_allocs + 0.5:
+            flags.append('MORE ALLOCS')
+            failed = True
+
+        print('%-40s %12.1f %12.1f %+7.1f%% %10.2f %10.2f %s' %
+              (name, b['cpu_time'], r['cpu_time'], change, base_allocs,
+               allocs, ' '.join(flags)))
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
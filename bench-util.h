@@ -0,0 +1,43 @@
+
+#ifndef BENCH_UTIL_H_
+#define BENCH_UTIL_H_
+
+#include <stdint.h>
+
+#include <benchmark/benchmark.h>
+
+#include "alloc-counter.h"
+
+
+// Helpers shared by the *_bench.cc microbenchmarks.
+namespace bench {
+
+
+// Reports the heap allocations made during its lifetime as the allocs/op
+// counter of the benchmark. Create it right before the timing loop so that
+// the setup is not counted.
+class alloc_counter {
+public:
+    explicit alloc_counter(benchmark::State &state)
+        : state_(state),
+          start_(allocation_count())
+    {
+    }
+
+    ~alloc_counter() {
+        state_.counters["allocs/op"] = benchmark::Counter(
+            allocation_count() - start_, benchmark::Counter::kAvgIterations);
+    }
+
+private:
+    alloc_counter(const alloc_counter &);
+    alloc_counter &operator= (const alloc_counter &);
+
+    benchmark::State &state_;
+    uint64_t start_;
+};
+
+
+}
+
+#endif
@@ -4,12 +4,13 @@
 
 #include <algorithm>
 #include <memory>
-#include <vector>
 
 #include "buffered-connection.h"
 #include "event-manager.h"
 #include "executor.h"
 #include "io-buffer.h"
+#include "metrics.h"
+#include "serial-trace.h"
 
 
 namespace net {
@@ -37,7 +38,15 @@ buffered_connection::buffered_connection(
       fd_(fd),
       event_manager_(em),
       executor_(ex),
-      read_buffer_(256)
+      bytes_read_(metrics::registry::global().get_counter(
+          "shd_serial_read_bytes_total",
+          "Bytes read by buffered connections.")),
+      bytes_written_(metrics::registry::global().get_counter(
+          "shd_serial_written_bytes_total",
+          "Bytes written by buffered connections.")),
+      trace_(0),
+      read_buffer_(256),
+      free_ops_(0)
 {
 }
 
@@ -48,6 +57,12 @@ buffered_connection::~buffered_connection()
         stop();
     } catch(...) {
     }
+
+    while(free_ops_) {
+        io_op *next = free_ops_->next;
+        delete free_ops_;
+        free_ops_ = next;
+    }
 }
 
 
@@ -107,8 +122,7 @@ void buffered_connection::read(
         }
     }
 
-    io_op *op = new io_op(buf + bytes_read, len - bytes_read, done);
-    read_ops_.push(op);
+    read_ops_.push(new_op(buf + bytes_read, len - bytes_read, done));
 }
 
 
@@ -127,13 +141,18 @@ void buffered_connection::write(
             r = 0;
         }
 
+        bytes_written_->inc(r);
+
+        if(trace_ && r > 0) {
+            trace_->record(serial_trace::WRITE, buf, r);
+        }
+
         if(r == len) {
             executor_->run_later(done);
             return;
         }
 
-        io_op *op = new io_op((char *)buf + r, len - r, done);
-        write_ops_.push(op);
+        write_ops_.push(new_op((char *)buf + r, len - r, done));
         event_manager_->register_for_write(this);
     } catch(fd_exception &ex) {
         set_error(ex.error());
@@ -160,6 +179,12 @@ int buffered_connection::error() const
 }
 
 
+void buffered_connection::set_trace(serial_trace *trace)
+{
+    trace_ = trace;
+}
+
+
 int buffered_connection::get_fd()
 {
     return fd_->get_fd();
@@ -183,7 +208,12 @@ void buffered_connection::on_read()
                 break;
             }
 
+            if(trace_) {
+                trace_->record(serial_trace::READ, write_buf.first, r);
+            }
+
             read_buffer_.advance_write_pointer(r);
+            bytes_read_->inc(r);
         } catch(fd_exception &ex) {
             set_error(ex.error());
             return;
@@ -203,8 +233,7 @@ void buffered_connection::on_read()
 
         if(bytes_read == op->len) {
             executor_->run_later(op->done);
-            delete op;
-            read_ops_.pop();
+            free_op(read_ops_.pop());
         } else {
             op->buf += bytes_read;
             op->len -= bytes_read;
@@ -225,10 +254,15 @@ void buffered_connection::on_write()
                 return;  // EAGAIN
             }
 
+            bytes_written_->inc(r);
+
+            if(trace_) {
+                trace_->record(serial_trace::WRITE, op->buf, r);
+            }
+
             if(r == op->len) {
                 executor_->run_later(op->done);
-                delete op;
-                write_ops_.pop();
+                free_op(write_ops_.pop());
             } else {
                 op->buf += r;
                 op->len -= r;
@@ -247,27 +281,49 @@ void buffered_connection::on_write()
 
 void buffered_connection::clear_queues(bool call_callbacks)
 {
-    std::vector<io_op *> ops;
+    op_queue ops[] = { read_ops_, write_ops_ };
 
-    while(!read_ops_.empty()) {
-        ops.push_back(read_ops_.front());
-        read_ops_.pop();
-    }
+    read_ops_ = op_queue();
+    write_ops_ = op_queue();
 
-    while(!write_ops_.empty()) {
-        ops.push_back(write_ops_.front());
-        write_ops_.pop();
-    }
+    for(size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+        while(!ops[i].empty()) {
+            io_op *op = ops[i].pop();
 
-    for(size_t i = 0; i < ops.size(); ++i) {
-        io_op *op = ops[i];
+            if(call_callbacks) {
+                executor_->run_later(op->done);
+            }
 
-        if(call_callbacks) {
-            executor_->run_later(op->done);
+            free_op(op);
         }
+    }
+}
 
-        delete op;
+
+buffered_connection::io_op *buffered_connection::new_op(
+    char *buf, int len, const std::function<void()> &done)
+{
+    io_op *op = free_ops_;
+
+    if(op) {
+        free_ops_ = op->next;
+    } else {
+        op = new io_op;
     }
+
+    op->buf = buf;
+    op->len = len;
+    op->done = done;
+    return op;
+}
+
+
+void buffered_connection::free_op(io_op *op)
+{
+    // Release whatever the callback holds on to.
+    op->done = nullptr;
+    op->next = free_ops_;
+    free_ops_ = op;
 }
 
 
@@ -6,17 +6,22 @@
 
 #include <exception>
 #include <functional>
-#include <queue>
 #include <utility>
 
 #include "event-manager.h"
 #include "io-buffer.h"
 
 
+namespace metrics {
+class counter;
+}
+
+
 namespace net {
 
 class executor;
 class io_buffer;
+class serial_trace;
 
 
 // Exception used by the fd_interface methods to signal errors.
@@ -78,6 +83,10 @@ public:
     // If not_ok() and not closed will return the last error.
     int error() const;
 
+    // Makes the connection record everything it reads and writes into the
+    // given trace (not owned), null turns the tracing off.
+    void set_trace(serial_trace *trace);
+
 private:
     buffered_connection(const buffered_connection &);
     buffered_connection &operator= (const buffered_connection &);
@@ -110,19 +119,65 @@ private:
     executor *executor_;
 
     struct io_op {
-        io_op(char *b, int l, const std::function<void()> &c)
-            : buf(b), len(l), done(c)
-        {
-        }
-
         char *buf;
         int len;
         std::function<void()> done;
+        io_op *next;
     };
 
+    // A FIFO of io ops linked through io_op::next. Unlike std::queue it
+    // never allocates, the ops themselves are recycled through free_ops_.
+    struct op_queue {
+        op_queue() : head(0), tail(0) {}
+
+        bool empty() const { return head == 0; }
+        io_op *front() const { return head; }
+
+        void push(io_op *op) {
+            op->next = 0;
+
+            if(tail) {
+                tail->next = op;
+            } else {
+                head = op;
+            }
+
+            tail = op;
+        }
+
+        io_op *pop() {
+            io_op *op = head;
+
+            head = op->next;
+            if(!head) {
+                tail = 0;
+            }
+
+            return op;
+        }
+
+        io_op *head;
+        io_op *tail;
+    };
+
+    // Takes an op from the free list or allocates a new one.
+    io_op *new_op(char *buf, int len, const std::function<void()> &done);
+
+    // Puts the op on the free list.
+    void free_op(io_op *op);
+
+    // Shared by all buffered connections.
+    metrics::counter *bytes_read_;
+    metrics::counter *bytes_written_;
+
+    serial_trace *trace_;  // not owned
+
     io_buffer read_buffer_;
-    std::queue<io_op *> read_ops_;
-    std::queue<io_op *> write_ops_;
+    op_queue read_ops_;
+    op_queue write_ops_;
+
+    // Completed ops kept for reuse, linked through io_op::next.
+    io_op *free_ops_;
 };
 
 }
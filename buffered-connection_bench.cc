@@ -0,0 +1,55 @@
+
+#include <string>
+
+#include "bench-util.h"
+#include "buffered-connection.h"
+#include "mock-event-manager.h"
+#include "mock-executor.h"
+#include "mock-plm-fd.h"
+
+
+namespace net {
+
+
+// Many small reads served from a single fd read, which is how the PLM
+// connection consumes the modem input.
+static void BM_BufferedConnectionSmallReads(benchmark::State &state)
+{
+    const int frames = 64;
+    const int frame_len = state.range(0);
+    std::string input(frames * frame_len, 'x');
+    std::string out(frame_len, 0);
+
+    mock_executor executor;
+    mock_event_manager event_manager;
+    plm::mock_plm_fd fd;
+    buffered_connection conn(&fd, &event_manager, &executor);
+    int done = 0;
+
+    conn.start();
+
+    bench::alloc_counter allocs(state);
+
+    for(auto _ : state) {
+        fd.set_read_buf(input);
+
+        for(int i = 0; i < frames; ++i) {
+            conn.read(&out[0], frame_len, [&done]() { ++done; });
+        }
+
+        event_manager.send_signal();
+        executor.run_until_empty();
+    }
+
+    if(done != state.iterations() * frames) {
+        state.SkipWithError("reads did not complete");
+    }
+
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+    conn.stop();
+}
+
+BENCHMARK(BM_BufferedConnectionSmallReads)->Arg(1)->Arg(11);
+
+
+}
@@ -0,0 +1,33 @@
+
+#include <stdio.h>
+
+#include <stdexcept>
+#include <string>
+
+#include "insteon-address.h"
+
+
+namespace plm {
+
+
+bool insteon_address::parse(const std::string &hex, insteon_address *addr)
+{
+    try {
+        *addr = from_hex(hex.c_str());
+    } catch(std::invalid_argument &) {
+        return false;
+    }
+
+    return true;
+}
+
+
+std::string insteon_address::to_hex() const
+{
+    char buf[8];
+    snprintf(buf, sizeof(buf), "%06X", value_);
+    return buf;
+}
+
+
+}
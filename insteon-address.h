@@ -0,0 +1,104 @@
+
+#ifndef INSTEON_ADDRESS_H_
+#define INSTEON_ADDRESS_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+
+namespace plm {
+
+
+// A 24-bit INSTEON device address packed into an integer, e.g. 1A.2B.3C is
+// 0x1a2b3c. Trivially copyable and cheap to compare and hash, so it can key
+// the per-device tables directly.
+class insteon_address {
+public:
+    constexpr insteon_address() : value_(0) {}
+    constexpr explicit insteon_address(uint32_t value)
+        : value_(value & 0xffffff) {}
+
+    // From the three bytes as they are sent on the wire, most significant
+    // first.
+    static insteon_address from_bytes(const char *bytes) {
+        return insteon_address(((unsigned char)bytes[0] << 16) |
+                               ((unsigned char)bytes[1] << 8) |
+                               (unsigned char)bytes[2]);
+    }
+
+    // Parses six hex digits, optionally separated by dots. Usable in
+    // constant expressions, where invalid input fails the compilation;
+    // throws std::invalid_argument at run time. Use parse() for input that
+    // is not known to be valid.
+    static constexpr insteon_address from_hex(const char *hex) {
+        return insteon_address(parse_hex(hex, 0, 0));
+    }
+
+    // Like from_hex(), returns false if the string is not a valid address.
+    static bool parse(const std::string &hex, insteon_address *addr);
+
+    constexpr uint32_t value() const { return value_; }
+
+    // Stores the three bytes in the wire order.
+    void to_bytes(char *out) const {
+        out[0] = char(value_ >> 16);
+        out[1] = char(value_ >> 8);
+        out[2] = char(value_);
+    }
+
+    // Six upper case hex digits, as in the config file.
+    std::string to_hex() const;
+
+    constexpr bool operator== (const insteon_address &rh) const {
+        return value_ == rh.value_;
+    }
+
+    constexpr bool operator!= (const insteon_address &rh) const {
+        return value_ != rh.value_;
+    }
+
+    constexpr bool operator< (const insteon_address &rh) const {
+        return value_ < rh.value_;
+    }
+
+private:
+    static constexpr uint32_t hex_digit(char c) {
+        return c >= '0' && c <= '9' ? c - '0' :
+               c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+               c >= 'A' && c <= 'F' ? c - 'A' + 10 :
+               throw std::invalid_argument("Invalid INSTEON address");
+    }
+
+    static constexpr uint32_t parse_hex(const char *hex, int digits,
+                                        uint32_t value) {
+        return digits == 6 ?
+                   (*hex == 0 ? value :
+                    throw std::invalid_argument("Invalid INSTEON address")) :
+               *hex == '.' && digits % 2 == 0 && digits > 0 ?
+                   parse_hex(hex + 1, digits, value) :
+                   parse_hex(hex + 1, digits + 1,
+                             (value << 4) | hex_digit(*hex));
+    }
+
+    uint32_t value_;
+};
+
+
+}
+
+
+namespace std {
+
+template<>
+struct hash<plm::insteon_address> {
+    size_t operator()(const plm::insteon_address &addr) const {
+        return addr.value();
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+
+#include <string>
+#include <unordered_map>
+
+#include "insteon-address.h"
+
+#include <gtest/gtest.h>
+
+
+namespace plm {
+
+
+TEST(InsteonAddressTest, FromHex)
+{
+    // Parsed at compile time.
+    constexpr insteon_address addr = insteon_address::from_hex("1A2b3C");
+    static_assert(addr.value() == 0x1a2b3c, "compile time parsing");
+
+    EXPECT_EQ(insteon_address(0x1a2b3c), insteon_address::from_hex("1A.2B.3C"));
+    EXPECT_EQ("1A2B3C", addr.to_hex());
+    EXPECT_EQ("00000A", insteon_address(10).to_hex());
+
+    EXPECT_THROW(insteon_address::from_hex("1A2B3"), std::invalid_argument);
+    EXPECT_THROW(insteon_address::from_hex("1A2B3C4"), std::invalid_argument);
+    EXPECT_THROW(insteon_address::from_hex("1A2B3G"), std::invalid_argument);
+}
+
+
+TEST(InsteonAddressTest, Parse)
+{
+    insteon_address addr;
+
+    EXPECT_TRUE(insteon_address::parse("021F3A", &addr));
+    EXPECT_EQ(0x021f3au, addr.value());
+
+    EXPECT_FALSE(insteon_address::parse("", &addr));
+    EXPECT_FALSE(insteon_address::parse(".021F3A", &addr));
+    EXPECT_FALSE(insteon_address::parse("021F3A ", &addr));
+    EXPECT_FALSE(insteon_address::parse(std::string("02\0F3A", 6), &addr));
+    EXPECT_EQ(0x021f3au, addr.value());
+}
+
+
+TEST(InsteonAddressTest, Bytes)
+{
+    insteon_address addr = insteon_address::from_bytes("\x01\xf2\x03");
+    char out[3];
+
+    EXPECT_EQ(0x01f203u, addr.value());
+
+    addr.to_bytes(out);
+    EXPECT_EQ(std::string("\x01\xf2\x03", 3), std::string(out, 3));
+
+    // Only 24 bits are kept.
+    EXPECT_EQ(insteon_address(0x123456), insteon_address(0xff123456));
+}
+
+
+TEST(InsteonAddressTest, KeysMaps)
+{
+    std::unordered_map<insteon_address, int> levels;
+
+    levels[insteon_address(1)] = 10;
+    levels[insteon_address::from_hex("000002")] = 20;
+
+    EXPECT_EQ(10, levels[insteon_address::from_bytes("\x00\x00\x01")]);
+    EXPECT_EQ(20, levels[insteon_address(2)]);
+    EXPECT_TRUE(insteon_address(1) < insteon_address(2));
+    EXPECT_TRUE(insteon_address(1) != insteon_address(2));
+}
+
+
+}
@@ -40,6 +40,13 @@ public:
         write_offset_ += size;
     }
 
+    // Makes the whole capacity available for writing again, the block must
+    // have been read out.
+    void reset() {
+        read_offset_ = 0;
+        write_offset_ = 0;
+    }
+
     int read_size() const {
         return write_offset_ - read_offset_;
     }
@@ -105,6 +112,13 @@ int io_buffer::read(char *buf, int len)
         written += to_copy;
 
         if(b->read_size() == 0) {
+            if(blocks_.size() == 1) {
+                // Keep the last block for the next write so that steady
+                // traffic does not allocate.
+                b->reset();
+                break;
+            }
+
             delete b;
             blocks_.pop_front();
         }
@@ -0,0 +1,67 @@
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "bench-util.h"
+#include "io-buffer.h"
+
+
+namespace net {
+
+
+// Fills the buffer through the raw write interface the way
+// buffered_connection does and drains it with reads of the given size.
+static void BM_IoBufferWriteRead(benchmark::State &state)
+{
+    const int total = 4096;
+    const int read_len = state.range(0);
+    std::vector<char> data(total, 'x');
+    std::vector<char> out(read_len);
+    io_buffer buffer(1024);
+    bench::alloc_counter allocs(state);
+
+    for(auto _ : state) {
+        int written = 0;
+
+        while(written < total) {
+            std::pair<char *, int> raw = buffer.get_raw_write_buffer();
+            int len = std::min(raw.second, total - written);
+
+            memcpy(raw.first, &data[written], len);
+            buffer.advance_write_pointer(len);
+            written += len;
+        }
+
+        while(!buffer.empty()) {
+            benchmark::DoNotOptimize(buffer.read(&out[0], read_len));
+        }
+    }
+
+    state.SetBytesProcessed(int64_t(state.iterations()) * total);
+}
+
+BENCHMARK(BM_IoBufferWriteRead)->Arg(1)->Arg(11)->Arg(256)->Arg(4096);
+
+
+static void BM_IoBufferReadSize(benchmark::State &state)
+{
+    io_buffer buffer(64);
+
+    for(int i = 0; i < state.range(0); ++i) {
+        buffer.get_raw_write_buffer();
+        buffer.advance_write_pointer(64);
+    }
+
+    bench::alloc_counter allocs(state);
+
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(buffer.read_size());
+    }
+}
+
+BENCHMARK(BM_IoBufferReadSize)->Arg(1)->Arg(16)->Arg(256);
+
+
+}
@@ -0,0 +1,195 @@
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "link-db.h"
+#include "logger.h"
+#include "plm-frame.h"
+
+
+namespace plm {
+
+
+link_record link_record::from_frame(const plm_frame &frame)
+{
+    const char *d = frame.data();
+    link_record ret;
+
+    ret.flags = d[1];
+    ret.group = d[2];
+    ret.device = insteon_address::from_bytes(d + 3);
+
+    for(int i = 0; i < 3; ++i) {
+        ret.data[i] = d[6 + i];
+    }
+
+    return ret;
+}
+
+
+bool link_record::operator== (const link_record &rh) const
+{
+    return flags == rh.flags && group == rh.group && device == rh.device &&
+           memcmp(data, rh.data, sizeof(data)) == 0;
+}
+
+
+link_db::link_db()
+    : generation_(0)
+{
+}
+
+
+void link_db::assign(const std::vector<link_record> &records)
+{
+    if(records == records_) {
+        return;
+    }
+
+    records_ = records;
+    ++generation_;
+    build_index();
+}
+
+
+const link_record *link_db::find(uint8_t group, insteon_address device) const
+{
+    std::unordered_map<uint32_t, size_t>::const_iterator it =
+        by_key_.find(key(group, device));
+    return it == by_key_.end() ? 0 : &records_[it->second];
+}
+
+
+const std::vector<insteon_address> &link_db::responders(uint8_t group) const
+{
+    static const std::vector<insteon_address> none;
+
+    std::unordered_map<uint8_t, std::vector<insteon_address>>::const_iterator
+        it = responders_.find(group);
+    return it == responders_.end() ? none : it->second;
+}
+
+
+const std::vector<uint8_t> &link_db::groups(insteon_address device) const
+{
+    static const std::vector<uint8_t> none;
+
+    std::unordered_map<insteon_address, std::vector<uint8_t>>::const_iterator
+        it = groups_.find(device);
+    return it == groups_.end() ? none : it->second;
+}
+
+
+void link_db::build_index()
+{
+    by_key_.clear();
+    responders_.clear();
+    groups_.clear();
+
+    for(size_t i = 0; i < records_.size(); ++i) {
+        const link_record &r = records_[i];
+
+        if(!r.is_in_use()) {
+            continue;
+        }
+
+        by_key_[key(r.group, r.device)] = i;
+
+        if(r.is_controller()) {
+            responders_[r.group].push_back(r.device);
+            groups_[r.device].push_back(r.group);
+        }
+    }
+}
+
+
+// The snapshot is a text file:
+//
+//   generation 12
+//   E2 01 1A2B3C 031C01
+//
+// with a line per record: flags, group, device and data in hex.
+bool link_db::save(const std::string &path) const
+{
+    std::string tmp = path + ".tmp";
+    FILE *file = fopen(tmp.c_str(), "w");
+
+    if(!file) {
+        log_error("Cannot write '%s': %s", tmp, strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "generation %u\n", generation_);
+
+    for(size_t i = 0; i < records_.size(); ++i) {
+        const link_record &r = records_[i];
+        fprintf(file, "%02X %02X %06X %02X%02X%02X\n", r.flags, r.group,
+                r.device.value(), r.data[0], r.data[1], r.data[2]);
+    }
+
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+
+    if(!ok || rename(tmp.c_str(), path.c_str()) == -1) {
+        log_error("Cannot write '%s': %s", path, strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+bool link_db::load(const std::string &path)
+{
+    FILE *file = fopen(path.c_str(), "r");
+
+    if(!file) {
+        return false;
+    }
+
+    unsigned generation;
+    std::vector<link_record> records;
+    bool ok = fscanf(file, "generation %u\n", &generation) == 1;
+
+    while(ok) {
+        unsigned flags, group, device, d0, d1, d2;
+        int n = fscanf(file, "%2x %2x %6x %2x%2x%2x\n", &flags, &group,
+                       &device, &d0, &d1, &d2);
+
+        if(n == EOF) {
+            break;
+        }
+
+        if(n != 6) {
+            ok = false;
+            break;
+        }
+
+        link_record r;
+        r.flags = flags;
+        r.group = group;
+        r.device = insteon_address(device);
+        r.data[0] = d0;
+        r.data[1] = d1;
+        r.data[2] = d2;
+        records.push_back(r);
+    }
+
+    fclose(file);
+
+    if(!ok) {
+        log_error("Invalid link database snapshot '%s'", path);
+        return false;
+    }
+
+    records_.swap(records);
+    generation_ = generation;
+    build_index();
+    return true;
+}
+
+
+}
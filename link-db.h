@@ -0,0 +1,97 @@
+
+#ifndef LINK_DB_H_
+#define LINK_DB_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "insteon-address.h"
+
+
+namespace plm {
+
+class plm_frame;
+
+
+// A record of the modem's ALL-link database as reported in 0x57:
+//
+//   0x57 flags group device[3] data[3]
+struct link_record {
+    enum {
+        IN_USE = 0x80,
+        CONTROLLER = 0x40
+    };
+
+    link_record() : flags(0), group(0), data() {}
+
+    bool is_in_use() const { return flags & IN_USE; }
+
+    // The modem is the controller and the device responds to the group.
+    bool is_controller() const { return flags & CONTROLLER; }
+
+    static link_record from_frame(const plm_frame &frame);
+
+    bool operator== (const link_record &rh) const;
+
+    uint8_t flags;
+    uint8_t group;
+    insteon_address device;
+    uint8_t data[3];
+};
+
+
+// The modem's link database in memory, indexed by group and by device. The
+// generation is bumped every time the records change, so users can tell
+// whether what they derived from the database is still current. The
+// database can be saved to and loaded from a snapshot file, which keeps the
+// generation across restarts.
+class link_db {
+public:
+    link_db();
+
+    // Replaces the records, bumps the generation if they are different.
+    void assign(const std::vector<link_record> &records);
+
+    const std::vector<link_record> &records() const { return records_; }
+    uint32_t generation() const { return generation_; }
+
+    // The record for the device in the group, null if there is none.
+    const link_record *find(uint8_t group, insteon_address device) const;
+
+    // The devices that respond to the modem's broadcasts to the group.
+    const std::vector<insteon_address> &responders(uint8_t group) const;
+
+    // The groups the modem controls the device in.
+    const std::vector<uint8_t> &groups(insteon_address device) const;
+
+    // Writes the snapshot atomically. Returns false on errors.
+    bool save(const std::string &path) const;
+
+    // Replaces the database with the snapshot. Returns false if the file
+    // does not exist or cannot be parsed, the database is not changed then.
+    bool load(const std::string &path);
+
+private:
+    void build_index();
+
+    static uint32_t key(uint8_t group, insteon_address device) {
+        return (uint32_t(group) << 24) | device.value();
+    }
+
+private:
+    std::vector<link_record> records_;
+    uint32_t generation_;
+
+    // Indexes into records_ by key(), of the records in use.
+    std::unordered_map<uint32_t, size_t> by_key_;
+    std::unordered_map<uint8_t, std::vector<insteon_address>> responders_;
+    std::unordered_map<insteon_address, std::vector<uint8_t>> groups_;
+};
+
+
+}
+
+#endif
@@ -0,0 +1,109 @@
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "link-db.h"
+#include "logger.h"
+#include "plm-frame.h"
+
+#include <gtest/gtest.h>
+
+
+namespace plm {
+
+
+static link_record make_record(uint8_t flags, uint8_t group, uint32_t device)
+{
+    // As the modem reports it.
+    char msg[] = { 0x57, char(flags), char(group), 0, 0, 0, 0x01, 0x20, 0x41 };
+    insteon_address(device).to_bytes(msg + 3);
+    return link_record::from_frame(plm_frame(msg, sizeof(msg)));
+}
+
+
+static std::string temp_path(const char *name)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "/tmp/shd-%s.%d", name, int(getpid()));
+    return buf;
+}
+
+
+TEST(LinkDbTest, Index)
+{
+    std::vector<link_record> records;
+    records.push_back(make_record(0xe2, 1, 0x0a0b0c));
+    records.push_back(make_record(0xe2, 1, 0x0d0e0f));
+    records.push_back(make_record(0xa2, 0, 0x0a0b0c));  // responder
+    records.push_back(make_record(0x62, 2, 0x0a0b0c));  // not in use
+
+    link_db db;
+    EXPECT_EQ(0u, db.generation());
+
+    db.assign(records);
+    EXPECT_EQ(1u, db.generation());
+
+    const link_record *r = db.find(1, insteon_address(0x0d0e0f));
+    ASSERT_TRUE(r != 0);
+    EXPECT_TRUE(r->is_controller());
+    EXPECT_EQ(0x20, r->data[1]);
+
+    ASSERT_TRUE(db.find(0, insteon_address(0x0a0b0c)) != 0);
+    EXPECT_FALSE(db.find(0, insteon_address(0x0a0b0c))->is_controller());
+    EXPECT_TRUE(db.find(2, insteon_address(0x0a0b0c)) == 0);
+
+    ASSERT_EQ(2u, db.responders(1).size());
+    EXPECT_EQ(insteon_address(0x0a0b0c), db.responders(1)[0]);
+    EXPECT_TRUE(db.responders(0).empty());
+    EXPECT_EQ(std::vector<uint8_t>(1, 1),
+              db.groups(insteon_address(0x0a0b0c)));
+
+    // The same records do not make a new generation.
+    db.assign(records);
+    EXPECT_EQ(1u, db.generation());
+
+    records.pop_back();
+    db.assign(records);
+    EXPECT_EQ(2u, db.generation());
+}
+
+
+TEST(LinkDbTest, Snapshot)
+{
+    disable_logging();
+
+    std::string path = temp_path("link-db");
+    std::vector<link_record> records;
+    records.push_back(make_record(0xe2, 1, 0x0a0b0c));
+    records.push_back(make_record(0xa2, 0xff, 0x0d0e0f));
+
+    link_db db;
+    db.assign(records);
+    db.assign(std::vector<link_record>(records.begin(), records.begin() + 1));
+    db.assign(records);
+    ASSERT_TRUE(db.save(path));
+
+    link_db loaded;
+    ASSERT_TRUE(loaded.load(path));
+    EXPECT_EQ(3u, loaded.generation());
+    EXPECT_TRUE(loaded.records() == records);
+    EXPECT_TRUE(loaded.find(0xff, insteon_address(0x0d0e0f)) != 0);
+
+    // A broken snapshot leaves the database alone.
+    FILE *file = fopen(path.c_str(), "w");
+    fputs("generation 7\nE2 01 zz\n", file);
+    fclose(file);
+
+    EXPECT_FALSE(loaded.load(path));
+    EXPECT_EQ(3u, loaded.generation());
+    EXPECT_EQ(2u, loaded.records().size());
+
+    unlink(path.c_str());
+    EXPECT_FALSE(loaded.load(path));
+}
+
+
+}
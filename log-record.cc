@@ -0,0 +1,613 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "log-record.h"
+
+
+namespace logging {
+
+const char BINARY_LOG_MAGIC[8] = { 'S', 'H', 'D', 'L', 'O', 'G', '1', '\n' };
+
+namespace {
+
+std::atomic<uint32_t> next_site_id(0);
+
+
+template<class T>
+void append_pod(std::string *out, const T &v)
+{
+    out->append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+
+void append_short_string(std::string *out, const char *s)
+{
+    uint16_t len = std::min(strlen(s), size_t(UINT16_MAX));
+    append_pod(out, len);
+    out->append(s, len);
+}
+
+
+const char *priority_name(int priority)
+{
+    static const char *names[] = {
+        "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+    };
+
+    if(priority < 0 || priority > 7) {
+        return "?";
+    }
+
+    return names[priority];
+}
+
+
+void append_timestamp(std::string *out, int64_t timestamp)
+{
+    time_t secs = timestamp / 1000000;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+
+    char buf[64];
+    size_t len = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(buf + len, sizeof(buf) - len, ".%06d",
+             int(timestamp % 1000000));
+    out->append(buf);
+}
+
+
+template<class T>
+void put_raw(record *r, char type, const T &v)
+{
+    if(r->num_args == record::MAX_ARGS ||
+       r->args_len + sizeof(v) > record::ARGS_SIZE)
+    {
+        r->truncated = true;
+        return;
+    }
+
+    memcpy(r->args + r->args_len, &v, sizeof(v));
+    r->args_len += sizeof(v);
+    r->types[r->num_args++] = type;
+}
+
+
+void put_string(record *r, const char *s, size_t len)
+{
+    if(r->num_args == record::MAX_ARGS ||
+       r->args_len + 1 > record::ARGS_SIZE)
+    {
+        r->truncated = true;
+        return;
+    }
+
+    // Long strings are cut to whatever space is left.
+    size_t space = record::ARGS_SIZE - r->args_len - 1;
+    if(len > space) {
+        len = space;
+        r->truncated = true;
+    }
+
+    memcpy(r->args + r->args_len, s, len);
+    r->args[r->args_len + len] = 0;
+    r->args_len += len + 1;
+    r->types[r->num_args++] = record::ARG_STRING;
+}
+
+
+template<class T>
+T get_raw(const char *args, int *offset)
+{
+    T v;
+    memcpy(&v, args + *offset, sizeof(v));
+    *offset += sizeof(v);
+    return v;
+}
+
+
+// Checks that an argument of the given type fits into what is left of the
+// argument buffer.
+bool arg_available(char type, const char *args, int offset, int args_len)
+{
+    switch(type) {
+        case record::ARG_INT:
+        case record::ARG_UINT:
+            return offset + 4 <= args_len;
+
+        case record::ARG_LONG:
+        case record::ARG_ULONG:
+        case record::ARG_DOUBLE:
+        case record::ARG_POINTER:
+            return offset + 8 <= args_len;
+
+        case record::ARG_STRING:
+            return offset < args_len &&
+                memchr(args + offset, 0, args_len - offset) != 0;
+    }
+
+    return false;
+}
+
+
+bool is_int_conversion(char conv)
+{
+    return strchr("diouxXc", conv) != 0;
+}
+
+
+bool is_double_conversion(char conv)
+{
+    return strchr("fFeEgGaA", conv) != 0;
+}
+
+
+// Appends the result of snprintf to the output, keeps track of the position.
+template<class T>
+void append_formatted(char *out, size_t out_len, size_t *pos,
+                      const char *spec, T v)
+{
+    if(*pos + 1 >= out_len) {
+        return;
+    }
+
+    int r = snprintf(out + *pos, out_len - *pos, spec, v);
+
+    if(r > 0) {
+        *pos += std::min(size_t(r), out_len - *pos - 1);
+    }
+}
+
+
+void append_str(char *out, size_t out_len, size_t *pos, const char *s)
+{
+    append_formatted(out, out_len, pos, "%s", s);
+}
+
+}
+
+
+site::site(int priority, const char *format, const char *file, int line)
+    : priority(priority), format(format), file(file), line(line),
+      id(next_site_id++)
+{
+}
+
+
+void init_record(record *r, const site *origin)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+
+    r->timestamp = int64_t(tv.tv_sec) * 1000000 + tv.tv_usec;
+    r->origin = origin;
+    r->num_args = 0;
+    r->truncated = false;
+    r->args_len = 0;
+}
+
+
+void put_arg(record *r, int v)
+{
+    put_raw(r, record::ARG_INT, int32_t(v));
+}
+
+
+void put_arg(record *r, unsigned v)
+{
+    put_raw(r, record::ARG_UINT, uint32_t(v));
+}
+
+
+void put_arg(record *r, long v)
+{
+    put_raw(r, record::ARG_LONG, int64_t(v));
+}
+
+
+void put_arg(record *r, unsigned long v)
+{
+    put_raw(r, record::ARG_ULONG, uint64_t(v));
+}
+
+
+void put_arg(record *r, long long v)
+{
+    put_raw(r, record::ARG_LONG, int64_t(v));
+}
+
+
+void put_arg(record *r, unsigned long long v)
+{
+    put_raw(r, record::ARG_ULONG, uint64_t(v));
+}
+
+
+void put_arg(record *r, double v)
+{
+    put_raw(r, record::ARG_DOUBLE, v);
+}
+
+
+void put_arg(record *r, const char *v)
+{
+    if(!v) {
+        v = "(null)";
+    }
+
+    put_string(r, v, strlen(v));
+}
+
+
+void put_arg(record *r, const std::string &v)
+{
+    put_string(r, v.c_str(), v.size());
+}
+
+
+void put_arg(record *r, const void *v)
+{
+    put_raw(r, record::ARG_POINTER, uint64_t(uintptr_t(v)));
+}
+
+
+size_t format_message(const char *format,
+                      const char *types, int num_args,
+                      const char *args, int args_len,
+                      char *out, size_t out_len)
+{
+    if(out_len == 0) {
+        return 0;
+    }
+
+    size_t pos = 0;
+    int arg = 0;
+    int arg_offset = 0;
+    const char *p = format;
+
+    while(*p && pos + 1 < out_len) {
+        if(*p != '%') {
+            out[pos++] = *p++;
+            continue;
+        }
+
+        if(p[1] == '%') {
+            out[pos++] = '%';
+            p += 2;
+            continue;
+        }
+
+        // Collect the conversion spec without the length modifiers, they are
+        // chosen from the captured argument type instead.
+        char spec[32];
+        size_t spec_len = 0;
+        spec[spec_len++] = *p++;
+
+        while(*p && strchr("-+ #0123456789.", *p) && spec_len < 24) {
+            spec[spec_len++] = *p++;
+        }
+
+        while(*p && strchr("hlLqjzt", *p)) {
+            ++p;
+        }
+
+        char conv = *p;
+        if(!conv) {
+            break;
+        }
+        ++p;
+
+        if(arg >= num_args) {
+            append_str(out, out_len, &pos, "<?>");
+            continue;
+        }
+
+        char type = types[arg++];
+        bool ok = true;
+
+        if(!arg_available(type, args, arg_offset, args_len)) {
+            // Corrupted record, do not decode any further arguments.
+            append_str(out, out_len, &pos, "<?>");
+            num_args = arg;
+            continue;
+        }
+
+        switch(type) {
+            case record::ARG_INT:
+            case record::ARG_UINT: {
+                int32_t v = get_raw<int32_t>(args, &arg_offset);
+                spec[spec_len++] = conv;
+                spec[spec_len] = 0;
+                if(is_int_conversion(conv)) {
+                    append_formatted(out, out_len, &pos, spec, v);
+                } else {
+                    ok = false;
+                }
+                break;
+            }
+
+            case record::ARG_LONG:
+            case record::ARG_ULONG: {
+                long long v = get_raw<int64_t>(args, &arg_offset);
+                spec[spec_len++] = 'l';
+                spec[spec_len++] = 'l';
+                spec[spec_len++] = conv;
+                spec[spec_len] = 0;
+                if(is_int_conversion(conv) && conv != 'c') {
+                    append_formatted(out, out_len, &pos, spec, v);
+                } else {
+                    ok = false;
+                }
+                break;
+            }
+
+            case record::ARG_DOUBLE: {
+                double v = get_raw<double>(args, &arg_offset);
+                spec[spec_len++] = conv;
+                spec[spec_len] = 0;
+                if(is_double_conversion(conv)) {
+                    append_formatted(out, out_len, &pos, spec, v);
+                } else {
+                    ok = false;
+                }
+                break;
+            }
+
+            case record::ARG_STRING: {
+                const char *v = args + arg_offset;
+                arg_offset += strlen(v) + 1;
+                spec[spec_len++] = conv;
+                spec[spec_len] = 0;
+                if(conv == 's') {
+                    append_formatted(out, out_len, &pos, spec, v);
+                } else {
+                    ok = false;
+                }
+                break;
+            }
+
+            case record::ARG_POINTER: {
+                uint64_t v = get_raw<uint64_t>(args, &arg_offset);
+                spec[spec_len++] = conv;
+                spec[spec_len] = 0;
+                if(conv == 'p') {
+                    append_formatted(out, out_len, &pos, spec,
+                                     (const void *)uintptr_t(v));
+                } else {
+                    ok = false;
+                }
+                break;
+            }
+
+            default:
+                // Unknown type, the rest of the arguments cannot be decoded.
+                num_args = arg;
+                ok = false;
+                break;
+        }
+
+        if(!ok) {
+            append_str(out, out_len, &pos, "<?>");
+        }
+    }
+
+    out[pos] = 0;
+    return pos;
+}
+
+
+size_t format_record(const record &r, char *out, size_t out_len)
+{
+    size_t len = format_message(r.origin->format, r.types, r.num_args,
+                                r.args, r.args_len, out, out_len);
+
+    if(r.truncated && len + 1 < out_len) {
+        len += snprintf(out + len, out_len - len, "%s", " <truncated>");
+        len = std::min(len, out_len - 1);
+    }
+
+    return len;
+}
+
+
+void append_binary_site(const site &s, std::string *out)
+{
+    out->push_back('S');
+    append_pod(out, uint32_t(s.id));
+    append_pod(out, uint8_t(s.priority));
+    append_pod(out, uint32_t(s.line));
+    append_short_string(out, s.file);
+    append_short_string(out, s.format);
+}
+
+
+void append_binary_record(const record &r, std::string *out)
+{
+    out->push_back('R');
+    append_pod(out, uint32_t(r.origin->id));
+    append_pod(out, int64_t(r.timestamp));
+    append_pod(out, uint8_t(r.num_args));
+    out->append(r.types, r.num_args);
+    append_pod(out, uint16_t(r.args_len));
+    out->append(r.args, r.args_len);
+}
+
+
+void append_binary_drops(int64_t timestamp, uint64_t count, std::string *out)
+{
+    out->push_back('D');
+    append_pod(out, timestamp);
+    append_pod(out, count);
+}
+
+
+binary_log_reader::binary_log_reader(const std::string &data)
+    : data_(data), pos_(sizeof(BINARY_LOG_MAGIC)), valid_(false)
+{
+    valid_ = data_.size() >= sizeof(BINARY_LOG_MAGIC) &&
+        memcmp(data_.data(), BINARY_LOG_MAGIC, sizeof(BINARY_LOG_MAGIC)) == 0;
+}
+
+
+bool binary_log_reader::is_valid() const
+{
+    return valid_;
+}
+
+
+bool binary_log_reader::next(std::string *line)
+{
+    if(!valid_) {
+        return false;
+    }
+
+    char type;
+
+    while(read(&type, 1)) {
+        if(type == 'S') {
+            if(!read_site()) {
+                return false;
+            }
+
+            continue;
+        }
+
+        if(type == 'D') {
+            int64_t timestamp;
+            uint64_t count;
+
+            if(!read(&timestamp, sizeof(timestamp)) ||
+               !read(&count, sizeof(count)))
+            {
+                return false;
+            }
+
+            char buf[64];
+            snprintf(buf, sizeof(buf), " warning logger: dropped %llu messages",
+                     (unsigned long long)count);
+
+            line->clear();
+            append_timestamp(line, timestamp);
+            line->append(buf);
+            return true;
+        }
+
+        if(type != 'R') {
+            return false;
+        }
+
+        uint32_t site_id;
+        int64_t timestamp;
+        uint8_t num_args;
+        char types[256];
+        uint16_t args_len;
+
+        if(!read(&site_id, sizeof(site_id)) ||
+           !read(&timestamp, sizeof(timestamp)) ||
+           !read(&num_args, sizeof(num_args)) ||
+           !read(types, num_args) ||
+           !read(&args_len, sizeof(args_len)) ||
+           pos_ + args_len > data_.size())
+        {
+            return false;
+        }
+
+        const char *args = data_.data() + pos_;
+        pos_ += args_len;
+
+        if(site_id >= known_sites_.size() || !known_sites_[site_id]) {
+            return false;
+        }
+
+        const site_info &s = sites_[site_id];
+        char message[1024];
+        format_message(s.format.c_str(), types, num_args, args, args_len,
+                       message, sizeof(message));
+
+        char location[64];
+        snprintf(location, sizeof(location), ":%d: ", s.line);
+
+        line->clear();
+        append_timestamp(line, timestamp);
+        line->push_back(' ');
+        line->append(priority_name(s.priority));
+        line->push_back(' ');
+        line->append(s.file);
+        line->append(location);
+        line->append(message);
+        return true;
+    }
+
+    return false;
+}
+
+
+bool binary_log_reader::read(void *buf, size_t len)
+{
+    if(pos_ + len > data_.size()) {
+        return false;
+    }
+
+    memcpy(buf, data_.data() + pos_, len);
+    pos_ += len;
+    return true;
+}
+
+
+bool binary_log_reader::read_string(std::string *s)
+{
+    uint16_t len;
+
+    if(!read(&len, sizeof(len)) || pos_ + len > data_.size()) {
+        return false;
+    }
+
+    s->assign(data_, pos_, len);
+    pos_ += len;
+    return true;
+}
+
+
+bool binary_log_reader::read_site()
+{
+    uint32_t id;
+    uint8_t priority;
+    uint32_t line;
+    site_info info;
+
+    if(!read(&id, sizeof(id)) ||
+       !read(&priority, sizeof(priority)) ||
+       !read(&line, sizeof(line)) ||
+       !read_string(&info.file) ||
+       !read_string(&info.format))
+    {
+        return false;
+    }
+
+    // Site ids are small and dense, they are handed out sequentially.
+    if(id > 1000000) {
+        return false;
+    }
+
+    info.priority = priority;
+    info.line = line;
+
+    if(id >= sites_.size()) {
+        sites_.resize(id + 1);
+        known_sites_.resize(id + 1, false);
+    }
+
+    sites_[id] = info;
+    known_sites_[id] = true;
+    return true;
+}
+
+
+}
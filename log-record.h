@@ -0,0 +1,152 @@
+
+#ifndef LOG_RECORD_H_
+#define LOG_RECORD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+
+namespace logging {
+
+
+// A place in the code that logs. Sites are static objects created by the
+// logging macros, every site gets a unique id on construction which is used
+// to refer to it in binary logs.
+struct site {
+    site(int priority, const char *format, const char *file, int line);
+
+    int priority;           // syslog priority
+    const char *format;
+    const char *file;
+    int line;
+    uint32_t id;
+};
+
+
+// A log message in its unformatted form: the site it comes from and the raw
+// argument values. Records are cheap to fill on the logging thread and are
+// formatted later, see format_record().
+struct record {
+    enum {
+        MAX_ARGS = 8,
+        ARGS_SIZE = 96
+    };
+
+    // Argument type codes stored in 'types'.
+    enum arg_type {
+        ARG_INT = 'i',      // int32_t
+        ARG_UINT = 'u',     // uint32_t
+        ARG_LONG = 'l',     // int64_t
+        ARG_ULONG = 'L',    // uint64_t
+        ARG_DOUBLE = 'd',   // double
+        ARG_STRING = 's',   // nul-terminated, copied into args
+        ARG_POINTER = 'p'   // uint64_t
+    };
+
+    int64_t timestamp;      // usecs since the epoch
+    const site *origin;
+    uint8_t num_args;
+    bool truncated;         // some arguments did not fit
+    char types[MAX_ARGS];
+    uint16_t args_len;
+    char args[ARGS_SIZE];
+};
+
+
+// Initializes the record header and sets the timestamp to now.
+void init_record(record *r, const site *origin);
+
+// Appends an argument to the record. Integral types are widened the same way
+// they would be for a printf call, strings are copied.
+void put_arg(record *r, int v);
+void put_arg(record *r, unsigned v);
+void put_arg(record *r, long v);
+void put_arg(record *r, unsigned long v);
+void put_arg(record *r, long long v);
+void put_arg(record *r, unsigned long long v);
+void put_arg(record *r, double v);
+void put_arg(record *r, const char *v);
+void put_arg(record *r, const std::string &v);
+void put_arg(record *r, const void *v);
+
+
+template<class... Args>
+inline void put_args(record *r, const Args &... args)
+{
+    int unused[] = { 0, (put_arg(r, args), 0)... };
+    (void)unused;
+}
+
+
+// Formats the message the same way printf would with the original arguments.
+// Conversions that do not match the captured argument type are rendered as
+// "<?>". The output is always nul-terminated, returns the length of the
+// formatted message (possibly truncated).
+size_t format_message(const char *format,
+                      const char *types, int num_args,
+                      const char *args, int args_len,
+                      char *out, size_t out_len);
+
+size_t format_record(const record &r, char *out, size_t out_len);
+
+
+// Binary log format. A file starts with BINARY_LOG_MAGIC followed by
+// entries, all integers are in host byte order:
+//
+//   'S' site:    u32 id, u8 priority, u32 line, u16 len, file,
+//                u16 len, format
+//   'R' record:  u32 site id, i64 timestamp, u8 num_args,
+//                num_args type codes, u16 args_len, args
+//   'D' drops:   i64 timestamp, u64 count
+//
+// A site entry precedes the first record that refers to it. The file can be
+// rendered with shd-logcat.
+extern const char BINARY_LOG_MAGIC[8];
+
+void append_binary_site(const site &s, std::string *out);
+void append_binary_record(const record &r, std::string *out);
+void append_binary_drops(int64_t timestamp, uint64_t count,
+                         std::string *out);
+
+
+// Decodes binary log data into text lines of the form:
+//
+//   2016-01-02 03:04:05.678901 err plm-connection.cc:123: message
+class binary_log_reader {
+public:
+    // The data should include the magic. The reader keeps a reference.
+    explicit binary_log_reader(const std::string &data);
+
+    // False if the data does not start with the magic.
+    bool is_valid() const;
+
+    // Renders the next message into 'line'. Returns false at the end of the
+    // data or if the data is corrupted.
+    bool next(std::string *line);
+
+private:
+    struct site_info {
+        int priority;
+        std::string file;
+        int line;
+        std::string format;
+    };
+
+    bool read(void *buf, size_t len);
+    bool read_string(std::string *s);
+    bool read_site();
+
+    const std::string &data_;
+    size_t pos_;
+    bool valid_;
+    std::vector<site_info> sites_;
+    std::vector<bool> known_sites_;
+};
+
+
+}
+
+#endif
@@ -1,44 +1,480 @@
 
 #include "logger.h"
 
-#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/time.h>
 #include <syslog.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
-static bool logging_disabled = false;
 
+namespace logging {
 
-void log_error(const char *format, ...)
+std::atomic<int> log_level(LOG_INFO);
+
+namespace {
+
+// Number of records in every per-thread ring.
+const unsigned RING_SIZE = 512;
+
+// The background thread wakes up at least this often, producers never block
+// or signal it unless their ring is filling up.
+const int DRAIN_INTERVAL = 100;  // msecs
+
+// At most RATE_LIMIT messages with the same format are written within
+// RATE_LIMIT_WINDOW, the rest are counted and reported as a summary.
+const int RATE_LIMIT = 10;
+const int64_t RATE_LIMIT_WINDOW = 1000000;  // usecs
+
+const size_t MAX_MESSAGE_LEN = 512;
+
+
+int64_t usecs_now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return int64_t(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+
+void syslog_output(int priority, const char *message)
+{
+    syslog(priority, "%s", message);
+}
+
+
+// Single producer, single consumer ring of records. The producer is the
+// thread that owns the ring, the consumer is the background thread.
+class ring {
+public:
+    ring() : head_(0), tail_(0), dropped_(0), reported_dropped_(0),
+             orphaned_(false) {
+    }
+
+    // Producer side.
+    record *reserve() {
+        unsigned head = head_.load(std::memory_order_relaxed);
+
+        if(head - tail_.load(std::memory_order_acquire) == RING_SIZE) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return 0;
+        }
+
+        return &records_[head % RING_SIZE];
+    }
+
+    // Producer side, returns the number of records in the ring.
+    unsigned commit() {
+        unsigned head = head_.load(std::memory_order_relaxed) + 1;
+        head_.store(head, std::memory_order_release);
+        return head - tail_.load(std::memory_order_relaxed);
+    }
+
+    // Consumer side.
+    const record *front() {
+        unsigned tail = tail_.load(std::memory_order_relaxed);
+
+        if(tail == head_.load(std::memory_order_acquire)) {
+            return 0;
+        }
+
+        return &records_[tail % RING_SIZE];
+    }
+
+    void pop() {
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+    }
+
+    // Returns the number of drops since the last call. Consumer side.
+    uint64_t take_dropped() {
+        uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+        uint64_t ret = dropped - reported_dropped_;
+        reported_dropped_ = dropped;
+        return ret;
+    }
+
+    void set_orphaned() { orphaned_ = true; }
+    bool is_orphaned() const { return orphaned_; }
+
+private:
+    ring(const ring &);
+    ring &operator= (const ring &);
+
+    std::atomic<unsigned> head_;
+    std::atomic<unsigned> tail_;
+    std::atomic<uint64_t> dropped_;
+    uint64_t reported_dropped_;
+    std::atomic<bool> orphaned_;
+
+    record records_[RING_SIZE];
+};
+
+
+// The background thread and the list of all rings.
+class log_writer {
+public:
+    log_writer() : output_(syslog_output), binary_file_(0),
+                   next_binary_file_(0), started_(false), stopping_(false),
+                   flush_requested_(0), flush_done_(0) {
+    }
+
+    // Drains everything that is left and stops the background thread.
+    ~log_writer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+
+        wakeup_cv_.notify_one();
+
+        if(thread_.joinable()) {
+            thread_.join();
+        }
+
+        for(size_t i = 0; i < rings_.size(); ++i) {
+            delete rings_[i];
+        }
+
+        if(binary_file_) {
+            fclose(binary_file_);
+        }
+
+        if(next_binary_file_) {
+            fclose(next_binary_file_);
+        }
+    }
+
+    ring *create_ring() {
+        ring *r = new ring;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        rings_.push_back(r);
+
+        if(!started_) {
+            started_ = true;
+            thread_ = std::thread(&log_writer::run, this);
+        }
+
+        return r;
+    }
+
+    void wakeup() {
+        wakeup_cv_.notify_one();
+    }
+
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        if(!started_) {
+            return;
+        }
+
+        uint64_t target = ++flush_requested_;
+        wakeup_cv_.notify_one();
+        flush_cv_.wait(lock, [&]() { return flush_done_ >= target; });
+    }
+
+    void set_output(void (*output)(int, const char *)) {
+        output_ = output ? output : syslog_output;
+    }
+
+    bool set_binary_file(const char *path) {
+        FILE *file = fopen(path, "a");
+
+        if(!file) {
+            return false;
+        }
+
+        if(ftell(file) == 0) {
+            fwrite(BINARY_LOG_MAGIC, sizeof(BINARY_LOG_MAGIC), 1, file);
+        }
+
+        // The background thread picks the file up on its next pass.
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if(next_binary_file_) {
+            fclose(next_binary_file_);
+        }
+
+        next_binary_file_ = file;
+        return true;
+    }
+
+private:
+    log_writer(const log_writer &);
+    log_writer &operator= (const log_writer &);
+
+    struct rate_entry {
+        rate_entry() : window_start(0), count(0), suppressed(0) {}
+
+        int64_t window_start;
+        int count;
+        uint64_t suppressed;
+    };
+
+    void run() {
+        while(true) {
+            uint64_t flush_target;
+            bool stopping;
+            std::vector<ring *> rings;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wakeup_cv_.wait_for(
+                    lock,
+                    std::chrono::milliseconds(DRAIN_INTERVAL),
+                    [this]() {
+                        return stopping_ || flush_requested_ > flush_done_;
+                    });
+
+                flush_target = flush_requested_;
+                stopping = stopping_;
+                rings = rings_;
+
+                if(next_binary_file_) {
+                    if(binary_file_) {
+                        fclose(binary_file_);
+                    }
+
+                    binary_file_ = next_binary_file_;
+                    next_binary_file_ = 0;
+                    defined_sites_.clear();
+                }
+            }
+
+            for(size_t i = 0; i < rings.size(); ++i) {
+                drain(rings[i]);
+            }
+
+            if(binary_file_) {
+                fwrite(binary_buf_.data(), binary_buf_.size(), 1, binary_file_);
+                fflush(binary_file_);
+                binary_buf_.clear();
+            }
+
+            report_suppressed(stopping ? INT64_MAX : usecs_now());
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                remove_orphaned_rings();
+                flush_done_ = flush_target;
+            }
+
+            flush_cv_.notify_all();
+
+            if(stopping) {
+                return;
+            }
+        }
+    }
+
+    void drain(ring *r) {
+        const record *rec;
+
+        while((rec = r->front()) != 0) {
+            if(binary_file_) {
+                write_binary(*rec);
+            } else {
+                write(*rec);
+            }
+
+            r->pop();
+        }
+
+        uint64_t dropped = r->take_dropped();
+        if(dropped > 0 && binary_file_) {
+            append_binary_drops(usecs_now(), dropped, &binary_buf_);
+        } else if(dropped > 0) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "logger: dropped %llu messages",
+                     (unsigned long long)dropped);
+            output_.load()(LOG_WARNING, buf);
+        }
+    }
+
+    // Binary records are not rate-limited, they are meant for high volume
+    // tracing and are cheap to write.
+    void write_binary(const record &r) {
+        uint32_t id = r.origin->id;
+
+        if(id >= defined_sites_.size()) {
+            defined_sites_.resize(id + 1, false);
+        }
+
+        if(!defined_sites_[id]) {
+            append_binary_site(*r.origin, &binary_buf_);
+            defined_sites_[id] = true;
+        }
+
+        append_binary_record(r, &binary_buf_);
+    }
+
+    void write(const record &r) {
+        rate_entry &e = rates_[r.origin];
+
+        if(r.timestamp - e.window_start >= RATE_LIMIT_WINDOW) {
+            write_suppressed(r.origin, &e);
+            e.window_start = r.timestamp;
+            e.count = 0;
+        }
+
+        if(++e.count > RATE_LIMIT) {
+            ++e.suppressed;
+            return;
+        }
+
+        char buf[MAX_MESSAGE_LEN];
+        format_record(r, buf, sizeof(buf));
+        output_.load()(r.origin->priority, buf);
+    }
+
+    // Reports the suppressed messages for all expired windows and forgets
+    // about the quiet formats.
+    void report_suppressed(int64_t now) {
+        auto it = rates_.begin();
+
+        while(it != rates_.end()) {
+            if(now - it->second.window_start < RATE_LIMIT_WINDOW) {
+                ++it;
+                continue;
+            }
+
+            write_suppressed(it->first, &it->second);
+            it = rates_.erase(it);
+        }
+    }
+
+    void write_suppressed(const site *origin, rate_entry *e) {
+        if(e->suppressed == 0) {
+            return;
+        }
+
+        char buf[MAX_MESSAGE_LEN];
+        snprintf(buf, sizeof(buf), "suppressed %llu messages like: %s",
+                 (unsigned long long)e->suppressed, origin->format);
+        output_.load()(origin->priority, buf);
+        e->suppressed = 0;
+    }
+
+    // Must be called with mutex_ held. Deletes rings of exited threads once
+    // they have been drained.
+    void remove_orphaned_rings() {
+        size_t j = 0;
+
+        for(size_t i = 0; i < rings_.size(); ++i) {
+            if(rings_[i]->is_orphaned() && rings_[i]->front() == 0) {
+                delete rings_[i];
+            } else {
+                rings_[j++] = rings_[i];
+            }
+        }
+
+        rings_.resize(j);
+    }
+
+private:
+    std::atomic<void (*)(int, const char *)> output_;
+
+    // Only used by the background thread.
+    std::unordered_map<const site *, rate_entry> rates_;
+    FILE *binary_file_;
+    std::string binary_buf_;
+    std::vector<bool> defined_sites_;
+
+    std::mutex mutex_;
+    std::condition_variable wakeup_cv_;
+    std::condition_variable flush_cv_;
+    std::vector<ring *> rings_;
+    std::thread thread_;
+    FILE *next_binary_file_;
+    bool started_;
+    bool stopping_;
+    uint64_t flush_requested_;
+    uint64_t flush_done_;
+};
+
+
+log_writer &writer()
 {
-    if(logging_disabled) {
-        return;
+    static log_writer w;
+    return w;
+}
+
+
+// Gives the thread's ring back to the writer when the thread exits.
+struct ring_holder {
+    ring_holder() : r(0) {}
+
+    ~ring_holder() {
+        if(r) {
+            r->set_orphaned();
+        }
     }
 
-    va_list ap;
+    ring *r;
+};
+
+
+thread_local ring_holder thread_ring;
+
+}
+
 
-    va_start(ap, format);
-    vsyslog(LOG_ERR, format, ap);
-    va_end(ap);
+record *reserve_record()
+{
+    if(!thread_ring.r) {
+        thread_ring.r = writer().create_ring();
+    }
+
+    return thread_ring.r->reserve();
 }
 
 
-void log_info(const char *format, ...)
+void commit_record()
 {
-    if(logging_disabled) {
-        return;
+    // Do not wait for the periodic drain if the ring is filling up.
+    if(thread_ring.r->commit() > RING_SIZE / 2) {
+        writer().wakeup();
     }
+}
 
+}
 
-    va_list ap;
 
-    va_start(ap, format);
-    vsyslog(LOG_INFO, format, ap);
-    va_end(ap);
+void set_log_level(int priority)
+{
+    logging::log_level = priority;
 }
 
 
 void disable_logging()
 {
-    logging_disabled = true;
+    logging::log_level = -1;
 }
 
+
+bool set_binary_log_file(const char *path)
+{
+    return logging::writer().set_binary_file(path);
+}
+
+
+void flush_logging()
+{
+    logging::writer().flush();
+}
+
+
+void set_log_output(void (*output)(int priority, const char *message))
+{
+    logging::writer().set_output(output);
+}
@@ -2,14 +2,114 @@
 #ifndef LOGGER_H_
 #define LOGGER_H_
 
-// Sends a message to the system logger.
-void log_error(const char *format, ...);
-void log_info(const char *format, ...);
+#include <syslog.h>
+
+#include <atomic>
+
+#include "log-record.h"
+
+
+// Messages less severe than SHD_LOG_LEVEL (a syslog priority) are compiled
+// out entirely. By default everything is compiled in and the level is
+// checked at run time, see set_log_level().
+#ifndef SHD_LOG_LEVEL
+#define SHD_LOG_LEVEL LOG_DEBUG
+#endif
+
+
+// Send a message to the system logger, e.g.
+//
+//   log_error("Unexpected STX character: 0x%x", stx_buf_);
+//
+// The arguments are only evaluated if the message's level is enabled. The
+// message is not formatted on the calling thread: the argument values are
+// copied into a lock-free per-thread ring and a background thread formats
+// them and hands them to syslog (or writes them out in binary form, see
+// set_binary_log_file()). This keeps logging cheap on the event loop thread.
+//
+// The format must be a string literal. Arguments may be of arithmetic types,
+// pointers, C strings or std::string. If the ring is full the message is
+// dropped and the number of dropped messages is reported later. Bursts of
+// the same message are rate-limited.
+#define log_error(...) SHD_LOG(LOG_ERR, __VA_ARGS__)
+#define log_warning(...) SHD_LOG(LOG_WARNING, __VA_ARGS__)
+#define log_info(...) SHD_LOG(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) SHD_LOG(LOG_DEBUG, __VA_ARGS__)
+
+
+#define SHD_LOG(priority, ...)                                              \
+    do {                                                                    \
+        if((priority) <= SHD_LOG_LEVEL &&                                   \
+           logging::is_enabled(priority))                                   \
+        {                                                                   \
+            static const logging::site shd_log_site_(                       \
+                priority, SHD_LOG_FORMAT_(__VA_ARGS__, 0),                  \
+                __FILE__, __LINE__);                                        \
+            logging::log(&shd_log_site_, __VA_ARGS__);                      \
+        }                                                                   \
+    } while(0)
+
+#define SHD_LOG_FORMAT_(format, ...) format
+
+
+// Sets the least severe priority that is logged, LOG_INFO by default.
+void set_log_level(int priority);
 
 
 // Turns the logger off. Primarily to be used for tests.
 void disable_logging();
 
 
-#endif
+// Makes the logger write binary records into the given file instead of
+// sending formatted messages to syslog. The file is appended to. Returns
+// false if the file could not be opened.
+bool set_binary_log_file(const char *path);
+
+
+// Blocks until all messages logged so far (from any thread) have been
+// written out.
+void flush_logging();
 
+
+// Replaces syslog as the destination for formatted messages. Passing null
+// restores syslog. Primarily to be used for tests.
+void set_log_output(void (*output)(int priority, const char *message));
+
+
+namespace logging {
+
+extern std::atomic<int> log_level;
+
+inline bool is_enabled(int priority)
+{
+    return priority <= log_level.load(std::memory_order_relaxed);
+}
+
+// Returns a free record in the calling thread's ring or null if the ring is
+// full (the drop is accounted for).
+record *reserve_record();
+
+// Makes the record returned by reserve_record() visible to the background
+// thread.
+void commit_record();
+
+
+// The format is already known to the site, it is only passed to keep the
+// macro simple.
+template<class... Args>
+inline void log(const site *origin, const char *, const Args &... args)
+{
+    record *r = reserve_record();
+    if(!r) {
+        return;
+    }
+
+    init_record(r, origin);
+    put_args(r, args...);
+    commit_record();
+}
+
+}
+
+
+#endif
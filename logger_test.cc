@@ -0,0 +1,181 @@
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log-record.h"
+#include "logger.h"
+
+#include <gtest/gtest.h>
+
+
+namespace logging {
+
+
+template<class... Args>
+std::string format(const char *fmt, const Args &... args)
+{
+    site s(LOG_INFO, fmt, __FILE__, __LINE__);
+    record r;
+    init_record(&r, &s);
+    put_args(&r, args...);
+
+    char buf[256];
+    format_record(r, buf, sizeof(buf));
+    return buf;
+}
+
+
+TEST(LogRecordTest, Format)
+{
+    EXPECT_EQ("plain", format("plain"));
+    EXPECT_EQ("100%", format("100%%"));
+    EXPECT_EQ("int -5 hex 0x1f", format("int %d hex 0x%x", -5, 0x1f));
+    EXPECT_EQ("char 0x41", format("char 0x%x", 'A'));
+    EXPECT_EQ("long 12345678901", format("long %ld", 12345678901L));
+    EXPECT_EQ("size 7", format("size %zu", size_t(7)));
+    EXPECT_EQ("padded [   42]", format("padded [%5d]", 42));
+    EXPECT_EQ("double 1.50", format("double %.2f", 1.5));
+    EXPECT_EQ("str abc and def",
+              format("str %s and %s", "abc", std::string("def")));
+}
+
+
+TEST(LogRecordTest, Mismatches)
+{
+    EXPECT_EQ("missing <?>", format("missing %d"));
+    EXPECT_EQ("wrong <?> 2", format("wrong %s %d", 1, 2));
+    EXPECT_EQ("extra 1", format("extra %d", 1, 2));
+}
+
+
+TEST(LogRecordTest, Truncation)
+{
+    std::string long_str(200, 'x');
+    std::string out = format("%s", long_str);
+
+    EXPECT_EQ(std::string(record::ARGS_SIZE - 1, 'x') + " <truncated>", out);
+}
+
+
+TEST(LogRecordTest, BinaryRoundTrip)
+{
+    site s1(LOG_ERR, "Unknown command: 0x%x", "plm-connection.cc", 12);
+    site s2(LOG_DEBUG, "PLM receive %s", "plm-connection.cc", 34);
+
+    std::string data(BINARY_LOG_MAGIC, sizeof(BINARY_LOG_MAGIC));
+    record r;
+
+    append_binary_site(s1, &data);
+    init_record(&r, &s1);
+    put_args(&r, 0x51);
+    append_binary_record(r, &data);
+
+    append_binary_site(s2, &data);
+    init_record(&r, &s2);
+    put_args(&r, "frame");
+    append_binary_record(r, &data);
+
+    append_binary_drops(r.timestamp, 3, &data);
+
+    binary_log_reader reader(data);
+    ASSERT_TRUE(reader.is_valid());
+
+    // Skip the timestamp, it depends on the time zone.
+    std::string line;
+    ASSERT_TRUE(reader.next(&line));
+    EXPECT_EQ("err plm-connection.cc:12: Unknown command: 0x51",
+              line.substr(27));
+    ASSERT_TRUE(reader.next(&line));
+    EXPECT_EQ("debug plm-connection.cc:34: PLM receive frame",
+              line.substr(27));
+    ASSERT_TRUE(reader.next(&line));
+    EXPECT_EQ("warning logger: dropped 3 messages", line.substr(27));
+    EXPECT_FALSE(reader.next(&line));
+
+    // A record for an undefined site is an error.
+    std::string bad(BINARY_LOG_MAGIC, sizeof(BINARY_LOG_MAGIC));
+    append_binary_record(r, &bad);
+    binary_log_reader bad_reader(bad);
+    EXPECT_FALSE(bad_reader.next(&line));
+}
+
+
+std::vector<std::string> messages;
+
+void capture_output(int priority, const char *message)
+{
+    messages.push_back(message);
+}
+
+
+TEST(LoggerTest, AsyncOutput)
+{
+    messages.clear();
+    set_log_output(capture_output);
+
+    log_info("hello %d", 1);
+    log_error("from %s", "error");
+
+    std::thread t([]() { log_info("thread %d", 2); });
+    t.join();
+
+    flush_logging();
+    set_log_output(0);
+
+    ASSERT_EQ(3u, messages.size());
+    EXPECT_EQ("hello 1", messages[0]);
+    EXPECT_EQ("from error", messages[1]);
+    EXPECT_EQ("thread 2", messages[2]);
+}
+
+
+TEST(LoggerTest, Levels)
+{
+    messages.clear();
+    set_log_output(capture_output);
+
+    int evaluated = 0;
+    log_debug("not evaluated %d", ++evaluated);
+    log_info("evaluated %d", ++evaluated);
+
+    set_log_level(LOG_DEBUG);
+    log_debug("debug %d", ++evaluated);
+    set_log_level(LOG_INFO);
+
+    flush_logging();
+    set_log_output(0);
+
+    EXPECT_EQ(2, evaluated);
+    ASSERT_EQ(2u, messages.size());
+    EXPECT_EQ("evaluated 1", messages[0]);
+    EXPECT_EQ("debug 2", messages[1]);
+}
+
+
+TEST(LoggerTest, RateLimit)
+{
+    messages.clear();
+    set_log_output(capture_output);
+
+    for(int i = 0; i < 50; ++i) {
+        log_error("Unexpected STX character: 0x%x", i);
+    }
+
+    flush_logging();
+
+    // The first ten get through, the summary comes once the window expires.
+    ASSERT_EQ(10u, messages.size());
+    EXPECT_EQ("Unexpected STX character: 0x9", messages[9]);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    flush_logging();
+    set_log_output(0);
+
+    ASSERT_EQ(11u, messages.size());
+    EXPECT_EQ("suppressed 40 messages like: Unexpected STX character: 0x%x",
+              messages[10]);
+}
+
+
+}
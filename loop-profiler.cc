@@ -0,0 +1,173 @@
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#include "logger.h"
+#include "loop-profiler.h"
+#include "metrics.h"
+
+
+namespace net {
+
+namespace {
+
+std::string demangle(const char *name)
+{
+    int status;
+    char *s = abi::__cxa_demangle(name, 0, 0, &status);
+
+    if(status != 0) {
+        return name;
+    }
+
+    std::string ret(s);
+    free(s);
+    return ret;
+}
+
+}
+
+
+void loop_profiler::stats::add(int64_t usecs)
+{
+    ++count;
+    total += usecs;
+    max = std::max(max, usecs);
+}
+
+
+loop_profiler::loop_profiler(int slow_usecs) : slow_usecs_(slow_usecs)
+{
+    for(int i = 0; i < NUM_PHASES; ++i) {
+        phase_time_[i] = metrics::registry::global().get_histogram(
+            "shd_loop_phase_seconds",
+            "Time spent in each phase of an event loop iteration.",
+            std::string("phase=\"") + phase_name(phase_t(i)) + "\"",
+            1e-6);
+    }
+}
+
+
+void loop_profiler::record_phase(phase_t phase, int64_t usecs)
+{
+    phases_[phase].add(usecs);
+    phase_time_[phase]->record(usecs);
+}
+
+
+void loop_profiler::record_callback(phase_t phase, const void *site,
+                                    int64_t usecs)
+{
+    sites_[phase][site].add(usecs);
+
+    if(usecs >= slow_usecs_) {
+        log_warning("Slow %s callback %s took %lld us", phase_name(phase),
+                    site_name(phase, site), (long long)usecs);
+    }
+}
+
+
+std::vector<std::string> loop_profiler::report(size_t top) const
+{
+    std::vector<std::string> lines;
+    char buf[512];
+
+    for(int i = 0; i < NUM_PHASES; ++i) {
+        const stats &s = phases_[i];
+
+        snprintf(buf, sizeof(buf),
+                 "phase %s: %llu runs, total %lld us, max %lld us",
+                 phase_name(phase_t(i)), (unsigned long long)s.count,
+                 (long long)s.total, (long long)s.max);
+        lines.push_back(buf);
+    }
+
+    struct entry {
+        phase_t phase;
+        const void *site;
+        const stats *s;
+    };
+
+    std::vector<entry> entries;
+
+    for(int i = 0; i < NUM_PHASES; ++i) {
+        std::unordered_map<const void *, stats>::const_iterator it =
+            sites_[i].begin();
+
+        for(; it != sites_[i].end(); ++it) {
+            entry e = { phase_t(i), it->first, &it->second };
+            entries.push_back(e);
+        }
+    }
+
+    std::sort(entries.begin(), entries.end(),
+              [](const entry &a, const entry &b) {
+                  return a.s->total > b.s->total;
+              });
+
+    for(size_t i = 0; i < entries.size() && i < top; ++i) {
+        const entry &e = entries[i];
+
+        snprintf(buf, sizeof(buf),
+                 "%s %s: %llu calls, total %lld us, max %lld us",
+                 phase_name(e.phase), site_name(e.phase, e.site).c_str(),
+                 (unsigned long long)e.s->count, (long long)e.s->total,
+                 (long long)e.s->max);
+        lines.push_back(buf);
+    }
+
+    return lines;
+}
+
+
+const char *loop_profiler::phase_name(phase_t phase)
+{
+    static const char *names[] = {
+        "events", "alarms", "callbacks", "death-row"
+    };
+
+    return names[phase];
+}
+
+
+std::string loop_profiler::site_name(phase_t phase, const void *site)
+{
+    if(phase == EVENTS) {
+        return demangle(static_cast<const std::type_info *>(site)->name());
+    }
+
+    Dl_info info;
+    char buf[256];
+
+    if(!dladdr(site, &info) || !info.dli_fname) {
+        snprintf(buf, sizeof(buf), "%p", site);
+        return buf;
+    }
+
+    // The offset can be fed to addr2line for symbols the dynamic linker
+    // does not know about.
+    const char *module = strrchr(info.dli_fname, '/');
+    module = module ? module + 1 : info.dli_fname;
+
+    snprintf(buf, sizeof(buf), "%s+0x%lx", module,
+             (unsigned long)((const char *)site - (const char *)info.dli_fbase));
+
+    std::string ret(buf);
+
+    if(info.dli_sname) {
+        ret += " (" + demangle(info.dli_sname) + ")";
+    }
+
+    return ret;
+}
+
+
+}
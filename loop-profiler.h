@@ -0,0 +1,71 @@
+
+#ifndef LOOP_PROFILER_H_
+#define LOOP_PROFILER_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace metrics {
+class histogram;
+}
+
+
+namespace net {
+
+
+// Collects the time the event loop spends in every phase of an iteration and
+// in every callback, keyed by the callback's site: the code that called
+// run_later() or schedule_alarm(), or the type of the connection for fd
+// events. Callbacks that take longer than the slow threshold are logged as
+// they happen. Only to be used from the loop thread.
+class loop_profiler {
+public:
+    enum phase_t {
+        EVENTS, ALARMS, CALLBACKS, DEATH_ROW, NUM_PHASES
+    };
+
+    explicit loop_profiler(int slow_usecs);
+
+    void record_phase(phase_t phase, int64_t usecs);
+
+    // For the EVENTS phase the site is a std::type_info of the connection,
+    // otherwise it is a code address.
+    void record_callback(phase_t phase, const void *site, int64_t usecs);
+
+    // Returns human readable lines with the phase totals followed by the
+    // sites with the largest total time, most expensive first.
+    std::vector<std::string> report(size_t top) const;
+
+    static const char *phase_name(phase_t phase);
+
+    // Returns a printable name of the site, resolving code addresses to
+    // "module+offset (symbol)" as far as the dynamic linker knows them.
+    static std::string site_name(phase_t phase, const void *site);
+
+private:
+    loop_profiler(const loop_profiler &);
+    loop_profiler &operator= (const loop_profiler &);
+
+    struct stats {
+        stats() : count(0), total(0), max(0) {}
+
+        void add(int64_t usecs);
+
+        uint64_t count;
+        int64_t total;
+        int64_t max;
+    };
+
+    int slow_usecs_;
+    stats phases_[NUM_PHASES];
+    metrics::histogram *phase_time_[NUM_PHASES];
+    std::unordered_map<const void *, stats> sites_[NUM_PHASES];
+};
+
+}
+
+#endif
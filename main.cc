@@ -1,18 +1,36 @@
 
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "buffered-connection.h"
 #include "logger.h"
+#include "metrics.h"
+#include "metrics-server.h"
 #include "shd-app.h"
 #include "shd-config.h"
 #include "select-server.h"
+#include "thread-pool.h"
+
+
+static net::select_server *server = 0;
 
 
 void usage(const char *exec_name)
 {
-    printf("Usage: %s [-d] [-h]\n", exec_name);
+    printf("Usage: %s [-d] [-v] [-b binary-log] [-p slow-msecs] [-h]\n",
+           exec_name);
+}
+
+
+// Dumps the loop profile to the log on SIGUSR1.
+void on_sigusr1(int)
+{
+    if(server) {
+        server->request_profile_dump();
+    }
 }
 
 
@@ -20,13 +38,28 @@ int main(int argc, char *argv[])
 {
     int opt;
     bool debug_mode = false;
+    bool verbose = false;
+    const char *binary_log = 0;
+    int slow_msecs = -1;
 
-    while((opt = getopt(argc, argv, "dh")) != -1) {
+    while((opt = getopt(argc, argv, "dvb:p:h")) != -1) {
         switch(opt) {
         case 'd':
             debug_mode = true;
             break;
 
+        case 'v':
+            verbose = true;
+            break;
+
+        case 'b':
+            binary_log = optarg;
+            break;
+
+        case 'p':
+            slow_msecs = atoi(optarg);
+            break;
+
         case 'h':
             usage(argv[0]);
             exit(0);
@@ -51,9 +84,39 @@ int main(int argc, char *argv[])
         }
     }
 
+    // Set up logging only after daemonizing, the logger runs a background
+    // thread that would not survive the fork.
+    if(verbose) {
+        set_log_level(LOG_DEBUG);
+    }
+
+    if(binary_log && !set_binary_log_file(binary_log)) {
+        log_error("Cannot open binary log '%s'", binary_log);
+    }
+
     net::select_server ss;
+
+    if(slow_msecs >= 0) {
+        ss.enable_profiling(slow_msecs);
+    }
+
+    server = &ss;
+    signal(SIGUSR1, on_sigusr1);
+    net::thread_pool pool(2);
     shd_config c;
-    shd_app a(&c, &ss, &ss, &ss);
+    shd_app a(&c, &ss, &ss, &ss, &pool);
+
+    net::metrics_server ms(&metrics::registry::global(), &ss, &ss);
+
+    try {
+        if(!c.metrics_socket().empty()) {
+            ms.listen_unix(c.metrics_socket());
+        } else if(c.metrics_port() > 0) {
+            ms.listen_tcp(c.metrics_port());
+        }
+    } catch(net::fd_exception &ex) {
+        log_error("Cannot serve metrics: %s", ex.what());
+    }
 
     a.run();
 
@@ -0,0 +1,264 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+
+#include "buffered-connection.h"
+#include "executor.h"
+#include "metrics.h"
+#include "metrics-server.h"
+
+
+namespace net {
+
+namespace {
+
+// Maximal number of request bytes we look at, the rest is ignored.
+const int MAX_REQUEST = 1024;
+
+
+void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+}
+
+
+// A connected client. Waits for the request, writes the response and tells
+// the server it is done.
+class metrics_server::client : public connection {
+public:
+    client(int fd, metrics_server *server)
+        : fd_(fd), server_(server), written_(0), responding_(false)
+    {
+        set_nonblocking(fd_);
+    }
+
+    ~client() {
+        close(fd_);
+    }
+
+    virtual int get_fd() override {
+        return fd_;
+    }
+
+    virtual void on_read() override {
+        if(responding_) {
+            return;
+        }
+
+        char buf[MAX_REQUEST];
+        int r = ::read(fd_, buf, sizeof(buf));
+
+        if(r == -1 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+
+        if(r == -1) {
+            server_->remove_client(this);
+            return;
+        }
+
+        std::string body = server_->registry_->render();
+        bool http = r >= 4 && memcmp(buf, "GET ", 4) == 0;
+
+        if(http) {
+            response_ = "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                "Connection: close\r\n\r\n";
+        }
+
+        response_ += body;
+        responding_ = true;
+        server_->event_manager_->deregister_for_read(this);
+        on_write();
+    }
+
+    virtual void on_write() override {
+        while(written_ < response_.size()) {
+            int r = ::write(fd_, response_.data() + written_,
+                            response_.size() - written_);
+
+            if(r == -1 && errno == EINTR) {
+                continue;
+            }
+
+            if(r == -1 && errno == EAGAIN) {
+                server_->event_manager_->register_for_write(this);
+                return;
+            }
+
+            if(r == -1) {
+                break;
+            }
+
+            written_ += r;
+        }
+
+        server_->remove_client(this);
+    }
+
+private:
+    client(const client &);
+    client &operator= (const client &);
+
+    int fd_;
+    metrics_server *server_;
+    std::string response_;
+    size_t written_;
+    bool responding_;
+};
+
+
+metrics_server::metrics_server(metrics::registry *reg,
+                               event_manager *em,
+                               executor *ex)
+    : registry_(reg), event_manager_(em), executor_(ex), fd_(-1)
+{
+}
+
+
+metrics_server::~metrics_server()
+{
+    std::set<client *>::iterator it = clients_.begin();
+
+    for(; it != clients_.end(); ++it) {
+        event_manager_->deregister_connection(*it);
+        delete *it;
+    }
+
+    if(fd_ != -1) {
+        event_manager_->deregister_connection(this);
+        close(fd_);
+    }
+
+    if(!unix_path_.empty()) {
+        unlink(unix_path_.c_str());
+    }
+}
+
+
+void metrics_server::listen_unix(const std::string &path)
+{
+    struct sockaddr_un addr;
+
+    if(path.size() >= sizeof(addr.sun_path)) {
+        throw fd_exception(ENAMETOOLONG);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        throw fd_exception(errno);
+    }
+
+    unlink(path.c_str());
+
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int error = errno;
+        close(fd);
+        throw fd_exception(error);
+    }
+
+    unix_path_ = path;
+    listen_fd(fd);
+}
+
+
+void metrics_server::listen_tcp(int port)
+{
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        throw fd_exception(errno);
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int error = errno;
+        close(fd);
+        throw fd_exception(error);
+    }
+
+    listen_fd(fd);
+}
+
+
+void metrics_server::listen_fd(int fd)
+{
+    if(listen(fd, 8) == -1) {
+        int error = errno;
+        close(fd);
+        throw fd_exception(error);
+    }
+
+    set_nonblocking(fd);
+
+    if(fd_ != -1) {
+        event_manager_->deregister_connection(this);
+        close(fd_);
+    }
+
+    fd_ = fd;
+    event_manager_->register_for_read(this);
+}
+
+
+int metrics_server::get_fd()
+{
+    return fd_;
+}
+
+
+void metrics_server::on_read()
+{
+    while(true) {
+        int fd = accept4(fd_, 0, 0, SOCK_CLOEXEC);
+
+        if(fd == -1) {
+            // EAGAIN or a client that went away before we got to it.
+            return;
+        }
+
+        client *c = new client(fd, this);
+        clients_.insert(c);
+        event_manager_->register_for_read(c);
+    }
+}
+
+
+void metrics_server::remove_client(client *c)
+{
+    event_manager_->deregister_connection(c);
+
+    if(clients_.erase(c) == 0) {
+        return;
+    }
+
+    // The client may be in the middle of its own event handler.
+    executor_->run_later([c]() { delete c; });
+}
+
+
+}
@@ -0,0 +1,66 @@
+
+#ifndef METRICS_SERVER_H_
+#define METRICS_SERVER_H_
+
+#include <set>
+#include <string>
+
+#include "event-manager.h"
+
+
+namespace metrics {
+class registry;
+}
+
+
+namespace net {
+
+class executor;
+
+
+// Serves the metrics of a registry in the Prometheus text format on a local
+// socket. Every client gets one snapshot and is disconnected, so both
+// "curl http://127.0.0.1:<port>/metrics" and "socat - UNIX:<path>" work: if
+// the request looks like HTTP the response gets HTTP headers, otherwise the
+// raw text is sent as soon as the client has sent anything (e.g. a newline)
+// or shut down its side.
+class metrics_server : public connection {
+public:
+    metrics_server(metrics::registry *reg, event_manager *em, executor *ex);
+    ~metrics_server();
+
+    // Start listening on a Unix socket, any stale socket file is removed.
+    // Only one listening socket is kept, calling either of the listen
+    // functions again replaces it. Throws fd_exception.
+    void listen_unix(const std::string &path);
+
+    // Start listening on the loopback interface. Throws fd_exception.
+    void listen_tcp(int port);
+
+private:
+    metrics_server(const metrics_server &);
+    metrics_server &operator= (const metrics_server &);
+
+    class client;
+
+    virtual int get_fd() override;
+    virtual void on_read() override;
+
+    void listen_fd(int fd);
+
+    // Called by the client when it is done, the client is deleted later.
+    void remove_client(client *c);
+
+private:
+    metrics::registry *registry_;  // not owned
+    event_manager *event_manager_;  // not owned
+    executor *executor_;  // not owned
+
+    int fd_;
+    std::string unix_path_;
+    std::set<client *> clients_;
+};
+
+}
+
+#endif
@@ -0,0 +1,345 @@
+
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "metrics.h"
+
+
+namespace metrics {
+
+namespace {
+
+int msb(uint64_t v)
+{
+    return 63 - __builtin_clzll(v);
+}
+
+
+void append_sample(const std::string &name,
+                   const std::string &labels,
+                   const char *value,
+                   std::string *out)
+{
+    out->append(name);
+
+    if(!labels.empty()) {
+        out->push_back('{');
+        out->append(labels);
+        out->push_back('}');
+    }
+
+    out->push_back(' ');
+    out->append(value);
+    out->push_back('\n');
+}
+
+
+std::string join_labels(const std::string &labels, const std::string &extra)
+{
+    if(labels.empty()) {
+        return extra;
+    }
+
+    return labels + "," + extra;
+}
+
+}
+
+
+histogram::histogram() : count_(0), sum_(0)
+{
+    for(int i = 0; i < NUM_BUCKETS; ++i) {
+        buckets_[i] = 0;
+    }
+}
+
+
+void histogram::record(uint64_t v)
+{
+    buckets_[bucket_index(v)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(v, std::memory_order_relaxed);
+}
+
+
+uint64_t histogram::count() const
+{
+    return count_.load(std::memory_order_relaxed);
+}
+
+
+uint64_t histogram::sum() const
+{
+    return sum_.load(std::memory_order_relaxed);
+}
+
+
+uint64_t histogram::bucket_count(int index) const
+{
+    return buckets_[index].load(std::memory_order_relaxed);
+}
+
+
+uint64_t histogram::quantile(double q) const
+{
+    uint64_t total = 0;
+    uint64_t counts[NUM_BUCKETS];
+
+    // Take a snapshot first, the buckets can change while we are looking.
+    for(int i = 0; i < NUM_BUCKETS; ++i) {
+        counts[i] = bucket_count(i);
+        total += counts[i];
+    }
+
+    if(total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = std::max(uint64_t(ceil(q * total)), uint64_t(1));
+    uint64_t seen = 0;
+
+    for(int i = 0; i < NUM_BUCKETS; ++i) {
+        seen += counts[i];
+        if(seen >= rank) {
+            return bucket_upper_bound(i) - 1;
+        }
+    }
+
+    return bucket_upper_bound(NUM_BUCKETS - 1) - 1;
+}
+
+
+int histogram::bucket_index(uint64_t v)
+{
+    if(v < SUB_BUCKETS) {
+        return v;
+    }
+
+    int e = std::min(msb(v), int(MAX_BITS));
+    if(e == MAX_BITS) {
+        return NUM_BUCKETS - 1;
+    }
+
+    int sub = (v >> (e - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return (e - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+
+uint64_t histogram::bucket_upper_bound(int index)
+{
+    if(index < SUB_BUCKETS) {
+        return index + 1;
+    }
+
+    int e = index / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t sub = index % SUB_BUCKETS;
+    uint64_t lower = (SUB_BUCKETS + sub) << (e - SUB_BITS);
+    return lower + (uint64_t(1) << (e - SUB_BITS));
+}
+
+
+registry::registry()
+{
+}
+
+
+registry::~registry()
+{
+    std::map<std::string, family>::iterator it = families_.begin();
+
+    for(; it != families_.end(); ++it) {
+        std::map<std::string, void *>::iterator m = it->second.metrics.begin();
+
+        for(; m != it->second.metrics.end(); ++m) {
+            switch(it->second.type) {
+                case COUNTER:
+                    delete static_cast<counter *>(m->second);
+                    break;
+                case GAUGE:
+                    delete static_cast<gauge *>(m->second);
+                    break;
+                case HISTOGRAM:
+                    delete static_cast<histogram *>(m->second);
+                    break;
+            }
+        }
+    }
+}
+
+
+counter *registry::get_counter(const std::string &name,
+                               const std::string &help,
+                               const std::string &labels)
+{
+    return static_cast<counter *>(get(COUNTER, name, help, labels, 1));
+}
+
+
+gauge *registry::get_gauge(const std::string &name,
+                           const std::string &help,
+                           const std::string &labels)
+{
+    return static_cast<gauge *>(get(GAUGE, name, help, labels, 1));
+}
+
+
+histogram *registry::get_histogram(const std::string &name,
+                                   const std::string &help,
+                                   const std::string &labels,
+                                   double scale)
+{
+    return static_cast<histogram *>(get(HISTOGRAM, name, help, labels, scale));
+}
+
+
+void *registry::get(type_t type, const std::string &name,
+                    const std::string &help, const std::string &labels,
+                    double scale)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::map<std::string, family>::iterator it = families_.find(name);
+
+    if(it == families_.end()) {
+        family f;
+        f.type = type;
+        f.help = help;
+        f.scale = scale;
+        it = families_.insert(std::make_pair(name, f)).first;
+    }
+
+    // Asking for the same name with a different type is a programming error.
+    if(it->second.type != type) {
+        return 0;
+    }
+
+    void *&metric = it->second.metrics[labels];
+
+    if(!metric) {
+        switch(type) {
+            case COUNTER:
+                metric = new counter;
+                break;
+            case GAUGE:
+                metric = new gauge;
+                break;
+            case HISTOGRAM:
+                metric = new histogram;
+                break;
+        }
+    }
+
+    return metric;
+}
+
+
+std::string registry::render() const
+{
+    static const char *type_names[] = { "counter", "gauge", "histogram" };
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string out;
+    char buf[64];
+
+    std::map<std::string, family>::const_iterator it = families_.begin();
+
+    for(; it != families_.end(); ++it) {
+        const std::string &name = it->first;
+        const family &f = it->second;
+
+        out += "# HELP " + name + " " + f.help + "\n";
+        out += "# TYPE " + name + " " + type_names[f.type] + "\n";
+
+        std::map<std::string, void *>::const_iterator m = f.metrics.begin();
+
+        for(; m != f.metrics.end(); ++m) {
+            switch(f.type) {
+                case COUNTER:
+                    snprintf(buf, sizeof(buf), "%llu", (unsigned long long)
+                             static_cast<counter *>(m->second)->value());
+                    append_sample(name, m->first, buf, &out);
+                    break;
+
+                case GAUGE:
+                    snprintf(buf, sizeof(buf), "%lld", (long long)
+                             static_cast<gauge *>(m->second)->value());
+                    append_sample(name, m->first, buf, &out);
+                    break;
+
+                case HISTOGRAM:
+                    render_histogram(name, m->first,
+                                     *static_cast<histogram *>(m->second),
+                                     f.scale, &out);
+                    break;
+            }
+        }
+    }
+
+    return out;
+}
+
+
+registry &registry::global()
+{
+    static registry r;
+    return r;
+}
+
+
+void registry::render_histogram(const std::string &name,
+                                const std::string &labels,
+                                const histogram &h,
+                                double scale,
+                                std::string *out)
+{
+    char buf[64];
+    int last = -1;
+
+    for(int i = 0; i < histogram::NUM_BUCKETS; ++i) {
+        if(h.bucket_count(i) > 0) {
+            last = i;
+        }
+    }
+
+    // Cumulative counts at power of two boundaries up to the last non-empty
+    // bucket. Since buckets never straddle a power of two the counts are
+    // exact for "less than the boundary".
+    uint64_t cumulative = 0;
+    int i = 0;
+
+    for(int bit = 0; bit <= histogram::MAX_BITS && i <= last; ++bit) {
+        uint64_t bound = uint64_t(1) << bit;
+
+        while(i < histogram::NUM_BUCKETS &&
+              histogram::bucket_upper_bound(i) <= bound)
+        {
+            cumulative += h.bucket_count(i++);
+        }
+
+        snprintf(buf, sizeof(buf), "le=\"%g\"", double(bound) * scale);
+        snprintf(buf + 32, sizeof(buf) - 32, "%llu",
+                 (unsigned long long)cumulative);
+        append_sample(name + "_bucket", join_labels(labels, buf), buf + 32,
+                      out);
+    }
+
+    uint64_t count = h.count();
+
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long)count);
+    append_sample(name + "_bucket", join_labels(labels, "le=\"+Inf\""), buf,
+                  out);
+
+    snprintf(buf, sizeof(buf), "%g", double(h.sum()) * scale);
+    append_sample(name + "_sum", labels, buf, out);
+
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long)count);
+    append_sample(name + "_count", labels, buf, out);
+}
+
+
+}
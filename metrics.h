@@ -0,0 +1,163 @@
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+
+
+namespace metrics {
+
+
+// All metric updates are lock-free and can be done from any thread.
+
+class counter {
+public:
+    counter() : value_(0) {}
+
+    void inc(uint64_t n = 1) {
+        value_.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    counter(const counter &);
+    counter &operator= (const counter &);
+
+    std::atomic<uint64_t> value_;
+};
+
+
+class gauge {
+public:
+    gauge() : value_(0) {}
+
+    void set(int64_t v) {
+        value_.store(v, std::memory_order_relaxed);
+    }
+
+    void add(int64_t n) {
+        value_.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    int64_t value() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    gauge(const gauge &);
+    gauge &operator= (const gauge &);
+
+    std::atomic<int64_t> value_;
+};
+
+
+// A histogram of non-negative integer values (e.g. latencies in usecs) with
+// log-linear buckets in the style of HDR histograms: every power of two is
+// split into SUB_BUCKETS linear buckets, which bounds the relative error of
+// reported values to 1/SUB_BUCKETS regardless of the magnitude.
+class histogram {
+public:
+    enum {
+        SUB_BITS = 3,
+        SUB_BUCKETS = 1 << SUB_BITS,
+        MAX_BITS = 40,  // larger values are clamped
+        NUM_BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS
+    };
+
+    histogram();
+
+    void record(uint64_t v);
+
+    uint64_t count() const;
+    uint64_t sum() const;
+    uint64_t bucket_count(int index) const;
+
+    // Returns the largest value that falls into the same bucket as the value
+    // at the given quantile (0..1), 0 if there are no values.
+    uint64_t quantile(double q) const;
+
+    static int bucket_index(uint64_t v);
+
+    // Values in the bucket are less than this bound.
+    static uint64_t bucket_upper_bound(int index);
+
+private:
+    histogram(const histogram &);
+    histogram &operator= (const histogram &);
+
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> buckets_[NUM_BUCKETS];
+};
+
+
+// A set of named metrics that can be rendered in the Prometheus text
+// exposition format. Metrics are created on first lookup and live as long as
+// the registry. Lookups take a lock, so they should be done once and the
+// returned pointer kept around; updates are lock-free.
+class registry {
+public:
+    registry();
+    ~registry();
+
+    // 'labels' is a preformatted Prometheus label list without the braces,
+    // e.g. device="1A2B3C". Metrics with the same name and different labels
+    // form a family and share the help text.
+    counter *get_counter(const std::string &name,
+                         const std::string &help,
+                         const std::string &labels = "");
+    gauge *get_gauge(const std::string &name,
+                     const std::string &help,
+                     const std::string &labels = "");
+
+    // Histogram values are multiplied by 'scale' when rendered, e.g. 1e-6
+    // for values recorded in usecs and exposed in seconds. Only the power of
+    // two bucket boundaries are exposed.
+    histogram *get_histogram(const std::string &name,
+                             const std::string &help,
+                             const std::string &labels = "",
+                             double scale = 1);
+
+    std::string render() const;
+
+    // The registry used by the daemon's own instrumentation.
+    static registry &global();
+
+private:
+    registry(const registry &);
+    registry &operator= (const registry &);
+
+    enum type_t { COUNTER, GAUGE, HISTOGRAM };
+
+    struct family {
+        type_t type;
+        std::string help;
+        double scale;
+        std::map<std::string, void *> metrics;  // by labels
+    };
+
+    void *get(type_t type, const std::string &name, const std::string &help,
+              const std::string &labels, double scale);
+
+    static void render_histogram(const std::string &name,
+                                 const std::string &labels,
+                                 const histogram &h,
+                                 double scale,
+                                 std::string *out);
+
+    mutable std::mutex mutex_;
+    std::map<std::string, family> families_;
+};
+
+
+}
+
+#endif
@@ -0,0 +1,181 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+#include <thread>
+
+#include "metrics.h"
+#include "metrics-server.h"
+#include "select-server.h"
+
+#include <gtest/gtest.h>
+
+
+namespace metrics {
+
+
+TEST(HistogramTest, Buckets)
+{
+    // Small values get a bucket each.
+    for(int i = 0; i < histogram::SUB_BUCKETS; ++i) {
+        EXPECT_EQ(i, histogram::bucket_index(i));
+        EXPECT_EQ(uint64_t(i + 1), histogram::bucket_upper_bound(i));
+    }
+
+    // Buckets are contiguous and every value is below its bucket's bound.
+    int prev = histogram::bucket_index(histogram::SUB_BUCKETS - 1);
+
+    for(uint64_t v = histogram::SUB_BUCKETS; v < 100000; ++v) {
+        int index = histogram::bucket_index(v);
+
+        ASSERT_TRUE(index == prev || index == prev + 1) << v;
+        ASSERT_LT(v, histogram::bucket_upper_bound(index)) << v;
+        ASSERT_GE(v, histogram::bucket_upper_bound(index - 1)) << v;
+        prev = index;
+    }
+
+    EXPECT_EQ(histogram::NUM_BUCKETS - 1,
+              histogram::bucket_index(uint64_t(1) << 50));
+}
+
+
+TEST(HistogramTest, Quantiles)
+{
+    histogram h;
+
+    EXPECT_EQ(0u, h.quantile(0.5));
+
+    for(int i = 1; i <= 1000; ++i) {
+        h.record(i);
+    }
+
+    EXPECT_EQ(1000u, h.count());
+    EXPECT_EQ(500500u, h.sum());
+
+    // Within the bucket resolution.
+    EXPECT_NEAR(500, h.quantile(0.5), 500 / histogram::SUB_BUCKETS);
+    EXPECT_NEAR(990, h.quantile(0.99), 990 / histogram::SUB_BUCKETS);
+    EXPECT_EQ(1u, h.quantile(0));
+}
+
+
+TEST(RegistryTest, SameMetric)
+{
+    registry r;
+
+    counter *c = r.get_counter("requests_total", "Requests.");
+    EXPECT_EQ(c, r.get_counter("requests_total", "Requests."));
+    EXPECT_NE(c, r.get_counter("requests_total", "Requests.", "a=\"1\""));
+
+    // Type mismatch.
+    EXPECT_EQ(0, r.get_gauge("requests_total", "Requests."));
+}
+
+
+TEST(RegistryTest, Render)
+{
+    registry r;
+
+    r.get_counter("requests_total", "Requests.", "dev=\"a\"")->inc(3);
+    r.get_counter("requests_total", "Requests.", "dev=\"b\"")->inc();
+    r.get_gauge("queue_length", "Queue.")->set(-2);
+
+    histogram *h = r.get_histogram("latency_seconds", "Latency.", "", 0.5);
+    h->record(1);
+    h->record(3);
+
+    EXPECT_EQ(
+        "# HELP latency_seconds Latency.\n"
+        "# TYPE latency_seconds histogram\n"
+        "latency_seconds_bucket{le=\"0.5\"} 0\n"
+        "latency_seconds_bucket{le=\"1\"} 1\n"
+        "latency_seconds_bucket{le=\"2\"} 2\n"
+        "latency_seconds_bucket{le=\"+Inf\"} 2\n"
+        "latency_seconds_sum 2\n"
+        "latency_seconds_count 2\n"
+        "# HELP queue_length Queue.\n"
+        "# TYPE queue_length gauge\n"
+        "queue_length -2\n"
+        "# HELP requests_total Requests.\n"
+        "# TYPE requests_total counter\n"
+        "requests_total{dev=\"a\"} 3\n"
+        "requests_total{dev=\"b\"} 1\n",
+        r.render());
+}
+
+
+std::string fetch(const std::string &path, const std::string &request)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return "connect failed";
+    }
+
+    if(request.empty()) {
+        shutdown(fd, SHUT_WR);
+    } else {
+        write(fd, request.data(), request.size());
+    }
+
+    std::string ret;
+    char buf[256];
+    int r;
+
+    while((r = read(fd, buf, sizeof(buf))) > 0) {
+        ret.append(buf, r);
+    }
+
+    close(fd);
+    return ret;
+}
+
+
+TEST(MetricsServerTest, ServeUnixSocket)
+{
+    registry r;
+    r.get_counter("requests_total", "Requests.")->inc(7);
+
+    net::select_server ss;
+    net::metrics_server server(&r, &ss, &ss);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/shd-metrics-test.%d", int(getpid()));
+    server.listen_unix(path);
+
+    std::string plain;
+    std::string http;
+
+    std::thread client([&]() {
+        plain = fetch(path, "");
+        http = fetch(path, "GET /metrics HTTP/1.1\r\n\r\n");
+        ss.stop();
+    });
+
+    ss.loop();
+    client.join();
+
+    const char *body =
+        "# HELP requests_total Requests.\n"
+        "# TYPE requests_total counter\n"
+        "requests_total 7\n";
+
+    EXPECT_EQ(body, plain);
+    EXPECT_EQ(0u, http.find("HTTP/1.0 200 OK\r\n"));
+    EXPECT_NE(std::string::npos, http.find(
+        "Content-Length: " + std::to_string(strlen(body)) + "\r\n"));
+    EXPECT_EQ(body, http.substr(http.find("\r\n\r\n") + 4));
+}
+
+
+}
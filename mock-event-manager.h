@@ -32,13 +32,17 @@ public:
     }
 
     void send_signal() {
+        // Connections may (de)register themselves from within the handlers,
+        // iterate over copies.
+        std::set<net::connection *> reads(reads_);
+        std::set<net::connection *> writes(writes_);
         std::set<net::connection *>::iterator it;
 
-        for (it = reads_.begin(); it != reads_.end(); ++it) {
+        for (it = reads.begin(); it != reads.end(); ++it) {
             (*it)->on_read();
         }
 
-        for (it = writes_.begin(); it != writes_.end(); ++it) {
+        for (it = writes.begin(); it != writes.end(); ++it) {
             (*it)->on_write();
         }
     }
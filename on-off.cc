@@ -6,8 +6,9 @@
 #include <functional>
 #include <string>
 
+#include "insteon-address.h"
+#include "plm-command.h"
 #include "plm-connection.h"
-#include "plm-util.h"
 #include "select-server.h"
 
 
@@ -16,7 +17,7 @@ using std::placeholders::_1;
 
 class cmd_executor : public plm::plm_command_listener {
 public:
-    cmd_executor(const std::string &cmd, net::select_server *ss)
+    cmd_executor(const plm::plm_command &cmd, net::select_server *ss)
         : cmd_(cmd), ss_(ss),
           fd_("/dev/ttyUSB0"),
           conn_(&fd_, ss, ss),
@@ -34,14 +35,14 @@ public:
         on_resend_timeout();
     }
 
-    virtual void on_command(const std::string &data)
+    virtual void on_command(const plm::plm_frame &frame)
     {
-        if(data[0] != 0x50) {
+        if(frame.command() != 0x50) {
             return;
         }
 
-        // cmd_[5] has the insteon command (0x12 or 0x13; on or off).
-        if(data[8] != cmd_[5]) {
+        // The insteon command (0x12 or 0x13; on or off).
+        if(uint8_t(frame.cmd1()) != cmd_.cmd1()) {
             // Response to a wrong command.
             return;
         }
@@ -49,9 +50,7 @@ public:
         ack_timeout_->stop();
         ack_timeout_ = 0;
 
-        char flags = data[7];
-
-        if((flags & 0xf0) == 0x20) {
+        if(frame.message_type() == plm::plm_frame::DIRECT_ACK) {
             // ACK
             exit(0);
         }
@@ -90,7 +89,7 @@ private:
     }
 
 private:
-    std::string cmd_;
+    plm::plm_command cmd_;
     net::select_server *ss_;
     plm::plm_fd fd_;
     plm::plm_connection conn_;
@@ -111,13 +110,14 @@ int main(int argc, char *argv[])
     }
 
     std::string cmd(argv[1]);
-    std::string addr(plm::hex_to_bin("226A8F"));
+    constexpr plm::insteon_address addr =
+        plm::insteon_address::from_hex("226A8F");
 
-    std::string full_cmd = char(0x62) + addr +
-        (cmd == "on" ? plm::hex_to_bin("0F12FF") : plm::hex_to_bin("0F1300"));
+    constexpr plm::plm_command on = plm::plm_command::fast_on(addr);
+    constexpr plm::plm_command off = plm::plm_command::light_off(addr);
 
     net::select_server ss;
-    cmd_executor executor(full_cmd, &ss);
+    cmd_executor executor(cmd == "on" ? on : off, &ss);
 
     ss.loop();
 }
@@ -0,0 +1,243 @@
+
+#ifndef PLM_COMMAND_H_
+#define PLM_COMMAND_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#include "insteon-address.h"
+
+
+namespace plm {
+
+
+// A command for the modem, without the leading STX, in a fixed-size buffer.
+// Commands are built by the factory functions below, all of which are
+// constexpr, so commands with constant arguments are encoded (and checked)
+// at compile time and building one never allocates.
+//
+// Device commands are sent with 0x62 (send INSTEON message):
+//
+//   0x62 to[3] flags cmd1 cmd2                    standard, 7 bytes
+//   0x62 to[3] flags cmd1 cmd2 user_data[14]      extended, 21 bytes
+//
+// The last byte of the extended user data is the checksum of cmd1, cmd2 and
+// the first 13 bytes, computed when the command is built.
+class plm_command {
+public:
+    enum {
+        MAX_SIZE = 21,
+        STANDARD_SIZE = 7,
+        EXTENDED_SIZE = 21,
+        USER_DATA_LEN = 14,
+
+        // Direct message, 3 hops allowed and left.
+        STANDARD_FLAGS = 0x0f,
+        EXTENDED_FLAGS = 0x1f
+    };
+
+    // The first 13 bytes of the extended user data, the checksum is added
+    // when the command is built.
+    struct user_data {
+        uint8_t d[USER_DATA_LEN - 1];
+    };
+
+    // A standard direct message.
+    constexpr plm_command(insteon_address to, uint8_t cmd1, uint8_t cmd2)
+        : size_(STANDARD_SIZE),
+          data_{ 0x62, addr_byte(to, 16), addr_byte(to, 8), addr_byte(to, 0),
+                 STANDARD_FLAGS, cmd1, cmd2 }
+    {
+    }
+
+    // An extended direct message.
+    constexpr plm_command(insteon_address to, uint8_t cmd1, uint8_t cmd2,
+                          const user_data &u)
+        : size_(EXTENDED_SIZE),
+          data_{ 0x62, addr_byte(to, 16), addr_byte(to, 8), addr_byte(to, 0),
+                 EXTENDED_FLAGS, cmd1, cmd2,
+                 u.d[0], u.d[1], u.d[2], u.d[3], u.d[4], u.d[5], u.d[6],
+                 u.d[7], u.d[8], u.d[9], u.d[10], u.d[11], u.d[12],
+                 checksum(cmd1, cmd2, u) }
+    {
+    }
+
+    const char *data() const {
+        return reinterpret_cast<const char *>(data_);
+    }
+
+    constexpr int size() const { return size_; }
+
+    std::string bytes() const { return std::string(data(), size_); }
+
+    constexpr uint8_t operator[] (int i) const { return data_[i]; }
+
+    // The PLM command number, e.g. 0x62.
+    constexpr uint8_t command() const { return data_[0]; }
+
+    // Only meaningful for 0x62.
+    constexpr bool is_extended() const { return size_ == EXTENDED_SIZE; }
+
+    constexpr insteon_address to() const {
+        return insteon_address((uint32_t(data_[1]) << 16) |
+                               (uint32_t(data_[2]) << 8) | data_[3]);
+    }
+
+    constexpr uint8_t cmd1() const { return data_[5]; }
+    constexpr uint8_t cmd2() const { return data_[6]; }
+
+    // A standard device command that sets the on level outright: on, off,
+    // their fast and ramped variants. It makes any such command sent before
+    // it to the same device moot.
+    constexpr bool sets_level() const {
+        return command() == 0x62 && !is_extended() &&
+               ((cmd1() >= 0x11 && cmd1() <= 0x14) ||
+                cmd1() == 0x2e || cmd1() == 0x2f);
+    }
+
+    // A standard status request (0x19), asking it twice gets the same
+    // answer.
+    constexpr bool is_status_request() const {
+        return command() == 0x62 && !is_extended() && cmd1() == 0x19;
+    }
+
+    bool operator== (const plm_command &rh) const {
+        return size_ == rh.size_ && memcmp(data_, rh.data_, size_) == 0;
+    }
+
+    // INSTEON checksum of an extended message: the two's complement of the
+    // sum of cmd1, cmd2 and the first 13 bytes of the user data.
+    static constexpr uint8_t checksum(uint8_t cmd1, uint8_t cmd2,
+                                      const user_data &u) {
+        return uint8_t(0x100 - ((cmd1 + cmd2 + sum(u, 0)) & 0xff));
+    }
+
+
+    // Modem commands.
+
+    static constexpr plm_command get_im_info() {
+        return plm_command(1, 0x60);
+    }
+
+    // Sends cmd1/cmd2 to all devices linked to the modem in the group.
+    static constexpr plm_command send_all_link(uint8_t group, uint8_t cmd1,
+                                               uint8_t cmd2) {
+        return plm_command(4, 0x61, group, cmd1, cmd2);
+    }
+
+    // Iterate the modem's ALL-link database, records come back as 0x57.
+    static constexpr plm_command get_first_all_link_record() {
+        return plm_command(1, 0x69);
+    }
+
+    static constexpr plm_command get_next_all_link_record() {
+        return plm_command(1, 0x6a);
+    }
+
+
+    // Device commands.
+
+    static constexpr plm_command ping(insteon_address to) {
+        return plm_command(to, 0x0f, 0x00);
+    }
+
+    static constexpr plm_command id_request(insteon_address to) {
+        return plm_command(to, 0x10, 0x00);
+    }
+
+    // Turns on at the given level (0-255) with the device's ramp rate.
+    static constexpr plm_command light_on(insteon_address to,
+                                          uint8_t level = 0xff) {
+        return plm_command(to, 0x11, level);
+    }
+
+    // Turns on at the given level immediately.
+    static constexpr plm_command fast_on(insteon_address to,
+                                         uint8_t level = 0xff) {
+        return plm_command(to, 0x12, level);
+    }
+
+    static constexpr plm_command light_off(insteon_address to) {
+        return plm_command(to, 0x13, 0x00);
+    }
+
+    static constexpr plm_command fast_off(insteon_address to) {
+        return plm_command(to, 0x14, 0x00);
+    }
+
+    // One of the 32 brightness steps up or down.
+    static constexpr plm_command brighten_step(insteon_address to) {
+        return plm_command(to, 0x15, 0x00);
+    }
+
+    static constexpr plm_command dim_step(insteon_address to) {
+        return plm_command(to, 0x16, 0x00);
+    }
+
+    // Starts brightening (up) or dimming until stop_manual_change().
+    static constexpr plm_command start_manual_change(insteon_address to,
+                                                     bool up) {
+        return plm_command(to, 0x17, up ? 0x01 : 0x00);
+    }
+
+    static constexpr plm_command stop_manual_change(insteon_address to) {
+        return plm_command(to, 0x18, 0x00);
+    }
+
+    // The device answers with the ALDB delta in cmd1 and the level in cmd2.
+    static constexpr plm_command status_request(insteon_address to) {
+        return plm_command(to, 0x19, 0x00);
+    }
+
+    // Level and ramp rate are 4 bits each: level 0-15 maps to 0x0f-0xff,
+    // rate 0-15 to 9 minutes down to 0.1 seconds.
+    static constexpr plm_command light_on_at_ramp(insteon_address to,
+                                                  uint8_t level,
+                                                  uint8_t rate) {
+        return plm_command(to, 0x2e,
+                           uint8_t(((level & 0x0f) << 4) | (rate & 0x0f)));
+    }
+
+    static constexpr plm_command light_off_at_ramp(insteon_address to,
+                                                   uint8_t rate) {
+        return plm_command(to, 0x2f, uint8_t(rate & 0x0f));
+    }
+
+    // Reads 'count' records of the device's ALL-link database starting at
+    // the given database address, 0 reads the whole database. The records
+    // come back as extended 0x2f messages.
+    static constexpr plm_command read_aldb(insteon_address to,
+                                           uint16_t address,
+                                           uint8_t count) {
+        return plm_command(to, 0x2f, 0x00,
+                           user_data{ { 0x00, 0x00, uint8_t(address >> 8),
+                                        uint8_t(address), count } });
+    }
+
+private:
+    // A modem command of up to 4 bytes.
+    constexpr plm_command(int size, uint8_t b0, uint8_t b1 = 0,
+                          uint8_t b2 = 0, uint8_t b3 = 0)
+        : size_(size),
+          data_{ b0, b1, b2, b3 }
+    {
+    }
+
+    static constexpr uint8_t addr_byte(insteon_address addr, int shift) {
+        return uint8_t(addr.value() >> shift);
+    }
+
+    static constexpr int sum(const user_data &u, int i) {
+        return i == USER_DATA_LEN - 1 ? 0 : u.d[i] + sum(u, i + 1);
+    }
+
+    int size_;
+    uint8_t data_[MAX_SIZE];
+};
+
+
+}
+
+#endif
@@ -0,0 +1,87 @@
+
+#include <string>
+
+#include "plm-command.h"
+
+#include <gtest/gtest.h>
+
+
+namespace plm {
+
+
+TEST(PlmCommandTest, Standard)
+{
+    // Encoded at compile time.
+    constexpr plm_command on =
+        plm_command::fast_on(insteon_address::from_hex("1A2B3C"));
+    static_assert(on.size() == 7 && on.cmd1() == 0x12 && on.cmd2() == 0xff,
+                  "compile time encoding");
+    static_assert(on.to() == insteon_address(0x1a2b3c),
+                  "compile time encoding");
+
+    EXPECT_EQ(std::string("\x62\x1a\x2b\x3c\x0f\x12\xff", 7), on.bytes());
+    EXPECT_FALSE(on.is_extended());
+
+    EXPECT_EQ(std::string("\x62\x1a\x2b\x3c\x0f\x11\x80", 7),
+              plm_command::light_on(insteon_address(0x1a2b3c), 0x80).bytes());
+    EXPECT_EQ(std::string("\x62\x00\x00\x05\x0f\x13\x00", 7),
+              plm_command::light_off(insteon_address(5)).bytes());
+    EXPECT_EQ(std::string("\x62\x00\x00\x05\x0f\x2e\x8d", 7),
+              plm_command::light_on_at_ramp(insteon_address(5), 8, 13)
+                  .bytes());
+    EXPECT_EQ(0x01, plm_command::start_manual_change(insteon_address(5),
+                                                     true).cmd2());
+}
+
+
+TEST(PlmCommandTest, Extended)
+{
+    constexpr plm_command read_all =
+        plm_command::read_aldb(insteon_address(0x010203), 0, 0);
+    static_assert(read_all.size() == 21 && read_all[20] == 0xd1,
+                  "compile time checksum");
+
+    EXPECT_TRUE(read_all.is_extended());
+    EXPECT_EQ(0x1f, read_all[4]);
+
+    // The record at 0x0fff.
+    plm_command read_one =
+        plm_command::read_aldb(insteon_address(0x010203), 0x0fff, 1);
+
+    EXPECT_EQ(std::string("\x62\x01\x02\x03\x1f\x2f\x00"
+                          "\x00\x00\x0f\xff\x01\x00\x00\x00\x00\x00\x00\x00"
+                          "\x00\xc2", 21),
+              read_one.bytes());
+}
+
+
+TEST(PlmCommandTest, ModemCommands)
+{
+    EXPECT_EQ(std::string("\x60", 1), plm_command::get_im_info().bytes());
+    EXPECT_EQ(std::string("\x61\x03\x11\xff", 4),
+              plm_command::send_all_link(3, 0x11, 0xff).bytes());
+    EXPECT_EQ(std::string("\x69", 1),
+              plm_command::get_first_all_link_record().bytes());
+}
+
+
+TEST(PlmCommandTest, SetsLevel)
+{
+    constexpr insteon_address to(0x010203);
+
+    static_assert(plm_command::light_on(to, 0x80).sets_level(), "on");
+    static_assert(plm_command::fast_off(to).sets_level(), "fast off");
+    static_assert(plm_command::light_on_at_ramp(to, 8, 2).sets_level(),
+                  "ramp");
+    static_assert(!plm_command::status_request(to).sets_level(), "status");
+    static_assert(!plm_command::read_aldb(to, 0x0fff, 1).sets_level(),
+                  "read aldb");
+    static_assert(!plm_command::send_all_link(1, 0x11, 0xff).sets_level(),
+                  "all link");
+
+    EXPECT_TRUE(plm_command::ping(to) == plm_command::ping(to));
+    EXPECT_FALSE(plm_command::light_on(to) == plm_command::fast_on(to));
+}
+
+
+}
@@ -143,7 +143,10 @@ plm_connection::plm_connection(
         net::fd_interface* fd, net::event_manager *em, net::executor *ex)
     : buffered_connection(fd, em, ex),
       executor_(ex),
+      cmd_out_len_(0),
       cmd_in_progress_(false),
+      rx_state_(RX_STX),
+      rx_resume_([this]() { on_rx(); }),
       cmd_len_(0)
 {
     // The longest command is 23 bytes, reserve some extra space.
@@ -178,7 +181,7 @@ void plm_connection::stop()
 
 
 void plm_connection::send_command(
-    const std::string &cmd,
+    const plm_command &cmd,
     const std::function<void(plm_response)> &done)
 {
     if(cmd_in_progress_) {
@@ -193,14 +196,16 @@ void plm_connection::send_command(
         return;
     }
 
-    cmd_out_buf_.clear();
-    cmd_out_buf_ += 0x02;   // The leading STX symbol
-    cmd_out_buf_ += cmd;
+    cmd_out_buf_[0] = 0x02;   // The leading STX symbol
+    memcpy(cmd_out_buf_ + 1, cmd.data(), cmd.size());
+    cmd_out_len_ = cmd.size() + 1;
+
+    log_debug("PLM send 0x%x, %d bytes", cmd_out_buf_[1], cmd.size());
 
     buffered_connection::write(
-        cmd_out_buf_.data(),
-        cmd_out_buf_.length(),
-        std::bind(&plm_connection::on_cmd_write_done, this));
+        cmd_out_buf_,
+        cmd_out_len_,
+        [this]() { on_cmd_write_done(); });
 }
 
 
@@ -212,31 +217,50 @@ void plm_connection::on_cmd_write_done()
 }
 
 
-void plm_connection::on_stx_receive()
+void plm_connection::read_next(char *buf, int len, rx_state_t next)
+{
+    rx_state_ = next;
+    read(buf, len, rx_resume_);
+}
+
+
+void plm_connection::on_rx()
 {
     if(!is_ok()) {
         send_response(plm_response::error());
         return;
     }
 
+    switch(rx_state_) {
+        case RX_STX:
+            on_stx_receive();
+            break;
+
+        case RX_CMD_NUM:
+            on_cmd_num_receive();
+            break;
+
+        case RX_CMD_DATA:
+            on_cmd_data_receive();
+            break;
+    }
+}
+
+
+void plm_connection::on_stx_receive()
+{
     if(stx_buf_ != 0x02) {
         log_error("Unexpected STX character: 0x%x", stx_buf_);
         wait_for_stx();
         return;
     }
 
-    read(&cmd_data_[0], 1,
-         std::bind(&plm_connection::on_cmd_num_receive, this));
+    read_next(&cmd_data_[0], 1, RX_CMD_NUM);
 }
 
 
 void plm_connection::on_cmd_num_receive()
 {
-    if(!is_ok()) {
-        send_response(plm_response::error());
-        return;
-    }
-
     if(!is_known_command(cmd_data_[0])) {
         log_error("Unknown command: 0x%x", cmd_data_[0]);
         // TODO reset the connection, falling back to getting stx might be too
@@ -256,52 +280,69 @@ void plm_connection::on_cmd_num_receive()
             cmd_len_ = 7;
             break;
 
+        case 0x61:
+            cmd_len_ = 4;
+            break;
+
+        case 0x69:
+        case 0x6a:
+            // Only the ACK, the record follows in 0x57.
+            cmd_len_ = 1;
+            break;
+
+        case 0x57:
+            cmd_len_ = 8;
+            break;
+
+        case 0x56:
+            // A responder did not confirm a group broadcast: 0x01 group
+            // device[3].
+            cmd_len_ = 5;
+            break;
+
+        case 0x58:
+            // The group broadcast and its cleanups are done, ACK if all the
+            // responders confirmed.
+            cmd_len_ = 1;
+            break;
+
         case 0x62:
-            cmd_len_ = cmd_out_buf_.size() - 2 + 1;
+            // A standard message, extended if the flags say so, see
+            // on_cmd_data_receive().
+            cmd_len_ = 7;
             break;
 
         case 0x50:
             cmd_len_ = 9;
             break;
 
+        case 0x51:
+            cmd_len_ = 23;
+            break;
+
         default:
             log_error("Unexpected command: 0x%x", cmd_data_[0]);
             wait_for_stx();
             return;
     }
 
-    read(&cmd_data_[1], 1,
-         std::bind(&plm_connection::on_cmd_first_byte_receive, this));
-}
-
-
-void plm_connection::on_cmd_first_byte_receive()
-{
-    if(!is_ok()) {
-        send_response(plm_response::error());
-        return;
-    }
-
-    // Did we get a NACK from the PLM for command waiting for the response?
-    if(cmd_send_done_ != 0 &&
-       cmd_out_buf_[1] == cmd_data_[0] &&
-       cmd_data_[1] == 0x15)
-    {
-        send_response(plm_response::nack());
-        wait_for_stx();
-        return;
-    }
-
-    // Retrieve the rest of the command.
-    read(&cmd_data_[2], cmd_len_ - 1,
-         std::bind(&plm_connection::on_cmd_data_receive, this));
+    // A NACK from the modem comes after the whole echo of the command, see
+    // on_cmd_data_receive(). The first byte may be 0x15 in any command,
+    // e.g. the first byte of an address.
+    read_next(&cmd_data_[1], cmd_len_, RX_CMD_DATA);
 }
 
 
 void plm_connection::on_cmd_data_receive()
 {
-    if(!is_ok()) {
-        send_response(plm_response::error());
+    // The echo of an extended message is 14 bytes longer, read the rest
+    // once the flags are known. Note that what was read as the ACK byte is
+    // the first byte of the user data.
+    if(cmd_data_[0] == 0x62 && cmd_len_ == 7 &&
+       (cmd_data_[4] & plm_frame::EXTENDED_FLAG))
+    {
+        cmd_len_ += plm_frame::USER_DATA_LEN;
+        read_next(&cmd_data_[8], plm_frame::USER_DATA_LEN, RX_CMD_DATA);
         return;
     }
 
@@ -317,14 +358,21 @@ void plm_connection::on_cmd_data_receive()
         has_ack = true;
     }
 
-    std::string data(cmd_data_.begin(), cmd_data_.begin() + data_len);
+    log_debug("PLM receive 0x%x, %d bytes", cmd_data_[0], data_len);
 
     // If this is an acknolegment from the modem, respond to the sender.
     // Note that the cmd_out_buf_ stores STX(0x02) as the first character
     // followed by the command whereas the receive buffer immediately starts
-    // with the command.
+    // with the command. A busy modem echoes the whole command followed by a
+    // NACK instead of the ACK.
     if(has_ack && cmd_send_done_ != 0 && cmd_out_buf_[1] == cmd_data_[0]) {
-        send_response(plm_response::ack(data));
+        if(cmd_data_[cmd_len_] == 0x15) {
+            send_response(plm_response::nack());
+        } else {
+            send_response(plm_response::ack(
+                std::string(cmd_data_.begin(),
+                            cmd_data_.begin() + data_len)));
+        }
     }
 
     maybe_notify_listeners();
@@ -346,28 +394,37 @@ void plm_connection::remove_listener(plm_command_listener *listener)
 
 void plm_connection::maybe_notify_listeners()
 {
-    if((cmd_data_[0] & 0x50) != 0x50) {
+    plm_frame frame(&cmd_data_[0], cmd_len_ + 1);
+
+    // 0x5x are sent by the modem on its own, the rest are responses to the
+    // commands sent.
+    if((frame.command() & 0xf0) != 0x50) {
         return;
     }
 
-    std::string data(cmd_data_.begin(), cmd_data_.begin() + cmd_len_ + 1);
+    if(!frame.is_checksum_ok()) {
+        log_error("Bad checksum in extended message from %s",
+                  frame.from().to_hex());
+        return;
+    }
 
     for(auto listener : listeners_) {
-        listener->on_command(data);
+        listener->on_command(frame);
     }
 }
 
 
 bool plm_connection::is_known_command(char cmd)
 {
-    return cmd == 0x60 || cmd == 0x62 || cmd == 0x50;
+    return cmd == 0x60 || cmd == 0x61 || cmd == 0x62 || cmd == 0x69 ||
+           cmd == 0x6a || cmd == 0x50 || cmd == 0x51 || cmd == 0x56 ||
+           cmd == 0x57 || cmd == 0x58;
 }
 
 
 void plm_connection::wait_for_stx()
 {
-    read(&stx_buf_, 1,
-         std::bind(&plm_connection::on_stx_receive, this));
+    read_next(&stx_buf_, 1, RX_STX);
 }
 
 
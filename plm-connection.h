@@ -9,18 +9,22 @@
 #include <vector>
 
 #include "buffered-connection.h"
+#include "plm-command.h"
+#include "plm-frame.h"
 
 
 namespace plm {
 
 
-// TODO
+// Listens for messages the modem receives from devices, and for what the
+// modem sends on its own (e.g. 0x57 link records).
 struct plm_command_listener {
     virtual ~plm_command_listener() {}
 
-    // This function is called when the PLM receives a command with the given
-    // PLM command number and the command data. The data is in binary form.
-    virtual void on_command(const std::string &data) = 0;
+    // This function is called when the PLM receives a message from a device
+    // or sends a command that is not a response. The frame is only valid
+    // during the call.
+    virtual void on_command(const plm_frame &frame) = 0;
 };
 
 
@@ -90,14 +94,15 @@ public:
     void stop();
 
     // Sends a command to the modem. Please note that the 'cmd' is the modem
-    // command, and not just an INSTEON instruction. The operation is async and
+    // command, and not just an INSTEON instruction. The command is copied,
+    // sending does not allocate. The operation is async and
     // will call the given callback once a response from the modem is received
     // (either ACK or NACK) or there was an error.
     //
     // Only one command can be sent at a time. Will throw a plm_exception if
     // called during execution of a previous command. If an exception is thrown
     // the callback will be deleted.
-    void send_command(const std::string &cmd,
+    void send_command(const plm_command &cmd,
                       const std::function<void(plm_response)> &done);
 
     // Manage listeners that listen for commands from other devices or from the
@@ -114,13 +119,25 @@ private:
 
     void on_cmd_write_done();
 
+    // The receiving side is a resumable state machine: every step issues a
+    // read with the same pre-built continuation and records which step should
+    // handle the data once it arrives. The continuation only captures 'this'
+    // so passing it around does not allocate.
+    enum rx_state_t {
+        RX_STX,
+        RX_CMD_NUM,
+        RX_CMD_DATA
+    };
+
+    void read_next(char *buf, int len, rx_state_t next);
+    void on_rx();
+
     void on_stx_receive();
     void on_cmd_num_receive();
-    void on_cmd_first_byte_receive();
     void on_cmd_data_receive();
 
-    // If the received command was originated at a remote device call all the
-    // listeners.
+    // If the received command was originated at a remote device or at the
+    // modem call all the listeners.
     void maybe_notify_listeners();
 
     void wait_for_stx();
@@ -132,10 +149,15 @@ private:
 
     std::set<plm_command_listener *> listeners_;
 
-    std::string cmd_out_buf_;
+    // STX followed by the command being sent.
+    char cmd_out_buf_[1 + plm_command::MAX_SIZE];
+    int cmd_out_len_;
     std::function<void(plm_response)> cmd_send_done_;
     bool cmd_in_progress_;
 
+    rx_state_t rx_state_;
+    std::function<void()> rx_resume_;
+
     char stx_buf_;
     std::vector<char> cmd_data_;
     int cmd_len_;
@@ -0,0 +1,118 @@
+
+#include <string>
+
+#include "bench-util.h"
+#include "logger.h"
+#include "mock-event-manager.h"
+#include "mock-executor.h"
+#include "mock-plm-fd.h"
+#include "plm-connection.h"
+
+
+namespace plm {
+
+
+class counting_listener : public plm_command_listener {
+public:
+    counting_listener() : count(0) {}
+
+    virtual void on_command(const plm_frame &frame) {
+        benchmark::DoNotOptimize(frame.cmd1());
+        ++count;
+    }
+
+    int count;
+};
+
+
+// Discards what is written so that long runs do not accumulate the output.
+class discarding_plm_fd : public mock_plm_fd {
+public:
+    virtual int write(const void *buf, int count) override {
+        return count;
+    }
+};
+
+
+// A burst of standard messages from devices arriving in one read, e.g. the
+// replies to an all-link broadcast.
+static void BM_PlmConnectionFrameBurst(benchmark::State &state)
+{
+    disable_logging();
+
+    const std::string frame("\x02\x50\xaa\xbb\xcc\x11\x22\x33\x2b\x11\xff", 11);
+    std::string burst;
+
+    for(int i = 0; i < state.range(0); ++i) {
+        burst += frame;
+    }
+
+    mock_executor executor;
+    mock_event_manager event_manager;
+    mock_plm_fd fd;
+    plm_connection conn(&fd, &event_manager, &executor);
+    counting_listener listener;
+
+    conn.add_listener(&listener);
+    conn.start();
+
+    bench::alloc_counter allocs(state);
+
+    for(auto _ : state) {
+        fd.set_read_buf(burst);
+        event_manager.send_signal();
+        executor.run_until_empty();
+    }
+
+    if(listener.count != state.iterations() * state.range(0)) {
+        state.SkipWithError("frames were lost");
+    }
+
+    state.SetItemsProcessed(listener.count);
+    conn.stop();
+}
+
+BENCHMARK(BM_PlmConnectionFrameBurst)->Arg(1)->Arg(16)->Arg(256);
+
+
+// A send message command and its echo with the modem ACK.
+static void BM_PlmConnectionSendCommand(benchmark::State &state)
+{
+    disable_logging();
+
+    const plm_command cmd =
+        plm_command::light_on(insteon_address(0xaabbcc));
+    const std::string echo = '\x02' + cmd.bytes() + '\x06';
+
+    mock_executor executor;
+    mock_event_manager event_manager;
+    discarding_plm_fd fd;
+    plm_connection conn(&fd, &event_manager, &executor);
+    int acks = 0;
+
+    conn.start();
+
+    bench::alloc_counter allocs(state);
+
+    for(auto _ : state) {
+        conn.send_command(cmd, [&acks](plm_connection::plm_response r) {
+            acks += r.status == plm_connection::plm_response::ACK;
+        });
+
+        executor.run_until_empty();
+        fd.set_read_buf(echo);
+        event_manager.send_signal();
+        executor.run_until_empty();
+    }
+
+    if(acks != state.iterations()) {
+        state.SkipWithError("commands were not acknowledged");
+    }
+
+    conn.stop();
+}
+
+BENCHMARK(BM_PlmConnectionSendCommand);
+
+
+}
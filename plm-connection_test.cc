@@ -1,12 +1,18 @@
 
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include <memory>
 #include <string>
+#include <vector>
 
+#include "alloc-counter.h"
 #include "logger.h"
 #include "plm-connection.h"
 #include "mock-event-manager.h"
 #include "mock-executor.h"
 #include "mock-plm-fd.h"
+#include "select-server.h"
 
 #include <gtest/gtest.h>
 
@@ -72,12 +78,15 @@ TEST_F(PlmConnectionTest, OpenClose)
 
 TEST_F(PlmConnectionTest, SendCommand)
 {
+    constexpr plm_command fast_on =
+        plm_command::fast_on(insteon_address(0x010101));
+
     conn_->start();
     EXPECT_TRUE(conn_->is_ok());
 
     // The modem is expected to send ACK/NACK, so preset the fd read buffer.
     fd_->set_read_buf("\x02\x62\x01\x01\x01\x0f\x12\xff\x06");
-    conn_->send_command("\x62\x01\x01\x01\x0f\x12\xff",
+    conn_->send_command(fast_on,
         std::bind(&PlmConnectionTest::done_callback, this, _1));
 
     loop_once();
@@ -86,21 +95,289 @@ TEST_F(PlmConnectionTest, SendCommand)
     EXPECT_EQ(plm_connection::plm_response::ACK, response_.status);
     EXPECT_EQ("\x62\x01\x01\x01\x0f\x12\xff", response_.data);
 
-    // Now simulate a NACK.
-    fd_->set_read_buf("\x2\x62\x15");
-    conn_->send_command("\x62\x01\x01\x01\x0f\x12\xff",
+    // A device address that starts with 0x15, the NACK byte.
+    constexpr plm_command fast_on_15 =
+        plm_command::fast_on(insteon_address(0x150101));
+
+    done_ = false;
+    fd_->set_read_buf("\x02\x62\x15\x01\x01\x0f\x12\xff\x06");
+    conn_->send_command(fast_on_15,
+        std::bind(&PlmConnectionTest::done_callback, this, _1));
+
+    loop_once();
+
+    EXPECT_TRUE(done_);
+    EXPECT_EQ(plm_connection::plm_response::ACK, response_.status);
+    EXPECT_EQ("\x62\x15\x01\x01\x0f\x12\xff", response_.data);
+
+    // Now simulate a NACK, the whole command is echoed with it.
+    done_ = false;
+    fd_->set_read_buf("\x02\x62\x01\x01\x01\x0f\x12\xff\x15");
+    conn_->send_command(fast_on,
+        std::bind(&PlmConnectionTest::done_callback, this, _1));
+
+    loop_once();
+
+    EXPECT_TRUE(done_);
+    EXPECT_EQ(plm_connection::plm_response::NACK, response_.status);
+}
+
+class recording_listener : public plm_command_listener {
+public:
+    virtual void on_command(const plm_frame &frame) {
+        commands.push_back(frame.bytes());
+    }
+
+    std::vector<std::string> commands;
+};
+
+
+TEST_F(PlmConnectionTest, ListenerAfterResync)
+{
+    recording_listener listener;
+    conn_->add_listener(&listener);
+    conn_->start();
+
+    // Garbage before the STX is skipped, the frame arrives in two parts.
+    fd_->set_read_buf("\x55\x02\x50\x04\x05");
+    loop_once();
+    EXPECT_TRUE(listener.commands.empty());
+
+    fd_->set_read_buf("\x06\x01\x02\x03\x2f\x12\xff");
+    loop_once();
+
+    ASSERT_EQ(1u, listener.commands.size());
+    EXPECT_EQ("\x50\x04\x05\x06\x01\x02\x03\x2f\x12\xff",
+              listener.commands[0]);
+
+    // The next frame is parsed from the start again.
+    fd_->set_read_buf("\x02\x50\x07\x08\x09\x01\x02\x03\x2f\x13\x01");
+    loop_once();
+
+    ASSERT_EQ(2u, listener.commands.size());
+    EXPECT_EQ("\x50\x07\x08\x09\x01\x02\x03\x2f\x13\x01",
+              listener.commands[1]);
+
+    conn_->remove_listener(&listener);
+}
+
+
+// Keeps the decoded fields of the last frame, the frame itself does not
+// outlive the call.
+class decoding_listener : public plm_command_listener {
+public:
+    decoding_listener() : count(0) {}
+
+    virtual void on_command(const plm_frame &frame) {
+        ++count;
+        from = frame.from();
+        to = frame.to();
+        type = frame.message_type();
+        is_ack = frame.is_ack();
+        hops_left = frame.hops_left();
+        cmd1 = frame.cmd1();
+        cmd2 = frame.cmd2();
+        user_data = frame.user_data() ?
+            std::string(frame.user_data(), plm_frame::USER_DATA_LEN) : "";
+    }
+
+    int count;
+    insteon_address from;
+    insteon_address to;
+    plm_frame::message_type_t type;
+    bool is_ack;
+    int hops_left;
+    char cmd1;
+    char cmd2;
+    std::string user_data;
+};
+
+
+TEST_F(PlmConnectionTest, DecodesMessages)
+{
+    decoding_listener listener;
+    conn_->add_listener(&listener);
+    conn_->start();
+
+    // A standard direct ACK with 2 hops left.
+    fd_->set_read_buf("\x02\x50\x04\x05\x06\x01\x02\x03\x2b\x11\xff");
+    loop_once();
+
+    ASSERT_EQ(1, listener.count);
+    EXPECT_EQ(insteon_address(0x040506), listener.from);
+    EXPECT_EQ(insteon_address(0x010203), listener.to);
+    EXPECT_EQ(plm_frame::DIRECT_ACK, listener.type);
+    EXPECT_TRUE(listener.is_ack);
+    EXPECT_EQ(2, listener.hops_left);
+    EXPECT_EQ(0x11, listener.cmd1);
+    EXPECT_EQ(char(0xff), listener.cmd2);
+    EXPECT_EQ("", listener.user_data);
+
+    // An extended direct message, e.g. an ALDB record.
+    std::string user_data("\x00\x01\x0f\xff\x01\xe2\x01\x0a\x0b\x0c"
+                          "\x03\x1c\x01\x9d", 14);
+    fd_->set_read_buf(
+        std::string("\x02\x51\x04\x05\x06\x01\x02\x03\x11\x2f\x00", 11) +
+        user_data);
+    loop_once();
+
+    ASSERT_EQ(2, listener.count);
+    EXPECT_EQ(plm_frame::DIRECT, listener.type);
+    EXPECT_FALSE(listener.is_ack);
+    EXPECT_EQ(0x2f, listener.cmd1);
+    EXPECT_EQ(user_data, listener.user_data);
+
+    // A corrupted one is dropped.
+    user_data[5] = 0x42;
+    fd_->set_read_buf(
+        std::string("\x02\x51\x04\x05\x06\x01\x02\x03\x11\x2f\x00", 11) +
+        user_data);
+    loop_once();
+
+    EXPECT_EQ(2, listener.count);
+
+    conn_->remove_listener(&listener);
+}
+
+
+TEST_F(PlmConnectionTest, SendExtendedCommand)
+{
+    static constexpr plm_command read_aldb =
+        plm_command::read_aldb(insteon_address(0x010203), 0x0fff, 1);
+    const std::string cmd = read_aldb.bytes();
+
+    conn_->start();
+
+    // The echo length follows the extended flag, not the standard length.
+    fd_->set_read_buf("\x02" + cmd + "\x06");
+    conn_->send_command(read_aldb,
+        std::bind(&PlmConnectionTest::done_callback, this, _1));
+
+    loop_once();
+
+    EXPECT_EQ("\x02" + cmd, fd_->get_write_buf());
+    EXPECT_TRUE(done_);
+    EXPECT_EQ(plm_connection::plm_response::ACK, response_.status);
+    EXPECT_EQ(cmd, response_.data);
+
+    // A busy modem echoes the extended command with a NACK.
+    done_ = false;
+    fd_->set_read_buf("\x02" + cmd + "\x15");
+    conn_->send_command(read_aldb,
         std::bind(&PlmConnectionTest::done_callback, this, _1));
 
     loop_once();
 
     EXPECT_TRUE(done_);
     EXPECT_EQ(plm_connection::plm_response::NACK, response_.status);
+
+    // The parser is back in sync.
+    recording_listener listener;
+    conn_->add_listener(&listener);
+    fd_->set_read_buf(
+        std::string("\x02\x50\x04\x05\x06\x01\x02\x03\x2f\x2f\x00", 11));
+    loop_once();
+
+    EXPECT_EQ(1u, listener.commands.size());
+    conn_->remove_listener(&listener);
+}
+
+
+// One side of a socket pair standing in for the serial device.
+class socket_fd : public net::fd_interface {
+public:
+    explicit socket_fd(int fd) : fd_(fd) {}
+
+    void open() override {}
+    void close() override {}
+    int get_fd() override { return fd_; }
+
+    int read(void *buf, int count) override {
+        return ::read(fd_, buf, count);
+    }
+
+    int write(const void *buf, int count) override {
+        return ::write(fd_, buf, count);
+    }
+
+private:
+    int fd_;
+};
+
+
+class stopping_listener : public plm_command_listener {
+public:
+    explicit stopping_listener(net::select_server *ss)
+        : ss_(ss), count(0), target(0) {}
+
+    virtual void on_command(const plm_frame &frame) {
+        if(++count == target) {
+            ss_->stop();
+        }
+    }
+
+    net::select_server *ss_;
+    int count;
+    int target;
+};
+
+
+// Once warmed up, getting a message from the modem to the listeners through
+// the select server and the buffered connection does not touch the heap.
+TEST(PlmConnectionReceiveTest, SteadyStateDoesNotAllocate)
+{
+    disable_logging();
+
+    int sv[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+
+    net::select_server ss;
+    socket_fd fd(sv[0]);
+    plm_connection conn(&fd, &ss, &ss);
+    stopping_listener listener(&ss);
+
+    conn.add_listener(&listener);
+    conn.start();
+
+    const std::string frame("\x02\x50\x04\x05\x06\x01\x02\x03\x2f\x12\xff",
+                            11);
+
+    std::string burst;
+
+    for(int i = 0; i < 8; ++i) {
+        burst += frame;
+    }
+
+    // Sends the data as many times as asked and runs the loop until all
+    // frames have arrived each time.
+    auto receive = [&](const std::string &data, int times) {
+        for(int i = 0; i < times; ++i) {
+            listener.target = listener.count + data.size() / frame.size();
+            ASSERT_EQ(int(data.size()), write(sv[1], data.data(), data.size()));
+            ss.loop();
+        }
+    };
+
+    receive(frame, 10);
+    receive(burst, 10);
+
+    uint64_t before = allocation_count();
+    receive(frame, 100);
+    receive(burst, 100);
+    uint64_t allocations = allocation_count() - before;
+
+    EXPECT_EQ(10 + 80 + 100 + 800, listener.count);
+    EXPECT_EQ(0u, allocations);
+
+    conn.stop();
+    close(sv[0]);
+    close(sv[1]);
 }
 
+
 // TODO
 // tests for
 // - fd error
-// - listener
 
 }
 
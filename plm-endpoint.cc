@@ -2,20 +2,97 @@
 #include <functional>
 
 #include "alarm-manager.h"
+#include "logger.h"
+#include "metrics.h"
 #include "plm-endpoint.h"
-#include "plm-util.h"
+#include "plm-sequence.h"
+#include "time-util.h"
 
 
 namespace plm {
 
-using std::placeholders::_1;
-
-
 // TODO make this a parameter
 // TODO in fact there are two different timeouts - a timeout for the response
 // from the modem and a timeout for the response from a device
 static const int ACK_TIMEOUT = 5000;  // msecs
 
+// The command fails with a timeout once the device has not answered this many
+// sends. A busy modem does not count.
+static const int MAX_DEVICE_TIMEOUTS = 3;
+
+// Added to the timeout of a group broadcast for every responder the modem
+// cleans up with.
+static const int CLEANUP_TIMEOUT = 1000;  // msecs
+
+static const uint8_t STATUS_REQUEST = 0x19;  // cmd1
+
+
+static const char *status_name(plm_endpoint::response_t r)
+{
+    if(r.is_ok()) {
+        return "ok";
+    }
+
+    if(r.is_nack()) {
+        return "nack";
+    }
+
+    return r.is_timeout() ? "timeout" : "error";
+}
+
+
+struct plm_endpoint::metrics_t {
+    metrics_t() {
+        metrics::registry &r = metrics::registry::global();
+
+        commands = r.get_counter(
+            "shd_plm_commands_total", "Commands queued for sending.");
+        sends = r.get_counter(
+            "shd_plm_sends_total",
+            "Commands handed to the modem, including resends.");
+        resends = r.get_counter(
+            "shd_plm_resends_total", "Commands sent more than once.");
+        modem_nacks = r.get_counter(
+            "shd_plm_modem_nacks_total", "Commands NACKed by the modem.");
+        device_nacks = r.get_counter(
+            "shd_plm_device_nacks_total", "Commands NACKed by the device.");
+        modem_timeouts = r.get_counter(
+            "shd_plm_modem_timeouts_total",
+            "Commands the modem did not respond to in time.");
+        device_timeouts = r.get_counter(
+            "shd_plm_device_timeouts_total",
+            "Commands the device did not acknowledge in time.");
+        coalesced = r.get_counter(
+            "shd_plm_coalesced_total",
+            "Commands merged into a waiting command for the same device.");
+        errors = r.get_counter(
+            "shd_plm_errors_total", "Commands failed with an error.");
+        queue_length = r.get_gauge(
+            "shd_plm_queue_length", "Commands waiting or in flight.");
+        modem_latency = r.get_histogram(
+            "shd_plm_modem_latency_seconds",
+            "Time from sending a command to the modem's response.",
+            "", 1e-6);
+        command_latency = r.get_histogram(
+            "shd_plm_command_latency_seconds",
+            "Time from queueing a command to the device's ACK.",
+            "", 1e-6);
+    }
+
+    metrics::counter *commands;
+    metrics::counter *sends;
+    metrics::counter *resends;
+    metrics::counter *modem_nacks;
+    metrics::counter *device_nacks;
+    metrics::counter *modem_timeouts;
+    metrics::counter *device_timeouts;
+    metrics::counter *coalesced;
+    metrics::counter *errors;
+    metrics::gauge *queue_length;
+    metrics::histogram *modem_latency;
+    metrics::histogram *command_latency;
+};
+
 
 class plm_endpoint::plm_listener_proxy : public plm_command_listener {
 public:
@@ -23,8 +100,8 @@ public:
         : obj_(obj) {
     }
 
-    virtual void on_command(const std::string &data) {
-        obj_->on_plm_command(data);
+    virtual void on_command(const plm_frame &frame) {
+        obj_->on_plm_command(frame);
     }
 
 private:
@@ -39,7 +116,9 @@ plm_endpoint::plm_endpoint(
         net::executor *ex)
     : conn_(fd, em, ex),
       plm_listener_proxy_(new plm_listener_proxy(this)),
-      alarm_manager_(alarm_manager)
+      alarm_manager_(alarm_manager),
+      aging_usecs_(30000000), next_seq_(0),
+      link_sequence_(new plm_sequence(this, alarm_manager))
 {
     conn_.add_listener(plm_listener_proxy_.get());
 }
@@ -61,64 +140,406 @@ void plm_endpoint::stop()
 {
     conn_.stop();
     clear_command_queue(response_t(response_t::ERROR));
+
+    if(link_download_.active) {
+        finish_link_download(response_t(response_t::ERROR));
+    }
+}
+
+
+void plm_endpoint::send_command(
+    const plm_command &cmd,
+    const std::function<void(response_t)> &done,
+    priority_t priority)
+{
+    enqueue_command(cmd, done, priority);
 }
 
 
 void plm_endpoint::send_light_on(
-    const std::string &device_addr,
-    const std::function<void(response_t)> &done)
+    insteon_address device,
+    const std::function<void(response_t)> &done,
+    priority_t priority)
 {
-    std::string cmd = char(0x62) + device_addr + "\x0f\x12\xff";
+    enqueue_command(plm_command::fast_on(device), done, priority);
+}
 
-    command_queue_.push(command_t(cmd, done));
 
-    if(command_queue_.size() == 1) {
-        send_top_command();
+void plm_endpoint::send_light_off(
+    insteon_address device,
+    const std::function<void(response_t)> &done,
+    priority_t priority)
+{
+    enqueue_command(plm_command::light_off(device), done, priority);
+}
+
+
+void plm_endpoint::send_light_level(
+    insteon_address device,
+    uint8_t level,
+    bool fast,
+    const std::function<void(response_t)> &done,
+    priority_t priority)
+{
+    if(level == 0) {
+        enqueue_command(fast ? plm_command::fast_off(device)
+                             : plm_command::light_off(device),
+                        done, priority);
+    } else {
+        enqueue_command(fast ? plm_command::fast_on(device, level)
+                             : plm_command::light_on(device, level),
+                        done, priority);
     }
 }
 
 
-void plm_endpoint::send_light_off(
-    const std::string &device_addr,
-    const std::function<void(response_t)> &done)
+void plm_endpoint::send_light_ramp(
+    insteon_address device,
+    uint8_t level,
+    uint8_t rate,
+    const std::function<void(response_t)> &done,
+    priority_t priority)
+{
+    if(level == 0) {
+        enqueue_command(plm_command::light_off_at_ramp(device, rate), done,
+                        priority);
+    } else {
+        enqueue_command(
+            plm_command::light_on_at_ramp(device, level >> 4, rate), done,
+            priority);
+    }
+}
+
+
+void plm_endpoint::send_start_manual_change(
+    insteon_address device,
+    bool up,
+    const std::function<void(response_t)> &done,
+    priority_t priority)
 {
-    std::string cmd = char(0x62) + device_addr +
-        std::string("\x0f\x13\x00", 3);  // Be careful about trailing \nul.
+    enqueue_command(plm_command::start_manual_change(device, up), done,
+                    priority);
+}
+
 
-    command_queue_.push(command_t(cmd, done));
+void plm_endpoint::send_stop_manual_change(
+    insteon_address device,
+    const std::function<void(response_t)> &done,
+    priority_t priority)
+{
+    enqueue_command(plm_command::stop_manual_change(device), done, priority);
+}
 
-    if(command_queue_.size() == 1) {
+
+void plm_endpoint::download_link_db(
+    const std::function<void(response_t)> &done,
+    priority_t priority)
+{
+    if(link_download_.active) {
+        // Join the download in progress.
+        std::function<void(response_t)> first = link_download_.done;
+        link_download_.done = [first, done](response_t r) {
+            first(r);
+            done(r);
+        };
+        return;
+    }
+
+    link_download_.active = true;
+    link_download_.priority = priority;
+    link_download_.records.clear();
+    link_download_.done = done;
+    request_link_record(true);
+}
+
+
+void plm_endpoint::request_link_record(bool first)
+{
+    // The record may come in ahead of the modem's ACK. NACK means that
+    // there are no (more) records.
+    link_sequence_->expect([](const plm_frame &frame) {
+        return frame.command() == 0x57;
+    });
+
+    link_sequence_->send(
+        first ? plm_command::get_first_all_link_record()
+              : plm_command::get_next_all_link_record(),
+        link_download_.priority,
+        [this](response_t r) {
+            if(r.is_nack()) {
+                finish_link_download(response_t(response_t::OK));
+                return;
+            }
+
+            if(!r.is_ok()) {
+                finish_link_download(r);
+                return;
+            }
+
+            link_sequence_->read(ACK_TIMEOUT, [this](const plm_frame *record) {
+                if(!record) {
+                    finish_link_download(response_t(response_t::TIMEOUT));
+                    return;
+                }
+
+                link_download_.records.push_back(
+                    link_record::from_frame(*record));
+                request_link_record(false);
+            });
+        });
+}
+
+
+void plm_endpoint::finish_link_download(response_t r)
+{
+    link_download_.active = false;
+    link_sequence_->cancel();
+
+    if(r.is_ok()) {
+        link_db_.assign(link_download_.records);
+        log_info("Downloaded %zu modem links, generation %u",
+                 link_db_.records().size(), link_db_.generation());
+    } else {
+        log_error("Cannot download the modem's link database: %s",
+                  status_name(r));
+    }
+
+    link_download_.records.clear();
+
+    std::function<void(response_t)> done;
+    done.swap(link_download_.done);
+    done(r);
+}
+
+
+void plm_endpoint::enqueue_command(
+    const plm_command &cmd,
+    const std::function<void(response_t)> &done,
+    priority_t priority)
+{
+    metrics().commands->inc();
+
+    if(coalesce_command(cmd, done, priority)) {
+        metrics().coalesced->inc();
+        return;
+    }
+
+    std::deque<command_t> &waiting = waiting_[priority];
+    waiting.push_back(command_t(cmd, done, priority));
+    waiting.back().queued_at = net::monotonic_usecs();
+    waiting.back().seq = next_seq_++;
+
+    metrics().queue_length->set(queued_commands());
+
+    if(command_queue_.empty()) {
+        next_command();
         send_top_command();
     }
 }
 
 
-void plm_endpoint::on_plm_command(const std::string &data)
+bool plm_endpoint::coalesce_command(
+    const plm_command &cmd,
+    const std::function<void(response_t)> &done,
+    priority_t priority)
+{
+    // The latest of the waiting commands the command supersedes.
+    int cls = 0;
+    std::deque<command_t>::iterator it;
+    bool found = false;
+
+    for(int i = 0; i < PRIORITY_COUNT; ++i) {
+        std::deque<command_t>::iterator w = waiting_[i].begin();
+
+        for(; w != waiting_[i].end(); ++w) {
+            if(supersedes(cmd, w->command) && (!found || w->seq > it->seq)) {
+                cls = i;
+                it = w;
+                found = true;
+            }
+        }
+    }
+
+    if(!found || waiting_after(*it, cmd)) {
+        return false;
+    }
+
+    // Both callers get the result of the later command.
+    std::function<void(response_t)> first = it->done;
+    std::function<void(response_t)> second = done;
+    it->done = [first, second](response_t r) {
+        first(r);
+        second(r);
+    };
+    it->command = cmd;
+
+    // Keep the place in the line unless the later command is more
+    // urgent, it is queued anew in its class then.
+    if(priority < it->priority) {
+        command_t moved = *it;
+        waiting_[cls].erase(it);
+        moved.priority = priority;
+        moved.queued_at = net::monotonic_usecs();
+        moved.seq = next_seq_++;
+        waiting_[priority].push_back(moved);
+    }
+
+    return true;
+}
+
+
+bool plm_endpoint::supersedes(const plm_command &cmd,
+                              const plm_command &other)
+{
+    // Only commands that can be repeated without a different outcome are
+    // merged, two brighten steps or link record requests are both sent.
+    if(cmd.sets_level() && other.sets_level()) {
+        return other.to() == cmd.to();
+    }
+
+    return cmd.is_status_request() && other == cmd;
+}
+
+
+bool plm_endpoint::waiting_after(const command_t &merged,
+                                 const plm_command &cmd) const
+{
+    for(int i = 0; i < PRIORITY_COUNT; ++i) {
+        std::deque<command_t>::const_iterator it = waiting_[i].begin();
+
+        for(; it != waiting_[i].end(); ++it) {
+            if(it->is_device_command() && it->device() == cmd.to() &&
+               it->seq > merged.seq &&
+               !supersedes(cmd, it->command))
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+
+void plm_endpoint::pop_command()
+{
+    command_queue_.pop();
+    next_command();
+    metrics().queue_length->set(queued_commands());
+}
+
+
+void plm_endpoint::next_command()
+{
+    // The oldest command of every class is the first in line in its class,
+    // it goes first if it has waited the longest once the class handicaps
+    // are added.
+    int best = -1;
+    int64_t best_at = 0;
+
+    for(int i = 0; i < PRIORITY_COUNT; ++i) {
+        if(waiting_[i].empty()) {
+            continue;
+        }
+
+        int64_t at = waiting_[i].front().queued_at + i * aging_usecs_;
+
+        if(best == -1 || at < best_at) {
+            best = i;
+            best_at = at;
+        }
+    }
+
+    if(best != -1) {
+        command_queue_.push(waiting_[best].front());
+        waiting_[best].pop_front();
+    }
+}
+
+
+size_t plm_endpoint::queued_commands() const
+{
+    size_t ret = command_queue_.size();
+
+    for(int i = 0; i < PRIORITY_COUNT; ++i) {
+        ret += waiting_[i].size();
+    }
+
+    return ret;
+}
+
+
+void plm_endpoint::on_plm_command(const plm_frame &frame)
 {
-    if(data[0] != 0x50) {
+    if(frame.command() == 0x58) {
+        on_group_cleanup_done(frame);
         return;
     }
 
-    // Check that the response is for the right command.
-    if(data[8] != top_command().command[5]) {
+    if(frame.command() != 0x50 || command_queue_.empty() ||
+       !top_command().is_device_command())
+    {
+        return;
+    }
+
+    // Only the ACK or NACK of the device the command was sent to answers it,
+    // broadcasts and cleanups are sent by devices on their own.
+    if(frame.from() != top_command().device() ||
+       (frame.message_type() != plm_frame::DIRECT_ACK &&
+        frame.message_type() != plm_frame::DIRECT_NACK))
+    {
+        return;
+    }
+
+    // Check that the response is for the right command. The ACK to a status
+    // request carries the ALDB delta in cmd1 instead.
+    if(uint8_t(frame.cmd1()) != top_command().command.cmd1() &&
+       top_command().command.cmd1() != STATUS_REQUEST)
+    {
         return;
     }
 
     top_command().stop_alarm();
 
-    char flags = data[7];
-    if((flags & 0xf0) == 0x20) {
+    if(frame.message_type() == plm_frame::DIRECT_ACK) {
         // ACK
         if(top_command().state == command_t::WAIT_DEV) {
+            int64_t now = net::monotonic_usecs();
+            record_latency(top_command(), now);
+            trace_command(top_command(), "ok", now);
+
             top_command().state = command_t::DONE;
-            top_command().done(response_t(response_t::OK));
-            command_queue_.pop();
+            top_command().done(response_t(response_t::OK, frame.cmd1(),
+                                          frame.cmd2()));
+            pop_command();
+            send_top_command();
         }
 
         return;
     }
 
     // Resend the command on NACK.
+    metrics().device_nacks->inc();
+    ++top_command().device_nacks;
+    send_top_command();
+}
+
+
+void plm_endpoint::on_group_cleanup_done(const plm_frame &frame)
+{
+    if(command_queue_.empty() || !top_command().is_group_command() ||
+       top_command().state != command_t::WAIT_DEV)
+    {
+        return;
+    }
+
+    // Whether all the responders confirmed goes in cmd1, the ones that did
+    // not are reported in 0x56 before.
+    top_command().stop_alarm();
+    trace_command(top_command(), "ok", net::monotonic_usecs());
+    top_command().state = command_t::DONE;
+    top_command().done(response_t(response_t::OK, frame.data()[1]));
+    pop_command();
     send_top_command();
 }
 
@@ -127,15 +548,53 @@ void plm_endpoint::on_command_sent(plm_connection::plm_response r)
 {
     top_command().stop_alarm();
 
+    top_command().modem_ack_at = net::monotonic_usecs();
+    metrics().modem_latency->record(
+        top_command().modem_ack_at - top_command().sent_at);
+
+    if(r.status == plm_connection::plm_response::ACK &&
+       top_command().is_group_command())
+    {
+        // The modem now cleans up with every responder in turn and reports
+        // with 0x58 once done.
+        size_t responders = link_db_.responders(
+            top_command().command[1]).size();
+        top_command().state = command_t::WAIT_DEV;
+        top_command().timeout_alarm = alarm_manager_->schedule_alarm(
+            [this]() { on_device_timeout(); },
+            ACK_TIMEOUT + CLEANUP_TIMEOUT * int(responders));
+        return;
+    }
+
+    if(!top_command().is_device_command() &&
+       (r.status == plm_connection::plm_response::ACK ||
+        (r.status == plm_connection::plm_response::NACK &&
+         top_command().nack_is_answer())))
+    {
+        response_t resp(r.status == plm_connection::plm_response::ACK ?
+                        response_t::OK : response_t::NACK);
+        trace_command(top_command(), status_name(resp),
+                      net::monotonic_usecs());
+        top_command().state = command_t::DONE;
+        top_command().done(resp);
+        pop_command();
+        send_top_command();
+        return;
+    }
+
     if(r.status == plm_connection::plm_response::NACK) {
         // The modem was not ready, resend.
+        metrics().modem_nacks->inc();
         top_command().state = command_t::NEED_RESEND;
     }
 
     if(r.status == plm_connection::plm_response::ERROR) {
+        metrics().errors->inc();
+        trace_command(top_command(), "error", net::monotonic_usecs());
         top_command().state = command_t::DONE;
         top_command().done(response_t(response_t::ERROR));
-        command_queue_.pop();
+        pop_command();
+        send_top_command();
         return;
     }
 
@@ -148,7 +607,7 @@ void plm_endpoint::on_command_sent(plm_connection::plm_response r)
     // confirmation.
     top_command().state = command_t::WAIT_DEV;
     top_command().timeout_alarm = alarm_manager_->schedule_alarm(
-        std::bind(&plm_endpoint::on_device_timeout, this), ACK_TIMEOUT);
+        [this]() { on_device_timeout(); }, ACK_TIMEOUT);
 }
 
 
@@ -157,6 +616,7 @@ void plm_endpoint::on_modem_timeout()
     // Modem timeouts are not really expected unless the connection somehow got
     // out of sync or there was some physical break, in either case recourse is
     // limited.
+    metrics().modem_timeouts->inc();
     top_command().timeout_alarm = 0;
     reset_connection();
     send_top_command();
@@ -165,7 +625,19 @@ void plm_endpoint::on_modem_timeout()
 
 void plm_endpoint::on_device_timeout()
 {
+    metrics().device_timeouts->inc();
     top_command().timeout_alarm = 0;
+
+    // The broadcast went out, sending it again would not help.
+    if(top_command().is_group_command() ||
+       ++top_command().device_timeouts >= MAX_DEVICE_TIMEOUTS)
+    {
+        trace_command(top_command(), "timeout", net::monotonic_usecs());
+        top_command().state = command_t::DONE;
+        top_command().done(response_t(response_t::TIMEOUT));
+        pop_command();
+    }
+
     send_top_command();
 }
 
@@ -188,10 +660,22 @@ void plm_endpoint::send_top_command()
         return;
     }
 
+    if(top_command().attempts++ > 0) {
+        metrics().resends->inc();
+    }
+
+    metrics().sends->inc();
+    top_command().sent_at = net::monotonic_usecs();
+    top_command().modem_ack_at = 0;
+
+    if(top_command().first_sent_at == 0) {
+        top_command().first_sent_at = top_command().sent_at;
+    }
+
     top_command().timeout_alarm = alarm_manager_->schedule_alarm(
-        std::bind(&plm_endpoint::on_modem_timeout, this), ACK_TIMEOUT);
+        [this]() { on_modem_timeout(); }, ACK_TIMEOUT);
     conn_.send_command(top_command().command,
-        std::bind(&plm_endpoint::on_command_sent, this, _1));
+        [this](plm_connection::plm_response r) { on_command_sent(r); });
 
     top_command().state = command_t::SENT;
 }
@@ -208,11 +692,71 @@ void plm_endpoint::reset_connection()
 
 void plm_endpoint::clear_command_queue(response_t resp)
 {
+    int64_t now = net::monotonic_usecs();
+
     while(!command_queue_.empty()) {
         top_command().stop_alarm();
+        trace_command(top_command(), status_name(resp), now);
         top_command().done(resp);
-        command_queue_.pop();
+        pop_command();
+    }
+}
+
+
+void plm_endpoint::record_latency(const command_t &cmd, int64_t now)
+{
+    std::unordered_map<insteon_address, device_latency_t>::iterator it =
+        device_latency_.find(cmd.device());
+
+    if(it == device_latency_.end()) {
+        metrics::registry &r = metrics::registry::global();
+        std::string device =
+            "device=\"" + cmd.device().to_hex() + "\",stage=";
+        const char *name = "shd_plm_stage_latency_seconds";
+        const char *help = "Time commands spend in every stage, per device.";
+
+        device_latency_t l;
+        l.queue = r.get_histogram(name, help, device + "\"queue\"", 1e-6);
+        l.retry = r.get_histogram(name, help, device + "\"retry\"", 1e-6);
+        l.modem = r.get_histogram(name, help, device + "\"modem\"", 1e-6);
+        l.powerline = r.get_histogram(name, help, device + "\"powerline\"",
+                                      1e-6);
+
+        it = device_latency_.insert(std::make_pair(cmd.device(), l)).first;
     }
+
+    it->second.queue->record(cmd.first_sent_at - cmd.queued_at);
+    it->second.retry->record(cmd.sent_at - cmd.first_sent_at);
+    it->second.modem->record(cmd.modem_ack_at - cmd.sent_at);
+    it->second.powerline->record(now - cmd.modem_ack_at);
+
+    metrics().command_latency->record(now - cmd.queued_at);
+}
+
+
+void plm_endpoint::trace_command(const command_t &cmd, const char *status,
+                                 int64_t now)
+{
+    // Stages that were not reached are reported as -1.
+    long long queue = cmd.first_sent_at ? cmd.first_sent_at - cmd.queued_at
+                                        : -1;
+    long long retry = cmd.first_sent_at ? cmd.sent_at - cmd.first_sent_at
+                                        : -1;
+    long long modem = cmd.modem_ack_at ? cmd.modem_ack_at - cmd.sent_at : -1;
+    long long powerline = cmd.modem_ack_at ? now - cmd.modem_ack_at : -1;
+
+    log_debug("PLM trace %s %s: attempts %d, queue %lld us, retry %lld us, "
+              "modem %lld us, powerline %lld us, total %lld us",
+              cmd.device().to_hex(), status, cmd.attempts,
+              queue, retry, modem, powerline,
+              (long long)(now - cmd.queued_at));
+}
+
+
+plm_endpoint::metrics_t &plm_endpoint::metrics()
+{
+    static metrics_t m;
+    return m;
 }
 
 
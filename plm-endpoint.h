@@ -2,17 +2,34 @@
 #ifndef PLM_ENDPOINT_H_
 #define PLM_ENDPOINT_H_
 
+#include <stdint.h>
+
+#include <deque>
 #include <functional>
 #include <memory>
 #include <queue>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "alarm-manager.h"
+#include "insteon-address.h"
+#include "link-db.h"
+#include "plm-command.h"
 #include "plm-connection.h"
 
 
+namespace metrics {
+class counter;
+class gauge;
+class histogram;
+}
+
+
 namespace plm {
 
+class plm_sequence;
+
 
 // A PLM modem manager. Creates and manages a connection to the physical modem.
 // Manages command execution, timeouts, etc.
@@ -33,11 +50,14 @@ public:
 
     // Response to a command.
     struct response_t {
+        // NACK is only used for modem commands, the modem declined the
+        // command, e.g. there are no more link records.
         enum status_t {
-            OK, ERROR, TIMEOUT
+            OK, ERROR, TIMEOUT, NACK
         };
 
-        explicit response_t(status_t s) : status(s) {}
+        explicit response_t(status_t s, uint8_t c1 = 0, uint8_t c2 = 0)
+            : status(s), cmd1(c1), cmd2(c2) {}
 
         bool is_ok() const {
             return status == OK;
@@ -51,37 +71,161 @@ public:
             return status == TIMEOUT;
         }
 
+        bool is_nack() const {
+            return status == NACK;
+        }
+
         // TODO add error information
         status_t status;
+
+        // The device's ACK to a device command, e.g. the ALDB delta and the
+        // on level for a status request. 0 otherwise.
+        uint8_t cmd1;
+        uint8_t cmd2;
     };
 
 
     bool is_ok() const { return conn_.is_ok(); }
     bool is_closed() const { return conn_.is_closed(); }
 
+    // True if no command is queued or in flight, e.g. for background work
+    // that should not delay other commands.
+    bool is_idle() const {
+        return command_queue_.empty() && !link_download_.active;
+    }
+
+    // Records the serial traffic, see buffered_connection::set_trace().
+    void set_trace(net::serial_trace *trace) { conn_.set_trace(trace); }
+
+
+    // Manage listeners for messages from devices, e.g. the data sent back in
+    // extended messages, see plm_connection::add_listener().
+    void add_listener(plm_command_listener *listener) {
+        conn_.add_listener(listener);
+    }
+
+    void remove_listener(plm_command_listener *listener) {
+        conn_.remove_listener(listener);
+    }
+
 
     // Commands.
 
-    void send_light_on(const std::string &device_addr,
-                       const std::function<void(response_t)> &done);
-    void send_light_off(const std::string &device_addr,
-                        const std::function<void(response_t)> &done);
+    // Commands are sent one at a time. The waiting commands are sent in the
+    // order of their class, and in the order they were queued within a
+    // class, so a command queued by a user goes ahead of a batch of
+    // scheduled ones or a poll sweep that has not been sent yet. To keep
+    // the lower classes from starving, a waiting command is treated as one
+    // class higher for every aging period it has waited.
+    //
+    // A status request that is the same as a waiting one, or a command
+    // that sets the level of a device a waiting command sets the level of
+    // too, replaces the waiting command instead of being queued. Relative
+    // commands, e.g. steps, are never merged. Only the later command is
+    // sent and the callbacks of both get its result. It is queued as usual
+    // if another command to the device, e.g. a manual change, was queued
+    // after the waiting one.
+    enum priority_t {
+        INTERACTIVE,
+        SCHEDULED,
+        BACKGROUND,
+        PRIORITY_COUNT
+    };
+
+    // 30 s by default.
+    void set_aging(int msecs) { aging_usecs_ = int64_t(msecs) * 1000; }
+
+    // Sends any device command, standard or extended. The command is done
+    // when the device acknowledges it, data the device sends back in
+    // separate messages goes to the listeners. Modem commands are done when
+    // the modem responds. A group broadcast (0x61) is done once the modem
+    // has cleaned up with the responders, with the 0x58 ACK or NACK in
+    // cmd1; the responders that did not confirm are reported to the
+    // listeners in 0x56 before.
+    void send_command(const plm_command &cmd,
+                      const std::function<void(response_t)> &done,
+                      priority_t priority = SCHEDULED);
+
+    void send_light_on(insteon_address device,
+                       const std::function<void(response_t)> &done,
+                       priority_t priority = SCHEDULED);
+    void send_light_off(insteon_address device,
+                        const std::function<void(response_t)> &done,
+                        priority_t priority = SCHEDULED);
+
+    // Sets the level (0-255) with a single command, 0 turns the light off.
+    // A fast change skips the ramp configured in the device.
+    void send_light_level(insteon_address device,
+                          uint8_t level,
+                          bool fast,
+                          const std::function<void(response_t)> &done,
+                          priority_t priority = SCHEDULED);
+
+    // Goes to the level at the given ramp rate (0-15, 9 minutes down to 0.1
+    // seconds). The device only takes 16 levels this way, the level is
+    // rounded down to a multiple of 16 plus 15.
+    void send_light_ramp(insteon_address device,
+                         uint8_t level,
+                         uint8_t rate,
+                         const std::function<void(response_t)> &done,
+                         priority_t priority = SCHEDULED);
+
+    // Starts brightening (up) or dimming until send_stop_manual_change().
+    void send_start_manual_change(insteon_address device,
+                                  bool up,
+                                  const std::function<void(response_t)> &done,
+                                  priority_t priority = INTERACTIVE);
+    void send_stop_manual_change(insteon_address device,
+                                 const std::function<void(response_t)> &done,
+                                 priority_t priority = INTERACTIVE);
+
+
+    // The modem's link database.
+
+    // Downloads the database from the modem (0x69/0x6a, collecting the
+    // 0x57 records) into link_database(). The requests are sent in the
+    // given class, e.g. in the background to refresh a loaded snapshot.
+    void download_link_db(const std::function<void(response_t)> &done,
+                          priority_t priority = SCHEDULED);
+
+    const link_db &link_database() const { return link_db_; }
+
+    // E.g. to load a snapshot instead of downloading.
+    link_db &link_database() { return link_db_; }
 
 private:
     plm_endpoint(const plm_endpoint &);
     plm_endpoint &operator= (const plm_endpoint &);
 
-    // TODO limit number of send attempts
     struct command_t {
         enum state_t {
             INIT, SENT, NEED_RESEND, WAIT_DEV, DONE
         };
 
-        command_t(const std::string &cmd,
-                  const std::function<void(response_t)> &callaback)
-            : state(INIT), command(cmd), done(callaback), timeout_alarm(0)
+        command_t(const plm_command &cmd,
+                  const std::function<void(response_t)> &callaback,
+                  priority_t p)
+            : state(INIT), priority(p), command(cmd), done(callaback),
+              timeout_alarm(0),
+              attempts(0), device_nacks(0), device_timeouts(0),
+              queued_at(0), first_sent_at(0), sent_at(0), modem_ack_at(0),
+              seq(0)
         {}
 
+        insteon_address device() const { return command.to(); }
+
+        // Modem commands are done once the modem responds, except for group
+        // broadcasts which are done once the modem has cleaned up with the
+        // responders (0x58).
+        bool is_device_command() const { return command.command() == 0x62; }
+        bool is_group_command() const { return command.command() == 0x61; }
+
+        // The modem NACKs the link record requests when there are no more
+        // records. Any other NACK means the modem was busy.
+        bool nack_is_answer() const {
+            return command.command() == 0x69 || command.command() == 0x6a;
+        }
+
         inline bool has_alarm() const { return timeout_alarm != 0; }
         inline void stop_alarm() {
             if(has_alarm()) {
@@ -91,13 +235,76 @@ private:
         }
 
         state_t state;
-        std::string command;
+        priority_t priority;
+        plm_command command;
         std::function<void(response_t)> done;
         net::alarm *timeout_alarm;
+
+        // Number of times the command was handed to the modem.
+        int attempts;
+        int device_nacks;
+        int device_timeouts;
+
+        // Stage timestamps in monotonic usecs, 0 if the stage has not been
+        // reached. sent_at and modem_ack_at are for the latest attempt.
+        int64_t queued_at;
+        int64_t first_sent_at;
+        int64_t sent_at;
+        int64_t modem_ack_at;
+
+        // The order the commands were queued in.
+        uint64_t seq;
+    };
+
+    // Per-stage latency of the commands sent to one device.
+    struct device_latency_t {
+        metrics::histogram *queue;  // waiting for earlier commands
+        metrics::histogram *retry;  // first send to the last resend
+        metrics::histogram *modem;  // last send to the modem's ACK
+        metrics::histogram *powerline;  // modem's ACK to the device's ACK
     };
 
+    // Queues the command and sends it if nothing else is in flight.
+    void enqueue_command(const plm_command &cmd,
+                         const std::function<void(response_t)> &done,
+                         priority_t priority);
+
+    // Merges the command into a waiting command it supersedes, see
+    // send_command(). Returns false if there is none.
+    bool coalesce_command(const plm_command &cmd,
+                          const std::function<void(response_t)> &done,
+                          priority_t priority);
+
+    // True if the command replaces the waiting other one.
+    static bool supersedes(const plm_command &cmd, const plm_command &other);
+
+    // True if a command to the device of cmd that cmd does not supersede,
+    // e.g. a manual change, waits behind the one cmd would be merged into.
+    // The commands would be sent out of order then.
+    bool waiting_after(const command_t &merged, const plm_command &cmd) const;
+
+    // Removes the completed top command from the queue and makes the next
+    // waiting command the top one.
+    void pop_command();
+
+    // Moves the waiting command that should go next to the top, if any.
+    void next_command();
+
+    // Number of commands waiting or in flight.
+    size_t queued_commands() const;
+
+    // Records the stage latencies of a command acknowledged by the device.
+    void record_latency(const command_t &cmd, int64_t now);
+
+    // Writes the command's stages to the debug log.
+    static void trace_command(const command_t &cmd, const char *status,
+                              int64_t now);
+
     // Called when the modem receives a command from a remote device.
-    void on_plm_command(const std::string &data);
+    void on_plm_command(const plm_frame &frame);
+
+    // Called when the modem reports that a group broadcast is done.
+    void on_group_cleanup_done(const plm_frame &frame);
 
     // Called when the modem accepts the command.
     void on_command_sent(plm_connection::plm_response r);
@@ -115,6 +322,21 @@ private:
     // Clears the queue and send the given response to all command's callbacks.
     void clear_command_queue(response_t resp);
 
+    // The link database download asks for one record at a time on
+    // link_sequence_ and moves on once both the modem's ACK and the 0x57
+    // record are in.
+    struct link_download_t {
+        link_download_t() : active(false), priority(SCHEDULED) {}
+
+        bool active;
+        priority_t priority;
+        std::vector<link_record> records;
+        std::function<void(response_t)> done;
+    };
+
+    void request_link_record(bool first);
+    void finish_link_download(response_t r);
+
     inline command_t &top_command() {
         return command_queue_.front();
     }
@@ -130,7 +352,26 @@ private:
     // TODO the current implementation is simple and allows only one command in
     // flight until it is acknoledged by the device (or until a timeout
     // occurs).  Improve it by allowing concurrent execution of commands.
+    //
+    // The top command, the one in flight. It is empty only if there are no
+    // waiting commands either.
     std::queue<command_t> command_queue_;
+
+    // The commands waiting to be sent, by class.
+    std::deque<command_t> waiting_[PRIORITY_COUNT];
+    int64_t aging_usecs_;
+    uint64_t next_seq_;
+
+    // Created on the first command to the device.
+    std::unordered_map<insteon_address, device_latency_t> device_latency_;
+
+    link_db link_db_;
+    link_download_t link_download_;
+    std::unique_ptr<plm_sequence> link_sequence_;
+
+    // Shared by all endpoints.
+    struct metrics_t;
+    static metrics_t &metrics();
 };
 
 
@@ -1,8 +1,13 @@
 
+#include <unistd.h>
+
 #include <functional>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "logger.h"
+#include "metrics.h"
 #include "mock-alarm-manager.h"
 #include "mock-event-manager.h"
 #include "mock-executor.h"
@@ -58,6 +63,23 @@ public:
     }
 
 
+    // Lets the modem and the device acknowledge the standard command last
+    // written. Returns the device it was sent to and stores its cmd1.
+    uint32_t ack_command(int *cmd1 = 0) {
+        std::string cmd = fd_->get_write_buf();
+        cmd = cmd.substr(cmd.size() - 8);
+        fd_->set_read_buf(cmd + '\x06' + "\x02\x50" + cmd.substr(2, 3) +
+                          "\x01\x02\x03\x2b" + cmd.substr(6));
+        loop_once();
+
+        if(cmd1) {
+            *cmd1 = (unsigned char)cmd[6];
+        }
+
+        return insteon_address::from_bytes(cmd.data() + 2).value();
+    }
+
+
     std::unique_ptr<mock_executor> executor_;
     std::unique_ptr<mock_event_manager> event_manager_;
     std::unique_ptr<mock_plm_fd> fd_;
@@ -79,7 +101,7 @@ TEST_F(PlmEndpointTest, StartStop) {
 
 TEST_F(PlmEndpointTest, SendLightOn) {
     endpoint_->start();
-    endpoint_->send_light_on("\x01\x02\x03", make_done_func());
+    endpoint_->send_light_on(insteon_address(0x010203), make_done_func());
 
     loop_once();
 
@@ -91,8 +113,8 @@ TEST_F(PlmEndpointTest, SendLightOn) {
     loop_once();
     EXPECT_FALSE(done_);
 
-    // And now ack from the device (device addr 04 05 06).
-    fd_->set_read_buf("\x02\x50\x04\x05\x06\x01\x02\x03\x2f\x12\xff");
+    // And now ack from the device (modem addr 04 05 06).
+    fd_->set_read_buf("\x02\x50\x01\x02\x03\x04\x05\x06\x2f\x12\xff");
     loop_once();
     EXPECT_TRUE(done_);
     EXPECT_EQ(plm_endpoint::response_t::OK, response_.status);
@@ -101,7 +123,7 @@ TEST_F(PlmEndpointTest, SendLightOn) {
 
 TEST_F(PlmEndpointTest, SendLightOff) {
     endpoint_->start();
-    endpoint_->send_light_off("\x01\x02\x03", make_done_func());
+    endpoint_->send_light_off(insteon_address(0x010203), make_done_func());
 
     loop_once();
 
@@ -114,19 +136,483 @@ TEST_F(PlmEndpointTest, SendLightOff) {
     loop_once();
     EXPECT_FALSE(done_);
 
-    // And now ack from the device (device addr 04 05 06).
+    // And now ack from the device (modem addr 04 05 06).
+    fd_->set_read_buf(
+        std::string("\x02\x50\x01\x02\x03\x04\x05\x06\x2f\x13\x00", 11));
+    loop_once();
+    EXPECT_TRUE(done_);
+    EXPECT_EQ(plm_endpoint::response_t::OK, response_.status);
+}
+
+
+class counting_listener : public plm_command_listener {
+public:
+    counting_listener() : extended(0) {}
+
+    virtual void on_command(const plm_frame &frame) {
+        extended += frame.is_extended();
+    }
+
+    int extended;
+};
+
+
+TEST_F(PlmEndpointTest, LevelCommands) {
+    const insteon_address light(0x010203);
+    auto ignore = [](plm_endpoint::response_t) {};
+
+    endpoint_->start();
+    endpoint_->send_light_level(light, 0x80, true, ignore);
+    loop_once();
+    EXPECT_EQ("\x02\x62\x01\x02\x03\x0f\x12\x80", fd_->get_write_buf());
+    ack_command();
+
+    endpoint_->send_light_ramp(light, 0x80, 10, ignore);
+    loop_once();
+    EXPECT_EQ("\x02\x62\x01\x02\x03\x0f\x2e\x8a",
+              fd_->get_write_buf().substr(8));
+    ack_command();
+
+    endpoint_->send_light_ramp(light, 0, 10, ignore);
+    loop_once();
+    EXPECT_EQ("\x02\x62\x01\x02\x03\x0f\x2f\x0a",
+              fd_->get_write_buf().substr(16));
+    ack_command();
+
+    endpoint_->send_start_manual_change(light, true, ignore);
+    endpoint_->send_stop_manual_change(light, ignore);
+    loop_once();
+    ack_command();
+    ack_command();
+    EXPECT_EQ(std::string("\x02\x62\x01\x02\x03\x0f\x17\x01"
+                          "\x02\x62\x01\x02\x03\x0f\x18\x00", 16),
+              fd_->get_write_buf().substr(24));
+    EXPECT_TRUE(endpoint_->is_idle());
+}
+
+
+TEST_F(PlmEndpointTest, SendExtendedCommand) {
+    counting_listener listener;
+    static constexpr plm_command cmd =
+        plm_command::read_aldb(insteon_address(0x010203), 0x0fff, 1);
+    const std::string bytes = "\x02" + cmd.bytes();
+
+    endpoint_->add_listener(&listener);
+    endpoint_->start();
+    endpoint_->send_command(cmd, make_done_func());
+
+    loop_once();
+
+    EXPECT_EQ(bytes, fd_->get_write_buf());
+
+    fd_->set_read_buf(bytes + "\x06");
+    loop_once();
+    EXPECT_FALSE(done_);
+
+    // The device ACKs with a standard message and sends the record in an
+    // extended one.
+    fd_->set_read_buf(
+        std::string("\x02\x50\x01\x02\x03\x04\x05\x06\x2f\x2f\x00", 11) +
+        std::string("\x02\x51\x01\x02\x03\x04\x05\x06\x11\x2f\x00"
+                    "\x00\x01\x0f\xff\x01\xe2\x01\x0a\x0b\x0c"
+                    "\x03\x1c\x01\x9d", 25));
+    loop_once();
+
+    EXPECT_TRUE(done_);
+    EXPECT_EQ(plm_endpoint::response_t::OK, response_.status);
+    EXPECT_EQ(1, listener.extended);
+
+    endpoint_->remove_listener(&listener);
+}
+
+
+TEST_F(PlmEndpointTest, StatusRequest) {
+    endpoint_->start();
+    endpoint_->send_command(
+        plm_command::status_request(insteon_address(0x010203)),
+        make_done_func());
+    loop_once();
+
+    fd_->set_read_buf(
+        std::string("\x02\x62\x01\x02\x03\x0f\x19\x00\x06", 9));
+    loop_once();
+
+    // The ACK has the ALDB delta in cmd1 and the level in cmd2.
+    fd_->set_read_buf("\x02\x50\x01\x02\x03\x04\x05\x06\x2b\x05\x80");
+    loop_once();
+    EXPECT_TRUE(done_);
+    EXPECT_EQ(plm_endpoint::response_t::OK, response_.status);
+    EXPECT_EQ(0x05, response_.cmd1);
+    EXPECT_EQ(0x80, response_.cmd2);
+}
+
+
+TEST_F(PlmEndpointTest, ForeignDeviceAck) {
+    endpoint_->start();
+    endpoint_->send_command(
+        plm_command::status_request(insteon_address(0x010203)),
+        make_done_func());
+    loop_once();
+
+    fd_->set_read_buf(
+        std::string("\x02\x62\x01\x02\x03\x0f\x19\x00\x06", 9));
+    loop_once();
+
+    // Another device ACKs a command of its own, or NACKs.
+    fd_->set_read_buf(
+        std::string("\x02\x50\x0a\x0b\x0c\x04\x05\x06\x2b\x00\x40", 11));
+    loop_once();
+    fd_->set_read_buf(
+        std::string("\x02\x50\x0a\x0b\x0c\x04\x05\x06\xab\x19\xff", 11));
+    loop_once();
+    EXPECT_FALSE(done_);
+    EXPECT_EQ(8u, fd_->get_write_buf().size());
+
+    fd_->set_read_buf("\x02\x50\x01\x02\x03\x04\x05\x06\x2b\x05\x80");
+    loop_once();
+    EXPECT_TRUE(done_);
+    EXPECT_EQ(0x80, response_.cmd2);
+}
+
+
+TEST_F(PlmEndpointTest, BroadcastDuringStatusRequest) {
+    endpoint_->start();
+    endpoint_->send_command(
+        plm_command::status_request(insteon_address(0x010203)),
+        make_done_func());
+    loop_once();
+
     fd_->set_read_buf(
-        std::string("\x02\x50\x04\x05\x06\x01\x02\x03\x2f\x13\x00", 11));
+        std::string("\x02\x62\x01\x02\x03\x0f\x19\x00\x06", 9));
     loop_once();
+
+    // A paddle is pressed on another device, and on the one polled: the
+    // group broadcast and the cleanup to the modem are neither an answer
+    // nor a reason to resend.
+    fd_->set_read_buf(
+        std::string("\x02\x50\x0a\x0b\x0c\x00\x00\x01\xcb\x11\x00", 11) +
+        std::string("\x02\x50\x0a\x0b\x0c\x04\x05\x06\x4b\x11\x01", 11) +
+        std::string("\x02\x50\x01\x02\x03\x00\x00\x01\xcb\x13\x00", 11) +
+        std::string("\x02\x50\x01\x02\x03\x04\x05\x06\x4b\x13\x01", 11));
+    loop_once();
+    EXPECT_FALSE(done_);
+    EXPECT_EQ(8u, fd_->get_write_buf().size());
+
+    fd_->set_read_buf(
+        std::string("\x02\x50\x01\x02\x03\x04\x05\x06\x2b\x05\x00", 11));
+    loop_once();
+    EXPECT_TRUE(done_);
+    EXPECT_EQ(0x00, response_.cmd2);
+}
+
+
+TEST_F(PlmEndpointTest, DeviceTimeout) {
+    endpoint_->start();
+    endpoint_->send_light_on(insteon_address(0x010203), make_done_func());
+    loop_once();
+
+    // Sent three times, the device never answers.
+    for(int i = 0; i < 3; ++i) {
+        EXPECT_FALSE(done_);
+        fd_->set_read_buf("\x02\x62\x01\x02\x03\x0f\x12\xff\x06");
+        loop_once();
+        alarm_manager_->fire_all_alarms();
+    }
+
+    EXPECT_TRUE(done_);
+    EXPECT_EQ(plm_endpoint::response_t::TIMEOUT, response_.status);
+    EXPECT_TRUE(endpoint_->is_idle());
+}
+
+
+TEST_F(PlmEndpointTest, Priorities) {
+    std::vector<uint32_t> done;
+    auto record = [&done](uint32_t device) {
+        return [&done, device](plm_endpoint::response_t) {
+            done.push_back(device);
+        };
+    };
+
+    endpoint_->start();
+    endpoint_->send_light_on(insteon_address(0x0a0a0a), record(0x0a0a0a));
+    endpoint_->send_light_on(insteon_address(0x0b0b0b), record(0x0b0b0b),
+                             plm_endpoint::BACKGROUND);
+    endpoint_->send_light_on(insteon_address(0x0c0c0c), record(0x0c0c0c),
+                             plm_endpoint::SCHEDULED);
+    endpoint_->send_light_on(insteon_address(0x0d0d0d), record(0x0d0d0d),
+                             plm_endpoint::INTERACTIVE);
+    endpoint_->send_light_on(insteon_address(0x0e0e0e), record(0x0e0e0e),
+                             plm_endpoint::SCHEDULED);
+    loop_once();
+
+    // The command in flight is not preempted, the waiting ones go by class.
+    EXPECT_EQ(0x0a0a0au, ack_command());
+    EXPECT_EQ(0x0d0d0du, ack_command());
+    EXPECT_EQ(0x0c0c0cu, ack_command());
+    EXPECT_EQ(0x0e0e0eu, ack_command());
+    EXPECT_EQ(0x0b0b0bu, ack_command());
+
+    uint32_t order[] = { 0x0a0a0a, 0x0d0d0d, 0x0c0c0c, 0x0e0e0e, 0x0b0b0b };
+    EXPECT_EQ(std::vector<uint32_t>(order, order + 5), done);
+    EXPECT_TRUE(endpoint_->is_idle());
+}
+
+
+TEST_F(PlmEndpointTest, Aging) {
+    endpoint_->set_aging(10);
+    endpoint_->start();
+    endpoint_->send_light_on(insteon_address(0x0a0a0a), make_done_func());
+    endpoint_->send_light_on(insteon_address(0x0b0b0b), make_done_func(),
+                             plm_endpoint::BACKGROUND);
+    loop_once();
+
+    // Waiting for longer than two aging periods puts the background command
+    // ahead of an interactive one.
+    usleep(30000);
+    endpoint_->send_light_on(insteon_address(0x0d0d0d), make_done_func(),
+                             plm_endpoint::INTERACTIVE);
+
+    EXPECT_EQ(0x0a0a0au, ack_command());
+    EXPECT_EQ(0x0b0b0bu, ack_command());
+    EXPECT_EQ(0x0d0d0du, ack_command());
+}
+
+
+TEST_F(PlmEndpointTest, Coalescing) {
+    int calls = 0;
+    auto count = [&calls](plm_endpoint::response_t r) {
+        EXPECT_TRUE(r.is_ok());
+        ++calls;
+    };
+
+    endpoint_->start();
+    endpoint_->send_light_on(insteon_address(0x0a0a0a), count);
+
+    // The later level supersedes the earlier one, an identical command is
+    // only sent once.
+    endpoint_->send_light_off(insteon_address(0x0b0b0b), count);
+    endpoint_->send_light_on(insteon_address(0x0b0b0b), count);
+    endpoint_->send_command(
+        plm_command::status_request(insteon_address(0x0c0c0c)), count);
+    endpoint_->send_command(
+        plm_command::status_request(insteon_address(0x0c0c0c)), count);
+
+    // Not merged with the command in flight.
+    endpoint_->send_light_off(insteon_address(0x0a0a0a), count);
+
+    // A more urgent command takes the place of a background one.
+    endpoint_->send_light_off(insteon_address(0x0d0d0d), count,
+                              plm_endpoint::BACKGROUND);
+    endpoint_->send_light_on(insteon_address(0x0d0d0d), count,
+                             plm_endpoint::INTERACTIVE);
+    loop_once();
+
+    int cmd1 = 0;
+    EXPECT_EQ(0x0a0a0au, ack_command());
+    EXPECT_EQ(0x0d0d0du, ack_command(&cmd1));
+    EXPECT_EQ(0x12, cmd1);
+    EXPECT_EQ(3, calls);
+
+    EXPECT_EQ(0x0b0b0bu, ack_command(&cmd1));
+    EXPECT_EQ(0x12, cmd1);
+    EXPECT_EQ(0x0c0c0cu, ack_command(&cmd1));
+    EXPECT_EQ(0x19, cmd1);
+    EXPECT_EQ(0x0a0a0au, ack_command(&cmd1));
+    EXPECT_EQ(0x13, cmd1);
+    EXPECT_EQ(8, calls);
+    EXPECT_TRUE(endpoint_->is_idle());
+}
+
+
+TEST_F(PlmEndpointTest, CoalescingKeepsOrder) {
+    const insteon_address light(0x0b0b0b);
+    int calls = 0;
+    auto count = [&calls](plm_endpoint::response_t r) {
+        EXPECT_TRUE(r.is_ok());
+        ++calls;
+    };
+
+    endpoint_->start();
+    endpoint_->send_light_on(insteon_address(0x0a0a0a), count);
+
+    // The off may not go ahead of the manual change, the later level
+    // replaces the off.
+    endpoint_->send_light_on(light, count);
+    endpoint_->send_start_manual_change(light, true, count,
+                                        plm_endpoint::SCHEDULED);
+    endpoint_->send_light_off(light, count);
+    endpoint_->send_light_level(light, 0x40, false, count);
+    loop_once();
+
+    int cmd1 = 0;
+    EXPECT_EQ(0x0a0a0au, ack_command());
+    EXPECT_EQ(0x0b0b0bu, ack_command(&cmd1));
+    EXPECT_EQ(0x12, cmd1);
+    EXPECT_EQ(0x0b0b0bu, ack_command(&cmd1));
+    EXPECT_EQ(0x17, cmd1);
+    EXPECT_EQ(0x0b0b0bu, ack_command(&cmd1));
+    EXPECT_EQ(0x11, cmd1);
+    EXPECT_EQ(5, calls);
+    EXPECT_TRUE(endpoint_->is_idle());
+}
+
+
+TEST_F(PlmEndpointTest, StepsNotCoalesced) {
+    const insteon_address light(0x0b0b0b);
+    int calls = 0;
+    auto count = [&calls](plm_endpoint::response_t r) {
+        EXPECT_TRUE(r.is_ok());
+        ++calls;
+    };
+
+    endpoint_->start();
+    endpoint_->send_light_on(insteon_address(0x0a0a0a), count);
+
+    // Each step dims the light further.
+    endpoint_->send_command(plm_command::dim_step(light), count);
+    endpoint_->send_command(plm_command::dim_step(light), count);
+    loop_once();
+
+    int cmd1 = 0;
+    EXPECT_EQ(0x0a0a0au, ack_command());
+    EXPECT_EQ(0x0b0b0bu, ack_command(&cmd1));
+    EXPECT_EQ(0x16, cmd1);
+    EXPECT_EQ(2, calls);
+    EXPECT_EQ(0x0b0b0bu, ack_command(&cmd1));
+    EXPECT_EQ(0x16, cmd1);
+    EXPECT_EQ(3, calls);
+    EXPECT_TRUE(endpoint_->is_idle());
+}
+
+
+TEST_F(PlmEndpointTest, StageLatency) {
+    endpoint_->start();
+    endpoint_->send_light_on(insteon_address(0x0a0b0c), make_done_func());
+    loop_once();
+
+    // The device NACKs the first attempt.
+    fd_->set_read_buf("\x02\x62\x0a\x0b\x0c\x0f\x12\xff\x06");
+    loop_once();
+    fd_->set_read_buf("\x02\x50\x0a\x0b\x0c\x04\x05\x06\xaf\x12\xff");
+    loop_once();
+    EXPECT_FALSE(done_);
+
+    fd_->set_read_buf("\x02\x62\x0a\x0b\x0c\x0f\x12\xff\x06");
+    loop_once();
+    fd_->set_read_buf("\x02\x50\x0a\x0b\x0c\x04\x05\x06\x2f\x12\xff");
+    loop_once();
+    EXPECT_TRUE(done_);
+
+    // Only the completed command is recorded, once per stage.
+    std::string text = metrics::registry::global().render();
+    const char *stages[] = { "queue", "retry", "modem", "powerline" };
+
+    for(int i = 0; i < 4; ++i) {
+        std::string sample = std::string(
+            "shd_plm_stage_latency_seconds_count{device=\"0A0B0C\",stage=\"") +
+            stages[i] + "\"} 1\n";
+        EXPECT_NE(std::string::npos, text.find(sample)) << sample;
+    }
+}
+
+
+TEST_F(PlmEndpointTest, DownloadLinkDb) {
+    endpoint_->start();
+    endpoint_->download_link_db(make_done_func());
+    loop_once();
+
+    EXPECT_EQ("\x02\x69", fd_->get_write_buf());
+
+    fd_->set_read_buf(
+        std::string("\x02\x69\x06", 3) +
+        std::string("\x02\x57\xe2\x01\x0a\x0b\x0c\x01\x20\x41", 11));
+    loop_once();
+
+    EXPECT_EQ("\x02\x69\x02\x6a", fd_->get_write_buf());
+    EXPECT_FALSE(done_);
+
+    // The record may come before the ACK too.
+    fd_->set_read_buf(
+        std::string("\x02\x57\xa2\x00\x0d\x0e\x0f\x01\x20\x41", 11) +
+        std::string("\x02\x6a\x06", 3));
+    loop_once();
+    EXPECT_FALSE(done_);
+
+    // No more records.
+    fd_->set_read_buf("\x02\x6a\x15");
+    loop_once();
+
+    EXPECT_TRUE(done_);
+    EXPECT_EQ(plm_endpoint::response_t::OK, response_.status);
+
+    const link_db &db = endpoint_->link_database();
+    EXPECT_EQ(2u, db.records().size());
+    EXPECT_EQ(1u, db.generation());
+    ASSERT_EQ(1u, db.responders(1).size());
+    EXPECT_EQ(insteon_address(0x0a0b0c), db.responders(1)[0]);
+}
+
+
+TEST_F(PlmEndpointTest, BackgroundLinkDbDownload) {
+    endpoint_->start();
+    endpoint_->send_light_on(insteon_address(0x0a0a0a),
+                             [](plm_endpoint::response_t) {});
+    endpoint_->download_link_db(make_done_func(), plm_endpoint::BACKGROUND);
+    endpoint_->send_light_on(insteon_address(0x0b0b0b),
+                             [](plm_endpoint::response_t) {});
+    loop_once();
+
+    EXPECT_EQ(0x0a0a0au, ack_command());
+    EXPECT_EQ(0x0b0b0bu, ack_command());
+    EXPECT_EQ("\x02\x69", fd_->get_write_buf().substr(16));
+
+    fd_->set_read_buf("\x02\x69\x15");
+    loop_once();
+    EXPECT_TRUE(done_);
+    EXPECT_TRUE(endpoint_->is_idle());
+}
+
+
+TEST_F(PlmEndpointTest, ModemNackResends) {
+    const std::string cmd("\x02\x61\x02\x11\xff", 5);
+
+    endpoint_->start();
+    endpoint_->send_command(plm_command::send_all_link(2, 0x11, 0xff),
+                            make_done_func());
+    loop_once();
+    EXPECT_EQ(cmd, fd_->get_write_buf());
+
+    // The modem is busy.
+    fd_->set_read_buf(cmd + "\x15");
+    loop_once();
+    EXPECT_FALSE(done_);
+    EXPECT_EQ(cmd + cmd, fd_->get_write_buf());
+
+    fd_->set_read_buf(cmd + "\x06" + "\x02\x58\x06");
+    loop_once();
+    EXPECT_TRUE(done_);
+    EXPECT_EQ(plm_endpoint::response_t::OK, response_.status);
+    EXPECT_EQ(0x06, response_.cmd1);
+}
+
+
+TEST_F(PlmEndpointTest, DownloadEmptyLinkDb) {
+    endpoint_->start();
+    endpoint_->download_link_db(make_done_func());
+    loop_once();
+
+    fd_->set_read_buf("\x02\x69\x15");
+    loop_once();
+
     EXPECT_TRUE(done_);
     EXPECT_EQ(plm_endpoint::response_t::OK, response_.status);
+    EXPECT_TRUE(endpoint_->link_database().records().empty());
 }
 
 
 // TODO test
 // - NACKs
 // - errors
-// - timeouts
 
 
 }
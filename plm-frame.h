@@ -0,0 +1,119 @@
+
+#ifndef PLM_FRAME_H_
+#define PLM_FRAME_H_
+
+#include <string>
+
+#include "insteon-address.h"
+
+
+namespace plm {
+
+
+// A non-owning view of a command received from the modem, starting with the
+// PLM command number (the leading STX is not included). The connection
+// decodes the frame once and passes the same view to all listeners, so the
+// view is only valid for the duration of the listener call. Copy bytes() to
+// keep the frame around.
+//
+// The message accessors are only meaningful for INSTEON messages received
+// from devices, i.e. 0x50 (standard) and 0x51 (extended):
+//
+//   0x50 from[3] to[3] flags cmd1 cmd2
+//   0x51 from[3] to[3] flags cmd1 cmd2 user_data[14]
+class plm_frame {
+public:
+    // Bits 5-7 of the message flags.
+    enum message_type_t {
+        DIRECT = 0,
+        DIRECT_ACK = 1,
+        GROUP_CLEANUP = 2,
+        GROUP_CLEANUP_ACK = 3,
+        BROADCAST = 4,
+        DIRECT_NACK = 5,
+        GROUP_BROADCAST = 6,
+        GROUP_CLEANUP_NACK = 7
+    };
+
+    enum {
+        USER_DATA_LEN = 14,
+
+        // Set in the flags of extended messages.
+        EXTENDED_FLAG = 0x10
+    };
+
+    plm_frame(const char *data, int len) : data_(data), len_(len) {}
+
+    char command() const { return data_[0]; }
+
+    const char *data() const { return data_; }
+    int size() const { return len_; }
+
+    std::string bytes() const { return std::string(data_, len_); }
+
+    bool is_message() const {
+        return command() == 0x50 || command() == 0x51;
+    }
+
+    bool is_extended() const { return command() == 0x51; }
+
+    insteon_address from() const {
+        return insteon_address::from_bytes(data_ + 1);
+    }
+
+    insteon_address to() const {
+        return insteon_address::from_bytes(data_ + 4);
+    }
+
+    char flags() const { return data_[7]; }
+    char cmd1() const { return data_[8]; }
+    char cmd2() const { return data_[9]; }
+
+    message_type_t message_type() const {
+        return message_type_t((flags() >> 5) & 0x07);
+    }
+
+    bool is_ack() const {
+        return message_type() == DIRECT_ACK ||
+               message_type() == GROUP_CLEANUP_ACK;
+    }
+
+    bool is_nack() const {
+        return message_type() == DIRECT_NACK ||
+               message_type() == GROUP_CLEANUP_NACK;
+    }
+
+    int hops_left() const { return (flags() >> 2) & 0x03; }
+
+    // The 14 bytes of user data of an extended message, null for standard
+    // messages.
+    const char *user_data() const {
+        return is_extended() ? data_ + 10 : 0;
+    }
+
+    // Extended messages carry a checksum in the last byte of the user data:
+    // cmd1, cmd2 and all 14 bytes add up to 0 (mod 256). Standard messages
+    // are always ok.
+    bool is_checksum_ok() const {
+        if(!is_extended()) {
+            return true;
+        }
+
+        unsigned sum = 0;
+
+        for(int i = 8; i < 10 + USER_DATA_LEN; ++i) {
+            sum += (unsigned char)data_[i];
+        }
+
+        return (sum & 0xff) == 0;
+    }
+
+private:
+    const char *data_;
+    int len_;
+};
+
+
+}
+
+#endif
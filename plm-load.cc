@@ -0,0 +1,428 @@
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <random>
+#include <string>
+
+#include "logger.h"
+#include "metrics.h"
+#include "plm-endpoint.h"
+#include "plm-simulator.h"
+#include "select-server.h"
+#include "time-util.h"
+
+
+// Measures the throughput and latency of the modem stack (plm_endpoint over
+// plm_fd, i.e. what shd_app uses to switch lights) against a simulated modem
+// on a pty. The simulator runs in a child process so that the CPU time and
+// memory reported are those of the stack alone.
+
+
+struct load_options {
+    load_options()
+        : devices(100), concurrency(1), rate(0), duration_secs(10),
+          on_percent(50), baud(19200), busy_msecs(50), seed(1)
+    {
+    }
+
+    int devices;
+    int concurrency;  // commands in flight in the closed loop mode
+    double rate;  // commands per second, 0 for the closed loop mode
+    int duration_secs;
+    int on_percent;  // the rest are off commands
+    plm::plm_simulator::device_profile profile;
+    int baud;
+    int busy_msecs;
+    unsigned seed;
+};
+
+
+static void usage(const char *exec_name)
+{
+    printf("Usage: %s [options]\n"
+           "  -n count       number of devices (100)\n"
+           "  -c count       commands in flight (1)\n"
+           "  -r rate        submit commands per second regardless of the\n"
+           "                 completions instead of keeping -c in flight\n"
+           "  -d secs        duration (10)\n"
+           "  -o percent     on commands, the rest are off (50)\n"
+           "  -l msecs       device latency (100)\n"
+           "  -j msecs       device latency jitter (0)\n"
+           "  -p percent     message loss (0)\n"
+           "  -b baud        line speed, 0 for no pacing (19200)\n"
+           "  -B msecs       modem busy time per message (50)\n"
+           "  -s seed        random seed (1)\n",
+           exec_name);
+}
+
+
+// Drives the endpoint with commands to random devices and collects the
+// submit-to-ACK latencies.
+class load_driver {
+public:
+    load_driver(plm::plm_endpoint *plm,
+                net::select_server *ss,
+                const load_options &options)
+        : plm_(plm), ss_(ss), options_(options), random_(options.seed),
+          submitted_(0), in_flight_(0), ok_(0), errors_(0), start_(0),
+          last_done_(0), stopping_(false)
+    {
+    }
+
+    void start() {
+        start_ = net::monotonic_usecs();
+
+        if(options_.rate > 0) {
+            tick();
+        } else {
+            for(int i = 0; i < options_.concurrency; ++i) {
+                submit();
+            }
+        }
+
+        ss_->schedule_alarm([this]() { on_end(); },
+                            options_.duration_secs * 1000);
+    }
+
+    void report(FILE *out) const {
+        double secs = (last_done_ - start_) / 1e6;
+
+        fprintf(out, "commands: %llu ok, %llu failed, %d unfinished\n",
+                (unsigned long long)ok_, (unsigned long long)errors_,
+                in_flight_);
+        fprintf(out, "throughput: %.1f commands/s\n",
+                secs > 0 ? ok_ / secs : 0.0);
+        fprintf(out, "latency: p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, "
+                "max %.1f ms\n",
+                latency_.quantile(0.5) / 1e3, latency_.quantile(0.9) / 1e3,
+                latency_.quantile(0.99) / 1e3, latency_.quantile(1) / 1e3);
+    }
+
+    uint64_t completed() const { return ok_ + errors_; }
+
+private:
+    load_driver(const load_driver &);
+    load_driver &operator= (const load_driver &);
+
+    void submit() {
+        plm::insteon_address addr(std::uniform_int_distribution<int>(
+            1, options_.devices)(random_));
+
+        int64_t submitted_at = net::monotonic_usecs();
+        std::function<void(plm::plm_endpoint::response_t)> done =
+            [this, submitted_at](plm::plm_endpoint::response_t r) {
+                on_done(submitted_at, r);
+            };
+
+        ++submitted_;
+        ++in_flight_;
+
+        if(std::uniform_int_distribution<int>(0, 99)(random_) <
+           options_.on_percent)
+        {
+            plm_->send_light_on(addr, done);
+        } else {
+            plm_->send_light_off(addr, done);
+        }
+    }
+
+    void on_done(int64_t submitted_at,
+                 plm::plm_endpoint::response_t r) {
+        last_done_ = net::monotonic_usecs();
+        --in_flight_;
+
+        if(r.is_ok()) {
+            ++ok_;
+            latency_.record(last_done_ - submitted_at);
+        } else {
+            ++errors_;
+        }
+
+        if(stopping_) {
+            if(in_flight_ == 0) {
+                ss_->stop();
+            }
+            return;
+        }
+
+        if(options_.rate <= 0) {
+            submit();
+        }
+    }
+
+    // Submits the commands due at the configured rate.
+    void tick() {
+        if(stopping_) {
+            return;
+        }
+
+        double elapsed = (net::monotonic_usecs() - start_) / 1e6;
+
+        while(submitted_ < elapsed * options_.rate) {
+            submit();
+        }
+
+        ss_->schedule_alarm([this]() { tick(); }, 1);
+    }
+
+    // Stops submitting and waits a while for the commands in flight.
+    void on_end() {
+        stopping_ = true;
+
+        if(in_flight_ == 0) {
+            ss_->stop();
+            return;
+        }
+
+        ss_->schedule_alarm([this]() { ss_->stop(); }, 10000);
+    }
+
+private:
+    plm::plm_endpoint *plm_;
+    net::select_server *ss_;
+    load_options options_;
+    std::mt19937 random_;
+
+    uint64_t submitted_;
+    int in_flight_;
+    uint64_t ok_;
+    uint64_t errors_;
+    metrics::histogram latency_;  // usecs
+
+    int64_t start_;
+    int64_t last_done_;
+    bool stopping_;
+};
+
+
+static volatile sig_atomic_t sim_stop_requested = 0;
+
+
+static void on_sim_signal(int)
+{
+    sim_stop_requested = 1;
+}
+
+
+static void poll_sim_stop(net::select_server *ss)
+{
+    if(sim_stop_requested) {
+        ss->stop();
+        return;
+    }
+
+    ss->schedule_alarm([ss]() { poll_sim_stop(ss); }, 10);
+}
+
+
+// Runs the simulator on the pty master until SIGTERM, then writes its
+// statistics into the given fd.
+static void run_simulator(int master, const load_options &options, int out)
+{
+    signal(SIGTERM, on_sim_signal);
+
+    net::select_server ss;
+    plm::plm_simulator sim(master, &ss, &ss);
+
+    sim.set_device_count(options.devices);
+    sim.set_default_profile(options.profile);
+    sim.set_baud_rate(options.baud);
+    sim.set_busy_msecs(options.busy_msecs);
+    sim.set_seed(options.seed);
+    sim.start();
+
+    poll_sim_stop(&ss);
+    ss.loop();
+
+    const plm::plm_simulator::stats_t &s = sim.stats();
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf),
+        "modem: %llu messages, %llu NACKs, %llu device ACKs, %llu lost\n",
+        (unsigned long long)s.commands, (unsigned long long)s.modem_nacks,
+        (unsigned long long)s.device_acks, (unsigned long long)s.lost);
+
+    if(write(out, buf, len) != len) {
+        _exit(1);
+    }
+}
+
+
+static double timeval_secs(const struct timeval &tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+// Current resident set size in KB.
+static long current_rss_kb()
+{
+    FILE *file = fopen("/proc/self/statm", "r");
+    long pages = 0;
+    long resident = 0;
+
+    if(!file) {
+        return 0;
+    }
+
+    if(fscanf(file, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+
+    fclose(file);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+int main(int argc, char *argv[])
+{
+    load_options options;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:c:r:d:o:l:j:p:b:B:s:h")) != -1) {
+        switch(opt) {
+        case 'n':
+            options.devices = atoi(optarg);
+            break;
+
+        case 'c':
+            options.concurrency = atoi(optarg);
+            break;
+
+        case 'r':
+            options.rate = atof(optarg);
+            break;
+
+        case 'd':
+            options.duration_secs = atoi(optarg);
+            break;
+
+        case 'o':
+            options.on_percent = atoi(optarg);
+            break;
+
+        case 'l':
+            options.profile.latency_msecs = atoi(optarg);
+            break;
+
+        case 'j':
+            options.profile.jitter_msecs = atoi(optarg);
+            break;
+
+        case 'p':
+            options.profile.loss = atof(optarg) / 100;
+            break;
+
+        case 'b':
+            options.baud = atoi(optarg);
+            break;
+
+        case 'B':
+            options.busy_msecs = atoi(optarg);
+            break;
+
+        case 's':
+            options.seed = strtoul(optarg, 0, 10);
+            break;
+
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if(options.devices < 1 || options.concurrency < 1 ||
+       options.duration_secs < 1)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    disable_logging();
+
+    std::string slave_path;
+    int slave;
+    int master;
+    int stats_pipe[2];
+
+    try {
+        master = plm::plm_simulator::open_pty(&slave_path, &slave);
+    } catch(net::fd_exception &ex) {
+        fprintf(stderr, "Cannot open pty: %s\n", ex.what());
+        exit(1);
+    }
+
+    if(pipe(stats_pipe) == -1) {
+        fprintf(stderr, "Cannot create pipe: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    pid_t pid = fork();
+
+    if(pid == -1) {
+        fprintf(stderr, "Cannot fork: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if(pid == 0) {
+        close(stats_pipe[0]);
+        run_simulator(master, options, stats_pipe[1]);
+        _exit(0);
+    }
+
+    close(stats_pipe[1]);
+    close(master);
+    close(slave);
+
+    struct rusage usage_start;
+    getrusage(RUSAGE_SELF, &usage_start);
+
+    net::select_server ss;
+    plm::plm_fd fd(slave_path);
+    plm::plm_endpoint plm(&fd, &ss, &ss, &ss);
+    load_driver driver(&plm, &ss, options);
+
+    plm.start();
+    driver.start();
+    ss.loop();
+    plm.stop();
+
+    struct rusage usage_end;
+    getrusage(RUSAGE_SELF, &usage_end);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, 0, 0);
+
+    double user = timeval_secs(usage_end.ru_utime) -
+                  timeval_secs(usage_start.ru_utime);
+    double sys = timeval_secs(usage_end.ru_stime) -
+                 timeval_secs(usage_start.ru_stime);
+    uint64_t completed = driver.completed();
+
+    driver.report(stdout);
+    printf("cpu: %.2f s user, %.2f s system, %.1f us/command\n",
+           user, sys, completed ? (user + sys) * 1e6 / completed : 0.0);
+    printf("rss: %ld KB, max %ld KB\n", current_rss_kb(),
+           usage_end.ru_maxrss);
+
+    char buf[256];
+    int len = read(stats_pipe[0], buf, sizeof(buf) - 1);
+
+    if(len > 0) {
+        buf[len] = 0;
+        printf("%s", buf);
+    }
+
+    close(stats_pipe[0]);
+    return 0;
+}
@@ -0,0 +1,157 @@
+
+#include "alarm-manager.h"
+#include "plm-sequence.h"
+
+
+namespace plm {
+
+
+plm_sequence::plm_sequence(plm_endpoint *plm,
+                           net::alarm_manager *alarm_manager)
+    : plm_(plm),
+      alarm_manager_(alarm_manager),
+      step_(0),
+      waiting_(false),
+      alarm_(0)
+{
+    plm_->add_listener(this);
+}
+
+
+plm_sequence::~plm_sequence()
+{
+    cancel();
+    plm_->remove_listener(this);
+}
+
+
+void plm_sequence::expect(const filter_t &filter)
+{
+    filter_ = filter;
+    frames_.clear();
+}
+
+
+void plm_sequence::send(const plm_command &cmd,
+                        plm_endpoint::priority_t priority,
+                        const std::function<void(response_t)> &next)
+{
+    uint64_t step = begin_step();
+
+    plm_->send_command(
+        cmd,
+        [this, step, next](response_t r) {
+            if(end_step(step)) {
+                next(r);
+            }
+        },
+        priority);
+}
+
+
+void plm_sequence::read(int msecs,
+                        const std::function<void(const plm_frame *)> &next)
+{
+    uint64_t step = begin_step();
+
+    if(!frames_.empty()) {
+        std::string bytes;
+        bytes.swap(frames_.front());
+        frames_.pop_front();
+        end_step(step);
+
+        plm_frame frame(bytes.data(), bytes.size());
+        next(&frame);
+        return;
+    }
+
+    read_next_ = next;
+    alarm_ = alarm_manager_->schedule_alarm(
+        [this, step]() {
+            alarm_ = 0;
+
+            if(end_step(step)) {
+                resume_read(0);
+            }
+        },
+        msecs);
+}
+
+
+void plm_sequence::sleep(int msecs, const std::function<void()> &next)
+{
+    uint64_t step = begin_step();
+
+    alarm_ = alarm_manager_->schedule_alarm(
+        [this, step, next]() {
+            alarm_ = 0;
+
+            if(end_step(step)) {
+                next();
+            }
+        },
+        msecs);
+}
+
+
+void plm_sequence::cancel()
+{
+    end_step(step_);
+    read_next_ = nullptr;
+    filter_ = nullptr;
+    frames_.clear();
+}
+
+
+void plm_sequence::on_command(const plm_frame &frame)
+{
+    if(!filter_ || !filter_(frame)) {
+        return;
+    }
+
+    if(read_next_ && end_step(step_)) {
+        resume_read(&frame);
+        return;
+    }
+
+    frames_.push_back(frame.bytes());
+}
+
+
+uint64_t plm_sequence::begin_step()
+{
+    // A step that still waits is dropped.
+    end_step(step_);
+    read_next_ = nullptr;
+
+    waiting_ = true;
+    return ++step_;
+}
+
+
+bool plm_sequence::end_step(uint64_t step)
+{
+    if(!waiting_ || step != step_) {
+        return false;
+    }
+
+    waiting_ = false;
+
+    if(alarm_) {
+        alarm_->stop();
+        alarm_ = 0;
+    }
+
+    return true;
+}
+
+
+void plm_sequence::resume_read(const plm_frame *frame)
+{
+    std::function<void(const plm_frame *)> next;
+    next.swap(read_next_);
+    next(frame);
+}
+
+
+}
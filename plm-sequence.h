@@ -0,0 +1,107 @@
+
+#ifndef PLM_SEQUENCE_H_
+#define PLM_SEQUENCE_H_
+
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <string>
+
+#include "plm-command.h"
+#include "plm-connection.h"
+#include "plm-endpoint.h"
+
+
+namespace net {
+class alarm;
+class alarm_manager;
+}
+
+
+namespace plm {
+
+
+// Runs a multi-step exchange with the modem as a chain of steps instead of
+// a set of callbacks and flags. A step starts one wait, for the response to
+// a command, for a frame from the modem or for a delay, and is resumed with
+// its result by the continuation it is given, which usually starts the next
+// step:
+//
+//   seq.expect(is_record);
+//   seq.send(request, priority, [this](response_t r) {
+//       seq.read(timeout, [this](const plm_frame *record) { ... });
+//   });
+//
+// Only one step waits at a time. cancel() drops the waiting step without
+// resuming it, which also ends the chain.
+class plm_sequence : public plm_command_listener {
+public:
+    typedef plm_endpoint::response_t response_t;
+    typedef std::function<bool(const plm_frame &)> filter_t;
+
+    // The sequence listens on the endpoint until it is destroyed. A command
+    // that has been sent is not taken back by cancel(), so the sequence
+    // should not be destroyed before the endpoint.
+    plm_sequence(plm_endpoint *plm, net::alarm_manager *alarm_manager);
+    ~plm_sequence();
+
+    // True if a step waits to be resumed.
+    bool is_waiting() const { return waiting_; }
+
+    // Keeps the frames the filter matches from now on for read(). Called
+    // before the command they answer is sent, so a frame that comes in
+    // before the step that reads it, e.g. ahead of the modem's ACK, is not
+    // lost. The frames kept before are dropped.
+    void expect(const filter_t &filter);
+
+    // Sends the command and resumes with the response.
+    void send(const plm_command &cmd,
+              plm_endpoint::priority_t priority,
+              const std::function<void(response_t)> &next);
+
+    // Resumes with the next expected frame, or with null if none comes in
+    // within msecs. The frame is only valid during the call.
+    void read(int msecs, const std::function<void(const plm_frame *)> &next);
+
+    // Resumes after msecs.
+    void sleep(int msecs, const std::function<void()> &next);
+
+    // Drops the waiting step and the kept frames and stops expecting.
+    void cancel();
+
+    virtual void on_command(const plm_frame &frame) override;
+
+private:
+    plm_sequence(const plm_sequence &);
+    plm_sequence &operator= (const plm_sequence &);
+
+    // Starts waiting, returns the id of the step.
+    uint64_t begin_step();
+
+    // Stops waiting, returns false if the step is no longer the waiting
+    // one, e.g. it was cancelled.
+    bool end_step(uint64_t step);
+
+    void resume_read(const plm_frame *frame);
+
+private:
+    plm_endpoint *plm_;  // not owned
+    net::alarm_manager *alarm_manager_;  // not owned
+
+    filter_t filter_;
+    std::deque<std::string> frames_;  // expected, not read yet
+
+    // Changes whenever a step starts or is cancelled, so that the response
+    // to a command sent by a dropped step is ignored.
+    uint64_t step_;
+    bool waiting_;
+
+    std::function<void(const plm_frame *)> read_next_;  // if reading
+    net::alarm *alarm_;  // the read timeout or the sleep
+};
+
+
+}
+
+#endif
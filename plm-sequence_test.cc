@@ -0,0 +1,202 @@
+
+#include <memory>
+#include <string>
+
+#include "logger.h"
+#include "mock-alarm-manager.h"
+#include "mock-event-manager.h"
+#include "mock-executor.h"
+#include "mock-plm-fd.h"
+#include "plm-command.h"
+#include "plm-endpoint.h"
+#include "plm-sequence.h"
+
+#include <gtest/gtest.h>
+
+
+namespace plm {
+
+
+class PlmSequenceTest : public testing::Test {
+public:
+    virtual void SetUp() {
+        disable_logging();
+
+        executor_.reset(new mock_executor);
+        event_manager_.reset(new mock_event_manager);
+        fd_.reset(new mock_plm_fd);
+        alarm_manager_.reset(new mock_alarm_manager);
+        endpoint_.reset(new plm_endpoint(
+            fd_.get(),
+            alarm_manager_.get(),
+            event_manager_.get(),
+            executor_.get()));
+        sequence_.reset(new plm_sequence(endpoint_.get(),
+                                         alarm_manager_.get()));
+        endpoint_->start();
+    }
+
+
+    virtual void TearDown() {
+        sequence_.reset();
+        endpoint_->stop();
+    }
+
+
+    void loop_once() {
+        event_manager_->send_signal();
+        executor_->run_until_empty();
+    }
+
+
+    // Expects link records (0x57).
+    void expect_records() {
+        sequence_->expect([](const plm_frame &frame) {
+            return frame.command() == 0x57;
+        });
+    }
+
+
+    // Reads a frame into frame_, "timeout" if none comes.
+    void read_frame() {
+        frame_.clear();
+        sequence_->read(1000, [this](const plm_frame *frame) {
+            frame_ = frame ? frame->bytes() : "timeout";
+        });
+    }
+
+
+    std::unique_ptr<mock_executor> executor_;
+    std::unique_ptr<mock_event_manager> event_manager_;
+    std::unique_ptr<mock_plm_fd> fd_;
+    std::unique_ptr<mock_alarm_manager> alarm_manager_;
+    std::unique_ptr<plm_endpoint> endpoint_;
+    std::unique_ptr<plm_sequence> sequence_;
+
+    std::string frame_;
+};
+
+
+static const std::string RECORD1("\x02\x57\xe2\x01\x0a\x0b\x0c\x01\x20\x41",
+                                 10);
+static const std::string RECORD2("\x02\x57\xa2\x00\x0d\x0e\x0f\x01\x20\x41",
+                                 10);
+
+
+TEST_F(PlmSequenceTest, SendThenRead) {
+    int steps = 0;
+
+    expect_records();
+    sequence_->send(
+        plm_command::get_first_all_link_record(),
+        plm_endpoint::SCHEDULED,
+        [this, &steps](plm_endpoint::response_t r) {
+            EXPECT_TRUE(r.is_ok());
+            ++steps;
+            read_frame();
+        });
+    loop_once();
+    EXPECT_EQ("\x02\x69", fd_->get_write_buf());
+    EXPECT_TRUE(sequence_->is_waiting());
+
+    fd_->set_read_buf("\x02\x69\x06");
+    loop_once();
+    EXPECT_EQ(1, steps);
+    EXPECT_TRUE(sequence_->is_waiting());
+    EXPECT_TRUE(frame_.empty());
+
+    // Frames that are not expected are skipped.
+    fd_->set_read_buf("\x02\x58\x06" + RECORD1);
+    loop_once();
+    EXPECT_EQ(RECORD1.substr(1), frame_);
+    EXPECT_FALSE(sequence_->is_waiting());
+}
+
+
+TEST_F(PlmSequenceTest, FrameBeforeRead) {
+    expect_records();
+    sequence_->send(
+        plm_command::get_first_all_link_record(),
+        plm_endpoint::SCHEDULED,
+        [this](plm_endpoint::response_t r) { read_frame(); });
+    loop_once();
+
+    // The records come in ahead of the ACK and are kept for the reads.
+    fd_->set_read_buf(RECORD1 + RECORD2 + "\x02\x69\x06");
+    loop_once();
+    EXPECT_EQ(RECORD1.substr(1), frame_);
+
+    read_frame();
+    EXPECT_EQ(RECORD2.substr(1), frame_);
+
+    // Expecting again drops what was kept.
+    fd_->set_read_buf(RECORD1);
+    loop_once();
+    expect_records();
+    read_frame();
+    EXPECT_TRUE(frame_.empty());
+}
+
+
+TEST_F(PlmSequenceTest, ReadTimeout) {
+    expect_records();
+    read_frame();
+    EXPECT_TRUE(sequence_->is_waiting());
+
+    alarm_manager_->fire_all_alarms();
+    EXPECT_EQ("timeout", frame_);
+    EXPECT_FALSE(sequence_->is_waiting());
+
+    // The record came too late, it is kept for the next read.
+    fd_->set_read_buf(RECORD1);
+    loop_once();
+    read_frame();
+    EXPECT_EQ(RECORD1.substr(1), frame_);
+}
+
+
+TEST_F(PlmSequenceTest, Sleep) {
+    bool woke = false;
+
+    sequence_->sleep(100, [&woke]() { woke = true; });
+    EXPECT_TRUE(sequence_->is_waiting());
+    EXPECT_FALSE(woke);
+
+    alarm_manager_->fire_all_alarms();
+    EXPECT_TRUE(woke);
+    EXPECT_FALSE(sequence_->is_waiting());
+}
+
+
+TEST_F(PlmSequenceTest, Cancel) {
+    bool resumed = false;
+
+    expect_records();
+    sequence_->send(
+        plm_command::get_first_all_link_record(),
+        plm_endpoint::SCHEDULED,
+        [&resumed](plm_endpoint::response_t) { resumed = true; });
+    loop_once();
+
+    // The command still goes through, the step is not resumed.
+    sequence_->cancel();
+    EXPECT_FALSE(sequence_->is_waiting());
+    fd_->set_read_buf("\x02\x69\x06" + RECORD1);
+    loop_once();
+    EXPECT_FALSE(resumed);
+
+    // Nothing is expected anymore.
+    read_frame();
+    alarm_manager_->fire_all_alarms();
+    EXPECT_EQ("timeout", frame_);
+
+    // A new step drops the one waiting.
+    sequence_->sleep(100, [&resumed]() { resumed = true; });
+    read_frame();
+    alarm_manager_->fire_all_alarms();
+    EXPECT_FALSE(resumed);
+    EXPECT_EQ("timeout", frame_);
+}
+
+
+}
@@ -0,0 +1,193 @@
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "buffered-connection.h"
+#include "plm-simulator.h"
+#include "select-server.h"
+
+
+// Runs a simulated PLM modem on a pseudo-terminal. Point shd's serial-device
+// at the printed (or linked) path to drive it against simulated devices.
+
+
+static void usage(const char *exec_name)
+{
+    printf("Usage: %s [options]\n"
+           "  -n count       number of devices 000001..count (1000)\n"
+           "  -l msecs       device latency (100)\n"
+           "  -j msecs       device latency jitter (0)\n"
+           "  -p percent     message loss (0)\n"
+           "  -D addr:msecs:percent\n"
+           "                 latency and loss of a single device\n"
+           "  -b baud        line speed, 0 for no pacing (19200)\n"
+           "  -B msecs       modem busy time per message (50)\n"
+           "  -A count       ALDB records per device (0)\n"
+           "  -s seed        random seed\n"
+           "  -L path        symlink to the pty\n"
+           "  -i secs        print statistics periodically\n",
+           exec_name);
+}
+
+
+static void print_stats(const plm::plm_simulator &sim)
+{
+    const plm::plm_simulator::stats_t &s = sim.stats();
+
+    printf("commands %llu, modem NACKs %llu, device ACKs %llu, lost %llu\n",
+           (unsigned long long)s.commands,
+           (unsigned long long)s.modem_nacks,
+           (unsigned long long)s.device_acks,
+           (unsigned long long)s.lost);
+    fflush(stdout);
+}
+
+
+static void schedule_stats(net::select_server *ss,
+                           const plm::plm_simulator *sim,
+                           int secs)
+{
+    ss->schedule_alarm([ss, sim, secs]() {
+                           print_stats(*sim);
+                           schedule_stats(ss, sim, secs);
+                       },
+                       secs * 1000);
+}
+
+
+int main(int argc, char *argv[])
+{
+    plm::plm_simulator::device_profile profile;
+    std::vector<std::pair<plm::insteon_address,
+                          plm::plm_simulator::device_profile>> devices;
+    int count = 1000;
+    int baud = 19200;
+    int busy = 50;
+    int aldb_size = 0;
+    unsigned seed = getpid();
+    const char *link = 0;
+    int stats_secs = 0;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:l:j:p:D:b:B:A:s:L:i:h")) != -1) {
+        switch(opt) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+
+        case 'l':
+            profile.latency_msecs = atoi(optarg);
+            break;
+
+        case 'j':
+            profile.jitter_msecs = atoi(optarg);
+            break;
+
+        case 'p':
+            profile.loss = atof(optarg) / 100;
+            break;
+
+        case 'D': {
+            char hex[7];
+            int latency;
+            double loss;
+            plm::insteon_address addr;
+
+            if(sscanf(optarg, "%6[0-9a-fA-F]:%d:%lf", hex, &latency,
+                      &loss) != 3 || !plm::insteon_address::parse(hex, &addr))
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+
+            plm::plm_simulator::device_profile p;
+            p.latency_msecs = latency;
+            p.loss = loss / 100;
+            devices.push_back(std::make_pair(addr, p));
+            break;
+        }
+
+        case 'b':
+            baud = atoi(optarg);
+            break;
+
+        case 'B':
+            busy = atoi(optarg);
+            break;
+
+        case 'A':
+            aldb_size = atoi(optarg);
+            break;
+
+        case 's':
+            seed = strtoul(optarg, 0, 10);
+            break;
+
+        case 'L':
+            link = optarg;
+            break;
+
+        case 'i':
+            stats_secs = atoi(optarg);
+            break;
+
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    std::string slave_path;
+    int slave;
+    int master;
+
+    try {
+        master = plm::plm_simulator::open_pty(&slave_path, &slave);
+    } catch(net::fd_exception &ex) {
+        fprintf(stderr, "Cannot open pty: %s\n", ex.what());
+        exit(1);
+    }
+
+    if(link) {
+        unlink(link);
+        if(symlink(slave_path.c_str(), link) == -1) {
+            fprintf(stderr, "Cannot link %s: %s\n", link, strerror(errno));
+            exit(1);
+        }
+    }
+
+    net::select_server ss;
+    plm::plm_simulator sim(master, &ss, &ss);
+
+    sim.set_device_count(count);
+    sim.set_default_profile(profile);
+    sim.set_baud_rate(baud);
+    sim.set_busy_msecs(busy);
+    sim.set_aldb_size(aldb_size);
+    sim.set_seed(seed);
+
+    for(size_t i = 0; i < devices.size(); ++i) {
+        sim.set_device_profile(devices[i].first, devices[i].second);
+    }
+
+    printf("%s\n", slave_path.c_str());
+    fflush(stdout);
+
+    if(stats_secs > 0) {
+        schedule_stats(&ss, &sim, stats_secs);
+    }
+
+    sim.start();
+    ss.loop();
+}
@@ -0,0 +1,513 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <string>
+
+#include "alarm-manager.h"
+#include "buffered-connection.h"
+#include "plm-simulator.h"
+#include "time-util.h"
+
+
+namespace plm {
+
+const insteon_address plm_simulator::MODEM_ADDR(0x112233);
+
+
+plm_simulator::plm_simulator(int fd,
+                             net::event_manager *em,
+                             net::alarm_manager *am)
+    : fd_(fd),
+      event_manager_(em),
+      alarm_manager_(am),
+      device_count_(1000),
+      baud_(19200),
+      busy_msecs_(50),
+      aldb_size_(0),
+      record_msecs_(100),
+      next_byte_at_(0),
+      flush_scheduled_(false),
+      busy_until_(0),
+      next_alarm_id_(0)
+{
+}
+
+
+plm_simulator::~plm_simulator()
+{
+    stop();
+}
+
+
+void plm_simulator::start()
+{
+    event_manager_->register_for_read(this);
+}
+
+
+void plm_simulator::stop()
+{
+    event_manager_->deregister_connection(this);
+
+    std::map<int, net::alarm *>::iterator it = alarms_.begin();
+    for(; it != alarms_.end(); ++it) {
+        it->second->stop();
+    }
+
+    alarms_.clear();
+    flush_scheduled_ = false;
+    input_.clear();
+    output_.clear();
+}
+
+
+void plm_simulator::set_device_count(int count)
+{
+    device_count_ = count;
+}
+
+
+void plm_simulator::set_default_profile(const device_profile &profile)
+{
+    default_profile_ = profile;
+}
+
+
+void plm_simulator::set_device_profile(insteon_address addr,
+                                       const device_profile &profile)
+{
+    profiles_[addr] = profile;
+}
+
+
+void plm_simulator::set_baud_rate(int baud)
+{
+    baud_ = baud;
+}
+
+
+void plm_simulator::set_busy_msecs(int msecs)
+{
+    busy_msecs_ = msecs;
+}
+
+
+void plm_simulator::set_aldb_size(int records)
+{
+    aldb_size_ = records;
+}
+
+
+void plm_simulator::set_record_msecs(int msecs)
+{
+    record_msecs_ = msecs;
+}
+
+
+void plm_simulator::set_seed(unsigned seed)
+{
+    random_.seed(seed);
+}
+
+
+int plm_simulator::device_level(insteon_address addr) const
+{
+    std::unordered_map<insteon_address, int>::const_iterator it =
+        levels_.find(addr);
+    return it == levels_.end() ? 0 : it->second;
+}
+
+
+int plm_simulator::open_pty(std::string *slave_path, int *slave_fd)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if(master == -1) {
+        throw net::fd_exception(errno);
+    }
+
+    if(grantpt(master) == -1 || unlockpt(master) == -1) {
+        int error = errno;
+        close(master);
+        throw net::fd_exception(error);
+    }
+
+    *slave_path = ptsname(master);
+    *slave_fd = open(slave_path->c_str(), O_RDWR | O_NOCTTY);
+
+    if(*slave_fd == -1) {
+        int error = errno;
+        close(master);
+        throw net::fd_exception(error);
+    }
+
+    struct termios tio;
+    tcgetattr(*slave_fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(*slave_fd, TCSANOW, &tio);
+
+    fcntl(master, F_SETFL, O_NONBLOCK);
+    return master;
+}
+
+
+int plm_simulator::get_fd()
+{
+    return fd_;
+}
+
+
+void plm_simulator::on_read()
+{
+    char buf[256];
+    int r;
+
+    // EIO means nobody has the other side open, there is nothing to read.
+    while((r = ::read(fd_, buf, sizeof(buf))) > 0) {
+        input_.append(buf, r);
+    }
+
+    while(parse_frame()) {
+    }
+}
+
+
+void plm_simulator::on_write()
+{
+    event_manager_->deregister_for_write(this);
+    flush_output();
+}
+
+
+bool plm_simulator::parse_frame()
+{
+    size_t stx = input_.find('\x02');
+
+    if(stx == std::string::npos) {
+        input_.clear();
+        return false;
+    }
+
+    input_.erase(0, stx);
+
+    if(input_.size() < 2) {
+        return false;
+    }
+
+    // Number of bytes following the command number.
+    size_t len;
+
+    switch(input_[1]) {
+        case 0x60:
+            len = 0;
+            break;
+
+        case 0x62:
+            if(input_.size() < 6) {
+                return false;
+            }
+
+            // Extended messages carry 14 bytes of user data.
+            len = (input_[5] & 0x10) ? 20 : 6;
+            break;
+
+        default:
+            // Like the real modem, NACK and resynchronize.
+            input_.erase(0, 1);
+            send("\x15");
+            return true;
+    }
+
+    if(input_.size() < 2 + len) {
+        return false;
+    }
+
+    std::string frame = input_.substr(1, 1 + len);
+    input_.erase(0, 2 + len);
+
+    schedule([this, frame]() { on_frame(frame); },
+             transmit_msecs(frame.size() + 1));
+    return true;
+}
+
+
+void plm_simulator::on_frame(const std::string &frame)
+{
+    if(frame[0] == 0x60) {
+        // Device category 0x03 (network bridge), firmware 0x9b.
+        char info[] = { 0x02, 0x60, 0, 0, 0, 0x03, 0x15, char(0x9b), 0x06 };
+        MODEM_ADDR.to_bytes(info + 2);
+        send(std::string(info, sizeof(info)));
+        return;
+    }
+
+    on_send_message(frame);
+}
+
+
+void plm_simulator::on_send_message(const std::string &frame)
+{
+    ++stats_.commands;
+
+    int64_t now = net::monotonic_usecs();
+
+    if(now < busy_until_) {
+        ++stats_.modem_nacks;
+        send('\x02' + frame + '\x15');
+        return;
+    }
+
+    busy_until_ = now + int64_t(busy_msecs_) * 1000;
+    send('\x02' + frame + '\x06');
+
+    insteon_address addr = insteon_address::from_bytes(&frame[1]);
+    char cmd1 = frame[5];
+    char cmd2 = frame[6];
+    device_profile profile;
+
+    if(!find_device(addr, &profile) ||
+       std::uniform_real_distribution<double>(0, 1)(random_) < profile.loss)
+    {
+        ++stats_.lost;
+        return;
+    }
+
+    int latency = profile.latency_msecs;
+
+    if(profile.jitter_msecs > 0) {
+        latency += std::uniform_int_distribution<int>(
+            0, profile.jitter_msecs)(random_);
+    }
+
+    bool extended = frame.size() == 21;
+    schedule([this, addr, cmd1, cmd2, extended]() {
+                 on_device_message(addr, cmd1, cmd2, extended);
+             },
+             latency);
+
+    // Read ALDB, the second byte of the user data is 0x00 in the request and
+    // 0x01 in the responses.
+    if(extended && cmd1 == 0x2f && frame[8] == 0x00) {
+        stream_aldb(addr, frame, profile, latency);
+    }
+}
+
+
+void plm_simulator::stream_aldb(insteon_address addr,
+                                const std::string &frame,
+                                const device_profile &profile,
+                                int latency)
+{
+    int address = ((unsigned char)frame[9] << 8) | (unsigned char)frame[10];
+    int count = (unsigned char)frame[11];
+
+    // The records are stored downwards from 0x0fff, the one after the last
+    // is all zeros and marks the end. A count of 0 reads to the end.
+    for(int i = 0; count == 0 || i < count; ++i) {
+        int a = address - i * 8;
+        int index = (0x0fff - a) / 8;
+
+        if(a < 0 || (0x0fff - a) % 8 != 0 || index > aldb_size_) {
+            break;
+        }
+
+        if(std::uniform_real_distribution<double>(0, 1)(random_) <
+           profile.loss)
+        {
+            ++stats_.lost;
+            continue;
+        }
+
+        schedule([this, addr, a]() { send_aldb_record(addr, a); },
+                 latency + (i + 1) * record_msecs_);
+    }
+}
+
+
+void plm_simulator::send_aldb_record(insteon_address addr, int address)
+{
+    int index = (0x0fff - address) / 8;
+    char msg[25] = { 0x02, 0x51, 0, 0, 0, 0, 0, 0, 0x1b, 0x2f, 0x00,
+                     0x00, 0x01, char(address >> 8), char(address), 0x00 };
+
+    addr.to_bytes(msg + 2);
+    MODEM_ADDR.to_bytes(msg + 5);
+
+    if(index < aldb_size_) {
+        // In use, controller, used before.
+        msg[16] = char(0xe2);
+        msg[17] = char(index + 1);
+        insteon_address(0x200000 + index).to_bytes(msg + 18);
+        msg[21] = 0x03;
+        msg[22] = 0x1c;
+        msg[23] = 0x01;
+    }
+
+    unsigned sum = 0;
+
+    for(int i = 9; i < 24; ++i) {
+        sum += (unsigned char)msg[i];
+    }
+
+    msg[24] = char(0x100 - (sum & 0xff));
+    send(std::string(msg, sizeof(msg)));
+}
+
+
+void plm_simulator::on_device_message(insteon_address addr,
+                                      char cmd1,
+                                      char cmd2,
+                                      bool extended)
+{
+    char ack1 = cmd1;
+    char ack2 = cmd2;
+    int level = device_level(addr);
+
+    switch(extended ? 0 : cmd1) {
+        case 0x11:  // on
+        case 0x12:  // fast on
+            levels_[addr] = (unsigned char)cmd2;
+            break;
+
+        case 0x13:  // off
+        case 0x14:  // fast off
+        case 0x2f:  // off at ramp rate
+            levels_[addr] = 0;
+            break;
+
+        case 0x15:  // brighten one of 32 steps
+            levels_[addr] = std::min(255, level + 8);
+            break;
+
+        case 0x16:  // dim one step
+            levels_[addr] = std::max(0, level - 8);
+            break;
+
+        case 0x2e:  // on at ramp rate, the level in the high nibble
+            levels_[addr] = ((unsigned char)cmd2 & 0xf0) | 0x0f;
+            break;
+
+        case 0x19:  // status request, the ALDB delta and the level
+            ack1 = 0;
+            ack2 = device_level(addr);
+            break;
+    }
+
+    ++stats_.device_acks;
+
+    // ACK, 2 hops left out of 3.
+    char msg[] = { 0x02, 0x50, 0, 0, 0, 0, 0, 0, 0x2b, ack1, ack2 };
+    addr.to_bytes(msg + 2);
+    MODEM_ADDR.to_bytes(msg + 5);
+    send(std::string(msg, sizeof(msg)));
+}
+
+
+bool plm_simulator::find_device(insteon_address addr,
+                                device_profile *profile) const
+{
+    std::unordered_map<insteon_address, device_profile>::const_iterator it =
+        profiles_.find(addr);
+
+    if(it != profiles_.end()) {
+        *profile = it->second;
+        return true;
+    }
+
+    if(addr.value() < 1 || addr.value() > uint32_t(device_count_)) {
+        return false;
+    }
+
+    *profile = default_profile_;
+    return true;
+}
+
+
+int plm_simulator::transmit_msecs(size_t bytes) const
+{
+    if(baud_ <= 0) {
+        return 0;
+    }
+
+    // 8N1, 10 bits per byte.
+    return (bytes * 10 * 1000 + baud_ - 1) / baud_;
+}
+
+
+void plm_simulator::send(const std::string &data)
+{
+    output_ += data;
+    flush_output();
+}
+
+
+void plm_simulator::flush_output()
+{
+    if(output_.empty()) {
+        return;
+    }
+
+    int64_t now = net::monotonic_usecs();
+    int64_t byte_usecs = baud_ > 0 ? 10000000 / baud_ : 0;
+    size_t len = output_.size();
+
+    if(baud_ > 0) {
+        // Do not build up credit while the line is idle, but allow for the
+        // coarse alarm resolution.
+        next_byte_at_ = std::max(next_byte_at_, now - 1000);
+        len = next_byte_at_ > now ? 0 : (now - next_byte_at_) / byte_usecs + 1;
+        len = std::min(len, output_.size());
+    }
+
+    if(len > 0) {
+        int r = ::write(fd_, output_.data(), len);
+
+        if(r == -1 && errno == EAGAIN) {
+            event_manager_->register_for_write(this);
+            return;
+        }
+
+        if(r == -1) {
+            output_.clear();  // nobody is listening
+            return;
+        }
+
+        output_.erase(0, r);
+        next_byte_at_ += r * byte_usecs;
+    }
+
+    if(!output_.empty() && !flush_scheduled_) {
+        int64_t wait = next_byte_at_ - now;
+
+        flush_scheduled_ = true;
+        schedule([this]() {
+                     flush_scheduled_ = false;
+                     flush_output();
+                 },
+                 std::max<int64_t>(wait / 1000, 1));
+    }
+}
+
+
+void plm_simulator::schedule(const std::function<void()> &callback,
+                             int msecs)
+{
+    int id = next_alarm_id_++;
+
+    alarms_[id] = alarm_manager_->schedule_alarm(
+        [this, id, callback]() {
+            alarms_.erase(id);
+            callback();
+        },
+        msecs);
+}
+
+
+}
@@ -0,0 +1,169 @@
+
+#ifndef PLM_SIMULATOR_H_
+#define PLM_SIMULATOR_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_map>
+
+#include "event-manager.h"
+#include "insteon-address.h"
+
+
+namespace net {
+class alarm;
+class alarm_manager;
+}
+
+
+namespace plm {
+
+
+// Emulates an INSTEON PowerLinc modem and the devices behind it on the modem
+// side of a serial line (e.g. the master side of a pty), for load testing
+// against the real protocol stack.
+//
+// The modem answers 0x60 (get IM info) and 0x62 (send message). A 0x62 is
+// echoed with an ACK unless the modem is still busy sending the previous
+// message on the powerline, in which case it is echoed with a NACK. The
+// addressed device then answers with a 0x50 ACK after its latency, or never
+// if it does not exist or the message is lost. A device ACKs an extended
+// read ALDB request and then streams the records as 0x51 messages, each of
+// which can be lost too. Output is paced to the baud rate of the real modem.
+class plm_simulator : public net::connection {
+public:
+    struct device_profile {
+        device_profile() : latency_msecs(100), jitter_msecs(0), loss(0) {}
+
+        int latency_msecs;
+        int jitter_msecs;  // uniformly added to the latency
+        double loss;  // probability that a message gets no response
+    };
+
+    struct stats_t {
+        stats_t() : commands(0), modem_nacks(0), device_acks(0), lost(0) {}
+
+        uint64_t commands;
+        uint64_t modem_nacks;
+        uint64_t device_acks;
+        uint64_t lost;  // includes messages to nonexistent devices
+    };
+
+    // The fd is not owned and must be non-blocking.
+    plm_simulator(int fd, net::event_manager *em, net::alarm_manager *am);
+    ~plm_simulator();
+
+    void start();
+    void stop();
+
+    // Devices 00.00.01 to the given count exist and use the default profile,
+    // 1000 by default.
+    void set_device_count(int count);
+    void set_default_profile(const device_profile &profile);
+
+    // Makes the device with the given address exist with its own profile.
+    void set_device_profile(insteon_address addr,
+                            const device_profile &profile);
+
+    // 19200 by default, 0 turns the pacing off.
+    void set_baud_rate(int baud);
+
+    // How long the modem is busy after accepting a message, 50 by default.
+    void set_busy_msecs(int msecs);
+
+    // Number of records in the ALDB of every device, 0 by default. The
+    // records link the device to 20.00.00, 20.00.01 and so on as a
+    // controller of groups 1, 2, etc.
+    void set_aldb_size(int records);
+
+    // Time between the streamed ALDB records, 100 by default.
+    void set_record_msecs(int msecs);
+
+    void set_seed(unsigned seed);
+
+    const stats_t &stats() const { return stats_; }
+
+    // The on level a device was last set to, 0 for devices never turned on.
+    int device_level(insteon_address addr) const;
+
+    // The address the modem uses in the device responses.
+    static const insteon_address MODEM_ADDR;
+
+    // Opens a pseudo-terminal in raw mode for the simulator. Returns the
+    // non-blocking master fd and stores the slave's path and fd. The slave
+    // should be kept open, otherwise reads from the master fail with EIO
+    // while no client is connected. Throws net::fd_exception.
+    static int open_pty(std::string *slave_path, int *slave_fd);
+
+private:
+    plm_simulator(const plm_simulator &);
+    plm_simulator &operator= (const plm_simulator &);
+
+    virtual int get_fd() override;
+    virtual void on_read() override;
+    virtual void on_write() override;
+
+    // Extracts complete frames from the input. Returns false if more input
+    // is needed.
+    bool parse_frame();
+
+    // Handles a frame (without the STX) once the host has finished sending
+    // it at the simulated baud rate.
+    void on_frame(const std::string &frame);
+    void on_send_message(const std::string &frame);
+    void on_device_message(insteon_address addr, char cmd1, char cmd2,
+                           bool extended);
+
+    // Schedules the records of a read ALDB request after the device's ACK.
+    void stream_aldb(insteon_address addr, const std::string &frame,
+                     const device_profile &profile, int latency);
+    void send_aldb_record(insteon_address addr, int address);
+
+    bool find_device(insteon_address addr, device_profile *profile) const;
+
+    // Time to transmit the given number of bytes, in msecs.
+    int transmit_msecs(size_t bytes) const;
+
+    // Queues output, it is written out at the baud rate.
+    void send(const std::string &data);
+    void flush_output();
+
+    // Schedules an alarm that is cancelled by stop().
+    void schedule(const std::function<void()> &callback, int msecs);
+
+private:
+    int fd_;
+    net::event_manager *event_manager_;  // not owned
+    net::alarm_manager *alarm_manager_;  // not owned
+
+    int device_count_;
+    device_profile default_profile_;
+    std::unordered_map<insteon_address, device_profile> profiles_;
+    std::unordered_map<insteon_address, int> levels_;
+    int baud_;
+    int busy_msecs_;
+    int aldb_size_;
+    int record_msecs_;
+    std::mt19937 random_;
+
+    std::string input_;
+    std::string output_;
+    int64_t next_byte_at_;  // usecs
+    bool flush_scheduled_;
+    int64_t busy_until_;  // usecs
+
+    // By id, removed when they fire.
+    std::map<int, net::alarm *> alarms_;
+    int next_alarm_id_;
+
+    stats_t stats_;
+};
+
+
+}
+
+#endif
@@ -0,0 +1,198 @@
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "event-manager.h"
+#include "logger.h"
+#include "plm-connection.h"
+#include "plm-endpoint.h"
+#include "plm-simulator.h"
+#include "select-server.h"
+
+#include <gtest/gtest.h>
+
+
+namespace plm {
+
+
+// Collects what the simulator sends to the host side of the pty.
+class host_side : public net::connection {
+public:
+    explicit host_side(int fd) : fd_(fd) {}
+
+    int get_fd() override { return fd_; }
+
+    void on_read() override {
+        char buf[256];
+        int r;
+
+        while((r = ::read(fd_, buf, sizeof(buf))) > 0) {
+            received.append(buf, r);
+        }
+    }
+
+    std::string received;
+
+private:
+    int fd_;
+};
+
+
+class PlmSimulatorTest : public testing::Test {
+public:
+    PlmSimulatorTest() {
+        disable_logging();
+    }
+
+    virtual void SetUp() {
+        master_ = plm_simulator::open_pty(&slave_path_, &slave_);
+        fcntl(slave_, F_SETFL, O_NONBLOCK);
+
+        sim_.reset(new plm_simulator(master_, &ss_, &ss_));
+        sim_->set_baud_rate(0);
+        sim_->set_device_count(10);
+        sim_->set_seed(1);
+
+        plm_simulator::device_profile fast;
+        fast.latency_msecs = 5;
+        sim_->set_default_profile(fast);
+        sim_->start();
+    }
+
+    virtual void TearDown() {
+        sim_.reset();
+        close(slave_);
+        close(master_);
+    }
+
+    // Writes the data on the host side and runs the loop until 'len' bytes
+    // have come back or about a second has passed.
+    std::string exchange(const std::string &data, size_t len) {
+        host_side host(slave_);
+        int ticks = 0;
+
+        ss_.register_for_read(&host);
+        write(slave_, data.data(), data.size());
+
+        std::function<void()> poll = [&]() {
+            if(host.received.size() >= len || ++ticks > 1000) {
+                ss_.stop();
+            } else {
+                ss_.schedule_alarm(poll, 1);
+            }
+        };
+
+        ss_.schedule_alarm(poll, 1);
+        ss_.loop();
+
+        ss_.deregister_connection(&host);
+        return host.received;
+    }
+
+protected:
+    net::select_server ss_;
+    std::unique_ptr<plm_simulator> sim_;
+    std::string slave_path_;
+    int master_;
+    int slave_;
+};
+
+
+TEST_F(PlmSimulatorTest, SendMessage)
+{
+    std::string cmd("\x02\x62\x00\x00\x05\x0f\x11\x80", 8);
+    std::string r = exchange(cmd, 9 + 11);
+
+    EXPECT_EQ(cmd + '\x06', r.substr(0, 9));
+    EXPECT_EQ(std::string("\x02\x50\x00\x00\x05\x11\x22\x33\x2b\x11\x80", 11),
+              r.substr(9));
+    EXPECT_EQ(0x80, sim_->device_level(insteon_address(0x000005)));
+    EXPECT_EQ(1u, sim_->stats().device_acks);
+}
+
+
+TEST_F(PlmSimulatorTest, RampAndSteps)
+{
+    sim_->set_busy_msecs(0);
+
+    // On at ramp rate to level 8 of 16, then a step down.
+    exchange(std::string("\x02\x62\x00\x00\x05\x0f\x2e\x8a", 8), 9 + 11);
+    EXPECT_EQ(0x8f, sim_->device_level(insteon_address(0x000005)));
+
+    exchange(std::string("\x02\x62\x00\x00\x05\x0f\x16\x00", 8), 9 + 11);
+    EXPECT_EQ(0x87, sim_->device_level(insteon_address(0x000005)));
+
+    exchange(std::string("\x02\x62\x00\x00\x05\x0f\x2f\x0a", 8), 9 + 11);
+    EXPECT_EQ(0, sim_->device_level(insteon_address(0x000005)));
+}
+
+
+TEST_F(PlmSimulatorTest, BusyModemNacks)
+{
+    sim_->set_busy_msecs(1000);
+
+    std::string cmd1("\x02\x62\x00\x00\x05\x0f\x11\xff", 8);
+    std::string cmd2("\x02\x62\x00\x00\x06\x0f\x11\xff", 8);
+    std::string r = exchange(cmd1 + cmd2, 9 + 9);
+
+    EXPECT_EQ(cmd1 + '\x06', r.substr(0, 9));
+    EXPECT_EQ(cmd2 + '\x15', r.substr(9, 9));
+    EXPECT_EQ(1u, sim_->stats().modem_nacks);
+}
+
+
+TEST_F(PlmSimulatorTest, MissingDeviceAndUnknownCommand)
+{
+    std::string cmd("\x02\x62\x00\x01\x00\x0f\x11\xff", 8);
+    std::string r = exchange(cmd + "\x02\x7f", 10);
+
+    EXPECT_EQ(std::string("\x15", 1) + cmd + '\x06', r);
+    EXPECT_EQ(1u, sim_->stats().lost);
+}
+
+
+TEST_F(PlmSimulatorTest, DrivesEndpoint)
+{
+    // The real stack on the other side of the pty.
+    plm_fd fd(slave_path_);
+    plm_endpoint endpoint(&fd, &ss_, &ss_, &ss_);
+    int ok = 0;
+
+    endpoint.start();
+
+    for(int i = 1; i <= 3; ++i) {
+        endpoint.send_light_on(
+            insteon_address(i),
+            [&](plm_endpoint::response_t r) {
+                ok += r.is_ok();
+                if(ok == 3) {
+                    ss_.stop();
+                }
+            });
+    }
+
+    bool timed_out = false;
+    net::alarm *timeout = ss_.schedule_alarm(
+        [&]() {
+            timed_out = true;
+            ss_.stop();
+        },
+        5000);
+
+    ss_.loop();
+
+    if(!timed_out) {
+        timeout->stop();
+    }
+
+    EXPECT_EQ(3, ok);
+    EXPECT_EQ(0xff, sim_->device_level(insteon_address(0x000003)));
+    endpoint.stop();
+}
+
+
+}
@@ -0,0 +1,38 @@
+
+#include <string>
+
+#include "bench-util.h"
+#include "plm-util.h"
+
+
+namespace plm {
+
+
+static void BM_HexToBin(benchmark::State &state)
+{
+    // A standard message as it appears in the config and on the wire.
+    std::string hex = "0262AABBCC0F11FF";
+    bench::alloc_counter allocs(state);
+
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(hex_to_bin(hex));
+    }
+}
+
+BENCHMARK(BM_HexToBin);
+
+
+static void BM_BinToHex(benchmark::State &state)
+{
+    std::string bin("\x02\x50\xaa\xbb\xcc\x11\x22\x33\x2b\x11\xff", 11);
+    bench::alloc_counter allocs(state);
+
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(bin_to_hex(bin));
+    }
+}
+
+BENCHMARK(BM_BinToHex);
+
+
+}
@@ -0,0 +1,674 @@
+
+#include "rules.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <sstream>
+
+
+namespace rules {
+
+namespace {
+
+// Sun offsets are kept within half a day.
+const int MAX_SUN_OFFSET = 12 * 60;
+
+// Copies of a message come within this time of the first one.
+const int64_t MESSAGE_COPIES_USECS = 3000000;
+
+
+inline bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+
+inline bool is_operator(char c)
+{
+    return c == '=' || c == '<' || c == '>' || c == '!';
+}
+
+
+// An action as written, the scenes are resolved once the whole file is read.
+struct action_t {
+    std::string scene;  // empty for set
+    plm::scene_target target;
+};
+
+
+// Splits a line into tokens and reads them one by one. Commas and runs of
+// operator characters are tokens of their own, the rest is separated by
+// spaces.
+class line_parser {
+public:
+    line_parser(const std::string &line, int line_no);
+
+    bool at_end() const { return pos_ >= tokens_.size(); }
+
+    // The next token without consuming it, empty at the end of the line.
+    std::string peek() const;
+
+    // Consumes the next token, throws if there is none.
+    std::string next(const char *what);
+
+    // Consumes the next token if it is the given one.
+    bool accept(const char *token);
+    void expect(const char *token);
+
+    int minute_of_day();
+    plm::insteon_address address();
+    int level();
+
+    // Throws parse_exception with the line number.
+    void fail(const std::string &msg) const;
+
+private:
+    line_parser(const line_parser &);
+    line_parser &operator= (const line_parser &);
+
+    std::vector<std::string> tokens_;
+    size_t pos_;
+    int line_no_;
+};
+
+
+line_parser::line_parser(const std::string &line, int line_no)
+    : pos_(0), line_no_(line_no)
+{
+    size_t i = 0;
+
+    while(i < line.size()) {
+        char c = line[i];
+
+        if(is_space(c)) {
+            ++i;
+            continue;
+        }
+
+        size_t start = i;
+
+        if(c == ',') {
+            ++i;
+        } else if(is_operator(c)) {
+            while(i < line.size() && is_operator(line[i])) {
+                ++i;
+            }
+        } else {
+            while(i < line.size() && !is_space(line[i]) &&
+                  line[i] != ',' && !is_operator(line[i]))
+            {
+                ++i;
+            }
+        }
+
+        tokens_.push_back(line.substr(start, i - start));
+    }
+}
+
+
+std::string line_parser::peek() const
+{
+    return at_end() ? std::string() : tokens_[pos_];
+}
+
+
+std::string line_parser::next(const char *what)
+{
+    if(at_end()) {
+        fail(std::string("expected ") + what);
+    }
+
+    return tokens_[pos_++];
+}
+
+
+bool line_parser::accept(const char *token)
+{
+    if(at_end() || tokens_[pos_] != token) {
+        return false;
+    }
+
+    ++pos_;
+    return true;
+}
+
+
+void line_parser::expect(const char *token)
+{
+    if(!accept(token)) {
+        fail(std::string("expected '") + token + "' instead of '" +
+             peek() + "'");
+    }
+}
+
+
+int line_parser::minute_of_day()
+{
+    std::string token = next("a time");
+    size_t colon = token.find(':');
+    char *end = 0;
+
+    if(colon == std::string::npos || colon == 0 ||
+       token.size() - colon != 3)
+    {
+        fail("invalid time '" + token + "', expected HH:MM");
+    }
+
+    long hour = strtol(token.c_str(), &end, 10);
+    if(end != token.c_str() + colon || hour < 0 || hour > 23) {
+        fail("invalid time '" + token + "', expected HH:MM");
+    }
+
+    long minute = strtol(token.c_str() + colon + 1, &end, 10);
+    if(*end != '\0' || minute < 0 || minute > 59) {
+        fail("invalid time '" + token + "', expected HH:MM");
+    }
+
+    return int(hour * 60 + minute);
+}
+
+
+plm::insteon_address line_parser::address()
+{
+    std::string token = next("a device address");
+    plm::insteon_address addr;
+
+    if(!plm::insteon_address::parse(token, &addr)) {
+        fail("invalid device address '" + token + "'");
+    }
+
+    return addr;
+}
+
+
+int line_parser::level()
+{
+    std::string token = next("a level");
+
+    if(token == "on") {
+        return 255;
+    }
+
+    if(token == "off") {
+        return 0;
+    }
+
+    char *end = 0;
+    long level = strtol(token.c_str(), &end, 10);
+
+    if(token.empty() || *end != '\0' || level < 0 || level > 255) {
+        fail("invalid level '" + token + "'");
+    }
+
+    return int(level);
+}
+
+
+void line_parser::fail(const std::string &msg) const
+{
+    std::ostringstream os;
+    os << "line " << line_no_ << ": " << msg;
+    throw parse_exception(os.str());
+}
+
+
+// <name> = <device> <level>[, <device> <level>...]
+void parse_scene(line_parser *p,
+                 std::map<std::string, std::vector<plm::scene_target>> *out)
+{
+    std::string name = p->next("a scene name");
+    p->expect("=");
+
+    if(out->count(name)) {
+        p->fail("duplicate scene '" + name + "'");
+    }
+
+    std::vector<plm::scene_target> &targets = (*out)[name];
+
+    do {
+        plm::insteon_address device = p->address();
+        targets.push_back(plm::scene_target(device, p->level()));
+    } while(p->accept(","));
+}
+
+
+void parse_trigger(line_parser *p, rule_t *rule)
+{
+    std::string trigger = p->next("a trigger");
+
+    if(trigger == "time") {
+        rule->trigger = rule_t::TIME;
+        rule->minute = p->minute_of_day();
+    } else if(trigger == "sunrise" || trigger == "sunset") {
+        rule->trigger = trigger == "sunrise" ? rule_t::SUNRISE
+                                             : rule_t::SUNSET;
+        rule->minute = 0;
+
+        std::string offset = p->peek();
+        if(!offset.empty() && (offset[0] == '+' || offset[0] == '-')) {
+            p->next("an offset");
+
+            char *end = 0;
+            long minutes = strtol(offset.c_str(), &end, 10);
+
+            if(offset.size() < 2 || *end != '\0' ||
+               labs(minutes) > MAX_SUN_OFFSET)
+            {
+                p->fail("invalid offset '" + offset + "'");
+            }
+
+            rule->minute = int(minutes);
+        }
+    } else if(trigger == "message") {
+        rule->trigger = rule_t::MESSAGE;
+        rule->device = p->address();
+
+        if(p->accept("on")) {
+            rule->cmd1 = 0x11;
+        } else if(p->accept("fast-on")) {
+            rule->cmd1 = 0x12;
+        } else if(p->accept("off")) {
+            rule->cmd1 = 0x13;
+        } else if(p->accept("fast-off")) {
+            rule->cmd1 = 0x14;
+        } else {
+            p->accept("any");
+            rule->cmd1 = rule_t::ANY_CMD;
+        }
+    } else {
+        p->fail("unknown trigger '" + trigger + "'");
+    }
+}
+
+
+void parse_condition(line_parser *p, condition_t *cond)
+{
+    std::string type = p->next("a condition");
+
+    if(type == "between") {
+        cond->type = condition_t::BETWEEN;
+        cond->from = p->minute_of_day();
+        cond->to = p->minute_of_day();
+    } else if(type == "dark") {
+        cond->type = condition_t::DARK;
+    } else if(type == "light") {
+        cond->type = condition_t::LIGHT;
+    } else if(type == "level") {
+        cond->type = condition_t::LEVEL;
+        cond->device = p->address();
+
+        std::string op = p->next("a comparison");
+        if(op == "==") {
+            cond->op = condition_t::EQ;
+        } else if(op == "!=") {
+            cond->op = condition_t::NE;
+        } else if(op == "<") {
+            cond->op = condition_t::LT;
+        } else if(op == ">") {
+            cond->op = condition_t::GT;
+        } else if(op == "<=") {
+            cond->op = condition_t::LE;
+        } else if(op == ">=") {
+            cond->op = condition_t::GE;
+        } else {
+            p->fail("invalid comparison '" + op + "'");
+        }
+
+        cond->value = p->level();
+    } else {
+        p->fail("unknown condition '" + type + "'");
+    }
+}
+
+
+void parse_action(line_parser *p, action_t *action)
+{
+    std::string type = p->next("an action");
+
+    if(type == "scene") {
+        action->scene = p->next("a scene name");
+    } else if(type == "set") {
+        plm::insteon_address device = p->address();
+        action->target = plm::scene_target(device, p->level());
+    } else {
+        p->fail("unknown action '" + type + "'");
+    }
+}
+
+
+// <trigger> [if <condition> [and <condition>...]] do <action>[, <action>...]
+void parse_rule(line_parser *p, rule_t *rule, std::vector<action_t> *actions)
+{
+    parse_trigger(p, rule);
+
+    if(p->accept("if")) {
+        do {
+            rule->conditions.push_back(condition_t());
+            parse_condition(p, &rule->conditions.back());
+        } while(p->accept("and"));
+    }
+
+    p->expect("do");
+
+    do {
+        actions->push_back(action_t());
+        parse_action(p, &actions->back());
+    } while(p->accept(","));
+}
+
+
+void add_target(const plm::scene_target &target,
+                std::vector<plm::scene_target> *targets)
+{
+    for(size_t i = 0; i < targets->size(); ++i) {
+        if((*targets)[i].device == target.device) {
+            (*targets)[i].level = target.level;
+            return;
+        }
+    }
+
+    targets->push_back(target);
+}
+
+
+inline bool compare(int a, condition_t::op_t op, int b)
+{
+    switch(op) {
+    case condition_t::EQ: return a == b;
+    case condition_t::NE: return a != b;
+    case condition_t::LT: return a < b;
+    case condition_t::GT: return a > b;
+    case condition_t::LE: return a <= b;
+    case condition_t::GE: return a >= b;
+    }
+
+    return false;
+}
+
+
+bool check_condition(const condition_t &cond, const context_t &ctx)
+{
+    int m = ctx.minute;
+    bool sun_known = ctx.sunrise >= 0 && ctx.sunset >= 0;
+
+    switch(cond.type) {
+    case condition_t::BETWEEN:
+        if(cond.from <= cond.to) {
+            return m >= cond.from && m < cond.to;
+        }
+        return m >= cond.from || m < cond.to;
+
+    case condition_t::DARK:
+        return sun_known && (m < ctx.sunrise || m >= ctx.sunset);
+
+    case condition_t::LIGHT:
+        return sun_known && m >= ctx.sunrise && m < ctx.sunset;
+
+    case condition_t::LEVEL: {
+        int level = ctx.level ? ctx.level(cond.device) : -1;
+        return level >= 0 && compare(level, cond.op, cond.value);
+    }
+    }
+
+    return false;
+}
+
+} // namespace
+
+
+parse_exception::parse_exception(const std::string &msg)
+    : msg_(msg)
+{
+}
+
+
+parse_exception::~parse_exception() throw()
+{
+}
+
+
+const char *parse_exception::what() const throw()
+{
+    return msg_.c_str();
+}
+
+
+rule_set::rule_set()
+{
+}
+
+
+void rule_set::parse(const std::string &content)
+{
+    std::vector<rule_t> rules;
+    std::vector<std::vector<action_t>> actions;
+    std::map<std::string, std::vector<plm::scene_target>> scenes;
+
+    size_t pos = 0;
+    int line_no = 0;
+
+    while(pos < content.size()) {
+        size_t eol = content.find('\n', pos);
+        if(eol == std::string::npos) {
+            eol = content.size();
+        }
+
+        std::string line = content.substr(pos, eol - pos);
+        pos = eol + 1;
+        ++line_no;
+
+        size_t start = line.find_first_not_of(" \t\r");
+        if(start == std::string::npos || line[start] == ';') {
+            continue;
+        }
+
+        line_parser p(line, line_no);
+
+        if(p.accept("scene")) {
+            parse_scene(&p, &scenes);
+        } else if(p.accept("on")) {
+            rules.push_back(rule_t());
+            rules.back().line = line_no;
+            actions.push_back(std::vector<action_t>());
+            parse_rule(&p, &rules.back(), &actions.back());
+        } else {
+            p.fail("expected 'scene' or 'on' instead of '" + p.peek() + "'");
+        }
+
+        if(!p.at_end()) {
+            p.fail("unexpected '" + p.peek() + "'");
+        }
+    }
+
+    // The actions of a rule are merged into one scene.
+    for(size_t i = 0; i < rules.size(); ++i) {
+        for(size_t j = 0; j < actions[i].size(); ++j) {
+            const action_t &action = actions[i][j];
+
+            if(action.scene.empty()) {
+                add_target(action.target, &rules[i].targets);
+                continue;
+            }
+
+            std::map<std::string, std::vector<plm::scene_target>>::
+                const_iterator it = scenes.find(action.scene);
+
+            if(it == scenes.end()) {
+                std::ostringstream os;
+                os << "line " << rules[i].line << ": unknown scene '"
+                   << action.scene << "'";
+                throw parse_exception(os.str());
+            }
+
+            for(size_t k = 0; k < it->second.size(); ++k) {
+                add_target(it->second[k], &rules[i].targets);
+            }
+        }
+    }
+
+    rules_.swap(rules);
+    build_index();
+}
+
+
+void rule_set::build_index()
+{
+    by_message_.clear();
+
+    for(int t = 0; t < rule_t::MESSAGE; ++t) {
+        by_time_[t].clear();
+    }
+
+    for(size_t i = 0; i < rules_.size(); ++i) {
+        const rule_t &rule = rules_[i];
+
+        if(rule.trigger == rule_t::MESSAGE) {
+            by_message_[message_key(rule.device, rule.cmd1)].push_back(i);
+        } else {
+            by_time_[rule.trigger].push_back(std::make_pair(rule.minute, i));
+        }
+    }
+
+    for(int t = 0; t < rule_t::MESSAGE; ++t) {
+        std::sort(by_time_[t].begin(), by_time_[t].end());
+    }
+}
+
+
+void rule_set::match_message(plm::insteon_address from, uint8_t cmd1,
+                             std::vector<size_t> *out) const
+{
+    static const std::vector<size_t> none;
+
+    std::unordered_map<uint64_t, std::vector<size_t>>::const_iterator it =
+        by_message_.find(message_key(from, cmd1));
+    const std::vector<size_t> &exact = it != by_message_.end() ? it->second
+                                                               : none;
+
+    it = by_message_.find(message_key(from, rule_t::ANY_CMD));
+    const std::vector<size_t> &any = it != by_message_.end() ? it->second
+                                                             : none;
+
+    // Both lists are in the order of the file.
+    std::merge(exact.begin(), exact.end(), any.begin(), any.end(),
+               std::back_inserter(*out));
+}
+
+
+void rule_set::match_span(const time_index_t &index, int from, int to,
+                          std::vector<size_t> *out)
+{
+    const size_t last = std::numeric_limits<size_t>::max();
+
+    time_index_t::const_iterator begin = std::upper_bound(
+        index.begin(), index.end(), std::make_pair(from, last));
+    time_index_t::const_iterator end = std::upper_bound(
+        begin, index.end(), std::make_pair(to, last));
+
+    for(; begin != end; ++begin) {
+        out->push_back(begin->second);
+    }
+}
+
+
+void rule_set::match_time(int from, int to, int sunrise, int sunset,
+                          std::vector<size_t> *out) const
+{
+    size_t first = out->size();
+
+    // (from, to] and, past midnight, (-1, to] of the next day.
+    int spans[2][2] = {{from, to}, {-1, to}};
+    int span_count = 1;
+
+    if(to < from) {
+        spans[0][1] = MINUTES_PER_DAY - 1;
+        span_count = 2;
+    }
+
+    for(int i = 0; i < span_count; ++i) {
+        int a = spans[i][0];
+        int b = spans[i][1];
+
+        match_span(by_time_[rule_t::TIME], a, b, out);
+
+        if(sunrise >= 0) {
+            match_span(by_time_[rule_t::SUNRISE], a - sunrise, b - sunrise,
+                       out);
+        }
+
+        if(sunset >= 0) {
+            match_span(by_time_[rule_t::SUNSET], a - sunset, b - sunset,
+                       out);
+        }
+    }
+
+    std::sort(out->begin() + first, out->end());
+}
+
+
+bool rule_set::check_conditions(const rule_t &rule, const context_t &ctx)
+{
+    for(size_t i = 0; i < rule.conditions.size(); ++i) {
+        if(!check_condition(rule.conditions[i], ctx)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool message_filter::is_new(const plm::plm_frame &frame, int64_t now)
+{
+    bool broadcast =
+        frame.message_type() == plm::plm_frame::GROUP_BROADCAST;
+
+    if(frame.command() != 0x50 ||
+       (!broadcast &&
+        frame.message_type() != plm::plm_frame::GROUP_CLEANUP))
+    {
+        return false;
+    }
+
+    // The group is the last byte of the address of a broadcast and cmd2 of
+    // a cleanup.
+    uint8_t group = broadcast ? uint8_t(frame.to().value())
+                              : uint8_t(frame.cmd2());
+    uint32_t key = (frame.from().value() << 8) | uint8_t(frame.cmd1());
+
+    std::unordered_map<uint32_t, press_t>::iterator it = presses_.find(key);
+
+    if(it != presses_.end() && it->second.group == group &&
+       now - it->second.first_at < MESSAGE_COPIES_USECS)
+    {
+        press_t &last = it->second;
+
+        if(!broadcast) {
+            // The cleanup after the broadcast, or a resend of it.
+            last.cleanup = true;
+            return false;
+        }
+
+        // A repeat has fewer hops left than the copy before it. A broadcast
+        // once the cleanup is done, or with as many hops left, is sent by
+        // the device again.
+        if(!last.cleanup && frame.hops_left() < last.hops_left) {
+            last.hops_left = frame.hops_left();
+            return false;
+        }
+    }
+
+    press_t &press = presses_[key];
+    press.first_at = now;
+    press.group = group;
+    press.hops_left = broadcast ? frame.hops_left() : 0;
+    press.cleanup = !broadcast;
+    return true;
+}
+
+
+}
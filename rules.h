@@ -0,0 +1,223 @@
+
+#ifndef RULES_H_
+#define RULES_H_
+
+#include <stdint.h>
+
+#include <exception>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "insteon-address.h"
+#include "plm-frame.h"
+#include "scene-engine.h"
+
+
+namespace rules {
+
+class parse_exception : public std::exception {
+public:
+    explicit parse_exception(const std::string &msg);
+    ~parse_exception() throw();
+
+    virtual const char *what() const throw();
+
+private:
+    std::string msg_;
+};
+
+
+enum {
+    MINUTES_PER_DAY = 24 * 60
+};
+
+
+// What a rule is evaluated against: the time of day in minutes since
+// midnight, sunrise and sunset for the day, -1 if they are not known, and
+// the known levels of the devices.
+struct context_t {
+    context_t() : minute(0), sunrise(-1), sunset(-1) {}
+
+    int minute;
+    int sunrise;
+    int sunset;
+
+    // Returns -1 if the level is not known.
+    std::function<int(plm::insteon_address)> level;
+};
+
+
+struct condition_t {
+    enum type_t {
+        BETWEEN,  // from <= minute < to, wraps around midnight if from > to
+        DARK,     // before sunrise or after sunset
+        LIGHT,    // between sunrise and sunset
+        LEVEL     // the known level of device compared to value
+    };
+
+    enum op_t {
+        EQ, NE, LT, GT, LE, GE
+    };
+
+    condition_t() : type(DARK), from(0), to(0), op(EQ), value(0) {}
+
+    type_t type;
+    int from;
+    int to;
+    plm::insteon_address device;
+    op_t op;
+    int value;
+};
+
+
+struct rule_t {
+    enum trigger_t {
+        TIME,     // at minute of the day
+        SUNRISE,  // minute is the offset from sunrise, may be negative
+        SUNSET,   // from sunset
+        MESSAGE   // a broadcast of device with cmd1, any cmd1 if ANY_CMD
+    };
+
+    enum {
+        ANY_CMD = 0x100
+    };
+
+    rule_t() : line(0), trigger(TIME), minute(0), cmd1(ANY_CMD) {}
+
+    int line;  // in the rules file
+    trigger_t trigger;
+    int minute;
+    plm::insteon_address device;
+    int cmd1;
+    std::vector<condition_t> conditions;  // all have to hold
+
+    // All the actions of the rule as one scene, a device set by several
+    // actions goes to the level of the last one.
+    std::vector<plm::scene_target> targets;
+};
+
+
+// The rules from a rules file, compiled into an index by trigger so that
+// the rules a device message triggers are found with a hash lookup and
+// those due in a span of time with a binary search, however many rules
+// there are.
+//
+// The file has a rule or a scene on each line. Empty lines and lines that
+// start with ';' are skipped, comma separated items may not span lines:
+//
+//   scene <name> = <device> <level>[, <device> <level>...]
+//   on <trigger> [if <condition> [and <condition>...]]
+//       do <action>[, <action>...]
+//
+// Triggers:
+//   time HH:MM
+//   sunrise [+-minutes]
+//   sunset [+-minutes]
+//   message <device> [on|off|fast-on|fast-off|any]
+//
+// Sun offsets are in minutes, up to 12 hours either way. A sun trigger is
+// not moved to another day, one that falls before midnight or after it
+// does not fire.
+//
+// A message trigger fires on the group broadcasts a device sends on its own,
+// e.g. when its paddle is pressed, with the given command (any by default).
+//
+// Conditions:
+//   between HH:MM HH:MM
+//   dark
+//   light
+//   level <device> ==|!=|<|>|<=|>= <0-255>
+//
+// Dark and light never hold if the sun times are not known, a level
+// condition never holds if the level of the device is not known.
+//
+// Actions:
+//   scene <name>
+//   set <device> <level>
+//
+// Devices are addresses in hex, levels are 0-255, on (255) or off (0).
+// Scenes may be used before they are defined.
+class rule_set {
+public:
+    rule_set();
+
+    // Replaces the rules with the ones in the content. Throws parse_exception
+    // with the line of the error, the rules are unchanged then.
+    void parse(const std::string &content);
+
+    size_t size() const { return rules_.size(); }
+    const rule_t &rule(size_t i) const { return rules_[i]; }
+
+    // Appends the indexes of the rules triggered by the message, in the
+    // order of the file.
+    void match_message(plm::insteon_address from, uint8_t cmd1,
+                       std::vector<size_t> *out) const;
+
+    // Appends the indexes of the rules due in the minutes of the day after
+    // from up to to, which wraps around midnight if to is before from. Sun
+    // triggers are only matched if the sun times are known (not -1).
+    void match_time(int from, int to, int sunrise, int sunset,
+                    std::vector<size_t> *out) const;
+
+    static bool check_conditions(const rule_t &rule, const context_t &ctx);
+
+private:
+    rule_set(const rule_set &);
+    rule_set &operator= (const rule_set &);
+
+    // Rule indexes sorted by minute (or the offset for the sun triggers).
+    typedef std::vector<std::pair<int, size_t>> time_index_t;
+
+    // Matches minutes in (from, to], no wrapping.
+    static void match_span(const time_index_t &index, int from, int to,
+                           std::vector<size_t> *out);
+
+    static uint64_t message_key(plm::insteon_address device, int cmd1) {
+        return (uint64_t(device.value()) << 9) | uint64_t(cmd1);
+    }
+
+    void build_index();
+
+private:
+    std::vector<rule_t> rules_;
+
+    std::unordered_map<uint64_t, std::vector<size_t>> by_message_;
+    time_index_t by_time_[rule_t::MESSAGE];
+};
+
+
+// Tells the first message of a button press from the copies that follow.
+// A device sends a group broadcast, which other devices repeat with fewer
+// hops left, and then a group cleanup message to the modem. Copies are only
+// recognized for a few seconds after the first message, so a press after
+// that is always new.
+class message_filter {
+public:
+    message_filter() {}
+
+    // True if the frame is a group broadcast or cleanup that starts a new
+    // press of the button, now is in monotonic usecs.
+    bool is_new(const plm::plm_frame &frame, int64_t now);
+
+private:
+    message_filter(const message_filter &);
+    message_filter &operator= (const message_filter &);
+
+    // The last press by device and command.
+    struct press_t {
+        int64_t first_at;
+        uint8_t group;
+        int hops_left;  // of the last copy of the broadcast
+        bool cleanup;   // the cleanup was seen
+    };
+
+    std::unordered_map<uint32_t, press_t> presses_;
+};
+
+
+}
+
+#endif
@@ -0,0 +1,272 @@
+
+#include <string>
+#include <vector>
+
+#include "rules.h"
+
+#include <gtest/gtest.h>
+
+
+namespace rules {
+
+namespace {
+
+const plm::insteon_address A(0x0a0a0a);
+const plm::insteon_address B(0x0b0b0b);
+const plm::insteon_address C(0x0c0c0c);
+
+
+std::vector<size_t> match_message(const rule_set &rules,
+                                  plm::insteon_address from, uint8_t cmd1)
+{
+    std::vector<size_t> out;
+    rules.match_message(from, cmd1, &out);
+    return out;
+}
+
+
+std::vector<size_t> match_time(const rule_set &rules, int from, int to,
+                               int sunrise = -1, int sunset = -1)
+{
+    std::vector<size_t> out;
+    rules.match_time(from, to, sunrise, sunset, &out);
+    return out;
+}
+
+
+std::string parse_error(const std::string &content)
+{
+    rule_set rules;
+
+    try {
+        rules.parse(content);
+    } catch(parse_exception &ex) {
+        return ex.what();
+    }
+
+    return std::string();
+}
+
+}
+
+
+TEST(RulesTest, Parse)
+{
+    rule_set rules;
+    rules.parse(
+        "; Comments and empty lines are skipped.\n"
+        "\n"
+        "on message 0A0A0A on if dark and level 0B0B0B<128 do scene evening\n"
+        "  on sunset -30 do set 0B0B0B 200, set 0C0C0C on\r\n"
+        "scene evening = 0B0B0B 128, 0C0C0C off\n"
+        "on time 23:15 if between 22:00 06:00 do scene evening, "
+            "set 0C0C0C 10\n");
+
+    ASSERT_EQ(3u, rules.size());
+
+    const rule_t &r0 = rules.rule(0);
+    EXPECT_EQ(3, r0.line);
+    EXPECT_EQ(rule_t::MESSAGE, r0.trigger);
+    EXPECT_EQ(A, r0.device);
+    EXPECT_EQ(0x11, r0.cmd1);
+    ASSERT_EQ(2u, r0.conditions.size());
+    EXPECT_EQ(condition_t::DARK, r0.conditions[0].type);
+    EXPECT_EQ(condition_t::LEVEL, r0.conditions[1].type);
+    EXPECT_EQ(B, r0.conditions[1].device);
+    EXPECT_EQ(condition_t::LT, r0.conditions[1].op);
+    EXPECT_EQ(128, r0.conditions[1].value);
+    ASSERT_EQ(2u, r0.targets.size());
+    EXPECT_EQ(B, r0.targets[0].device);
+    EXPECT_EQ(128, r0.targets[0].level);
+    EXPECT_EQ(C, r0.targets[1].device);
+    EXPECT_EQ(0, r0.targets[1].level);
+
+    const rule_t &r1 = rules.rule(1);
+    EXPECT_EQ(rule_t::SUNSET, r1.trigger);
+    EXPECT_EQ(-30, r1.minute);
+    EXPECT_TRUE(r1.conditions.empty());
+    ASSERT_EQ(2u, r1.targets.size());
+    EXPECT_EQ(200, r1.targets[0].level);
+    EXPECT_EQ(255, r1.targets[1].level);
+
+    // The later action wins for the same device.
+    const rule_t &r2 = rules.rule(2);
+    EXPECT_EQ(rule_t::TIME, r2.trigger);
+    EXPECT_EQ(23 * 60 + 15, r2.minute);
+    ASSERT_EQ(1u, r2.conditions.size());
+    EXPECT_EQ(22 * 60, r2.conditions[0].from);
+    EXPECT_EQ(6 * 60, r2.conditions[0].to);
+    ASSERT_EQ(2u, r2.targets.size());
+    EXPECT_EQ(C, r2.targets[1].device);
+    EXPECT_EQ(10, r2.targets[1].level);
+}
+
+
+TEST(RulesTest, ParseErrors)
+{
+    EXPECT_EQ("line 2: expected 'scene' or 'on' instead of 'off'",
+              parse_error("\noff time 10:00 do set 0A0A0A on"));
+    EXPECT_EQ("line 1: unknown trigger 'noon'",
+              parse_error("on noon do set 0A0A0A on"));
+    EXPECT_EQ("line 1: invalid time '24:00', expected HH:MM",
+              parse_error("on time 24:00 do set 0A0A0A on"));
+    EXPECT_EQ("line 1: invalid offset '+1000'",
+              parse_error("on sunrise +1000 do set 0A0A0A on"));
+    EXPECT_EQ("line 1: invalid device address 'porch'",
+              parse_error("on message porch do set 0A0A0A on"));
+    EXPECT_EQ("line 1: invalid comparison '=>'",
+              parse_error("on time 10:00 if level 0A0A0A => 5 do scene x"));
+    EXPECT_EQ("line 1: expected 'do' instead of ''",
+              parse_error("on time 10:00"));
+    EXPECT_EQ("line 1: invalid level '256'",
+              parse_error("on time 10:00 do set 0A0A0A 256"));
+    EXPECT_EQ("line 1: unexpected 'now'",
+              parse_error("on time 10:00 do set 0A0A0A on now"));
+    EXPECT_EQ("line 2: duplicate scene 'x'",
+              parse_error("scene x = 0A0A0A on\nscene x = 0B0B0B on"));
+    EXPECT_EQ("line 1: unknown scene 'x'",
+              parse_error("on time 10:00 do scene x"));
+
+    // The rules are unchanged after an error.
+    rule_set rules;
+    rules.parse("on time 10:00 do set 0A0A0A on");
+    EXPECT_THROW(rules.parse("on time 10:00 do scene x"), parse_exception);
+    EXPECT_EQ(1u, rules.size());
+}
+
+
+TEST(RulesTest, MatchMessage)
+{
+    rule_set rules;
+    rules.parse(
+        "on message 0A0A0A on do set 0C0C0C on\n"
+        "on message 0A0A0A do set 0C0C0C 100\n"
+        "on message 0A0A0A off do set 0C0C0C off\n"
+        "on message 0B0B0B fast-on do set 0C0C0C on\n");
+
+    EXPECT_EQ(std::vector<size_t>({0, 1}), match_message(rules, A, 0x11));
+    EXPECT_EQ(std::vector<size_t>({1, 2}), match_message(rules, A, 0x13));
+    EXPECT_EQ(std::vector<size_t>({1}), match_message(rules, A, 0x17));
+    EXPECT_EQ(std::vector<size_t>({3}), match_message(rules, B, 0x12));
+    EXPECT_TRUE(match_message(rules, B, 0x11).empty());
+    EXPECT_TRUE(match_message(rules, C, 0x11).empty());
+}
+
+
+TEST(RulesTest, MatchTime)
+{
+    rule_set rules;
+    rules.parse(
+        "on time 06:30 do set 0A0A0A on\n"
+        "on sunrise +15 do set 0A0A0A off\n"
+        "on sunset do set 0A0A0A on\n"
+        "on time 00:00 do set 0A0A0A off\n"
+        "on sunset -60 do set 0A0A0A 128\n");
+
+    int sunrise = 6 * 60 + 20;
+    int sunset = 19 * 60;
+
+    // The span excludes its start.
+    EXPECT_EQ(std::vector<size_t>({0}),
+              match_time(rules, 6 * 60 + 29, 6 * 60 + 30));
+    EXPECT_TRUE(match_time(rules, 6 * 60 + 30, 6 * 60 + 31).empty());
+
+    // Sun triggers need the sun times.
+    EXPECT_EQ(std::vector<size_t>({0}), match_time(rules, 6 * 60, 7 * 60));
+    EXPECT_EQ(std::vector<size_t>({0, 1}),
+              match_time(rules, 6 * 60, 7 * 60, sunrise, sunset));
+    EXPECT_EQ(std::vector<size_t>({2, 4}),
+              match_time(rules, 12 * 60, 20 * 60, sunrise, sunset));
+    EXPECT_EQ(std::vector<size_t>({4}),
+              match_time(rules, 17 * 60 + 59, 18 * 60, sunrise, sunset));
+
+    // Around midnight.
+    EXPECT_EQ(std::vector<size_t>({3}),
+              match_time(rules, 23 * 60 + 59, 0, sunrise, sunset));
+    EXPECT_EQ(std::vector<size_t>({0, 1, 2, 3, 4}),
+              match_time(rules, 12 * 60, 12 * 60 - 1, sunrise, sunset));
+    EXPECT_TRUE(match_time(rules, 12 * 60, 12 * 60, sunrise, sunset).empty());
+}
+
+
+TEST(RulesTest, Conditions)
+{
+    rule_set rules;
+    rules.parse(
+        "on time 10:00 if between 22:00 06:00 do set 0A0A0A on\n"
+        "on time 10:00 if dark do set 0A0A0A on\n"
+        "on time 10:00 if light and level 0A0A0A >= 100 do set 0A0A0A on\n");
+
+    context_t ctx;
+    ctx.minute = 23 * 60;
+
+    EXPECT_TRUE(rule_set::check_conditions(rules.rule(0), ctx));
+    EXPECT_FALSE(rule_set::check_conditions(rules.rule(1), ctx));
+
+    ctx.minute = 6 * 60;
+    EXPECT_FALSE(rule_set::check_conditions(rules.rule(0), ctx));
+
+    ctx.sunrise = 7 * 60;
+    ctx.sunset = 19 * 60;
+    EXPECT_TRUE(rule_set::check_conditions(rules.rule(1), ctx));
+
+    ctx.minute = 12 * 60;
+    EXPECT_FALSE(rule_set::check_conditions(rules.rule(1), ctx));
+
+    // The level is not known.
+    EXPECT_FALSE(rule_set::check_conditions(rules.rule(2), ctx));
+
+    int level = 100;
+    ctx.level = [&level](plm::insteon_address addr) {
+        return addr == A ? level : -1;
+    };
+    EXPECT_TRUE(rule_set::check_conditions(rules.rule(2), ctx));
+
+    level = 99;
+    EXPECT_FALSE(rule_set::check_conditions(rules.rule(2), ctx));
+}
+
+
+TEST(RulesTest, MessageFilter)
+{
+    // 0A0A0A sends ON to group 1, hops left in the flags, and the cleanup
+    // to the modem at 040506.
+    const std::string broadcast("\x50\x0a\x0a\x0a\x00\x00\x01\xcf\x11\x00",
+                                10);
+    const std::string repeat("\x50\x0a\x0a\x0a\x00\x00\x01\xcb\x11\x00",
+                             10);
+    const std::string cleanup("\x50\x0a\x0a\x0a\x04\x05\x06\x4f\x11\x01",
+                              10);
+    const std::string off("\x50\x0a\x0a\x0a\x00\x00\x01\xcf\x13\x00", 10);
+    const std::string ack("\x50\x0a\x0a\x0a\x04\x05\x06\x2f\x11\x00", 10);
+    const int64_t SEC = 1000000;
+
+    message_filter filter;
+    auto is_new = [&filter](const std::string &frame, int64_t now) {
+        return filter.is_new(plm::plm_frame(frame.data(), frame.size()),
+                             now);
+    };
+
+    EXPECT_FALSE(is_new(ack, 0));
+
+    EXPECT_TRUE(is_new(broadcast, 0));
+    EXPECT_FALSE(is_new(repeat, 100));
+    EXPECT_FALSE(is_new(cleanup, 200));
+    EXPECT_FALSE(is_new(cleanup, 300));
+    EXPECT_TRUE(is_new(off, 400));
+
+    // Pressed again and again within the time copies come in.
+    for(int i = 1; i <= 10; ++i) {
+        EXPECT_TRUE(is_new(broadcast, i * SEC)) << i;
+        EXPECT_FALSE(is_new(repeat, i * SEC + 100)) << i;
+        EXPECT_FALSE(is_new(cleanup, i * SEC + 200)) << i;
+    }
+
+    // The broadcast was missed, the cleanup counts.
+    EXPECT_TRUE(is_new(cleanup, 20 * SEC));
+    EXPECT_FALSE(is_new(cleanup, 20 * SEC + 100));
+    EXPECT_TRUE(is_new(cleanup, 30 * SEC));
+}
+
+
+}
@@ -0,0 +1,283 @@
+
+#include <set>
+
+#include "logger.h"
+#include "plm-command.h"
+#include "scene-engine.h"
+
+
+namespace plm {
+
+
+struct scene_engine::execution_t {
+    execution_t() : outstanding(0), priority(plm_endpoint::SCHEDULED) {}
+
+    done_t done;
+    std::vector<result_t> results;
+    size_t outstanding;  // devices without an outcome
+    plm_endpoint::priority_t priority;
+};
+
+
+scene_engine::scene_engine(plm_endpoint *plm)
+    : plm_(plm)
+{
+    plm_->add_listener(this);
+}
+
+
+scene_engine::~scene_engine()
+{
+    plm_->remove_listener(this);
+}
+
+
+void scene_engine::set_level(insteon_address device, int level)
+{
+    levels_[device] = level;
+}
+
+
+void scene_engine::forget_level(insteon_address device)
+{
+    levels_.erase(device);
+}
+
+
+int scene_engine::level(insteon_address device) const
+{
+    std::unordered_map<insteon_address, int>::const_iterator it =
+        levels_.find(device);
+    return it == levels_.end() ? -1 : it->second;
+}
+
+
+scene_engine::plan_t scene_engine::plan(
+    const std::vector<scene_target> &scene) const
+{
+    const link_db &db = plm_->link_database();
+    plan_t ret;
+
+    // The last target wins if a device is in the scene more than once.
+    std::unordered_map<insteon_address, uint8_t> targets;
+    std::vector<insteon_address> order;
+
+    for(size_t i = 0; i < scene.size(); ++i) {
+        if(targets.count(scene[i].device) == 0) {
+            order.push_back(scene[i].device);
+        }
+
+        targets[scene[i].device] = scene[i].level;
+    }
+
+    // The devices that need a change, and the groups that could do it.
+    std::unordered_set<insteon_address> remaining;
+    std::set<uint8_t> candidates;
+
+    for(size_t i = 0; i < order.size(); ++i) {
+        insteon_address device = order[i];
+        uint8_t target = targets[device];
+
+        if(level(device) == target) {
+            continue;
+        }
+
+        remaining.insert(device);
+
+        if(target == 0 || target == 0xff) {
+            const std::vector<uint8_t> &groups = db.groups(device);
+            candidates.insert(groups.begin(), groups.end());
+        }
+    }
+
+    // Take the group that covers the most devices still needing a change
+    // until no group saves a message.
+    for(;;) {
+        int best = -1;
+        size_t best_covered = 1;
+
+        std::set<uint8_t>::const_iterator it = candidates.begin();
+        for(; it != candidates.end(); ++it) {
+            const std::vector<insteon_address> &responders =
+                db.responders(*it);
+            size_t covered = 0;
+            bool usable = !responders.empty();
+
+            // All the responders go to the same level, in the scene.
+            for(size_t i = 0; usable && i < responders.size(); ++i) {
+                std::unordered_map<insteon_address, uint8_t>::const_iterator
+                    t = targets.find(responders[i]);
+                std::unordered_map<insteon_address, uint8_t>::const_iterator
+                    first = targets.find(responders[0]);
+
+                usable = t != targets.end() && t->second == first->second;
+                covered += remaining.count(responders[i]);
+            }
+
+            if(usable && covered > best_covered) {
+                best = *it;
+                best_covered = covered;
+            }
+        }
+
+        if(best == -1) {
+            break;
+        }
+
+        plan_t::group_t group;
+        group.group = best;
+        group.devices = db.responders(best);
+        group.level = targets[group.devices[0]];
+        ret.groups.push_back(group);
+
+        for(size_t i = 0; i < group.devices.size(); ++i) {
+            remaining.erase(group.devices[i]);
+            targets.erase(group.devices[i]);
+        }
+
+        candidates.erase(best);
+    }
+
+    // What is left in targets is not covered by a group.
+    for(size_t i = 0; i < order.size(); ++i) {
+        insteon_address device = order[i];
+
+        if(remaining.count(device)) {
+            ret.unicast.push_back(scene_target(device, targets[device]));
+        } else if(targets.count(device)) {
+            ret.unchanged.push_back(device);
+        }
+    }
+
+    return ret;
+}
+
+
+void scene_engine::execute(const std::vector<scene_target> &scene,
+                           const done_t &done,
+                           plm_endpoint::priority_t priority)
+{
+    plan_t p = plan(scene);
+    std::shared_ptr<execution_t> e(new execution_t);
+
+    e->done = done;
+    e->priority = priority;
+    e->outstanding = p.unicast.size();
+
+    for(size_t i = 0; i < p.groups.size(); ++i) {
+        e->outstanding += p.groups[i].devices.size();
+    }
+
+    for(size_t i = 0; i < p.unchanged.size(); ++i) {
+        result_t r = { p.unchanged[i], UNCHANGED, false };
+        e->results.push_back(r);
+    }
+
+    log_info("Scene of %zu devices: %zu group broadcasts, %zu commands, "
+             "%zu unchanged", scene.size(), p.groups.size(),
+             p.unicast.size(), p.unchanged.size());
+
+    if(e->outstanding == 0) {
+        done(e->results);
+        return;
+    }
+
+    for(size_t i = 0; i < p.groups.size(); ++i) {
+        send_group(e, p.groups[i]);
+    }
+
+    for(size_t i = 0; i < p.unicast.size(); ++i) {
+        send_unicast(e, p.unicast[i]);
+    }
+}
+
+
+void scene_engine::on_command(const plm_frame &frame)
+{
+    // 0x56 0x01 group device[3]
+    if(frame.command() == 0x56) {
+        cleanup_failures_.insert(
+            key(frame.data()[2],
+                insteon_address::from_bytes(frame.data() + 3)));
+        return;
+    }
+
+    // The device was changed by hand, its level is not known any more.
+    if(frame.command() == 0x50 &&
+       frame.message_type() != plm_frame::DIRECT_ACK &&
+       frame.message_type() != plm_frame::DIRECT_NACK)
+    {
+        forget_level(frame.from());
+    }
+}
+
+
+void scene_engine::send_group(std::shared_ptr<execution_t> e,
+                              const plan_t::group_t &group)
+{
+    for(size_t i = 0; i < group.devices.size(); ++i) {
+        cleanup_failures_.erase(key(group.group, group.devices[i]));
+    }
+
+    plm_->send_command(
+        plm_command::send_all_link(group.group,
+                                   group.level ? 0x11 : 0x13,
+                                   group.level),
+        [this, e, group](plm_endpoint::response_t r) {
+            on_group_done(e, group, r);
+        },
+        e->priority);
+}
+
+
+void scene_engine::send_unicast(std::shared_ptr<execution_t> e,
+                                const scene_target &target)
+{
+    plm_->send_light_level(
+        target.device, target.level, false,
+        [this, e, target](plm_endpoint::response_t r) {
+            finish_device(e, target, r.is_ok(), false);
+        },
+        e->priority);
+}
+
+
+void scene_engine::on_group_done(std::shared_ptr<execution_t> e,
+                                 const plan_t::group_t &group,
+                                 plm_endpoint::response_t r)
+{
+    for(size_t i = 0; i < group.devices.size(); ++i) {
+        scene_target target(group.devices[i], group.level);
+        bool failed = cleanup_failures_.erase(key(group.group,
+                                                  target.device)) > 0;
+
+        if(r.is_ok() && !failed) {
+            finish_device(e, target, true, true);
+        } else {
+            send_unicast(e, target);
+        }
+    }
+}
+
+
+void scene_engine::finish_device(std::shared_ptr<execution_t> e,
+                                 const scene_target &target,
+                                 bool ok,
+                                 bool by_group)
+{
+    if(ok) {
+        set_level(target.device, target.level);
+    } else {
+        forget_level(target.device);
+    }
+
+    result_t r = { target.device, ok ? OK : FAILED, by_group };
+    e->results.push_back(r);
+
+    if(--e->outstanding == 0) {
+        e->done(e->results);
+    }
+}
+
+
+}
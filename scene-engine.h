@@ -0,0 +1,134 @@
+
+#ifndef SCENE_ENGINE_H_
+#define SCENE_ENGINE_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "insteon-address.h"
+#include "plm-connection.h"
+#include "plm-endpoint.h"
+
+
+namespace plm {
+
+
+// A device of a scene and the level (0-255) it should be set to.
+struct scene_target {
+    scene_target() : level(0) {}
+    scene_target(insteon_address d, uint8_t l) : device(d), level(l) {}
+
+    insteon_address device;
+    uint8_t level;
+};
+
+
+// Sets a number of devices to their levels with as few messages as it can.
+//
+// Devices already known to be at their level are left alone. The rest are
+// covered by group broadcasts (0x61) where the modem's link database has a
+// group whose responders are all in the scene with the same level, and by
+// a command per device otherwise. A group broadcast makes the responders go
+// to the level linked in them, so groups are only used to turn devices off
+// and fully on, which assumes they were linked at full on (the default when
+// linking with the set button). Responders that do not confirm a broadcast
+// get a command of their own.
+//
+// The known levels come from the results of the scenes and from set_level(),
+// e.g. with what the status poller finds out.
+class scene_engine : public plm_command_listener {
+public:
+    enum outcome_t {
+        UNCHANGED,  // known to be at the level already, nothing sent
+        OK,
+        FAILED
+    };
+
+    struct result_t {
+        insteon_address device;
+        outcome_t outcome;
+        bool by_group;  // set by a group broadcast
+    };
+
+    typedef std::function<void(const std::vector<result_t> &)> done_t;
+
+    struct plan_t {
+        struct group_t {
+            uint8_t group;
+            uint8_t level;
+            std::vector<insteon_address> devices;
+        };
+
+        std::vector<group_t> groups;
+        std::vector<scene_target> unicast;
+        std::vector<insteon_address> unchanged;
+
+        // Number of commands the plan sends.
+        size_t commands() const { return groups.size() + unicast.size(); }
+    };
+
+    // The engine listens on the endpoint until it is destroyed. Scenes may
+    // be in progress until the endpoint is stopped.
+    explicit scene_engine(plm_endpoint *plm);
+    ~scene_engine();
+
+    // The device state cache.
+    void set_level(insteon_address device, int level);
+    void forget_level(insteon_address device);
+
+    // The known level of the device, -1 if unknown.
+    int level(insteon_address device) const;
+
+    // Works out what to send for the scene.
+    plan_t plan(const std::vector<scene_target> &scene) const;
+
+    // Plans the scene and sends it. The callback gets the outcome of every
+    // device of the scene once all the commands are done. Scenes can run
+    // at the same time, the endpoint sends their commands in turn.
+    void execute(const std::vector<scene_target> &scene,
+                 const done_t &done,
+                 plm_endpoint::priority_t priority =
+                     plm_endpoint::SCHEDULED);
+
+    virtual void on_command(const plm_frame &frame) override;
+
+private:
+    scene_engine(const scene_engine &);
+    scene_engine &operator= (const scene_engine &);
+
+    struct execution_t;
+
+    void send_group(std::shared_ptr<execution_t> e,
+                    const plan_t::group_t &group);
+    void send_unicast(std::shared_ptr<execution_t> e,
+                      const scene_target &target);
+    void on_group_done(std::shared_ptr<execution_t> e,
+                       const plan_t::group_t &group,
+                       plm_endpoint::response_t r);
+
+    // Records the outcome, completes the execution once all are in.
+    void finish_device(std::shared_ptr<execution_t> e,
+                       const scene_target &target, bool ok, bool by_group);
+
+    static uint32_t key(uint8_t group, insteon_address device) {
+        return (uint32_t(group) << 24) | device.value();
+    }
+
+private:
+    plm_endpoint *plm_;  // not owned
+    std::unordered_map<insteon_address, int> levels_;
+
+    // Responders that did not confirm a broadcast, by key(), until the
+    // broadcast is done.
+    std::unordered_set<uint32_t> cleanup_failures_;
+};
+
+
+}
+
+#endif
@@ -0,0 +1,210 @@
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "logger.h"
+#include "mock-alarm-manager.h"
+#include "mock-event-manager.h"
+#include "mock-executor.h"
+#include "mock-plm-fd.h"
+#include "scene-engine.h"
+
+#include <gtest/gtest.h>
+
+
+namespace plm {
+
+
+static const insteon_address A(0x0a0a0a);
+static const insteon_address B(0x0b0b0b);
+static const insteon_address C(0x0c0c0c);
+static const insteon_address D(0x0d0d0d);
+static const insteon_address E(0x0e0e0e);
+static const insteon_address F(0x0f0f0f);
+static const insteon_address G(0x101010);
+
+
+class SceneEngineTest : public testing::Test {
+public:
+    virtual void SetUp() {
+        disable_logging();
+
+        executor_.reset(new mock_executor);
+        event_manager_.reset(new mock_event_manager);
+        fd_.reset(new mock_plm_fd);
+        alarm_manager_.reset(new mock_alarm_manager);
+        endpoint_.reset(new plm_endpoint(
+            fd_.get(),
+            alarm_manager_.get(),
+            event_manager_.get(),
+            executor_.get()));
+        engine_.reset(new scene_engine(endpoint_.get()));
+
+        // Group 1 is A, B and C, group 2 is D and E, group 3 only F.
+        std::vector<link_record> records;
+        add_responder(1, A, &records);
+        add_responder(1, B, &records);
+        add_responder(1, C, &records);
+        add_responder(2, D, &records);
+        add_responder(2, E, &records);
+        add_responder(3, F, &records);
+        endpoint_->link_database().assign(records);
+
+        endpoint_->start();
+    }
+
+    virtual void TearDown() {
+        endpoint_->stop();
+        engine_.reset();
+    }
+
+    static void add_responder(uint8_t group, insteon_address device,
+                              std::vector<link_record> *records) {
+        link_record r;
+        r.flags = link_record::IN_USE | link_record::CONTROLLER;
+        r.group = group;
+        r.device = device;
+        records->push_back(r);
+    }
+
+    void loop_once() {
+        event_manager_->send_signal();
+        executor_->run_until_empty();
+    }
+
+    // Lets the modem and the device acknowledge the standard device command
+    // last written, checks that it was the expected one.
+    void ack_command(insteon_address device, char cmd1, char cmd2) {
+        std::string cmd("\x02\x62\x00\x00\x00\x0f", 6);
+        device.to_bytes(&cmd[2]);
+        cmd += std::string(1, cmd1) + cmd2;
+
+        std::string written = fd_->get_write_buf();
+        ASSERT_LE(cmd.size(), written.size());
+        EXPECT_EQ(cmd, written.substr(written.size() - cmd.size()));
+
+        std::string ack("\x02\x50\x00\x00\x00\x01\x02\x03\x2b", 9);
+        device.to_bytes(&ack[2]);
+        fd_->set_read_buf(cmd + '\x06' + ack + cmd1 + cmd2);
+        loop_once();
+    }
+
+    std::unique_ptr<mock_executor> executor_;
+    std::unique_ptr<mock_event_manager> event_manager_;
+    std::unique_ptr<mock_plm_fd> fd_;
+    std::unique_ptr<mock_alarm_manager> alarm_manager_;
+    std::unique_ptr<plm_endpoint> endpoint_;
+    std::unique_ptr<scene_engine> engine_;
+};
+
+
+TEST_F(SceneEngineTest, Plan) {
+    std::vector<scene_target> scene;
+    scene.push_back(scene_target(A, 0));
+    scene.push_back(scene_target(B, 0));
+    scene.push_back(scene_target(C, 0));
+    scene.push_back(scene_target(D, 0xff));
+    scene.push_back(scene_target(E, 0x80));  // not the level of group 2
+    scene.push_back(scene_target(F, 0));  // a group of one saves nothing
+    scene.push_back(scene_target(G, 0x40));  // in no group
+
+    engine_->set_level(C, 0);
+    scene_engine::plan_t plan = engine_->plan(scene);
+
+    ASSERT_EQ(1u, plan.groups.size());
+    EXPECT_EQ(1, plan.groups[0].group);
+    EXPECT_EQ(0, plan.groups[0].level);
+    EXPECT_EQ(3u, plan.groups[0].devices.size());
+
+    ASSERT_EQ(4u, plan.unicast.size());
+    EXPECT_EQ(D, plan.unicast[0].device);
+    EXPECT_EQ(0xff, plan.unicast[0].level);
+    EXPECT_EQ(G, plan.unicast[3].device);
+    EXPECT_TRUE(plan.unchanged.empty());
+    EXPECT_EQ(5u, plan.commands());
+
+    // A group is not worth it for a single device that needs a change.
+    engine_->set_level(A, 0);
+    engine_->set_level(F, 0);
+    engine_->set_level(G, 0x40);
+    plan = engine_->plan(scene);
+
+    EXPECT_TRUE(plan.groups.empty());
+    ASSERT_EQ(3u, plan.unicast.size());
+    EXPECT_EQ(B, plan.unicast[0].device);
+    EXPECT_EQ(4u, plan.unchanged.size());
+}
+
+
+TEST_F(SceneEngineTest, ExecuteWithFallback) {
+    std::vector<scene_target> scene;
+    scene.push_back(scene_target(A, 0));
+    scene.push_back(scene_target(B, 0));
+    scene.push_back(scene_target(C, 0));
+    scene.push_back(scene_target(G, 0x40));
+
+    std::vector<scene_engine::result_t> results;
+    bool done = false;
+    engine_->execute(scene,
+        [&](const std::vector<scene_engine::result_t> &r) {
+            results = r;
+            done = true;
+        });
+    loop_once();
+
+    EXPECT_EQ(std::string("\x02\x61\x01\x13\x00", 5), fd_->get_write_buf());
+
+    // B does not confirm the broadcast.
+    std::string b("\x02\x56\x01\x01\x00\x00\x00", 7);
+    B.to_bytes(&b[4]);
+    fd_->set_read_buf(std::string("\x02\x61\x01\x13\x00\x06", 6) + b +
+                      "\x02\x58\x15");
+    loop_once();
+
+    ack_command(G, 0x11, 0x40);
+    EXPECT_FALSE(done);
+    ack_command(B, 0x13, 0x00);
+    ASSERT_TRUE(done);
+
+    ASSERT_EQ(4u, results.size());
+    int by_group = 0;
+
+    for(size_t i = 0; i < results.size(); ++i) {
+        EXPECT_EQ(scene_engine::OK, results[i].outcome);
+        by_group += results[i].by_group;
+        EXPECT_TRUE(results[i].device != B || !results[i].by_group);
+    }
+
+    EXPECT_EQ(2, by_group);
+    EXPECT_EQ(0, engine_->level(B));
+    EXPECT_EQ(0x40, engine_->level(G));
+
+    // Everything is at its level now.
+    done = false;
+    engine_->execute(scene,
+        [&](const std::vector<scene_engine::result_t> &r) {
+            results = r;
+            done = true;
+        });
+    EXPECT_TRUE(done);
+    EXPECT_EQ(4u, results.size());
+    EXPECT_EQ(scene_engine::UNCHANGED, results[0].outcome);
+}
+
+
+TEST_F(SceneEngineTest, ManualChangeForgetsLevel) {
+    engine_->set_level(A, 0xff);
+
+    // A's paddle was pressed.
+    std::string msg("\x02\x50\x00\x00\x00\x00\x00\x01\xcb\x13\x00", 11);
+    A.to_bytes(&msg[2]);
+    fd_->set_read_buf(msg);
+    loop_once();
+
+    EXPECT_EQ(-1, engine_->level(A));
+}
+
+
+}
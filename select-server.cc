@@ -2,31 +2,30 @@
 #include <stdio.h>  // for debugging
 
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <functional>
 #include <list>
+#include <typeinfo>
 
+#include <sys/eventfd.h>
 #include <sys/select.h>
 #include <sys/time.h>
 
+#include "buffered-connection.h"
+#include "logger.h"
+#include "metrics.h"
 #include "select-server.h"
+#include "time-util.h"
 
 
 namespace net {
 
 namespace {
 
-// TODO move out to time utils
-double time_now()
-{
-    struct timeval tv;
-    gettimeofday(&tv, 0);
-    return double(tv.tv_sec) + double(tv.tv_usec) / 1000000;
-}
-
-
 void fill_timeval(double secs, struct timeval *tv)
 {
     tv->tv_sec = secs;
@@ -38,8 +37,8 @@ void fill_timeval(double secs, struct timeval *tv)
 
 class select_server::alarm_impl : public alarm {
 public:
-    explicit alarm_impl(const std::function<void()> &callback)
-        : callback_(callback), fired_(false)
+    alarm_impl(const std::function<void()> &callback, const void *site)
+        : callback_(callback), site_(site), fired_(false)
     {
     }
 
@@ -54,11 +53,20 @@ public:
         }
     }
 
+    bool is_pending() const {
+        return !fired_;
+    }
+
+    const void *site() const {
+        return site_;
+    }
+
 private:
     alarm_impl(const alarm_impl &);
     alarm_impl& operator= (const alarm_impl &);
 
     std::function<void()> callback_;
+    const void *site_;
     bool fired_;
 };
 
@@ -87,15 +95,77 @@ bool select_server::alarm_entry::operator> (const alarm_entry &rh) const
 }
 
 
+// Wraps an eventfd that other threads signal to interrupt select().
+class select_server::wakeup_connection : public connection {
+public:
+    // Throws fd_exception if the eventfd cannot be created.
+    wakeup_connection() : fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+        if(fd_ == -1) {
+            throw fd_exception(errno);
+        }
+    }
+
+    ~wakeup_connection() {
+        close(fd_);
+    }
+
+    virtual int get_fd() override {
+        return fd_;
+    }
+
+    // Resets the eventfd counter, the posted callbacks are picked up later
+    // in the loop iteration.
+    virtual void on_read() override {
+        uint64_t counter;
+        while(::read(fd_, &counter, sizeof(counter)) == -1 && errno == EINTR) {
+        }
+    }
+
+    // Async-signal-safe.
+    void signal() {
+        uint64_t one = 1;
+        while(::write(fd_, &one, sizeof(one)) == -1 && errno == EINTR) {
+        }
+    }
+
+private:
+    wakeup_connection(const wakeup_connection &);
+    wakeup_connection& operator= (const wakeup_connection &);
+
+    int fd_;
+};
+
+
 select_server::select_server()
+    : remote_callbacks_(0),
+      loop_thread_(std::this_thread::get_id()),
+      stop_requested_(false),
+      iteration_time_(metrics::registry::global().get_histogram(
+          "shd_loop_iteration_seconds",
+          "Time spent in one event loop iteration, excluding the wait.",
+          "", 1e-6)),
+      iterations_(metrics::registry::global().get_counter(
+          "shd_loop_iterations_total",
+          "Number of event loop iterations.")),
+      dump_requested_(false),
+      wakeup_(new wakeup_connection)
 {
+    register_for_read(wakeup_.get());
 }
 
 
 select_server::~select_server()
 {
+    deregister_connection(wakeup_.get());
     execute_death_row();
 
+    remote_callback *head = remote_callbacks_.exchange(0);
+    while(head) {
+        remote_callback *next = head->next;
+        delete head;
+        head = next;
+    }
+
     while(!alarm_queue_.empty()) {
         delete alarm_queue_.top().alarm();
         alarm_queue_.pop();
@@ -136,25 +206,81 @@ void select_server::deregister_connection(connection *conn)
 
 void select_server::run_later(const std::function<void()> &callback)
 {
-    callbacks_.push_back(callback);
+    const void *site = __builtin_return_address(0);
+
+    if(std::this_thread::get_id() != loop_thread_.load()) {
+        post_remote(callback, site);
+        return;
+    }
+
+    callbacks_.push_back(pending_callback(callback, site));
+}
+
+
+void select_server::stop()
+{
+    run_later([this]() { stop_requested_ = true; });
 }
 
 
 alarm *select_server::schedule_alarm(
     const std::function<void()> &callback, int msecs)
 {
-    alarm_impl *ret = new alarm_impl(callback);
+    alarm_impl *ret = new alarm_impl(callback, __builtin_return_address(0));
     alarm_queue_.push(alarm_entry(time_now() + double(msecs) / 1000, ret));
     return ret;
 }
 
 
+void select_server::enable_profiling(int slow_msecs)
+{
+    profiler_.reset(new loop_profiler(slow_msecs * 1000));
+}
+
+
+void select_server::request_profile_dump()
+{
+    dump_requested_ = true;
+    wakeup_->signal();
+}
+
+
+template<class F>
+void select_server::run_profiled(loop_profiler::phase_t phase,
+                                 const void *site,
+                                 const F &f)
+{
+    if(!profiler_) {
+        f();
+        return;
+    }
+
+    int64_t start = monotonic_usecs();
+    f();
+    profiler_->record_callback(phase, site, monotonic_usecs() - start);
+}
+
+
+int64_t select_server::end_phase(loop_profiler::phase_t phase, int64_t since)
+{
+    if(!profiler_) {
+        return 0;
+    }
+
+    int64_t now = monotonic_usecs();
+    profiler_->record_phase(phase, now - since);
+    return now;
+}
+
+
 void select_server::loop()
 {
     fd_set read_set;
     fd_set write_set;
 
-    while(true) {
+    loop_thread_ = std::this_thread::get_id();
+
+    while(!stop_requested_) {
         struct timeval timeout;
         int max_fd = init_fd_set(read_registrations_, &read_set);
 
@@ -176,6 +302,13 @@ void select_server::loop()
             fill_timeval(tm, &timeout);
         }
 
+        // Do not block if there is work posted before the loop was entered or
+        // left over by the previous iteration.
+        if(!callbacks_.empty()) {
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 0;
+        }
+
         int ret = select(max_fd + 1, &read_set, &write_set, 0, &timeout);
 
         if(ret == -1 && errno == EINTR) {
@@ -189,6 +322,8 @@ void select_server::loop()
             continue;
         }
 
+        int64_t start = monotonic_usecs();
+
         if(ret > 0) {
             process_events(read_registrations_,
                            &read_set,
@@ -198,10 +333,23 @@ void select_server::loop()
                            &connection::on_write);
         }
 
+        int64_t phase_start = end_phase(loop_profiler::EVENTS, start);
         maybe_fire_alarms();
+        phase_start = end_phase(loop_profiler::ALARMS, phase_start);
         run_all_callbacks();
+        phase_start = end_phase(loop_profiler::CALLBACKS, phase_start);
         execute_death_row();
+        end_phase(loop_profiler::DEATH_ROW, phase_start);
+
+        iteration_time_->record(monotonic_usecs() - start);
+        iterations_->inc();
+
+        if(dump_requested_.exchange(false)) {
+            dump_profile();
+        }
     }
+
+    stop_requested_ = false;
 }
 
 
@@ -230,13 +378,13 @@ void select_server::process_events(
 {
     // Need to copy the connection set because the original set can be modified
     // during the event processing invalidating the iterators.
-    connection_set cs(conns);
-    connection_set::iterator it = cs.begin();
+    event_connections_.assign(conns.begin(), conns.end());
 
-    for(; it != cs.end(); ++it) {
-        int fd = (*it)->get_fd();
-        if(FD_ISSET(fd, set)) {
-            ((*it)->*event)();
+    for(size_t i = 0; i < event_connections_.size(); ++i) {
+        connection *conn = event_connections_[i];
+        if(FD_ISSET(conn->get_fd(), set)) {
+            run_profiled(loop_profiler::EVENTS, &typeid(*conn),
+                         [conn, event]() { (conn->*event)(); });
         }
     }
 }
@@ -256,15 +404,81 @@ void select_server::execute_death_row()
 
 void select_server::run_all_callbacks()
 {
+    run_remote_callbacks();
+
     // TODO this loop may cause starvation of event processing if running
     // callbacks constantly add new callabacks. Or is it a feature?
-    std::list<std::function<void()>>::iterator it = callbacks_.begin();
+    while(!callbacks_.empty()) {
+        running_callbacks_.swap(callbacks_);
+
+        for(size_t i = 0; i < running_callbacks_.size(); ++i) {
+            const pending_callback &c = running_callbacks_[i];
+            run_profiled(loop_profiler::CALLBACKS, c.site, c.callback);
+        }
+
+        running_callbacks_.clear();
+    }
+}
+
 
-    for(; it != callbacks_.end(); ++it) {
-        (*it)();
+void select_server::dump_profile()
+{
+    if(!profiler_) {
+        log_info("Loop profiling is not enabled");
+        return;
     }
 
-    callbacks_.clear();
+    std::vector<std::string> lines = profiler_->report(20);
+
+    for(size_t i = 0; i < lines.size(); ++i) {
+        log_info("Loop profile: %s", lines[i]);
+    }
+}
+
+
+void select_server::post_remote(const std::function<void()> &callback,
+                                const void *site)
+{
+    remote_callback *node = new remote_callback;
+    node->callback = callback;
+    node->site = site;
+    node->next = remote_callbacks_.load(std::memory_order_relaxed);
+
+    while(!remote_callbacks_.compare_exchange_weak(
+              node->next, node,
+              std::memory_order_release,
+              std::memory_order_relaxed))
+    {
+    }
+
+    // Only the producer that found the queue empty needs to wake up the loop,
+    // the others will be picked up by the same drain.
+    if(node->next == 0) {
+        wakeup_->signal();
+    }
+}
+
+
+void select_server::run_remote_callbacks()
+{
+    remote_callback *head =
+        remote_callbacks_.exchange(0, std::memory_order_acquire);
+
+    // Reverse the stack to run the callbacks in the posting order.
+    remote_callback *fifo = 0;
+    while(head) {
+        remote_callback *next = head->next;
+        head->next = fifo;
+        fifo = head;
+        head = next;
+    }
+
+    while(fifo) {
+        remote_callback *next = fifo->next;
+        run_profiled(loop_profiler::CALLBACKS, fifo->site, fifo->callback);
+        delete fifo;
+        fifo = next;
+    }
 }
 
 
@@ -274,7 +488,12 @@ void select_server::maybe_fire_alarms()
 
     while(!alarm_queue_.empty() && alarm_queue_.top().time_to_run() < now) {
         alarm_impl *alarm = alarm_queue_.top().alarm();
-        alarm->fire();
+
+        if(alarm->is_pending()) {
+            run_profiled(loop_profiler::ALARMS, alarm->site(),
+                         [alarm]() { alarm->fire(); });
+        }
+
         delete alarm;
         alarm_queue_.pop();
     }
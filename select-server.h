@@ -2,10 +2,13 @@
 #ifndef SELECT_SERVER_H_
 #define SELECT_SERVER_H_
 
+#include <atomic>
 #include <functional>
 #include <list>
+#include <memory>
 #include <queue>
 #include <set>
+#include <thread>
 #include <vector>
 
 #include <sys/select.h>
@@ -13,6 +16,13 @@
 #include "alarm-manager.h"
 #include "event-manager.h"
 #include "executor.h"
+#include "loop-profiler.h"
+
+
+namespace metrics {
+class counter;
+class histogram;
+}
 
 
 namespace net {
@@ -34,6 +44,10 @@ public:
     // Deregister from receiving all events in one call.
     virtual void deregister_connection(connection *conn);
 
+    // Unlike the rest of the select server interface run_later() can be
+    // called from any thread. Callbacks posted from threads other than the
+    // loop thread are passed through a lock-free queue and wake up the loop if
+    // it is blocked in select().
     void run_later(const std::function<void()> &callback) override;
 
     virtual alarm *schedule_alarm(
@@ -41,7 +55,18 @@ public:
 
     void loop();
 
-    // TODO how to exit?
+    // Makes loop() return after the current iteration. Can be called from any
+    // thread.
+    void stop();
+
+    // Starts timing the loop phases and every callback (see loop_profiler).
+    // Callbacks and event handlers running longer than slow_msecs are
+    // logged. Must be called from the loop thread.
+    void enable_profiling(int slow_msecs);
+
+    // Makes the loop write the profile collected so far to the log.
+    // Async-signal-safe, meant to be called from a signal handler.
+    void request_profile_dump();
 
     // Registers the given object for deletion. The deletion will happen at
     // some time during loop execution.
@@ -60,7 +85,7 @@ private:
 
     // For all connection in the 'conns' set that are indicated as being
     // triggered in the fd_set call the given event function.
-    static void process_events(
+    void process_events(
         const connection_set &conns,
         fd_set *set,
         void (connection::*event)());
@@ -71,13 +96,80 @@ private:
     void run_all_callbacks();
     void maybe_fire_alarms();
 
+    // Runs the function, timing it if profiling is enabled.
+    template<class F>
+    void run_profiled(loop_profiler::phase_t phase, const void *site,
+                      const F &f);
+
+    // Records the time since 'since' for the phase if profiling is enabled
+    // and returns the current time.
+    int64_t end_phase(loop_profiler::phase_t phase, int64_t since);
+
+    void dump_profile();
+
+    // Pushes the callback onto the cross-thread queue and wakes up the loop
+    // if the queue was empty.
+    void post_remote(const std::function<void()> &callback, const void *site);
+
+    // Takes all callbacks posted from other threads and runs them in the
+    // order they were posted.
+    void run_remote_callbacks();
+
 private:
     // Connections on these lists are not owned by the select server.
     connection_set read_registrations_;
     connection_set write_registrations_;
 
-    // Callbacks for delayed execution.
-    std::list<std::function<void()>> callbacks_;
+    // A callback with the address of the code that posted it, for the
+    // profiler.
+    struct pending_callback {
+        pending_callback(const std::function<void()> &c, const void *s)
+            : callback(c), site(s)
+        {
+        }
+
+        std::function<void()> callback;
+        const void *site;
+    };
+
+    // Callbacks for delayed execution, only touched by the loop thread. The
+    // callbacks being run are swapped into running_callbacks_, the vectors
+    // keep their capacity so that posting a callback does not allocate.
+    std::vector<pending_callback> callbacks_;
+    std::vector<pending_callback> running_callbacks_;
+
+    // Copy of the registrations that process_events() iterates over, kept
+    // around for its capacity.
+    std::vector<connection *> event_connections_;
+
+    // Callbacks posted from other threads. This is a lock-free stack (newest
+    // first) that the loop thread takes over as a whole.
+    struct remote_callback {
+        std::function<void()> callback;
+        const void *site;
+        remote_callback *next;
+    };
+
+    std::atomic<remote_callback *> remote_callbacks_;
+
+    // The thread that runs (or is going to run) loop().
+    std::atomic<std::thread::id> loop_thread_;
+
+    bool stop_requested_;
+
+    // Time spent processing events, alarms and callbacks in one iteration,
+    // i.e. everything but waiting in select().
+    metrics::histogram *iteration_time_;
+    metrics::counter *iterations_;
+
+    // Null unless profiling is enabled.
+    std::unique_ptr<loop_profiler> profiler_;
+    std::atomic<bool> dump_requested_;
+
+    // An eventfd registered for read, signalled when a callback is posted
+    // from another thread.
+    class wakeup_connection;
+    std::unique_ptr<wakeup_connection> wakeup_;
 
     struct placeholder {
         placeholder() {}
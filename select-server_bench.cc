@@ -0,0 +1,148 @@
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+#include "bench-util.h"
+#include "buffered-connection.h"
+#include "logger.h"
+#include "select-server.h"
+
+
+namespace net {
+
+
+// One side of a socket pair, the other side is written to by the benchmark.
+class socket_fd : public fd_interface {
+public:
+    explicit socket_fd(int fd) : fd_(fd) {}
+
+    ~socket_fd() {
+        ::close(fd_);
+    }
+
+    void open() override {}
+    void close() override {}
+    int get_fd() override { return fd_; }
+
+    int read(void *buf, int count) override {
+        return ::read(fd_, buf, count);
+    }
+
+    int write(const void *buf, int count) override {
+        return ::write(fd_, buf, count);
+    }
+
+private:
+    int fd_;
+};
+
+
+// Alarms firing in the same iteration, every other one stopped before it
+// fires like a command timeout cancelled by the response.
+static void BM_SelectServerAlarmChurn(benchmark::State &state)
+{
+    select_server ss;
+    int fired = 0;
+    bench::alloc_counter allocs(state);
+
+    for(auto _ : state) {
+        for(int i = 0; i < state.range(0); ++i) {
+            alarm *a = ss.schedule_alarm([&fired]() { ++fired; }, 0);
+
+            if(i % 2) {
+                a->stop();
+            }
+        }
+
+        ss.schedule_alarm([&ss]() { ss.stop(); }, 0);
+        ss.loop();
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations()) * state.range(0));
+}
+
+BENCHMARK(BM_SelectServerAlarmChurn)->Arg(1)->Arg(64)->Arg(1024);
+
+
+static void BM_SelectServerRunLater(benchmark::State &state)
+{
+    select_server ss;
+    int ran = 0;
+    bench::alloc_counter allocs(state);
+
+    for(auto _ : state) {
+        for(int i = 0; i < state.range(0); ++i) {
+            ss.run_later([&ran]() { ++ran; });
+        }
+
+        ss.run_later([&ss]() { ss.stop(); });
+        ss.loop();
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations()) * state.range(0));
+}
+
+BENCHMARK(BM_SelectServerRunLater)->Arg(1)->Arg(64)->Arg(1024);
+
+
+// One byte arriving on each of many connections, i.e. the cost of the
+// select() based dispatch as the number of registered fds grows.
+static void BM_SelectServerManyConnections(benchmark::State &state)
+{
+    disable_logging();
+
+    const int count = state.range(0);
+    select_server ss;
+    std::vector<int> peers;
+    std::vector<std::unique_ptr<socket_fd>> fds;
+    std::vector<std::unique_ptr<buffered_connection>> conns;
+    std::vector<char> bufs(count);
+
+    for(int i = 0; i < count; ++i) {
+        int sv[2];
+
+        if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == -1) {
+            state.SkipWithError("socketpair() failed");
+            return;
+        }
+
+        peers.push_back(sv[1]);
+        fds.emplace_back(new socket_fd(sv[0]));
+        conns.emplace_back(new buffered_connection(fds.back().get(), &ss, &ss));
+        conns.back()->start();
+    }
+
+    int received = 0;
+    bench::alloc_counter allocs(state);
+
+    for(auto _ : state) {
+        received = 0;
+
+        for(int i = 0; i < count; ++i) {
+            conns[i]->read(&bufs[i], 1, [&]() {
+                if(++received == count) {
+                    ss.stop();
+                }
+            });
+
+            ::write(peers[i], "x", 1);
+        }
+
+        ss.loop();
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations()) * count);
+
+    for(int i = 0; i < count; ++i) {
+        conns[i]->stop();
+        ::close(peers[i]);
+    }
+}
+
+BENCHMARK(BM_SelectServerManyConnections)->Arg(1)->Arg(16)->Arg(256);
+
+
+}
@@ -0,0 +1,170 @@
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "logger.h"
+#include "select-server.h"
+
+#include <gtest/gtest.h>
+
+
+namespace net {
+
+
+TEST(SelectServerTest, RunLaterOnLoopThread)
+{
+    select_server ss;
+    std::vector<int> order;
+
+    ss.run_later([&]() { order.push_back(1); });
+    ss.run_later([&]() { order.push_back(2); });
+    ss.run_later([&]() { ss.stop(); });
+    ss.loop();
+
+    ASSERT_EQ(2u, order.size());
+    EXPECT_EQ(1, order[0]);
+    EXPECT_EQ(2, order[1]);
+}
+
+
+TEST(SelectServerTest, RunLaterFromOtherThread)
+{
+    select_server ss;
+    bool ran = false;
+    std::thread::id ran_on;
+
+    // Without a wakeup the loop would block in select() for a long time.
+    std::thread t([&]() {
+        ss.run_later([&]() {
+            ran = true;
+            ran_on = std::this_thread::get_id();
+            ss.stop();
+        });
+    });
+
+    ss.loop();
+    t.join();
+
+    EXPECT_TRUE(ran);
+    EXPECT_EQ(std::this_thread::get_id(), ran_on);
+}
+
+
+TEST(SelectServerTest, ManyProducers)
+{
+    const int num_threads = 4;
+    const int posts_per_thread = 1000;
+
+    select_server ss;
+    int count = 0;
+    std::vector<int> last_seen(num_threads, -1);
+    bool in_order = true;
+
+    std::vector<std::thread> threads;
+    for(int i = 0; i < num_threads; ++i) {
+        threads.push_back(std::thread([&, i]() {
+            for(int j = 0; j < posts_per_thread; ++j) {
+                ss.run_later([&, i, j]() {
+                    // Callbacks from the same producer keep their order.
+                    in_order = in_order && last_seen[i] == j - 1;
+                    last_seen[i] = j;
+
+                    if(++count == num_threads * posts_per_thread) {
+                        ss.stop();
+                    }
+                });
+            }
+        }));
+    }
+
+    ss.loop();
+
+    for(size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+
+    EXPECT_EQ(num_threads * posts_per_thread, count);
+    EXPECT_TRUE(in_order);
+}
+
+
+TEST(SelectServerTest, StopFromOtherThreadWhileWaitingForAlarm)
+{
+    select_server ss;
+    bool fired = false;
+
+    ss.schedule_alarm([&]() { fired = true; }, 100000);
+
+    std::thread t([&]() { ss.stop(); });
+    ss.loop();
+    t.join();
+
+    EXPECT_FALSE(fired);
+}
+
+
+std::mutex log_mutex;
+std::vector<std::string> log_lines;
+
+
+void capture_log(int, const char *message)
+{
+    std::lock_guard<std::mutex> lock(log_mutex);
+    log_lines.push_back(message);
+}
+
+
+bool logged(const std::string &prefix)
+{
+    std::lock_guard<std::mutex> lock(log_mutex);
+
+    for(size_t i = 0; i < log_lines.size(); ++i) {
+        if(log_lines[i].compare(0, prefix.size(), prefix) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+TEST(SelectServerTest, ProfilerReportsSlowCallbacks)
+{
+    set_log_output(capture_log);
+
+    select_server ss;
+    ss.enable_profiling(5);
+
+    ss.run_later([]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    });
+    ss.run_later([]() {});
+    ss.run_later([&]() {
+        ss.request_profile_dump();
+        ss.stop();
+    });
+    ss.loop();
+
+    flush_logging();
+    set_log_output(0);
+
+    // Only the sleeping callback is slow.
+    EXPECT_TRUE(logged("Slow callbacks callback "));
+    EXPECT_TRUE(logged("Loop profile: phase callbacks: 1 runs"));
+    EXPECT_TRUE(logged("Loop profile: callbacks "));
+
+    std::lock_guard<std::mutex> lock(log_mutex);
+    int slow = 0;
+
+    for(size_t i = 0; i < log_lines.size(); ++i) {
+        slow += log_lines[i].compare(0, 5, "Slow ") == 0;
+    }
+
+    EXPECT_EQ(1, slow);
+}
+
+
+}
@@ -0,0 +1,331 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "alarm-manager.h"
+#include "logger.h"
+#include "serial-trace.h"
+#include "time-util.h"
+
+
+namespace net {
+
+namespace {
+
+const char TRACE_MAGIC[8] = { 'S', 'H', 'D', 'T', 'R', 'C', '1', '\n' };
+
+// Direction, timestamp and length.
+const size_t ENTRY_HEADER_SIZE = 1 + 8 + 4;
+
+const size_t MIN_TRACE_SIZE = 4096;
+
+}
+
+
+serial_trace::serial_trace(const std::string &path, size_t max_size)
+    : path_(path),
+      max_size_(std::max(max_size, MIN_TRACE_SIZE)),
+      fd_(-1),
+      map_(0),
+      used_(0)
+{
+    open_file();
+}
+
+
+serial_trace::~serial_trace()
+{
+    close_file();
+}
+
+
+void serial_trace::record(direction_t direction, const char *data, int len)
+{
+    if(!map_) {
+        return;  // failed to rotate
+    }
+
+    if(used_ + ENTRY_HEADER_SIZE + len > max_size_) {
+        rotate();
+
+        if(!map_) {
+            return;
+        }
+
+        // Only a part of a huge chunk fits into an empty file.
+        len = std::min(size_t(len), max_size_ - used_ - ENTRY_HEADER_SIZE);
+    }
+
+    int64_t usecs = monotonic_usecs();
+    uint32_t len32 = len;
+    char *p = map_ + used_;
+
+    // The direction goes in last so that a reader never sees a partial entry.
+    memcpy(p + 1, &usecs, sizeof(usecs));
+    memcpy(p + 9, &len32, sizeof(len32));
+    memcpy(p + ENTRY_HEADER_SIZE, data, len);
+    __atomic_store_n(p, char(direction), __ATOMIC_RELEASE);
+
+    used_ += ENTRY_HEADER_SIZE + len;
+}
+
+
+bool serial_trace::parse(const std::string &content, std::vector<entry> *out)
+{
+    if(content.size() < sizeof(TRACE_MAGIC) ||
+       memcmp(content.data(), TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0)
+    {
+        return false;
+    }
+
+    size_t pos = sizeof(TRACE_MAGIC);
+
+    while(pos < content.size() && content[pos] != 0) {
+        if(content.size() - pos < ENTRY_HEADER_SIZE) {
+            return false;
+        }
+
+        entry e;
+        uint32_t len;
+
+        e.direction = direction_t(content[pos]);
+        memcpy(&e.usecs, content.data() + pos + 1, sizeof(e.usecs));
+        memcpy(&len, content.data() + pos + 9, sizeof(len));
+        pos += ENTRY_HEADER_SIZE;
+
+        if(content.size() - pos < len) {
+            return false;
+        }
+
+        e.data.assign(content, pos, len);
+        pos += len;
+        out->push_back(e);
+    }
+
+    return true;
+}
+
+
+void serial_trace::open_file()
+{
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if(fd_ == -1) {
+        throw fd_exception(errno);
+    }
+
+    void *map = MAP_FAILED;
+
+    if(ftruncate(fd_, max_size_) == 0) {
+        map = mmap(0, max_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    }
+
+    if(map == MAP_FAILED) {
+        int error = errno;
+        ::close(fd_);
+        fd_ = -1;
+        throw fd_exception(error);
+    }
+
+    map_ = static_cast<char *>(map);
+    memcpy(map_, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    used_ = sizeof(TRACE_MAGIC);
+}
+
+
+void serial_trace::close_file()
+{
+    if(map_) {
+        munmap(map_, max_size_);
+        map_ = 0;
+    }
+
+    if(fd_ != -1) {
+        // Drop the zero-filled tail.
+        if(ftruncate(fd_, used_) == -1) {
+            // The reader copes with the tail.
+        }
+
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+
+void serial_trace::rotate()
+{
+    close_file();
+    rename(path_.c_str(), (path_ + ".1").c_str());
+
+    try {
+        open_file();
+    } catch(fd_exception &ex) {
+        log_error("Cannot rotate serial trace '%s': %s", path_, ex.what());
+    }
+}
+
+
+replay_fd::replay_fd(const std::vector<serial_trace::entry> &entries,
+                     alarm_manager *am,
+                     double speed)
+    : entries_(entries),
+      alarm_manager_(am),
+      speed_(speed),
+      read_fd_(-1),
+      write_fd_(-1),
+      next_(0),
+      start_(0),
+      alarm_(0),
+      bytes_written_(0)
+{
+}
+
+
+replay_fd::~replay_fd()
+{
+    close();
+}
+
+
+void replay_fd::open()
+{
+    int fds[2];
+
+    if(pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        throw fd_exception(errno);
+    }
+
+    read_fd_ = fds[0];
+    write_fd_ = fds[1];
+    next_ = 0;
+    start_ = monotonic_usecs();
+    pending_.clear();
+
+    play();
+}
+
+
+void replay_fd::close()
+{
+    if(alarm_) {
+        alarm_->stop();
+        alarm_ = 0;
+    }
+
+    if(read_fd_ != -1) {
+        ::close(read_fd_);
+        read_fd_ = -1;
+    }
+
+    if(write_fd_ != -1) {
+        ::close(write_fd_);
+        write_fd_ = -1;
+    }
+}
+
+
+int replay_fd::get_fd()
+{
+    return read_fd_;
+}
+
+
+int replay_fd::read(void *buf, int count)
+{
+    if(read_fd_ == -1) {
+        throw fd_exception(EBADF);
+    }
+
+    int r = ::read(read_fd_, buf, count);
+
+    if(r == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return -1;
+    }
+
+    if(r == -1) {
+        throw fd_exception(errno);
+    }
+
+    return r;
+}
+
+
+int replay_fd::write(const void *, int count)
+{
+    bytes_written_ += count;
+    return count;
+}
+
+
+void replay_fd::play()
+{
+    alarm_ = 0;
+
+    int64_t now = monotonic_usecs();
+    int64_t first = entries_.empty() ? 0 : entries_[0].usecs;
+
+    while(next_ < entries_.size()) {
+        const serial_trace::entry &e = entries_[next_];
+
+        if(e.direction == serial_trace::READ) {
+            int64_t due = start_;
+
+            if(speed_ > 0) {
+                due += (e.usecs - first) / speed_;
+            }
+
+            if(due > now) {
+                break;
+            }
+
+            pending_ += e.data;
+        }
+
+        ++next_;
+    }
+
+    while(!pending_.empty()) {
+        int r = ::write(write_fd_, pending_.data(), pending_.size());
+
+        if(r == -1) {
+            break;  // the pipe is full, try again later
+        }
+
+        pending_.erase(0, r);
+    }
+
+    if(next_ == entries_.size() && pending_.empty()) {
+        ::close(write_fd_);
+        write_fd_ = -1;
+        return;
+    }
+
+    schedule_next();
+}
+
+
+void replay_fd::schedule_next()
+{
+    int msecs = 1;
+
+    if(pending_.empty()) {
+        int64_t first = entries_[0].usecs;
+        int64_t due = start_ + (entries_[next_].usecs - first) / speed_;
+
+        msecs = std::max<int64_t>((due - monotonic_usecs() + 999) / 1000, 0);
+    }
+
+    alarm_ = alarm_manager_->schedule_alarm([this]() { play(); }, msecs);
+}
+
+
+}
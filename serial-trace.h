@@ -0,0 +1,116 @@
+
+#ifndef SERIAL_TRACE_H_
+#define SERIAL_TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "buffered-connection.h"
+
+
+namespace net {
+
+class alarm;
+class alarm_manager;
+
+
+// An append-only binary capture of the traffic on a serial line. The file is
+// memory-mapped so recording a chunk is a memcpy. When the file reaches its
+// maximal size it is renamed to <path>.1 (replacing the previous one) and a
+// new file is started.
+//
+// File format, integers in host byte order:
+//
+//   magic "SHDTRC1\n"
+//   entries: u8 direction ('R' or 'W'), i64 monotonic usecs, u32 length,
+//            data
+//
+// The unused tail of a file that is still being written is zero-filled, a
+// zero direction marks the end of the entries.
+class serial_trace {
+public:
+    enum direction_t {
+        READ = 'R',
+        WRITE = 'W'
+    };
+
+    struct entry {
+        direction_t direction;
+        int64_t usecs;
+        std::string data;
+    };
+
+    // Creates (truncates) the file. Throws fd_exception.
+    serial_trace(const std::string &path, size_t max_size);
+    ~serial_trace();
+
+    void record(direction_t direction, const char *data, int len);
+
+    // Parses the content of a trace file. Returns false if it is not a trace
+    // or if it is truncated in the middle of an entry, the complete entries
+    // are returned in any case.
+    static bool parse(const std::string &content, std::vector<entry> *out);
+
+private:
+    serial_trace(const serial_trace &);
+    serial_trace &operator= (const serial_trace &);
+
+    void open_file();
+    void close_file();
+    void rotate();
+
+private:
+    std::string path_;
+    size_t max_size_;
+    int fd_;
+    char *map_;
+    size_t used_;
+};
+
+
+// Plays the reads of a recorded trace back with the original timing divided
+// by 'speed', or as fast as possible if the speed is 0. Writes are accepted
+// and discarded. Once all reads have been played the fd reports EOF.
+class replay_fd : public fd_interface {
+public:
+    replay_fd(const std::vector<serial_trace::entry> &entries,
+              alarm_manager *am,
+              double speed);
+    ~replay_fd();
+
+    void open() override;
+    void close() override;
+    int get_fd() override;
+    int read(void *buf, int count) override;
+    int write(const void *buf, int count) override;
+
+    size_t bytes_written() const { return bytes_written_; }
+
+private:
+    replay_fd(const replay_fd &);
+    replay_fd &operator= (const replay_fd &);
+
+    // Feeds all reads that are due into the pipe and schedules the next one.
+    void play();
+    void schedule_next();
+
+private:
+    std::vector<serial_trace::entry> entries_;
+    alarm_manager *alarm_manager_;  // not owned
+    double speed_;
+
+    int read_fd_;
+    int write_fd_;
+    size_t next_;
+    int64_t start_;
+    std::string pending_;  // did not fit into the pipe yet
+    alarm *alarm_;
+    size_t bytes_written_;
+};
+
+}
+
+#endif
@@ -0,0 +1,158 @@
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "buffered-connection.h"
+#include "select-server.h"
+#include "serial-trace.h"
+
+#include <gtest/gtest.h>
+
+
+namespace net {
+
+
+std::string read_file(const std::string &path)
+{
+    std::string ret;
+    FILE *file = fopen(path.c_str(), "r");
+
+    if(!file) {
+        return ret;
+    }
+
+    char buf[4096];
+    size_t len;
+
+    while((len = fread(buf, 1, sizeof(buf), file)) > 0) {
+        ret.append(buf, len);
+    }
+
+    fclose(file);
+    return ret;
+}
+
+
+std::string temp_path(const char *name)
+{
+    char buf[128];
+    snprintf(buf, sizeof(buf), "/tmp/shd-%s.%d", name, int(getpid()));
+    return buf;
+}
+
+
+TEST(SerialTraceTest, RecordAndParse)
+{
+    std::string path = temp_path("trace");
+
+    {
+        serial_trace trace(path, 1 << 20);
+        trace.record(serial_trace::WRITE, "\x02\x60", 2);
+        trace.record(serial_trace::READ, "\x02\x60\x06", 3);
+
+        // Entries are visible while the file is still being written.
+        std::vector<serial_trace::entry> entries;
+        EXPECT_TRUE(serial_trace::parse(read_file(path), &entries));
+        EXPECT_EQ(2u, entries.size());
+    }
+
+    std::string content = read_file(path);
+    unlink(path.c_str());
+
+    // The zero-filled tail is gone.
+    EXPECT_EQ(8u + 13 + 2 + 13 + 3, content.size());
+
+    std::vector<serial_trace::entry> entries;
+    ASSERT_TRUE(serial_trace::parse(content, &entries));
+    ASSERT_EQ(2u, entries.size());
+
+    EXPECT_EQ(serial_trace::WRITE, entries[0].direction);
+    EXPECT_EQ("\x02\x60", entries[0].data);
+    EXPECT_EQ(serial_trace::READ, entries[1].direction);
+    EXPECT_EQ("\x02\x60\x06", entries[1].data);
+    EXPECT_LE(entries[0].usecs, entries[1].usecs);
+
+    // Truncated in the middle of an entry.
+    entries.clear();
+    EXPECT_FALSE(serial_trace::parse(content.substr(0, content.size() - 1),
+                                     &entries));
+    EXPECT_EQ(1u, entries.size());
+
+    EXPECT_FALSE(serial_trace::parse("garbage", &entries));
+}
+
+
+TEST(SerialTraceTest, Rotate)
+{
+    std::string path = temp_path("rotate");
+    std::string chunk(100, 'x');
+
+    {
+        serial_trace trace(path, 4096);
+
+        for(int i = 0; i < 50; ++i) {
+            trace.record(serial_trace::READ, chunk.data(), chunk.size());
+        }
+    }
+
+    std::vector<serial_trace::entry> current;
+    std::vector<serial_trace::entry> old;
+
+    EXPECT_TRUE(serial_trace::parse(read_file(path), &current));
+    EXPECT_TRUE(serial_trace::parse(read_file(path + ".1"), &old));
+
+    unlink(path.c_str());
+    unlink((path + ".1").c_str());
+
+    // 4096 bytes hold 36 entries of 113 bytes after the magic.
+    EXPECT_EQ(36u, old.size());
+    EXPECT_EQ(14u, current.size());
+}
+
+
+class ReplayTest : public testing::TestWithParam<double> {
+};
+
+
+TEST_P(ReplayTest, FeedsConnection)
+{
+    std::vector<serial_trace::entry> entries(3);
+
+    entries[0].direction = serial_trace::WRITE;
+    entries[0].usecs = 1000000;
+    entries[0].data = "ignored";
+    entries[1].direction = serial_trace::READ;
+    entries[1].usecs = 1010000;
+    entries[1].data = "hello";
+    entries[2].direction = serial_trace::READ;
+    entries[2].usecs = 1030000;
+    entries[2].data = " world";
+
+    select_server ss;
+    replay_fd fd(entries, &ss, GetParam());
+    buffered_connection conn(&fd, &ss, &ss);
+    char buf[11];
+    char eof_buf[1];
+
+    conn.start();
+    conn.write("abc", 3, []() {});
+    conn.read(buf, sizeof(buf), [&]() {
+        // Nothing more is coming.
+        conn.read(eof_buf, sizeof(eof_buf), [&]() { ss.stop(); });
+    });
+
+    ss.loop();
+
+    EXPECT_EQ("hello world", std::string(buf, sizeof(buf)));
+    EXPECT_EQ(3u, fd.bytes_written());
+    EXPECT_TRUE(conn.is_closed());
+}
+
+
+INSTANTIATE_TEST_CASE_P(Speeds, ReplayTest, testing::Values(0.0, 1.0, 10.0));
+
+
+}
@@ -4,28 +4,56 @@
 #include <time.h>
 
 #include <functional>
+#include <memory>
 #include <string>
+#include <utility>
 
 #include "alarm-manager.h"
 #include "executor.h"
+#include "link-db.h"
+#include "logger.h"
 #include "plm-endpoint.h"
-#include "plm-util.h"
+#include "scene-engine.h"
+#include "serial-trace.h"
+#include "status-poller.h"
 #include "sunrise-sunset.h"
+#include "thread-pool.h"
+#include "time-util.h"
 
 
 using std::placeholders::_1;
 
 
+// Time rules missed while the modem was not available are run if they were
+// due this recently.
+static const time_t MAX_RULES_CATCHUP_SECS = 15 * 60;
+
+
 // TODO
 class shd_light {
 public:
-    shd_light(const std::string &addr,
+    // The light is turned on at the given level (1-255). With a ramp rate
+    // (0-15) it ramps to the level and back off, otherwise it goes on at
+    // once and off at the ramp configured in the device.
+    shd_light(plm::insteon_address addr,
+              int on_level,
+              int ramp_rate,
               plm::plm_endpoint *plm,
               net::executor *executor);
 
     void light_on(const std::function<void()> &done);
     void light_off(const std::function<void()> &done);
 
+    // Sets the level (0-255) with a single command.
+    void set_level(int level, const std::function<void()> &done);
+
+    // The level the light reported. A light found at a level other than
+    // the one it was set to has been changed by hand, it is set again on
+    // the next run.
+    void set_reported_level(int level);
+
+    plm::insteon_address address() const { return addr_; }
+
     // is_done will return true if the state machine has finished irrespective
     // of success, it may be true when none of is_on, is_off is true.
     bool is_done() const;
@@ -39,55 +67,88 @@ private:
     void on_plm_response(plm::plm_endpoint::response_t r);
     void on_timeout();
 
+    // The level the device ends up at when set to the given one.
+    int device_level(int level) const;
+
 private:
     enum state_t {
         INIT, SENT, DONE, ERROR
     };
 
-    enum on_off_t {
-        ON, OFF
-    };
-
-    std::string addr_;
+    plm::insteon_address addr_;
+    int on_level_;
+    int ramp_rate_;  // -1 if not used
 
     // not owned
     plm::plm_endpoint *plm_;
     net::executor *executor_;
 
     state_t state_;
-    on_off_t on_off_;
+    int level_;  // the level of the last command
     std::function<void()> done_;
 };
 
 
-shd_light::shd_light(const std::string &addr,
+shd_light::shd_light(plm::insteon_address addr,
+                     int on_level,
+                     int ramp_rate,
                      plm::plm_endpoint *plm,
                      net::executor *executor)
-    : addr_(addr), plm_(plm), executor_(executor),
-      state_(INIT), on_off_(OFF)
+    : addr_(addr), on_level_(on_level), ramp_rate_(ramp_rate),
+      plm_(plm), executor_(executor),
+      state_(INIT), level_(0)
 {
 }
 
 
 void shd_light::light_on(const std::function<void()> &done)
 {
-    on_off_ = ON;
-    done_ = done;
-    state_ = SENT;
-    plm_->send_light_on(
-        addr_,
-        std::bind(&shd_light::on_plm_response, this, _1));
+    set_level(on_level_, done);
 }
 
 
 void shd_light::light_off(const std::function<void()> &done)
 {
-    on_off_ = OFF;
+    set_level(0, done);
+}
+
+
+void shd_light::set_level(int level, const std::function<void()> &done)
+{
+    level_ = device_level(level);
     done_ = done;
     state_ = SENT;
-    plm_->send_light_off(
-        addr_,
-        std::bind(&shd_light::on_plm_response, this, _1));
+
+    std::function<void(plm::plm_endpoint::response_t)> cb =
+        std::bind(&shd_light::on_plm_response, this, _1);
+
+    if(ramp_rate_ >= 0) {
+        plm_->send_light_ramp(addr_, level, ramp_rate_, cb);
+    } else {
+        plm_->send_light_level(addr_, level, level > 0, cb);
+    }
+}
+
+
+int shd_light::device_level(int level) const
+{
+    if(ramp_rate_ >= 0 && level > 0) {
+        return (level & 0xf0) | 0x0f;
+    }
+
+    return level;
+}
+
+
+void shd_light::set_reported_level(int level)
+{
+    if(state_ != DONE || level == level_) {
+        return;
+    }
+
+    log_info("Light %s was set to %d by hand, expected %d", addr_.to_hex(),
+             level, level_);
+    state_ = INIT;
 }
 
 
@@ -99,13 +160,13 @@ bool shd_light::is_done() const
 
 bool shd_light::is_on() const
 {
-    return state_ == DONE && on_off_ == ON;
+    return state_ == DONE && level_ == device_level(on_level_);
 }
 
 
 bool shd_light::is_off() const
 {
-    return state_ == DONE && on_off_ == OFF;
+    return state_ == DONE && level_ == 0;
 }
 
 
@@ -124,24 +185,53 @@ void shd_light::on_plm_response(plm::plm_endpoint::response_t r)
 shd_app::shd_app(const shd_config *config,
                  net::event_manager *event_manager,
                  net::alarm_manager *alarm_manager,
-                 net::executor *executor)
+                 net::executor *executor,
+                 net::thread_pool *pool)
     : config_(config), event_manager_(event_manager),
-      alarm_manager_(alarm_manager), executor_(executor),
+      alarm_manager_(alarm_manager), executor_(executor), pool_(pool),
       fd_(config->serial_device()),
       plm_(&fd_, alarm_manager, event_manager, executor),
-      next_run_alarm_(0)
+      poller_(&plm_, alarm_manager),
+      scenes_(&plm_),
+      next_run_alarm_(0),
+      sun_day_(-1), hour_off_(0), hour_on_(0), sun_times_pending_(false),
+      link_db_loaded_(false), link_db_from_snapshot_(false),
+      link_db_downloading_(false), link_db_time_(0),
+      rules_time_(0)
 {
+    if(!config->serial_trace().empty()) {
+        try {
+            trace_.reset(new net::serial_trace(config->serial_trace(),
+                                               config->serial_trace_size()));
+            plm_.set_trace(trace_.get());
+        } catch(net::fd_exception &ex) {
+            log_error("Cannot open serial trace '%s': %s",
+                      config->serial_trace(), ex.what());
+        }
+    }
+
     for(size_t i = 0; i < config->outside_lights().size(); ++i) {
-        std::string addr = config->outside_lights()[i];
+        plm::insteon_address addr = config->outside_lights()[i];
         lights_.push_back(new shd_light(addr,
+                                        config->outside_lights_level(),
+                                        config->outside_lights_ramp_rate(),
                                         &plm_,
                                         executor_));
+        poller_.add_device(addr);
     }
+
+    poller_.set_budget(config->poll_budget());
+    poller_.set_callback(std::bind(&shd_app::on_light_status, this, _1,
+                                   std::placeholders::_2));
+
+    plm_.add_listener(this);
 }
 
 
 shd_app::~shd_app()
 {
+    plm_.remove_listener(this);
+
     if(next_run_alarm_) {
         next_run_alarm_->stop();
     }
@@ -162,17 +252,18 @@ void shd_app::run()
 void shd_app::process_ligths()
 {
     time_t time_now = time(0);
-    struct tm *tm = localtime(&time_now);
-    double hour_off = sunrise_hour(tm->tm_year + 1900,
-                                   tm->tm_mon + 1,
-                                   tm->tm_mday,
-                                   config_->latitude(),
-                                   config_->longitude());
-    double hour_on = sunset_hour(tm->tm_year + 1900,
-                                 tm->tm_mon + 1,
-                                 tm->tm_mday,
-                                 config_->latitude(),
-                                 config_->longitude());
+    struct tm tm;
+    localtime_r(&time_now, &tm);
+
+    if(tm.tm_year * 1000 + tm.tm_yday != sun_day_) {
+        update_sun_times(tm);
+        return;
+    }
+
+    process_time_rules(time_now, tm);
+
+    double hour_off = hour_off_;
+    double hour_on = hour_on_;
     double now = hour_now();
 
     std::list<shd_light *>::iterator it = lights_.begin();
@@ -182,10 +273,12 @@ void shd_app::process_ligths()
         if(now > hour_off && now < hour_on) {
             if(!light->is_off()) {
                 light->light_off(std::bind(&shd_app::light_done, this));
+                poller_.note_activity(light->address());
             }
         } else {
             if(!light->is_on()) {
                 light->light_on(std::bind(&shd_app::light_done, this));
+                poller_.note_activity(light->address());
             }
         }
     }
@@ -195,11 +288,51 @@ void shd_app::process_ligths()
 }
 
 
+void shd_app::update_sun_times(const struct tm &today)
+{
+    if(sun_times_pending_) {
+        return;
+    }
+
+    sun_times_pending_ = true;
+
+    int day = today.tm_year * 1000 + today.tm_yday;
+    int year = today.tm_year + 1900;
+    int month = today.tm_mon + 1;
+    int mday = today.tm_mday;
+    double lat = config_->latitude();
+    double lon = config_->longitude();
+
+    std::shared_ptr<std::pair<double, double>> hours(
+        new std::pair<double, double>(0, 0));
+
+    pool_->submit(
+        [=]() {
+            hours->first = sunrise_hour(year, month, mday, lat, lon);
+            hours->second = sunset_hour(year, month, mday, lat, lon);
+        },
+        executor_,
+        [=]() { on_sun_times(day, hours->first, hours->second); });
+}
+
+
+void shd_app::on_sun_times(int day, double hour_off, double hour_on)
+{
+    sun_times_pending_ = false;
+    sun_day_ = day;
+    hour_off_ = hour_off;
+    hour_on_ = hour_on;
+
+    process_ligths();
+}
+
+
 void shd_app::next_run()
 {
     next_run_alarm_ = 0;
 
     if(!plm_.is_ok()) {
+        poller_.stop();
         plm_.stop();
     }
 
@@ -215,10 +348,112 @@ void shd_app::next_run()
         return;
     }
 
+    load_link_db();
+
+    if(config_->poll_budget() > 0) {
+        poller_.start();
+    }
+
     process_ligths();
 }
 
 
+void shd_app::load_link_db()
+{
+    std::string path = config_->link_db_snapshot();
+
+    if(!link_db_loaded_) {
+        link_db_loaded_ = true;
+
+        if(!path.empty() && plm_.link_database().load(path)) {
+            log_info("Loaded %zu modem links from '%s', generation %u",
+                     plm_.link_database().records().size(), path,
+                     plm_.link_database().generation());
+            link_db_from_snapshot_ = true;
+            link_db_time_ = time(0);
+        }
+    }
+
+    if(link_db_downloading_) {
+        return;
+    }
+
+    // Without a snapshot the database is needed right away. A loaded
+    // snapshot is trusted, so that a restart does not download the whole
+    // database again, unless a refresh is configured. The refresh is only
+    // downloaded when the modem has nothing else to do.
+    bool have_db = link_db_time_ != 0;
+
+    if(have_db) {
+        time_t refresh = time_t(config_->link_db_refresh_hours()) * 60 * 60;
+
+        if(refresh <= 0 || time(0) - link_db_time_ < refresh ||
+           !plm_.is_idle())
+        {
+            return;
+        }
+    }
+
+    link_db_downloading_ = true;
+    plm_.download_link_db(
+        std::bind(&shd_app::on_link_db_downloaded, this,
+                  plm_.link_database().generation(), _1),
+        have_db ? plm::plm_endpoint::BACKGROUND
+                : plm::plm_endpoint::SCHEDULED);
+}
+
+
+void shd_app::on_link_db_downloaded(uint32_t generation,
+                                    plm::plm_endpoint::response_t r)
+{
+    link_db_downloading_ = false;
+
+    if(!r.is_ok()) {
+        // Try again on the next run.
+        return;
+    }
+
+    link_db_time_ = time(0);
+
+    if(plm_.link_database().generation() == generation &&
+       link_db_from_snapshot_)
+    {
+        // The snapshot is current.
+        return;
+    }
+
+    if(link_db_from_snapshot_) {
+        log_info("The modem's links changed since the snapshot");
+    }
+
+    if(!config_->link_db_snapshot().empty()) {
+        save_link_db();
+        link_db_from_snapshot_ = true;
+    }
+}
+
+
+void shd_app::save_link_db()
+{
+    // A copy is written, the database may change in the meantime.
+    std::string path = config_->link_db_snapshot();
+    std::shared_ptr<plm::link_db> db(new plm::link_db(plm_.link_database()));
+    std::shared_ptr<bool> ok(new bool(false));
+
+    pool_->submit(
+        [=]() { *ok = db->save(path); },
+        executor_,
+        [=]() {
+            if(*ok) {
+                log_info("Saved %zu modem links to '%s', generation %u",
+                         db->records().size(), path, db->generation());
+            } else {
+                log_error("Cannot save the modem's link database");
+            }
+        });
+}
+
+
 void shd_app::light_done()
 {
     bool all_done = true;
@@ -237,12 +472,148 @@ void shd_app::light_done()
 }
 
 
+void shd_app::on_light_status(
+    plm::insteon_address addr,
+    const plm::status_poller::device_status &status)
+{
+    if(!status.known || status.failures > 0) {
+        scenes_.forget_level(addr);
+        return;
+    }
+
+    scenes_.set_level(addr, status.level);
+
+    std::list<shd_light *>::iterator it = lights_.begin();
+    for(; it != lights_.end(); ++it) {
+        if((*it)->address() == addr) {
+            (*it)->set_reported_level(status.level);
+        }
+    }
+}
+
+
+void shd_app::process_time_rules(time_t time_now, const struct tm &now)
+{
+    const rules::rule_set &rules = config_->rules();
+    time_t from_time = rules_time_;
+    rules_time_ = time_now;
+
+    if(from_time == 0 || rules.size() == 0) {
+        return;
+    }
+
+    if(time_now - from_time > MAX_RULES_CATCHUP_SECS) {
+        from_time = time_now - MAX_RULES_CATCHUP_SECS;
+    }
+
+    struct tm from;
+    localtime_r(&from_time, &from);
+
+    rules::context_t ctx = rules_context(now);
+    std::vector<size_t> due;
+    rules.match_time(from.tm_hour * 60 + from.tm_min, ctx.minute,
+                     ctx.sunrise, ctx.sunset, &due);
+
+    for(size_t i = 0; i < due.size(); ++i) {
+        run_rule(due[i], ctx, plm::plm_endpoint::SCHEDULED);
+    }
+}
+
+
+void shd_app::on_command(const plm::plm_frame &frame)
+{
+    if(!rule_messages_.is_new(frame, net::monotonic_usecs())) {
+        return;
+    }
+
+    std::vector<size_t> matched;
+    config_->rules().match_message(frame.from(), frame.cmd1(), &matched);
+
+    if(matched.empty()) {
+        return;
+    }
+
+    time_t time_now = time(0);
+    struct tm tm;
+    localtime_r(&time_now, &tm);
+    rules::context_t ctx = rules_context(tm);
+
+    for(size_t i = 0; i < matched.size(); ++i) {
+        run_rule(matched[i], ctx, plm::plm_endpoint::INTERACTIVE);
+    }
+}
+
+
+void shd_app::run_rule(size_t rule, const rules::context_t &ctx,
+                       plm::plm_endpoint::priority_t priority)
+{
+    const rules::rule_t &r = config_->rules().rule(rule);
+
+    if(!rules::rule_set::check_conditions(r, ctx)) {
+        log_debug("Rule at line %d skipped, conditions do not hold", r.line);
+        return;
+    }
+
+    log_info("Running rule at line %d", r.line);
+
+    for(size_t i = 0; i < r.targets.size(); ++i) {
+        poller_.note_activity(r.targets[i].device);
+    }
+
+    scenes_.execute(r.targets,
+                    std::bind(&shd_app::on_rule_done, this, rule, _1),
+                    priority);
+}
+
+
+void shd_app::on_rule_done(
+    size_t rule,
+    const std::vector<plm::scene_engine::result_t> &results)
+{
+    size_t failed = 0;
+
+    for(size_t i = 0; i < results.size(); ++i) {
+        if(results[i].outcome == plm::scene_engine::FAILED) {
+            ++failed;
+        }
+    }
+
+    if(failed > 0) {
+        log_error("Rule at line %d: %zu of %zu devices failed",
+                  config_->rules().rule(rule).line, failed, results.size());
+    }
+}
+
+
+rules::context_t shd_app::rules_context(const struct tm &now) const
+{
+    rules::context_t ctx;
+    ctx.minute = now.tm_hour * 60 + now.tm_min;
+
+    // There may be no sunrise or sunset far enough north or south.
+    if(now.tm_year * 1000 + now.tm_yday == sun_day_ &&
+       hour_off_ >= 0 && hour_on_ < 24)
+    {
+        ctx.sunrise = int(hour_off_ * 60);
+        ctx.sunset = int(hour_on_ * 60);
+    }
+
+    const plm::scene_engine *scenes = &scenes_;
+    ctx.level = [scenes](plm::insteon_address addr) {
+        return scenes->level(addr);
+    };
+
+    return ctx;
+}
+
+
 double shd_app::hour_now()
 {
     time_t time_now = time(0);
-    struct tm *tm = localtime(&time_now);
-    return double(tm->tm_hour) +
-           double(tm->tm_min) / 60 +
-           double(tm->tm_sec) / 3600;
+    struct tm tm;
+    localtime_r(&time_now, &tm);
+    return double(tm.tm_hour) +
+           double(tm.tm_min) / 60 +
+           double(tm.tm_sec) / 3600;
 }
 
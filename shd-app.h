@@ -2,11 +2,20 @@
 #ifndef SHD_APP_H_
 #define SHD_APP_H_
 
+#include <stdint.h>
+#include <time.h>
+
 #include <list>
+#include <memory>
 #include <string>
+#include <vector>
 
+#include "plm-connection.h"
 #include "plm-endpoint.h"
+#include "rules.h"
+#include "scene-engine.h"
 #include "shd-config.h"
+#include "status-poller.h"
 
 
 namespace net {
@@ -14,22 +23,32 @@ class alarm;
 class alarm_manager;
 class event_manager;
 class executor;
+class serial_trace;
+class thread_pool;
 }
 
 
 class shd_light;
 
-class shd_app {
+// Turns the outside lights on at sunset and off at sunrise, and runs the
+// rules of the configuration on the messages of the devices and at their
+// times.
+class shd_app : public plm::plm_command_listener {
 public:
+    // The thread pool is used to move computations off the event loop.
     shd_app(const shd_config *config,
             net::event_manager *event_manager,
             net::alarm_manager *alarm_manager,
-            net::executor *executor);
+            net::executor *executor,
+            net::thread_pool *pool);
     ~shd_app();
 
     // TODO may or may not throw
     void run();
 
+    // Runs the rules the broadcasts of the devices trigger.
+    virtual void on_command(const plm::plm_frame &frame) override;
+
 private:
     shd_app(const shd_app &);
     shd_app &operator= (const shd_app &);
@@ -37,9 +56,42 @@ private:
     void process_ligths();
     void next_run();
 
+    // Loads the modem's link database from the snapshot, or downloads it
+    // and saves the snapshot if there is none. The database is downloaded
+    // again only if a refresh is configured, the snapshot is saved again if
+    // the links changed.
+    void load_link_db();
+    void on_link_db_downloaded(uint32_t generation,
+                               plm::plm_endpoint::response_t r);
+
+    // Writes the snapshot of the link database on the thread pool.
+    void save_link_db();
+
+    // Computes sunrise and sunset for the given day on the thread pool and
+    // processes the lights again once the times are known.
+    void update_sun_times(const struct tm &today);
+    void on_sun_times(int day, double hour_off, double hour_on);
+
     // Called when a light has finished processing a command.
     void light_done();
 
+    // Called when the poller learns the actual level of a light.
+    void on_light_status(plm::insteon_address addr,
+                         const plm::status_poller::device_status &status);
+
+    // Runs the time rules due since the last run, at most the ones of the
+    // last few minutes if the modem was not available for a while.
+    void process_time_rules(time_t time_now, const struct tm &now);
+
+    // Checks the conditions of the rule and sets its devices if they hold.
+    void run_rule(size_t rule, const rules::context_t &ctx,
+                  plm::plm_endpoint::priority_t priority);
+    void on_rule_done(size_t rule,
+                      const std::vector<plm::scene_engine::result_t> &results);
+
+    // The context to check the conditions of the rules in at the given time.
+    rules::context_t rules_context(const struct tm &now) const;
+
     // Returns current fractional day hour.
     static double hour_now();
 
@@ -49,13 +101,35 @@ private:
     net::event_manager *event_manager_;
     net::alarm_manager *alarm_manager_;
     net::executor *executor_;
+    net::thread_pool *pool_;
 
     plm::plm_fd fd_;
+    std::unique_ptr<net::serial_trace> trace_;  // outlives plm_
     plm::plm_endpoint plm_;
+    plm::status_poller poller_;
+    plm::scene_engine scenes_;  // knows the levels the poller finds
 
     net::alarm *next_run_alarm_;
 
+    // Sunrise and sunset hours for sun_day_ (tm_year * 1000 + tm_yday), -1
+    // if not computed yet.
+    int sun_day_;
+    double hour_off_;
+    double hour_on_;
+    bool sun_times_pending_;
+
+    bool link_db_loaded_;  // the snapshot was tried
+    bool link_db_from_snapshot_;  // the snapshot matches the database
+    bool link_db_downloading_;
+    time_t link_db_time_;  // of the last load or download, 0 if none yet
+
     std::list<shd_light *> lights_;
+
+    // The time rules were last run up to, 0 before the first run.
+    time_t rules_time_;
+
+    // Runs the rules once per button press, not for every copy of it.
+    rules::message_filter rule_messages_;
 };
 
 
@@ -5,10 +5,13 @@
 #include <string.h>
 
 #include "ini-file-parser.h"
-#include "plm-util.h"
 #include "shd-config.h"
 
 
+static const size_t DEFAULT_SERIAL_TRACE_SIZE = 16 * 1024 * 1024;
+static const int DEFAULT_POLL_BUDGET = 6;
+
+
 // May throw shd_config_exception.
 static std::string read_file_content(const std::string &file_path)
 {
@@ -61,7 +64,10 @@ const char *shd_config_exception::what() const throw()
 
 
 shd_config::shd_config()
-    : longitude_(0), latitude_(0)
+    : longitude_(0), latitude_(0), outside_lights_level_(255),
+      outside_lights_ramp_rate_(-1), metrics_port_(0),
+      serial_trace_size_(DEFAULT_SERIAL_TRACE_SIZE),
+      link_db_refresh_hours_(0), poll_budget_(DEFAULT_POLL_BUDGET)
 {
     char *home = getenv("HOME");
 
@@ -75,7 +81,10 @@ shd_config::shd_config()
 
 
 shd_config::shd_config(const std::string &file_path)
-    : longitude_(0), latitude_(0)
+    : longitude_(0), latitude_(0), outside_lights_level_(255),
+      outside_lights_ramp_rate_(-1), metrics_port_(0),
+      serial_trace_size_(DEFAULT_SERIAL_TRACE_SIZE),
+      link_db_refresh_hours_(0), poll_budget_(DEFAULT_POLL_BUDGET)
 {
     read_config(file_path);
 }
@@ -99,12 +108,72 @@ double shd_config::latitude() const
 }
 
 
-const std::vector<std::string> &shd_config::outside_lights() const
+const std::vector<plm::insteon_address> &shd_config::outside_lights() const
 {
     return outside_lights_;
 }
 
 
+int shd_config::outside_lights_level() const
+{
+    return outside_lights_level_;
+}
+
+
+int shd_config::outside_lights_ramp_rate() const
+{
+    return outside_lights_ramp_rate_;
+}
+
+
+std::string shd_config::metrics_socket() const
+{
+    return metrics_socket_;
+}
+
+
+int shd_config::metrics_port() const
+{
+    return metrics_port_;
+}
+
+
+std::string shd_config::serial_trace() const
+{
+    return serial_trace_;
+}
+
+
+size_t shd_config::serial_trace_size() const
+{
+    return serial_trace_size_;
+}
+
+
+std::string shd_config::link_db_snapshot() const
+{
+    return link_db_snapshot_;
+}
+
+
+int shd_config::link_db_refresh_hours() const
+{
+    return link_db_refresh_hours_;
+}
+
+
+int shd_config::poll_budget() const
+{
+    return poll_budget_;
+}
+
+
+const rules::rule_set &shd_config::rules() const
+{
+    return rules_;
+}
+
+
 void shd_config::read_config(const std::string &file_path)
 {
     ini::kv_map_t vals;
@@ -134,9 +203,83 @@ void shd_config::read_config(const std::string &file_path)
 
     it = vals.find("outside-lights");
     if(it != vals.end()) {
-        ini::parse_list(it->second, &outside_lights_);
-        for(size_t i = 0; i < outside_lights_.size(); ++i) {
-            outside_lights_[i] = plm::hex_to_bin(outside_lights_[i]);
+        std::vector<std::string> lights;
+        ini::parse_list(it->second, &lights);
+
+        for(size_t i = 0; i < lights.size(); ++i) {
+            plm::insteon_address addr;
+
+            if(!plm::insteon_address::parse(lights[i], &addr)) {
+                throw shd_config_exception("Invalid light address '" +
+                                           lights[i] + "'");
+            }
+
+            outside_lights_.push_back(addr);
+        }
+    }
+
+    it = vals.find("outside-lights-level");
+    if(it != vals.end()) {
+        outside_lights_level_ = atoi(it->second.c_str());
+
+        if(outside_lights_level_ < 1 || outside_lights_level_ > 255) {
+            throw shd_config_exception("Invalid outside lights level '" +
+                                       it->second + "'");
+        }
+    }
+
+    it = vals.find("outside-lights-ramp-rate");
+    if(it != vals.end()) {
+        outside_lights_ramp_rate_ = atoi(it->second.c_str());
+
+        if(outside_lights_ramp_rate_ < 0 || outside_lights_ramp_rate_ > 15) {
+            throw shd_config_exception("Invalid ramp rate '" + it->second +
+                                       "'");
+        }
+    }
+
+    it = vals.find("metrics-socket");
+    if(it != vals.end()) {
+        metrics_socket_ = it->second;
+    }
+
+    it = vals.find("metrics-port");
+    if(it != vals.end()) {
+        metrics_port_ = atoi(it->second.c_str());
+    }
+
+    it = vals.find("serial-trace");
+    if(it != vals.end()) {
+        serial_trace_ = it->second;
+    }
+
+    it = vals.find("serial-trace-size");
+    if(it != vals.end()) {
+        serial_trace_size_ = strtoul(it->second.c_str(), 0, 10);
+    }
+
+    it = vals.find("link-db-snapshot");
+    if(it != vals.end()) {
+        link_db_snapshot_ = it->second;
+    }
+
+    it = vals.find("link-db-refresh-hours");
+    if(it != vals.end()) {
+        link_db_refresh_hours_ = atoi(it->second.c_str());
+    }
+
+    it = vals.find("poll-budget");
+    if(it != vals.end()) {
+        poll_budget_ = atoi(it->second.c_str());
+    }
+
+    it = vals.find("rules-file");
+    if(it != vals.end()) {
+        try {
+            rules_.parse(read_file_content(it->second));
+        } catch(rules::parse_exception &ex) {
+            throw shd_config_exception("Could not parse rules '" +
+                                       it->second + "': " + ex.what());
         }
     }
 }
@@ -6,6 +6,9 @@
 #include <string>
 #include <vector>
 
+#include "insteon-address.h"
+#include "rules.h"
+
 
 class shd_config_exception : public std::exception {
 public:
@@ -31,9 +34,41 @@ public:
     double longitude() const;
     double latitude() const;
 
-    // A list of addresses for outside lights. The addresses have already been
-    // converted to binary form.
-    const std::vector<std::string> &outside_lights() const;
+    // A list of addresses for outside lights.
+    const std::vector<plm::insteon_address> &outside_lights() const;
+
+    // The level to turn the outside lights on at, 1-255, 255 by default.
+    // And the ramp rate to turn them on and off with, 0-15 for 9 minutes
+    // down to 0.1 seconds, -1 (the default) to use the devices' own.
+    int outside_lights_level() const;
+    int outside_lights_ramp_rate() const;
+
+    // Where to serve the metrics: a Unix socket path or a TCP port on the
+    // loopback interface, the socket wins if both are given. Empty and 0
+    // respectively if not configured.
+    std::string metrics_socket() const;
+    int metrics_port() const;
+
+    // A file to capture the serial traffic into, empty if not configured,
+    // and its size limit in bytes before it is rotated.
+    std::string serial_trace() const;
+    size_t serial_trace_size() const;
+
+    // A file to keep the snapshot of the modem's link database in, empty if
+    // not configured. The database is downloaded if the file is missing.
+    std::string link_db_snapshot() const;
+
+    // How often to download the link database again to pick up the links
+    // changed outside shd, in hours. 0 (the default) never does, a loaded
+    // snapshot is trusted then.
+    int link_db_refresh_hours() const;
+
+    // Status requests to send per minute at most, 0 turns polling off.
+    int poll_budget() const;
+
+    // The rules from the rules file, none if not configured. A rules file
+    // that cannot be read or parsed is a configuration error.
+    const rules::rule_set &rules() const;
 
 private:
     shd_config(const shd_config &);
@@ -45,7 +80,17 @@ private:
     std::string serial_device_;
     double longitude_;
     double latitude_;
-    std::vector<std::string> outside_lights_;
+    std::vector<plm::insteon_address> outside_lights_;
+    int outside_lights_level_;
+    int outside_lights_ramp_rate_;
+    std::string metrics_socket_;
+    int metrics_port_;
+    std::string serial_trace_;
+    size_t serial_trace_size_;
+    std::string link_db_snapshot_;
+    int link_db_refresh_hours_;
+    int poll_budget_;
+    rules::rule_set rules_;
 };
 
 
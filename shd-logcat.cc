@@ -0,0 +1,80 @@
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "log-record.h"
+
+
+// Renders binary log files written by shd (see set_binary_log_file()) as
+// text, one message per line.
+
+
+static bool read_file(FILE *file, std::string *out)
+{
+    char buf[4096];
+    size_t len;
+
+    while((len = fread(buf, 1, sizeof(buf), file)) > 0) {
+        out->append(buf, len);
+    }
+
+    return !ferror(file);
+}
+
+
+static int print_log(const char *name, FILE *file)
+{
+    std::string data;
+
+    if(!read_file(file, &data)) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        return 1;
+    }
+
+    logging::binary_log_reader reader(data);
+
+    if(!reader.is_valid()) {
+        fprintf(stderr, "%s: not a binary shd log\n", name);
+        return 1;
+    }
+
+    std::string line;
+    while(reader.next(&line)) {
+        printf("%s\n", line.c_str());
+    }
+
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2) {
+        return print_log("stdin", stdin);
+    }
+
+    if(strcmp(argv[1], "-h") == 0) {
+        printf("Usage: %s [file...]\n", argv[0]);
+        return 0;
+    }
+
+    int ret = 0;
+
+    for(int i = 1; i < argc; ++i) {
+        FILE *file = fopen(argv[i], "r");
+
+        if(!file) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+            ret = 1;
+            continue;
+        }
+
+        ret = print_log(argv[i], file) || ret;
+        fclose(file);
+    }
+
+    return ret;
+}
@@ -0,0 +1,311 @@
+
+#include <algorithm>
+
+#include "alarm-manager.h"
+#include "logger.h"
+#include "plm-command.h"
+#include "status-poller.h"
+
+
+namespace plm {
+
+// How often to check whether the endpoint has become idle while polls are
+// waiting for it.
+static const int IDLE_CHECK = 250;  // msecs
+
+
+status_poller::status_poller(plm_endpoint *plm,
+                             net::alarm_manager *alarm_manager)
+    : plm_(plm),
+      alarm_manager_(alarm_manager),
+      min_interval_(10000),
+      max_interval_(15 * 60000),
+      spacing_(10000),
+      running_(false),
+      polling_(false),
+      dispatch_alarm_(0),
+      polls_(0)
+{
+    plm_->add_listener(this);
+}
+
+
+status_poller::~status_poller()
+{
+    stop();
+    plm_->remove_listener(this);
+}
+
+
+void status_poller::set_intervals(int min_msecs, int max_msecs)
+{
+    min_interval_ = min_msecs;
+    max_interval_ = std::max(min_msecs, max_msecs);
+}
+
+
+void status_poller::set_budget(int polls_per_minute)
+{
+    spacing_ = 60000 / std::max(1, polls_per_minute);
+}
+
+
+void status_poller::set_callback(const callback_t &callback)
+{
+    callback_ = callback;
+}
+
+
+void status_poller::add_device(insteon_address addr)
+{
+    if(devices_.count(addr)) {
+        return;
+    }
+
+    device_t &device = devices_[addr];
+    device.interval = min_interval_;
+
+    if(running_) {
+        device.queued = true;
+        queue_.push_back(addr);
+        dispatch();
+    }
+}
+
+
+void status_poller::remove_device(insteon_address addr)
+{
+    std::unordered_map<insteon_address, device_t>::iterator it =
+        devices_.find(addr);
+
+    if(it == devices_.end()) {
+        return;
+    }
+
+    if(it->second.alarm) {
+        it->second.alarm->stop();
+    }
+
+    devices_.erase(it);
+}
+
+
+void status_poller::start()
+{
+    if(running_) {
+        return;
+    }
+
+    running_ = true;
+
+    std::unordered_map<insteon_address, device_t>::iterator it =
+        devices_.begin();
+
+    for(; it != devices_.end(); ++it) {
+        it->second.queued = true;
+        queue_.push_back(it->first);
+    }
+
+    dispatch();
+}
+
+
+void status_poller::stop()
+{
+    running_ = false;
+    queue_.clear();
+
+    std::unordered_map<insteon_address, device_t>::iterator it =
+        devices_.begin();
+
+    for(; it != devices_.end(); ++it) {
+        if(it->second.alarm) {
+            it->second.alarm->stop();
+            it->second.alarm = 0;
+        }
+
+        it->second.queued = false;
+    }
+
+    if(dispatch_alarm_) {
+        dispatch_alarm_->stop();
+        dispatch_alarm_ = 0;
+    }
+}
+
+
+void status_poller::note_activity(insteon_address addr)
+{
+    std::unordered_map<insteon_address, device_t>::iterator it =
+        devices_.find(addr);
+
+    if(it == devices_.end()) {
+        return;
+    }
+
+    it->second.interval = min_interval_;
+
+    if(running_ && !it->second.queued) {
+        schedule_poll(addr, &it->second, min_interval_);
+    }
+}
+
+
+const status_poller::device_status *status_poller::status(
+    insteon_address addr) const
+{
+    std::unordered_map<insteon_address, device_t>::const_iterator it =
+        devices_.find(addr);
+    return it == devices_.end() ? 0 : &it->second.status;
+}
+
+
+int status_poller::interval(insteon_address addr) const
+{
+    std::unordered_map<insteon_address, device_t>::const_iterator it =
+        devices_.find(addr);
+    return it == devices_.end() ? 0 : it->second.interval;
+}
+
+
+void status_poller::on_command(const plm_frame &frame)
+{
+    // Anything but the ACKs to direct messages is sent by the device on its
+    // own, e.g. the group broadcast when its paddle is pressed.
+    if(frame.command() != 0x50 ||
+       frame.message_type() == plm_frame::DIRECT_ACK ||
+       frame.message_type() == plm_frame::DIRECT_NACK)
+    {
+        return;
+    }
+
+    note_activity(frame.from());
+}
+
+
+void status_poller::schedule_poll(insteon_address addr,
+                                  device_t *device,
+                                  int msecs)
+{
+    if(device->alarm) {
+        device->alarm->stop();
+    }
+
+    device->alarm = alarm_manager_->schedule_alarm(
+        [this, addr]() { on_poll_due(addr); }, msecs);
+}
+
+
+void status_poller::on_poll_due(insteon_address addr)
+{
+    device_t &device = devices_[addr];
+    device.alarm = 0;
+    device.queued = true;
+    queue_.push_back(addr);
+    dispatch();
+}
+
+
+void status_poller::dispatch()
+{
+    if(!running_ || polling_ || dispatch_alarm_) {
+        return;
+    }
+
+    // Drop the devices removed since they became due.
+    while(!queue_.empty()) {
+        std::unordered_map<insteon_address, device_t>::iterator it =
+            devices_.find(queue_.front());
+
+        if(it != devices_.end() && it->second.queued) {
+            break;
+        }
+
+        queue_.pop_front();
+    }
+
+    if(queue_.empty()) {
+        return;
+    }
+
+    if(!plm_->is_idle()) {
+        schedule_dispatch(IDLE_CHECK);
+        return;
+    }
+
+    insteon_address addr = queue_.front();
+    queue_.pop_front();
+    devices_[addr].queued = false;
+
+    polling_ = true;
+    ++polls_;
+    plm_->send_command(
+        plm_command::status_request(addr),
+        [this, addr](plm_endpoint::response_t r) { on_poll_done(addr, r); },
+        plm_endpoint::BACKGROUND);
+}
+
+
+void status_poller::schedule_dispatch(int msecs)
+{
+    dispatch_alarm_ = alarm_manager_->schedule_alarm(
+        [this]() {
+            dispatch_alarm_ = 0;
+            dispatch();
+        },
+        msecs);
+}
+
+
+void status_poller::on_poll_done(insteon_address addr,
+                                 plm_endpoint::response_t r)
+{
+    polling_ = false;
+
+    std::unordered_map<insteon_address, device_t>::iterator it =
+        devices_.find(addr);
+
+    if(it == devices_.end() || !running_) {
+        return;
+    }
+
+    device_t &device = it->second;
+    device_status &status = device.status;
+    bool changed;
+
+    if(r.is_ok()) {
+        changed = !status.known || status.failures > 0 ||
+                  status.level != r.cmd2;
+        status.known = true;
+        status.level = r.cmd2;
+        status.failures = 0;
+    } else {
+        changed = status.known && status.failures == 0;
+        ++status.failures;
+        log_error("Status request to %s failed", addr.to_hex());
+    }
+
+    // Back off for devices that are stable, and for those that do not
+    // answer.
+    if(r.is_ok() && changed) {
+        device.interval = min_interval_;
+    } else {
+        device.interval = std::min(device.interval * 2, max_interval_);
+    }
+
+    if(!device.queued) {
+        schedule_poll(addr, &device, device.interval);
+    }
+
+    if(changed && callback_) {
+        callback_(addr, status);
+    }
+
+    // The callback may have stopped the poller.
+    if(running_) {
+        schedule_dispatch(spacing_);
+    }
+}
+
+
+}
@@ -0,0 +1,132 @@
+
+#ifndef STATUS_POLLER_H_
+#define STATUS_POLLER_H_
+
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <unordered_map>
+
+#include "insteon-address.h"
+#include "plm-connection.h"
+#include "plm-endpoint.h"
+
+
+namespace net {
+class alarm;
+class alarm_manager;
+}
+
+
+namespace plm {
+
+
+// Polls devices for their on level with status requests (cmd1 0x19), to
+// notice manual changes and devices that stopped responding.
+//
+// Every device has its own interval. The interval doubles up to the maximum
+// while the device keeps reporting the same level, and drops back to the
+// minimum when the level changes, when the device sends something on its own
+// (e.g. its paddle was pressed) or when note_activity() is called.
+//
+// Polls that are due wait in a queue and are only sent while the endpoint
+// has nothing else to do, one at a time, so they fill the idle time of the
+// modem instead of delaying other commands. Sending is also limited to a
+// budget of polls per minute to leave the powerline to the devices.
+class status_poller : public plm_command_listener {
+public:
+    struct device_status {
+        device_status() : known(false), level(0), failures(0) {}
+
+        bool known;  // the device has answered at least once
+        int level;  // the last reported on level, 0-255
+        int failures;  // polls without an answer since the last answer
+    };
+
+    typedef std::function<void(insteon_address, const device_status &)>
+        callback_t;
+
+    // The poller listens on the endpoint until it is destroyed. A poll may
+    // be in flight until the endpoint is stopped.
+    status_poller(plm_endpoint *plm, net::alarm_manager *alarm_manager);
+    ~status_poller();
+
+    // The bounds of the per-device interval, 10 s and 15 min by default.
+    void set_intervals(int min_msecs, int max_msecs);
+
+    // At most this many polls per minute, 6 by default.
+    void set_budget(int polls_per_minute);
+
+    // Called when a device reports a new level, and when a device that
+    // answered before stops answering.
+    void set_callback(const callback_t &callback);
+
+    // Devices are polled as soon as possible once added.
+    void add_device(insteon_address addr);
+    void remove_device(insteon_address addr);
+
+    void start();
+    void stop();
+
+    // The device was just commanded or is known to be changing, poll it at
+    // the minimum interval again.
+    void note_activity(insteon_address addr);
+
+    // Null if the device is not polled.
+    const device_status *status(insteon_address addr) const;
+
+    // The current interval of the device in msecs, 0 if it is not polled.
+    int interval(insteon_address addr) const;
+
+    // Number of polls sent.
+    uint64_t polls() const { return polls_; }
+
+    virtual void on_command(const plm_frame &frame) override;
+
+private:
+    status_poller(const status_poller &);
+    status_poller &operator= (const status_poller &);
+
+    struct device_t {
+        device_t() : interval(0), alarm(0), queued(false) {}
+
+        device_status status;
+        int interval;
+        net::alarm *alarm;  // the next poll, null while it is queued
+        bool queued;
+    };
+
+    void schedule_poll(insteon_address addr, device_t *device, int msecs);
+    void on_poll_due(insteon_address addr);
+
+    // Sends the next queued poll if the budget and the endpoint allow.
+    void dispatch();
+    void schedule_dispatch(int msecs);
+    void on_poll_done(insteon_address addr, plm_endpoint::response_t r);
+
+private:
+    plm_endpoint *plm_;  // not owned
+    net::alarm_manager *alarm_manager_;  // not owned
+
+    int min_interval_;
+    int max_interval_;
+    int spacing_;  // msecs between polls, from the budget
+    callback_t callback_;
+
+    bool running_;
+    std::unordered_map<insteon_address, device_t> devices_;
+
+    // Devices due for a poll, in the order they became due. May contain
+    // devices that have been removed since.
+    std::deque<insteon_address> queue_;
+
+    bool polling_;  // a poll is in flight
+    net::alarm *dispatch_alarm_;
+    uint64_t polls_;
+};
+
+
+}
+
+#endif
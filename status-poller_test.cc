@@ -0,0 +1,206 @@
+
+#include <memory>
+#include <string>
+
+#include "logger.h"
+#include "mock-alarm-manager.h"
+#include "mock-event-manager.h"
+#include "mock-executor.h"
+#include "mock-plm-fd.h"
+#include "status-poller.h"
+
+#include <gtest/gtest.h>
+
+
+namespace plm {
+
+
+static const insteon_address DEVICE(0x0a0b0c);
+
+static const std::string STATUS_REQUEST("\x02\x62\x0a\x0b\x0c\x0f\x19\x00", 8);
+
+
+class StatusPollerTest : public testing::Test {
+public:
+    virtual void SetUp() {
+        disable_logging();
+
+        executor_.reset(new mock_executor);
+        event_manager_.reset(new mock_event_manager);
+        fd_.reset(new mock_plm_fd);
+        endpoint_alarms_.reset(new mock_alarm_manager);
+        poller_alarms_.reset(new mock_alarm_manager);
+        endpoint_.reset(new plm_endpoint(
+            fd_.get(),
+            endpoint_alarms_.get(),
+            event_manager_.get(),
+            executor_.get()));
+        poller_.reset(new status_poller(endpoint_.get(),
+                                        poller_alarms_.get()));
+
+        poller_->set_intervals(1000, 8000);
+        poller_->set_callback(
+            [this](insteon_address addr,
+                   const status_poller::device_status &status) {
+                ++callbacks_;
+                last_ = status;
+            });
+        poller_->add_device(DEVICE);
+
+        endpoint_->start();
+        callbacks_ = 0;
+    }
+
+    virtual void TearDown() {
+        endpoint_->stop();
+        poller_.reset();
+    }
+
+    void loop_once() {
+        event_manager_->send_signal();
+        executor_->run_until_empty();
+    }
+
+    // Checks that a status request was the last thing written, then lets
+    // the modem and the device answer it with the given level.
+    void answer_poll(char level) {
+        std::string written = fd_->get_write_buf();
+
+        ASSERT_LE(STATUS_REQUEST.size(), written.size());
+        EXPECT_EQ(STATUS_REQUEST,
+                  written.substr(written.size() - STATUS_REQUEST.size()));
+
+        fd_->set_read_buf(
+            STATUS_REQUEST + '\x06' +
+            std::string("\x02\x50\x0a\x0b\x0c\x01\x02\x03\x2b\x00", 10) +
+            level);
+        loop_once();
+    }
+
+    std::unique_ptr<mock_executor> executor_;
+    std::unique_ptr<mock_event_manager> event_manager_;
+    std::unique_ptr<mock_plm_fd> fd_;
+    std::unique_ptr<mock_alarm_manager> endpoint_alarms_;
+    std::unique_ptr<mock_alarm_manager> poller_alarms_;
+    std::unique_ptr<plm_endpoint> endpoint_;
+    std::unique_ptr<status_poller> poller_;
+
+    int callbacks_;
+    status_poller::device_status last_;
+};
+
+
+TEST_F(StatusPollerTest, BacksOffWhileStable) {
+    poller_->start();
+    loop_once();
+
+    answer_poll('\xff');
+    EXPECT_EQ(1, callbacks_);
+    EXPECT_TRUE(last_.known);
+    EXPECT_EQ(255, last_.level);
+    EXPECT_EQ(1000, poller_->interval(DEVICE));
+
+    // The same level again, and again.
+    for(int interval = 2000; interval <= 8000; interval *= 2) {
+        poller_alarms_->fire_all_alarms();
+        loop_once();
+        answer_poll('\xff');
+        EXPECT_EQ(interval, poller_->interval(DEVICE));
+    }
+
+    EXPECT_EQ(1, callbacks_);
+
+    // Capped at the maximum.
+    poller_alarms_->fire_all_alarms();
+    loop_once();
+    answer_poll('\xff');
+    EXPECT_EQ(8000, poller_->interval(DEVICE));
+
+    // A new level tightens the interval.
+    poller_alarms_->fire_all_alarms();
+    loop_once();
+    answer_poll('\x40');
+    EXPECT_EQ(2, callbacks_);
+    EXPECT_EQ(0x40, last_.level);
+    EXPECT_EQ(1000, poller_->interval(DEVICE));
+    EXPECT_EQ(6u, poller_->polls());
+}
+
+
+TEST_F(StatusPollerTest, TightensOnActivity) {
+    poller_->start();
+    loop_once();
+    answer_poll('\x00');
+
+    poller_alarms_->fire_all_alarms();
+    loop_once();
+    answer_poll('\x00');
+    EXPECT_EQ(2000, poller_->interval(DEVICE));
+
+    // The paddle was pressed, the device broadcasts to group 1.
+    fd_->set_read_buf(
+        std::string("\x02\x50\x0a\x0b\x0c\x00\x00\x01\xcb\x11\x00", 11));
+    loop_once();
+    EXPECT_EQ(1000, poller_->interval(DEVICE));
+
+    poller_->note_activity(insteon_address(0x010203));  // not polled
+    EXPECT_EQ(0, poller_->interval(insteon_address(0x010203)));
+}
+
+
+TEST_F(StatusPollerTest, WaitsForIdleEndpoint) {
+    endpoint_->send_light_on(DEVICE, [](plm_endpoint::response_t) {});
+    poller_->start();
+    loop_once();
+
+    EXPECT_EQ("\x02\x62\x0a\x0b\x0c\x0f\x12\xff", fd_->get_write_buf());
+
+    // Still busy.
+    poller_alarms_->fire_all_alarms();
+    loop_once();
+    EXPECT_EQ(0u, poller_->polls());
+
+    fd_->set_read_buf("\x02\x62\x0a\x0b\x0c\x0f\x12\xff\x06"
+                      "\x02\x50\x0a\x0b\x0c\x01\x02\x03\x2b\x12\xff");
+    loop_once();
+    EXPECT_TRUE(endpoint_->is_idle());
+
+    poller_alarms_->fire_all_alarms();
+    loop_once();
+    EXPECT_EQ(1u, poller_->polls());
+    answer_poll('\xff');
+    EXPECT_EQ(255, last_.level);
+}
+
+
+TEST_F(StatusPollerTest, ReportsFailures) {
+    poller_->start();
+    loop_once();
+    answer_poll('\xff');
+
+    poller_alarms_->fire_all_alarms();
+    loop_once();
+
+    // The modem sends the request but the device never answers.
+    for(int i = 0; i < 3; ++i) {
+        fd_->set_read_buf(STATUS_REQUEST + '\x06');
+        loop_once();
+        endpoint_alarms_->fire_all_alarms();
+        loop_once();
+    }
+
+    EXPECT_EQ(2, callbacks_);
+    EXPECT_EQ(1, last_.failures);
+    EXPECT_EQ(255, last_.level);
+    EXPECT_EQ(2000, poller_->interval(DEVICE));
+
+    poller_alarms_->fire_all_alarms();
+    loop_once();
+    answer_poll('\xff');
+    EXPECT_EQ(3, callbacks_);
+    EXPECT_EQ(0, last_.failures);
+    EXPECT_EQ(1000, poller_->interval(DEVICE));
+}
+
+
+}
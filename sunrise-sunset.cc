@@ -70,11 +70,12 @@ double utc2local(int year, int month, int day, double utc)
     tm_utc.tm_year = year - 1900;
 
     time_t time = timegm(&tm_utc);
-    struct tm *tm_local = localtime(&time);
+    struct tm tm_local;
+    localtime_r(&time, &tm_local);
 
-    return double(tm_local->tm_hour) +
-           double(tm_local->tm_min) / 60 +
-           double(tm_local->tm_sec) / 3600;
+    return double(tm_local.tm_hour) +
+           double(tm_local.tm_min) / 60 +
+           double(tm_local.tm_sec) / 3600;
 }
 
 }
@@ -0,0 +1,166 @@
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "executor.h"
+#include "thread-pool.h"
+
+
+namespace net {
+
+namespace {
+
+// Identifies the pool and the worker the current thread belongs to, used to
+// keep tasks submitted by a worker on its own deque.
+thread_local const thread_pool *current_pool = 0;
+thread_local int current_worker = -1;
+
+}
+
+
+thread_pool::thread_pool(int num_threads)
+    : pending_(0), stopping_(false), next_worker_(0)
+{
+    num_threads = std::max(num_threads, 1);
+
+    for(int i = 0; i < num_threads; ++i) {
+        workers_.push_back(new worker);
+    }
+
+    // Start the threads only when all the deques exist, workers look into
+    // each other's deques.
+    for(int i = 0; i < num_threads; ++i) {
+        workers_[i]->thread = std::thread(&thread_pool::run_worker, this, i);
+    }
+}
+
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        stopping_ = true;
+    }
+
+    idle_cv_.notify_all();
+
+    for(size_t i = 0; i < workers_.size(); ++i) {
+        workers_[i]->thread.join();
+    }
+
+    for(size_t i = 0; i < workers_.size(); ++i) {
+        delete workers_[i];
+    }
+}
+
+
+void thread_pool::submit(const std::function<void()> &work,
+                         executor *ex,
+                         const std::function<void()> &done)
+{
+    int index;
+
+    if(current_pool == this) {
+        index = current_worker;
+    } else {
+        index = next_worker_++ % workers_.size();
+    }
+
+    task t;
+    t.work = work;
+    t.ex = ex;
+    t.done = done;
+
+    {
+        std::lock_guard<std::mutex> lock(workers_[index]->mutex);
+        workers_[index]->tasks.push_back(t);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        ++pending_;
+    }
+
+    idle_cv_.notify_one();
+}
+
+
+void thread_pool::submit(const std::function<void()> &work)
+{
+    submit(work, 0, std::function<void()>());
+}
+
+
+int thread_pool::size() const
+{
+    return workers_.size();
+}
+
+
+void thread_pool::run_worker(int index)
+{
+    current_pool = this;
+    current_worker = index;
+
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(idle_mutex_);
+            idle_cv_.wait(lock, [this]() { return pending_ > 0 || stopping_; });
+
+            if(stopping_) {
+                return;
+            }
+        }
+
+        task t;
+        if(!take_task(index, &t)) {
+            // Somebody else got there first.
+            continue;
+        }
+
+        t.work();
+
+        if(t.ex && t.done) {
+            t.ex->run_later(t.done);
+        }
+    }
+}
+
+
+bool thread_pool::take_task(int index, task *out)
+{
+    bool found = false;
+
+    {
+        worker *own = workers_[index];
+        std::lock_guard<std::mutex> lock(own->mutex);
+
+        if(!own->tasks.empty()) {
+            *out = own->tasks.back();
+            own->tasks.pop_back();
+            found = true;
+        }
+    }
+
+    for(size_t i = 1; i < workers_.size() && !found; ++i) {
+        worker *victim = workers_[(index + i) % workers_.size()];
+        std::lock_guard<std::mutex> lock(victim->mutex);
+
+        if(!victim->tasks.empty()) {
+            *out = victim->tasks.front();
+            victim->tasks.pop_front();
+            found = true;
+        }
+    }
+
+    if(found) {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        --pending_;
+    }
+
+    return found;
+}
+
+}
@@ -0,0 +1,84 @@
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace net {
+
+class executor;
+
+
+// A small pool of worker threads for CPU-bound work that should not run on
+// the event loop thread. Every worker owns a deque of tasks, it takes its own
+// tasks from the back and steals from the front of the other workers' deques
+// when it runs out of work.
+class thread_pool {
+public:
+    // Starts the given number of worker threads (at least one).
+    explicit thread_pool(int num_threads);
+
+    // Stops and joins the workers. A task that is already running is allowed
+    // to finish, tasks that have not started yet are dropped together with
+    // their completions.
+    ~thread_pool();
+
+    // Runs 'work' on one of the worker threads and once it is done schedules
+    // 'done' on the given executor, normally the select_server the caller is
+    // running on. Can be called from any thread including the workers. The
+    // work must not throw.
+    void submit(const std::function<void()> &work,
+                executor *ex,
+                const std::function<void()> &done);
+
+    // Same as above but without a completion.
+    void submit(const std::function<void()> &work);
+
+    int size() const;
+
+private:
+    thread_pool(const thread_pool &);
+    thread_pool &operator= (const thread_pool &);
+
+    struct task {
+        std::function<void()> work;
+        executor *ex;
+        std::function<void()> done;
+    };
+
+    struct worker {
+        std::mutex mutex;
+        std::deque<task> tasks;
+        std::thread thread;
+    };
+
+    void run_worker(int index);
+
+    // Takes a task from the worker's own deque or steals one from the others.
+    // Returns false if all deques are empty.
+    bool take_task(int index, task *out);
+
+private:
+    std::vector<worker *> workers_;
+
+    // Number of tasks sitting in the deques, guarded by idle_mutex_ for the
+    // purpose of sleeping and waking up workers.
+    std::mutex idle_mutex_;
+    std::condition_variable idle_cv_;
+    int pending_;
+    bool stopping_;
+
+    // Round-robin position for submissions from outside the pool.
+    std::atomic<unsigned> next_worker_;
+};
+
+}
+
+#endif
@@ -0,0 +1,118 @@
+
+#include <atomic>
+#include <thread>
+
+#include "select-server.h"
+#include "thread-pool.h"
+
+#include <gtest/gtest.h>
+
+
+namespace net {
+
+
+TEST(ThreadPoolTest, CompletionRunsOnLoop)
+{
+    select_server ss;
+    thread_pool pool(2);
+    std::thread::id work_thread;
+    std::thread::id done_thread;
+    int result = 0;
+
+    pool.submit(
+        [&]() {
+            work_thread = std::this_thread::get_id();
+            result = 42;
+        },
+        &ss,
+        [&]() {
+            done_thread = std::this_thread::get_id();
+            ss.stop();
+        });
+
+    ss.loop();
+
+    EXPECT_EQ(42, result);
+    EXPECT_NE(std::this_thread::get_id(), work_thread);
+    EXPECT_EQ(std::this_thread::get_id(), done_thread);
+}
+
+
+TEST(ThreadPoolTest, ManyTasks)
+{
+    const int num_tasks = 1000;
+
+    select_server ss;
+    thread_pool pool(4);
+    std::atomic<int> work_count(0);
+    int done_count = 0;
+
+    for(int i = 0; i < num_tasks; ++i) {
+        pool.submit(
+            [&]() { ++work_count; },
+            &ss,
+            [&]() {
+                if(++done_count == num_tasks) {
+                    ss.stop();
+                }
+            });
+    }
+
+    ss.loop();
+
+    EXPECT_EQ(num_tasks, work_count.load());
+    EXPECT_EQ(num_tasks, done_count);
+}
+
+
+TEST(ThreadPoolTest, SubmitFromWorker)
+{
+    select_server ss;
+    thread_pool pool(3);
+    std::atomic<int> work_count(0);
+    int done_count = 0;
+
+    // Every task fans out into more tasks that land on the submitting
+    // worker's deque and get stolen by the idle ones.
+    const int fan_out = 50;
+
+    pool.submit([&]() {
+        for(int i = 0; i < fan_out; ++i) {
+            pool.submit(
+                [&]() { ++work_count; },
+                &ss,
+                [&]() {
+                    if(++done_count == fan_out) {
+                        ss.stop();
+                    }
+                });
+        }
+    });
+
+    ss.loop();
+
+    EXPECT_EQ(fan_out, work_count.load());
+    EXPECT_EQ(fan_out, done_count);
+}
+
+
+TEST(ThreadPoolTest, DestroyWithPendingWork)
+{
+    std::atomic<int> work_count(0);
+
+    {
+        thread_pool pool(1);
+
+        for(int i = 0; i < 100; ++i) {
+            pool.submit([&]() {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                ++work_count;
+            });
+        }
+    }
+
+    EXPECT_LE(work_count.load(), 100);
+}
+
+
+}
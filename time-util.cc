@@ -0,0 +1,27 @@
+
+#include <sys/time.h>
+#include <time.h>
+
+#include "time-util.h"
+
+
+namespace net {
+
+
+double time_now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return double(tv.tv_sec) + double(tv.tv_usec) / 1000000;
+}
+
+
+int64_t monotonic_usecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+}
@@ -0,0 +1,19 @@
+
+#ifndef TIME_UTIL_H_
+#define TIME_UTIL_H_
+
+#include <stdint.h>
+
+
+namespace net {
+
+// Wall clock time in fractional seconds since the epoch.
+double time_now();
+
+// Microseconds from an arbitrary point in the past, not affected by changes
+// of the system clock. Use it to measure durations.
+int64_t monotonic_usecs();
+
+}
+
+#endif